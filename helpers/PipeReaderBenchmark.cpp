@@ -0,0 +1,182 @@
+/*
+ * Compares the libevent and the io_uring reader backend for the ffmpeg output pipes.
+ * Every simulated stream receives 48kHz stereo PCM in real time (3840 bytes every 20ms).
+ * Usage: PipeReaderBenchmark [seconds] [stream counts...]
+ *
+ * Built from the pipe reader sources directly (see BUILD_PIPE_BENCHMARK) since the provider library doesn't export them.
+ */
+#include <thread>
+#include <atomic>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <event2/event.h>
+#include <event2/thread.h>
+#include <providers/shared/libevent.h>
+#include "providers/ffmpeg/FFMpegMusicPlayer.h"
+#include "providers/ffmpeg/FFMpegUringReader.h"
+
+using namespace std;
+using namespace music::player;
+
+constexpr size_t kChunkSize{3840};
+
+/* usually provided by the host */
+void music::log::log(const music::log::Level& level, const std::string& message) {
+    if(level >= music::log::warn)
+        cerr << message << endl;
+}
+
+struct BenchmarkStream {
+    int fd_write{-1};
+    unique_ptr<pl::Process> process{};
+    shared_ptr<FFMpegProcessHandle> handle{};
+    shared_ptr<char> buffer{};
+    atomic<size_t> bytes{0};
+};
+
+struct Result {
+    double cpu_percent{0};
+    double wakeups{0};
+    double reads{0};
+    size_t lost{0};
+};
+
+inline double thread_cpu_seconds(clockid_t clock) {
+    timespec time{};
+    clock_gettime(clock, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+}
+
+Result run(void* event_base, clockid_t loop_clock, FFMpegUringReader* uring, pid_t dummy_pid, size_t stream_count, size_t seconds) {
+    vector<unique_ptr<BenchmarkStream>> streams{};
+    for(size_t index{0}; index < stream_count; index++) {
+        int fds[2];
+        if(pipe2(fds, O_CLOEXEC) != 0) {
+            cerr << "failed to create pipe: " << strerror(errno) << endl;
+            break;
+        }
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+
+        auto stream = make_unique<BenchmarkStream>();
+        stream->fd_write = fds[1];
+        stream->process = make_unique<pl::Process>(dummy_pid, -1, fds[0], -1);
+        stream->buffer = shared_ptr<char>(new char[64 * 1024], default_delete<char[]>());
+        stream->handle = make_shared<FFMpegProcessHandle>(&*stream->process);
+        stream->handle->io.event_base = event_base;
+        stream->handle->uring = uring;
+
+        auto stream_ptr = &*stream;
+        stream->handle->callback_prepare_output = [stream_ptr](iovec* vectors, size_t, vector<shared_ptr<void>>& keep_alive) {
+            vectors[0].iov_base = &*stream_ptr->buffer;
+            vectors[0].iov_len = 64 * 1024;
+            keep_alive.push_back(stream_ptr->buffer);
+            return (size_t) 1;
+        };
+        stream->handle->callback_commit_output = [stream_ptr](size_t length) { stream_ptr->bytes += length; };
+        stream->handle->initialize_events();
+        stream->handle->enable_buffering();
+        streams.push_back(move(stream));
+    }
+
+    const auto metrics_begin = FFMpegProcessHandle::io_metrics();
+    const auto cpu_begin = thread_cpu_seconds(loop_clock);
+    const auto begin = chrono::steady_clock::now();
+
+    char chunk[kChunkSize]{};
+    size_t written{0}, lost{0};
+    auto next_tick = begin;
+    while(chrono::steady_clock::now() - begin < chrono::seconds{seconds}) {
+        for(auto& stream : streams) {
+            if(write(stream->fd_write, chunk, kChunkSize) == kChunkSize)
+                written += kChunkSize;
+            else
+                lost++;
+        }
+
+        next_tick += chrono::milliseconds{20};
+        this_thread::sleep_until(next_tick);
+    }
+
+    const auto cpu_end = thread_cpu_seconds(loop_clock);
+    const auto metrics_end = FFMpegProcessHandle::io_metrics();
+    const auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    size_t received{0};
+    for(auto& stream : streams) {
+        ::close(stream->fd_write);
+        stream->handle->finalize();
+        received += stream->bytes;
+    }
+    if(received + kChunkSize * stream_count * 2 < written)
+        cerr << "  only " << received << " of " << written << " bytes have been received" << endl;
+
+    Result result{};
+    result.cpu_percent = (cpu_end - cpu_begin) / elapsed * 100;
+    result.wakeups = (double) (metrics_end.wakeups - metrics_begin.wakeups) / elapsed;
+    result.reads = (double) (metrics_end.reads - metrics_begin.reads) / elapsed;
+    result.lost = lost;
+    return result;
+}
+
+int main(int argc, char** argv) {
+    evthread_use_pthreads();
+
+    string error{};
+    if(!libevent::resolve_functions(error)) {
+        cerr << "failed to resolve libevent: " << error << endl;
+        return 1;
+    }
+
+    const size_t seconds = argc > 1 ? stoul(argv[1]) : 10;
+    vector<size_t> stream_counts{};
+    for(int index{2}; index < argc; index++)
+        stream_counts.push_back(stoul(argv[index]));
+    if(stream_counts.empty())
+        stream_counts = {100, 500, 1000};
+
+    auto event_base = libevent::functions->event_base_new();
+    thread event_loop{[&]{
+        while(!libevent::functions->event_base_got_exit(event_base))
+            libevent::functions->event_base_loop(event_base, EVLOOP_NO_EXIT_ON_EMPTY);
+    }};
+
+    clockid_t loop_clock{};
+    pthread_getcpuclockid(event_loop.native_handle(), &loop_clock);
+
+    /* the handles require a process. All of them share the pid of an already reaped child. */
+    auto dummy = pl::spawn({"true"}, error);
+    if(!dummy) {
+        cerr << "failed to spawn dummy process: " << error << endl;
+        return 1;
+    }
+    dummy->wait();
+
+    auto uring = make_unique<FFMpegUringReader>(event_base);
+    if(!uring->initialize(4096, error)) {
+        cerr << "io_uring is not available (" << error << "). Benchmarking libevent only." << endl;
+        uring = nullptr;
+    }
+
+    for(const auto& stream_count : stream_counts) {
+        for(auto backend : {(FFMpegUringReader*) nullptr, uring.get()}) {
+            if(backend && !uring) continue;
+
+            FFMpegUringReader::instance = backend;
+            const auto result = run(event_base, loop_clock, backend, dummy->pid(), stream_count, seconds);
+            cout << stream_count << " streams, " << (backend ? "io_uring" : "libevent") << ": "
+                 << "loop cpu " << result.cpu_percent << "%, "
+                 << result.wakeups << " wakeups/s, "
+                 << result.reads << " reads/s, "
+                 << result.lost << " lost chunks" << endl;
+        }
+    }
+
+    FFMpegUringReader::instance = nullptr;
+    uring = nullptr;
+
+    libevent::functions->event_base_loopexit(event_base, nullptr);
+    event_loop.join();
+    libevent::functions->event_base_free(event_base);
+    return 0;
+}
@@ -4,9 +4,14 @@
 #include <chrono>
 #include <memory>
 #include <deque>
+#include <vector>
 #include <utility>
 #include <variant>
 #include <map>
+#include <mutex>
+#include <functional>
+#include <cstring>
+#include <algorithm>
 #include <ThreadPool/Future.h>
 
 #if defined(_MSC_VER)
@@ -66,6 +71,46 @@ namespace music {
 	    }
     };
 
+    /* copies count s16le samples or mixes them (saturating) into the target */
+    inline void write_samples(int16_t* target, const int16_t* source, size_t count, bool mix) {
+        if(!mix) {
+            memcpy(target, source, count * sizeof(int16_t));
+            return;
+        }
+
+        for(size_t index{0}; index < count; index++)
+            target[index] = (int16_t) std::clamp((int32_t) target[index] + source[index], (int32_t) INT16_MIN, (int32_t) INT16_MAX);
+    }
+
+    struct EncodedSegment {
+        /**
+         * A single encoded packet, ready to send.
+         * Encoding    : see MusicPlayer::outputFormat()
+         */
+        mutable uint8_t* data;
+        const size_t maxLength{0};
+        size_t length{0};
+        size_t sampleCount{0}; /* samples per channel the packet decodes to */
+
+        EncodedSegment(uint8_t* data, const size_t maxLength) : data(data), maxLength(maxLength) {}
+        ~EncodedSegment() = default;
+
+        inline static std::shared_ptr<EncodedSegment> allocate(size_t maxLength) {
+            auto memory = malloc(maxLength + sizeof(EncodedSegment));
+            new(memory) EncodedSegment((uint8_t*) ((char*) memory + sizeof(EncodedSegment)), maxLength);
+
+            return std::shared_ptr<EncodedSegment>((EncodedSegment*) memory, [](EncodedSegment* data) {
+                data->~EncodedSegment();
+                ::free(data);
+            });
+        }
+    };
+
+    enum OutputFormat {
+        FORMAT_PCM_S16LE, /* SampleSegments via popNextSegment() */
+        FORMAT_OPUS       /* 48kHz opus packets via popNextPacket() */
+    };
+
     typedef std::chrono::milliseconds PlayerUnits;
 	enum ThumbnailType {
 		THUMBNAIL_NONE,
@@ -136,6 +181,57 @@ namespace music {
         EVENT_INFO_UPDATE
     };
 
+    /* executes the given task at some point within another thread (e.g. a worker pool) */
+    typedef std::function<void(std::function<void()>)> EventExecutor;
+
+    struct EventMetrics {
+        size_t dispatched_events{0};
+        size_t queued_peak{0}; /* events waiting for the executor */
+
+        /* time spent within the event handlers */
+        std::chrono::microseconds total_dispatch_time{0};
+        std::chrono::microseconds max_dispatch_time{0};
+    };
+
+    /*
+     * Copy on write list of event handlers for the host implementation of registerEventHandler, unregisterEventHandler and fireEvent.
+     * Changes replace the immutable snapshot, fire runs the handlers of the current snapshot without holding a lock.
+     * Handlers may (un)register handlers, the change applies to the next event.
+     */
+    class EventHandlerRegistry {
+        public:
+            typedef std::function<void(MusicEvent)> handler_t;
+            typedef std::vector<std::pair<std::string, handler_t>> handlers_t;
+
+            void add(const std::string& key, const handler_t& handler) {
+                std::lock_guard lock{this->lock};
+                auto handlers = std::make_shared<handlers_t>(*this->handlers);
+                handlers->emplace_back(key, handler);
+                this->handlers = std::move(handlers);
+            }
+
+            void remove(const std::string& key) {
+                std::lock_guard lock{this->lock};
+                auto handlers = std::make_shared<handlers_t>(*this->handlers);
+                handlers->erase(std::remove_if(handlers->begin(), handlers->end(), [&](const auto& entry) { return entry.first == key; }), handlers->end());
+                this->handlers = std::move(handlers);
+            }
+
+            [[nodiscard]] std::shared_ptr<const handlers_t> snapshot() {
+                std::lock_guard lock{this->lock};
+                return this->handlers;
+            }
+
+            void fire(MusicEvent event) {
+                const auto handlers = this->snapshot();
+                for(const auto& [_, handler] : *handlers)
+                    handler(event);
+            }
+        private:
+            std::mutex lock{};
+            std::shared_ptr<const handlers_t> handlers{std::make_shared<handlers_t>()};
+    };
+
     class MusicPlayer {
         public:
             virtual bool initialize(size_t channelCount) = 0;
@@ -172,13 +268,67 @@ namespace music {
 
             virtual void registerEventHandler(const std::string&, const std::function<void(MusicEvent)>&) = 0;
             virtual void unregisterEventHandler(const std::string&) = 0;
+
+            /* players which are able to deliver encoded audio directly will save the host a decode and encode */
+            virtual bool outputFormatSupported(OutputFormat format) { return format == OutputFormat::FORMAT_PCM_S16LE; }
+            virtual OutputFormat outputFormat() { return OutputFormat::FORMAT_PCM_S16LE; }
+            virtual bool outputFormat(OutputFormat format) { return format == OutputFormat::FORMAT_PCM_S16LE; } //Change the output format. Returns false if not supported.
+
+            virtual std::shared_ptr<EncodedSegment> popNextPacket() { return nullptr; }
+
+            /*
+             * Pull based alternative to popNextSegment: writes (or mixes if mix is set) up to maxFrames frames
+             * of channelCount() interleaved s16le samples into the target and returns the number of frames written.
+             * Partial data will be returned as well, e.g. the tail at the end of the song.
+             * Don't mix calls to readSamples and popNextSegment.
+             */
+            virtual size_t readSamples(int16_t* /* target */, size_t /* max frames */, bool /* mix */) { return 0; }
+
+            /*
+             * Optional readiness signal, so the host doesn't have to poll idle or buffering players on every tick.
+             * The callback will be called (from any thread) once at least thresholdFrames frames are available (zero for one segment),
+             * the song ended or an error occurred. After a signal the host should consume until nothing is available anymore,
+             * the next signal follows once the threshold has been reached again.
+             * The callback must not call back into the player (e.g. just write to an eventfd). Pass nullptr to unregister.
+             * Returns false if the player doesn't support it, the host has to poll then.
+             */
+            virtual bool readyCallback(std::function<void()> /* callback */, size_t /* threshold frames */) { return false; }
+
+            /*
+             * Appends up to maxSegments segments (as popNextSegment would return them) to the target and returns their count.
+             * Meant for catching up after the host stalled, players may implement it within one buffer access.
+             */
+            virtual size_t popSegments(size_t maxSegments, std::vector<std::shared_ptr<SampleSegment>>& target) {
+                size_t count{0};
+                while(count < maxSegments) {
+                    auto segment = this->popNextSegment();
+                    if(!segment) break;
+
+                    target.push_back(std::move(segment));
+                    count++;
+                }
+                return count;
+            }
+
+            /*
+             * Events will be dispatched within the thread which caused them (might be an IO thread of the provider)
+             * unless an executor has been set. The events of one player will be dispatched in order and never concurrently.
+             */
+            virtual void eventExecutor(EventExecutor /* executor */) {}
+            virtual EventMetrics eventMetrics() { return {}; }
     };
 
     class AbstractMusicPlayer : public MusicPlayer {
         public:
             AbstractMusicPlayer() = default;
 
-		    virtual ~AbstractMusicPlayer() = default;
+		    virtual ~AbstractMusicPlayer() {
+                /* waits for the event which is being dispatched. Queued events must not reach a deleted player. */
+                std::lock_guard dlock{this->eventDispatcher->dispatch_lock};
+                std::lock_guard lock{this->eventDispatcher->lock};
+                this->eventDispatcher->player = nullptr;
+                this->eventDispatcher->queue.clear();
+            }
 
 		    PlayerState state() override {
                 return playerState;
@@ -186,17 +336,18 @@ namespace music {
 
             void play() override {
                 playerState = PlayerState::STATE_PLAYING;
-                this->fireEvent(MusicEvent::EVENT_PLAY);
+                this->dispatchEvent(MusicEvent::EVENT_PLAY);
             }
 
             void pause() override {
                 playerState = PlayerState::STATE_PAUSE;
-                this->fireEvent(MusicEvent::EVENT_PAUSE);
+                this->dispatchEvent(MusicEvent::EVENT_PAUSE);
             }
 
             void stop() override {
                 playerState = PlayerState::STATE_STOPPED;
-                this->fireEvent(MusicEvent::EVENT_STOP);
+                this->_readSegment = nullptr;
+                this->dispatchEvent(MusicEvent::EVENT_STOP);
             }
 
             std::string error() override {
@@ -228,16 +379,70 @@ namespace music {
 
 		    bool seek_supported() override { return true; }
 
+            /* based on popNextSegment. The remainder of a segment will be returned with the next call. */
+            size_t readSamples(int16_t* target, size_t maxFrames, bool mix) override {
+                size_t written{0};
+                while(written < maxFrames) {
+                    if(!this->_readSegment || this->_readSegmentOffset >= this->_readSegment->segmentLength) {
+                        this->_readSegment = this->popNextSegment();
+                        this->_readSegmentOffset = 0;
+                        if(!this->_readSegment) break;
+                    }
+
+                    const auto channels = this->_readSegment->channels;
+                    const auto frames = std::min(maxFrames - written, this->_readSegment->segmentLength - this->_readSegmentOffset);
+                    write_samples(target + written * channels, this->_readSegment->segments + this->_readSegmentOffset * channels, frames * channels, mix);
+                    this->_readSegmentOffset += frames;
+                    written += frames;
+                }
+
+                if(this->_readSegment && this->_readSegmentOffset >= this->_readSegment->segmentLength)
+                    this->_readSegment = nullptr;
+                return written;
+            }
+
             void registerEventHandler(const std::string&, const std::function<void(MusicEvent)>& function) override;
 
             void unregisterEventHandler(const std::string&) override;
+
+            void eventExecutor(EventExecutor executor) override {
+                std::lock_guard lock{this->eventDispatcher->lock};
+                this->eventDispatcher->executor = std::move(executor);
+            }
+
+            EventMetrics eventMetrics() override {
+                std::lock_guard lock{this->eventDispatcher->lock};
+                return this->eventDispatcher->metrics;
+            }
         protected:
             void apply_error(const std::string &_err) {
                 this->_error = _err;
-                this->fireEvent(MusicEvent::EVENT_ERROR);
+                this->dispatchEvent(MusicEvent::EVENT_ERROR);
             }
             void fireEvent(MusicEvent);
 
+            /* calls fireEvent within the event executor if one has been set */
+            void dispatchEvent(MusicEvent event) {
+                auto dispatcher = this->eventDispatcher;
+                std::unique_lock lock{dispatcher->lock};
+                if(!dispatcher->executor) {
+                    lock.unlock();
+                    dispatcher->dispatch(this, event);
+                    return;
+                }
+
+                dispatcher->queue.push_back(event);
+                dispatcher->metrics.queued_peak = std::max(dispatcher->metrics.queued_peak, dispatcher->queue.size());
+                if(dispatcher->dispatching)
+                    return;
+
+                dispatcher->dispatching = true;
+                auto executor = dispatcher->executor;
+                lock.unlock();
+                /* the task only references the dispatcher so it might outlive the player */
+                executor([dispatcher]{ dispatcher->drain(); });
+            }
+
             PlayerState playerState = PlayerState::STATE_STOPPED;
             std::string _error = "";
             size_t _preferredSampleCount = 0;
@@ -245,6 +450,101 @@ namespace music {
 
             std::mutex eventLock;
             std::deque<std::pair<std::string, std::function<void(MusicEvent)>>> eventHandlers;
+
+		    /* appended to keep the offsets of the members above. Segment which has been partially returned by readSamples. */
+		    std::shared_ptr<SampleSegment> _readSegment{};
+		    size_t _readSegmentOffset{0};
+
+            /* appended as well. Shared with the executor tasks, which might outlive the player. */
+            struct EventDispatcher {
+                std::mutex lock{};
+                AbstractMusicPlayer* player{nullptr}; /* null once the player has been destroyed */
+                std::recursive_mutex dispatch_lock{}; /* held while a queued event is dispatched, handlers may delete the player */
+
+                EventExecutor executor{};
+                std::deque<MusicEvent> queue{};
+                bool dispatching{false}; /* a drain task has been handed to the executor */
+
+                EventMetrics metrics{};
+
+                void dispatch(AbstractMusicPlayer* target, MusicEvent event) {
+                    const auto begin = std::chrono::steady_clock::now();
+                    target->fireEvent(event);
+                    const auto time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin);
+
+                    std::lock_guard lock_{this->lock};
+                    this->metrics.dispatched_events++;
+                    this->metrics.total_dispatch_time += time;
+                    this->metrics.max_dispatch_time = std::max(this->metrics.max_dispatch_time, time);
+                }
+
+                void drain() {
+                    while(true) {
+                        std::lock_guard dlock{this->dispatch_lock};
+                        std::unique_lock lock_{this->lock};
+                        if(!this->player || this->queue.empty()) {
+                            this->dispatching = false;
+                            return;
+                        }
+
+                        const auto event = this->queue.front();
+                        this->queue.pop_front();
+                        auto target = this->player;
+                        lock_.unlock();
+
+                        this->dispatch(target, event);
+                    }
+                }
+            };
+            std::shared_ptr<EventDispatcher> eventDispatcher{[this]{
+                auto dispatcher = std::make_shared<EventDispatcher>();
+                dispatcher->player = this;
+                return dispatcher;
+            }()};
+
+            /* appended as well. The host implementations of registerEventHandler, unregisterEventHandler and fireEvent should use it instead of eventLock and eventHandlers. */
+            EventHandlerRegistry eventRegistry{};
+    };
+
+    /*
+     * Allows the host to abort a provider request (e.g. the song has been skipped while it's still being resolved).
+     * Providers stop their in flight work and fail the future with "cancelled".
+     */
+    class CancellationToken {
+        public:
+            void cancel() {
+                std::unique_lock lock{this->lock};
+                if(this->cancelled_)
+                    return;
+
+                this->cancelled_ = true;
+                auto callbacks = std::exchange(this->callbacks, {});
+                lock.unlock();
+
+                for(const auto& callback : callbacks)
+                    callback();
+            }
+
+            [[nodiscard]] bool cancelled() {
+                std::lock_guard lock{this->lock};
+                return this->cancelled_;
+            }
+
+            /* the callback will be called within the cancelling thread, or immediately if the token has been cancelled already */
+            void onCancel(std::function<void()> callback) {
+                std::unique_lock lock{this->lock};
+                if(!this->cancelled_) {
+                    this->callbacks.push_back(std::move(callback));
+                    return;
+                }
+
+                lock.unlock();
+                callback();
+            }
+        private:
+            std::mutex lock{};
+            bool cancelled_{false};
+            std::vector<std::function<void()>> callbacks{};
     };
 
     namespace manager {
@@ -283,6 +583,17 @@ namespace music {
             }
 
             virtual size_t weight(const std::string&) { return 0; }
+
+            /*
+             * Cancellable variants. Providers which don't support cancellation ignore the token.
+             * Appended to keep the vtable layout of providers built against older headers.
+             */
+            virtual threads::Future<std::shared_ptr<UrlInfo>> query_info(const std::string& url, void* custom_data, void* internal, const std::shared_ptr<CancellationToken>& /* token */) {
+                return this->query_info(url, custom_data, internal);
+            }
+            virtual threads::Future<std::shared_ptr<MusicPlayer>> createPlayer(const std::string& url, void* custom_data, void* internal, const std::shared_ptr<CancellationToken>& /* token */) {
+                return this->createPlayer(url, custom_data, internal);
+            }
         };
 
         extern std::deque<std::shared_ptr<PlayerProvider>> registeredTypes();
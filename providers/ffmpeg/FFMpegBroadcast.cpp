@@ -0,0 +1,425 @@
+#include <cstring>
+#include <algorithm>
+#include "./FFMpegBroadcast.h"
+#include "./FFMpegProvider.h"
+
+using namespace music;
+using namespace music::player;
+
+std::mutex FFMpegBroadcast::registry_lock{};
+std::map<std::string, std::weak_ptr<FFMpegBroadcast>> FFMpegBroadcast::registry{};
+
+std::string FFMpegBroadcast::registry_key(const std::string &url, size_t channel_count, size_t frame_sample_count) {
+    return std::to_string(channel_count) + ":" + std::to_string(frame_sample_count) + ":" + url;
+}
+
+std::shared_ptr<FFMpegBroadcast::Subscription> FFMpegBroadcast::subscribe(const std::string &url, size_t channel_count, size_t frame_sample_count, std::string &error) {
+    std::shared_ptr<FFMpegBroadcast> broadcast{};
+    {
+        std::lock_guard rlock{registry_lock};
+        const auto key = registry_key(url, channel_count, frame_sample_count);
+        if(auto it{registry.find(key)}; it != registry.end())
+            broadcast = it->second.lock();
+
+        if(!broadcast) {
+            broadcast = std::make_shared<FFMpegBroadcast>(url, channel_count, frame_sample_count);
+            if(!broadcast->spawn_upstream(error))
+                return nullptr;
+
+            registry[key] = broadcast;
+            log::log(log::debug, "[FFMPEG][Broadcast] Started upstream for " + url);
+        }
+    }
+
+    auto subscription = std::make_shared<Subscription>();
+    subscription->broadcast = broadcast;
+
+    std::lock_guard block{broadcast->lock};
+    subscription->cursor = broadcast->ring_offset + broadcast->ring.size(); /* start at the live edge */
+    broadcast->subscriptions.push_back(&*subscription);
+    log::log(log::debug, "[FFMPEG][Broadcast] Subscribed to " + url + ". Subscriber count: " + std::to_string(broadcast->subscriptions.size()));
+    return subscription;
+}
+
+void FFMpegBroadcast::Subscription::event_callback(callback_event_t callback) {
+    std::lock_guard clock{this->callback_lock};
+    this->callback_event = std::move(callback);
+}
+
+FFMpegBroadcast::Subscription::~Subscription() {
+    if(!this->broadcast)
+        return;
+
+    std::lock_guard block{this->broadcast->lock};
+    auto& subscriptions = this->broadcast->subscriptions;
+    subscriptions.erase(std::remove(subscriptions.begin(), subscriptions.end(), this), subscriptions.end());
+}
+
+FFMpegBroadcast::FFMpegBroadcast(std::string url, size_t channel_count, size_t frame_sample_count) : url{std::move(url)}, channel_count{channel_count}, frame_sample_count{frame_sample_count} {
+    const auto config = FFMpegProvider::instance->configuration();
+    this->ring_capacity = std::max((size_t) 1, config->broadcast.ring_length_ms * 48 / this->frame_sample_count);
+}
+
+FFMpegBroadcast::~FFMpegBroadcast() {
+    this->unregister();
+
+    if(auto stream{std::exchange(this->upstream, nullptr)}; stream) {
+        stream->callback_info_initialized = nullptr;
+        stream->callback_ended = nullptr;
+        stream->callback_abort = nullptr;
+        stream->callback_connect_error = nullptr;
+    }
+
+    log::log(log::debug, "[FFMPEG][Broadcast] Last subscriber left. Stopped upstream for " + this->url);
+}
+
+void FFMpegBroadcast::unregister() {
+    std::lock_guard rlock{registry_lock};
+    auto it = registry.find(registry_key(this->url, this->channel_count, this->frame_sample_count));
+    if(it == registry.end())
+        return;
+
+    auto registered = it->second.lock();
+    if(registered && &*registered != this)
+        return;
+
+    registry.erase(it);
+}
+
+bool FFMpegBroadcast::spawn_upstream(std::string &error) {
+    auto stream = std::make_shared<FFMpegStream>(this->url, FFMPEGURLType::STREAM, PlayerUnits{0}, this->frame_sample_count, this->channel_count, 48000);
+    stream->callback_info_initialized = std::bind(&FFMpegBroadcast::callback_stream_info, this);
+    stream->callback_ended = std::bind(&FFMpegBroadcast::callback_stream_ended, this);
+    stream->callback_abort = std::bind(&FFMpegBroadcast::callback_stream_aborted, this);
+    stream->callback_connect_error = std::bind(&FFMpegBroadcast::callback_stream_connect_error, this, std::placeholders::_1);
+    if(!stream->initialize(error))
+        return false;
+
+    std::unique_lock block{this->lock};
+    std::swap(this->upstream, stream);
+    block.unlock();
+
+    if(stream) {
+        stream->callback_info_initialized = nullptr;
+        stream->callback_ended = nullptr;
+        stream->callback_abort = nullptr;
+        stream->callback_connect_error = nullptr;
+    }
+    return true;
+}
+
+void FFMpegBroadcast::fire_event(Event event) {
+    std::vector<std::shared_ptr<Subscription>> subscriptions_{};
+    {
+        std::lock_guard block{this->lock};
+        subscriptions_.reserve(this->subscriptions.size());
+        for(const auto& subscription : this->subscriptions)
+            if(auto subscription_ref{subscription->weak_from_this().lock()}; subscription_ref)
+                subscriptions_.push_back(std::move(subscription_ref));
+    }
+
+    /* the owner clears the callback under the callback lock before it gets destroyed */
+    for(const auto& subscription : subscriptions_) {
+        std::lock_guard clock{subscription->callback_lock};
+        if(subscription->callback_event)
+            subscription->callback_event(event);
+    }
+}
+
+std::shared_ptr<SampleSegment> FFMpegBroadcast::pop_next_segment(Subscription &subscription) {
+    std::shared_ptr<SampleSegment> segment{};
+    {
+        std::lock_guard block{this->lock};
+        if(subscription.cursor < this->ring_offset) {
+            /* the subscriber hasn't been consumed for a while, continue with the oldest segment we've */
+            subscription.cursor = this->ring_offset;
+        }
+
+        if(subscription.cursor >= this->ring_offset + this->ring.size()) {
+            /* we're the most recent subscriber. Pull the next segment from the upstream. */
+            if(!this->upstream)
+                return nullptr;
+
+            auto upstream_segment = this->upstream->pop_next_segment();
+            if(!upstream_segment)
+                return nullptr;
+
+            this->ring.push_back(std::move(upstream_segment));
+            subscription.cursor = this->ring_offset + this->ring.size() - 1;
+        }
+
+        segment = this->ring[subscription.cursor - this->ring_offset];
+        subscription.cursor++;
+
+        /* drop segments every subscriber has already been consumed or which exceed the ring capacity */
+        uint64_t min_cursor{UINT64_MAX};
+        for(const auto& entry : this->subscriptions)
+            min_cursor = std::min(min_cursor, entry->cursor);
+
+        while(!this->ring.empty() && (this->ring_offset < min_cursor || this->ring.size() > this->ring_capacity)) {
+            this->ring.pop_front();
+            this->ring_offset++;
+        }
+    }
+
+    /* the receiver is allowed to modify the segment (e.g. apply the volume) so every subscriber gets its own copy */
+    auto result = SampleSegment::allocate(segment->maxSegmentLength, segment->channels);
+    memcpy(result->segments, segment->segments, segment->segmentLength * segment->channels * sizeof(int16_t));
+    result->segmentLength = segment->segmentLength;
+    result->full = segment->full;
+    return result;
+}
+
+std::shared_ptr<SampleSegment> FFMpegBroadcast::peek_next_segment(Subscription &subscription) {
+    std::lock_guard block{this->lock};
+    if(subscription.cursor < this->ring_offset || subscription.cursor >= this->ring_offset + this->ring.size())
+        return nullptr;
+
+    return this->ring[subscription.cursor - this->ring_offset];
+}
+
+PlayerUnits FFMpegBroadcast::buffered_time(const Subscription &subscription) {
+    std::lock_guard block{this->lock};
+
+    const auto ring_end = this->ring_offset + this->ring.size();
+    const auto ring_segments = subscription.cursor < ring_end ? ring_end - std::max(subscription.cursor, this->ring_offset) : 0;
+    auto result = PlayerUnits{ring_segments * this->frame_sample_count * 1000 / 48000};
+    if(this->upstream)
+        result += this->upstream->current_buffer_index() - this->upstream->current_playback_index();
+    return result;
+}
+
+std::map<std::string, std::string> FFMpegBroadcast::metadata() {
+    std::unique_lock block{this->lock};
+    auto stream = this->upstream;
+    block.unlock();
+
+    if(!stream)
+        return {};
+
+    auto& info = stream->stream_info();
+    std::lock_guard ilock{info.lock};
+    return info.metadata;
+}
+
+std::string FFMpegBroadcast::error() {
+    std::lock_guard block{this->lock};
+    return this->error_;
+}
+
+void FFMpegBroadcast::callback_stream_info() {
+    std::unique_lock block{this->lock};
+    auto stream = this->upstream;
+    block.unlock();
+    if(!stream)
+        return;
+
+    bool finite;
+    {
+        auto& info = stream->stream_info();
+        std::lock_guard ilock{info.lock};
+        if(!info.initialized)
+            return;
+
+        finite = info.stream_length.count() > 0;
+    }
+
+    if(finite) {
+        /* late joiners would start somewhere in the middle. Don't hand out this broadcast any more. */
+        log::log(log::debug, "[FFMPEG][Broadcast] Upstream " + this->url + " has a finite length. Disabling further subscriptions.");
+        this->unregister();
+    }
+
+    block.lock();
+    this->upstream_started = true;
+    this->upstream_fail_count = 0;
+    block.unlock();
+
+    this->fire_event(Event::INFO_UPDATE);
+}
+
+void FFMpegBroadcast::callback_stream_ended() {
+    this->fire_event(Event::ENDED);
+}
+
+void FFMpegBroadcast::callback_stream_aborted() {
+    std::unique_lock block{this->lock};
+    /* we're called by the upstream, which gets replaced by spawn_upstream */
+    auto stream_ref = this->upstream;
+    block.unlock();
+
+    this->fire_event(Event::ABORTED);
+
+    block.lock();
+    const auto restart = this->upstream_started && this->upstream_fail_count++ < 3;
+    block.unlock();
+
+    std::string error{};
+    if(restart) {
+        log::log(log::debug, "[FFMPEG][Broadcast] Upstream aborted. Restarting upstream for " + this->url);
+        if(this->spawn_upstream(error))
+            return;
+    } else {
+        error = "failed to reconnect to stream";
+    }
+
+    block.lock();
+    this->error_ = error;
+    block.unlock();
+
+    this->fire_event(Event::ERROR);
+}
+
+void FFMpegBroadcast::callback_stream_connect_error(const std::string &error) {
+    std::unique_lock block{this->lock};
+    if(this->upstream_started)
+        return; /* callback_stream_aborted will be called as well and we'll reconnect */
+
+    this->error_ = error;
+    block.unlock();
+
+    log::log(log::debug, "[FFMPEG][Broadcast] Upstream failed to connect: " + error);
+    this->fire_event(Event::ERROR);
+}
+
+FFMpegBroadcastPlayer::FFMpegBroadcastPlayer(std::string url) : url_{std::move(url)} {
+    this->_preferredSampleCount = 960;
+}
+
+FFMpegBroadcastPlayer::~FFMpegBroadcastPlayer() {
+    this->unsubscribe();
+}
+
+bool FFMpegBroadcastPlayer::initialize(size_t channel) {
+    AbstractMusicPlayer::initialize(channel);
+    this->subscribe();
+    return this->good();
+}
+
+void FFMpegBroadcastPlayer::subscribe() {
+    std::string error{};
+    auto subscription = FFMpegBroadcast::subscribe(this->url_, this->_channelCount > 0 ? this->_channelCount : 2, this->_preferredSampleCount, error);
+    if(!subscription) {
+        this->apply_error(error);
+        return;
+    }
+
+    subscription->event_callback(std::bind(&FFMpegBroadcastPlayer::callback_event, this, std::placeholders::_1));
+    this->stream_ended = false;
+    this->stream_aborted = false;
+    this->consumed_samples = 0;
+    this->subscription = std::move(subscription);
+
+    if(!this->subscription->broadcast->metadata().empty())
+        this->dispatchEvent(MusicEvent::EVENT_INFO_UPDATE);
+}
+
+void FFMpegBroadcastPlayer::unsubscribe() {
+    if(auto subscription_ref{std::exchange(this->subscription, nullptr)}; subscription_ref)
+        subscription_ref->event_callback(nullptr);
+}
+
+void FFMpegBroadcastPlayer::play() {
+    if(!this->subscription)
+        this->subscribe();
+
+    AbstractMusicPlayer::play();
+}
+
+void FFMpegBroadcastPlayer::pause() {
+    /* a live stream can't be paused. We'll continue at the live edge. */
+    this->unsubscribe();
+    AbstractMusicPlayer::pause();
+}
+
+void FFMpegBroadcastPlayer::stop() {
+    this->unsubscribe();
+    AbstractMusicPlayer::stop();
+}
+
+bool FFMpegBroadcastPlayer::finished() {
+    return this->subscription == nullptr;
+}
+
+PlayerUnits FFMpegBroadcastPlayer::currentIndex() {
+    return PlayerUnits{this->consumed_samples * 1000 / this->sampleRate()};
+}
+
+PlayerUnits FFMpegBroadcastPlayer::bufferedUntil() {
+    auto subscription_ref = this->subscription;
+    if(!subscription_ref)
+        return this->currentIndex();
+
+    return this->currentIndex() + subscription_ref->broadcast->buffered_time(*subscription_ref);
+}
+
+std::shared_ptr<SampleSegment> FFMpegBroadcastPlayer::popNextSegment() {
+    auto subscription_ref = this->subscription;
+    if(!subscription_ref) goto flush_events;
+
+    if(this->state() == PlayerState::STATE_STOPPED || this->state() == PlayerState::STATE_UNINIZALISIZED)
+        goto flush_events;
+
+    if(auto buffer = subscription_ref->broadcast->pop_next_segment(*subscription_ref); buffer) {
+        this->consumed_samples += buffer->segmentLength;
+        return buffer;
+    }
+
+    flush_events:
+    if(this->stream_aborted) {
+        this->dispatchEvent(MusicEvent::EVENT_ABORT);
+    } else if(this->stream_ended) {
+        this->dispatchEvent(MusicEvent::EVENT_END);
+    }
+    this->stream_ended = false;
+    this->stream_aborted = false;
+    return nullptr;
+}
+
+std::shared_ptr<SampleSegment> FFMpegBroadcastPlayer::peekNextSegment() {
+    auto subscription_ref = this->subscription;
+    if(!subscription_ref) return nullptr;
+
+    return subscription_ref->broadcast->peek_next_segment(*subscription_ref);
+}
+
+std::string FFMpegBroadcastPlayer::songTitle() {
+    auto subscription_ref = this->subscription;
+    if(!subscription_ref) return "";
+
+    const auto metadata = subscription_ref->broadcast->metadata();
+    for(const auto& key : {"title", "StreamTitle"})
+        if(metadata.count(key))
+            return metadata.at(key);
+    return "";
+}
+
+std::string FFMpegBroadcastPlayer::songDescription() {
+    auto subscription_ref = this->subscription;
+    if(!subscription_ref) return "";
+
+    const auto metadata = subscription_ref->broadcast->metadata();
+    for(const auto& key : {"artist", "album", "icy-name"})
+        if(metadata.count(key))
+            return metadata.at(key);
+    return "";
+}
+
+void FFMpegBroadcastPlayer::callback_event(FFMpegBroadcast::Event event) {
+    switch (event) {
+        case FFMpegBroadcast::Event::INFO_UPDATE:
+            this->dispatchEvent(MusicEvent::EVENT_INFO_UPDATE);
+            break;
+        case FFMpegBroadcast::Event::ENDED:
+            this->stream_ended = true;
+            break;
+        case FFMpegBroadcast::Event::ABORTED:
+            this->stream_aborted = true;
+            break;
+        case FFMpegBroadcast::Event::ERROR: {
+            auto subscription_ref = this->subscription;
+            this->apply_error(subscription_ref ? subscription_ref->broadcast->error() : "upstream failed");
+            break;
+        }
+    }
+}
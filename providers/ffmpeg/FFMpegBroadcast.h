@@ -0,0 +1,129 @@
+#pragma once
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include "./FFMpegMusicPlayer.h"
+
+namespace music::player {
+    /*
+     * A single upstream FFMpegStream which gets shared between multiple players playing the same live url.
+     * Decoded segments are kept within a ring and every subscriber reads them with its own cursor.
+     * The upstream will be shut down as soon the last subscriber has been released.
+     */
+    class FFMpegBroadcast : public std::enable_shared_from_this<FFMpegBroadcast> {
+        public:
+            enum struct Event {
+                INFO_UPDATE,
+                ENDED,
+                ABORTED,
+                ERROR
+            };
+
+            typedef std::function<void(Event)> callback_event_t;
+
+            struct Subscription : public std::enable_shared_from_this<Subscription> {
+                ~Subscription();
+
+                /* waits until a running callback returned. The callback won't be called afterwards. */
+                void event_callback(callback_event_t /* callback */);
+
+                std::shared_ptr<FFMpegBroadcast> broadcast{};
+                uint64_t cursor{0};
+
+                private:
+                    friend class FFMpegBroadcast;
+
+                    std::recursive_mutex callback_lock{}; /* the callback might release the subscription */
+                    callback_event_t callback_event{};
+            };
+
+            /* returns an already running broadcast for the url or starts a new one */
+            [[nodiscard]] static std::shared_ptr<Subscription> subscribe(const std::string& /* url */, size_t /* channel count */, size_t /* frame sample count */, std::string& /* error */);
+
+            FFMpegBroadcast(std::string /* url */, size_t /* channel count */, size_t /* frame sample count */);
+            ~FFMpegBroadcast();
+
+            [[nodiscard]] std::shared_ptr<SampleSegment> pop_next_segment(Subscription&);
+            [[nodiscard]] std::shared_ptr<SampleSegment> peek_next_segment(Subscription&);
+            [[nodiscard]] PlayerUnits buffered_time(const Subscription&);
+
+            [[nodiscard]] std::map<std::string, std::string> metadata();
+            [[nodiscard]] std::string error();
+
+            const std::string url;
+            const size_t channel_count;
+            const size_t frame_sample_count;
+        private:
+            static std::mutex registry_lock;
+            static std::map<std::string, std::weak_ptr<FFMpegBroadcast>> registry;
+
+            [[nodiscard]] static std::string registry_key(const std::string& /* url */, size_t /* channel count */, size_t /* frame sample count */);
+
+            bool spawn_upstream(std::string& /* error */);
+            void unregister();
+            void fire_event(Event);
+
+            void callback_stream_info();
+            void callback_stream_ended();
+            void callback_stream_aborted();
+            void callback_stream_connect_error(const std::string&);
+
+            std::mutex lock{};
+            std::shared_ptr<FFMpegStream> upstream{};
+            bool upstream_started{false};
+            size_t upstream_fail_count{0};
+            std::string error_{};
+
+            /* ring_offset is the absolute index of ring.front() */
+            std::deque<std::shared_ptr<SampleSegment>> ring{};
+            uint64_t ring_offset{0};
+            size_t ring_capacity{0};
+
+            std::deque<Subscription*> subscriptions{}; /* removed by the subscription destructor */
+    };
+
+    class FFMpegBroadcastPlayer : public AbstractMusicPlayer {
+        public:
+            explicit FFMpegBroadcastPlayer(std::string /* url */);
+            ~FFMpegBroadcastPlayer() override;
+
+            bool initialize(size_t) override;
+
+            void play() override;
+            void pause() override;
+            void stop() override;
+            bool finished() override;
+
+            bool seek_supported() override { return false; }
+            void forward(const PlayerUnits&) override {}
+            void rewind(const PlayerUnits&) override {}
+
+            PlayerUnits length() override { return PlayerUnits{0}; }
+            PlayerUnits currentIndex() override;
+            PlayerUnits bufferedUntil() override;
+
+            size_t sampleRate() override { return 48000; }
+
+            std::shared_ptr<SampleSegment> popNextSegment() override;
+            std::shared_ptr<SampleSegment> peekNextSegment() override;
+
+            std::string songTitle() override;
+            std::string songDescription() override;
+            std::deque<std::shared_ptr<Thumbnail>> thumbnails() override { return {}; }
+
+            [[nodiscard]] std::string url() const { return this->url_; }
+        private:
+            void subscribe();
+            void unsubscribe();
+            void callback_event(FFMpegBroadcast::Event);
+
+            std::string url_;
+            std::shared_ptr<FFMpegBroadcast::Subscription> subscription{};
+            size_t consumed_samples{0};
+
+            bool stream_ended{false}, stream_aborted{false};
+    };
+}
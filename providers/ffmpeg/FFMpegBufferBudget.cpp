@@ -0,0 +1,158 @@
+#include <algorithm>
+#include "./FFMpegBufferBudget.h"
+#include "./FFMpegMusicPlayer.h"
+
+using namespace music::player;
+
+/* every stream is allowed to buffer at least this amount of audio, even if the budget has been exhausted */
+constexpr static std::chrono::milliseconds kMinimumQuota{500};
+
+FFMpegBufferBudget::FFMpegBufferBudget(size_t budget, std::chrono::milliseconds idle_timeout, std::chrono::milliseconds idle_quota)
+    : budget_bytes{budget}, idle_timeout{idle_timeout}, idle_quota{idle_quota} { }
+
+FFMpegBufferBudget::~FFMpegBufferBudget() = default;
+
+void FFMpegBufferBudget::register_stream(const void *stream, FFMPEGURLType type, size_t bytes_per_second) {
+    std::lock_guard block{this->lock};
+
+    auto& entry = this->streams[stream];
+    entry.weight = type == FFMPEGURLType::STREAM ? 2 : 1; /* remote streams are more likely to stutter */
+    entry.bytes_per_second = bytes_per_second;
+    entry.last_consumed = std::chrono::system_clock::now(); /* give the stream the chance to fill its initial buffer */
+    this->active_weight += entry.weight;
+}
+
+void FFMpegBufferBudget::unregister_stream(const void *stream) {
+    std::lock_guard block{this->lock};
+
+    auto it = this->streams.find(stream);
+    if(it == this->streams.end())
+        return;
+
+    auto& entry = it->second;
+    this->used_bytes -= entry.used_bytes;
+    if(entry.idle)
+        this->idle_reserved_bytes -= entry.bytes_per_second * this->idle_quota.count() / 1000;
+    else
+        this->active_weight -= entry.weight;
+    this->streams.erase(it);
+}
+
+void FFMpegBufferBudget::update_idle_state(StreamEntry &entry, const std::chrono::system_clock::time_point &now) {
+    const auto idle = entry.last_consumed + this->idle_timeout < now;
+    if(idle == entry.idle)
+        return;
+
+    const auto reserved_bytes = entry.bytes_per_second * this->idle_quota.count() / 1000;
+    entry.idle = idle;
+    if(idle) {
+        this->active_weight -= entry.weight;
+        this->idle_reserved_bytes += reserved_bytes;
+    } else {
+        this->active_weight += entry.weight;
+        this->idle_reserved_bytes -= reserved_bytes;
+    }
+}
+
+void FFMpegBufferBudget::update_idle_states(const std::chrono::system_clock::time_point &now) {
+    /* streams which have stopped buffering will not report any usage so we've to check them from time to time */
+    if(this->last_idle_update + std::chrono::seconds{1} > now)
+        return;
+
+    this->last_idle_update = now;
+    for(auto& [_, entry] : this->streams)
+        this->update_idle_state(entry, now);
+}
+
+void FFMpegBufferBudget::stream_consumed(const void *stream) {
+    std::lock_guard block{this->lock};
+
+    auto it = this->streams.find(stream);
+    if(it == this->streams.end())
+        return;
+
+    const auto now = std::chrono::system_clock::now();
+    it->second.last_consumed = now;
+    this->update_idle_state(it->second, now);
+}
+
+void FFMpegBufferBudget::account_usage(StreamEntry &entry, size_t used) {
+    this->used_bytes += used;
+    this->used_bytes -= entry.used_bytes;
+    this->used_bytes_peak = std::max(this->used_bytes_peak, this->used_bytes);
+    entry.used_bytes = used;
+}
+
+size_t FFMpegBufferBudget::update_usage(const void *stream, size_t used) {
+    std::lock_guard block{this->lock};
+
+    auto it = this->streams.find(stream);
+    if(it == this->streams.end())
+        return SIZE_MAX;
+
+    auto& entry = it->second;
+    this->account_usage(entry, used);
+
+    if(this->budget_bytes == 0)
+        return SIZE_MAX;
+
+    const auto now = std::chrono::system_clock::now();
+    this->update_idle_state(entry, now);
+    this->update_idle_states(now);
+
+    const auto minimum_quota = entry.bytes_per_second * kMinimumQuota.count() / 1000;
+    size_t quota;
+    if(entry.idle) {
+        quota = entry.bytes_per_second * this->idle_quota.count() / 1000;
+    } else {
+        const auto available = this->budget_bytes > this->idle_reserved_bytes ? this->budget_bytes - this->idle_reserved_bytes : 0;
+        quota = this->active_weight > 0 ? available / this->active_weight * entry.weight : available;
+    }
+
+    quota = std::max(quota, minimum_quota);
+    entry.throttled = used >= quota;
+    return quota;
+}
+
+size_t FFMpegBufferBudget::trim_target(const void *stream, size_t used) {
+    std::lock_guard block{this->lock};
+
+    auto it = this->streams.find(stream);
+    if(it == this->streams.end())
+        return SIZE_MAX;
+
+    auto& entry = it->second;
+    this->account_usage(entry, used);
+
+    if(this->budget_bytes == 0)
+        return SIZE_MAX;
+
+    const auto now = std::chrono::system_clock::now();
+    this->update_idle_state(entry, now);
+    this->update_idle_states(now);
+    if(!entry.idle)
+        return SIZE_MAX;
+
+    const auto quota = entry.bytes_per_second * std::max(this->idle_quota, kMinimumQuota).count() / 1000;
+    if(used <= quota)
+        return SIZE_MAX;
+
+    this->streams_trimmed++;
+    return quota;
+}
+
+FFMpegBufferBudget::Usage FFMpegBufferBudget::usage() {
+    std::lock_guard block{this->lock};
+
+    Usage result{};
+    result.budget_bytes = this->budget_bytes;
+    result.used_bytes = this->used_bytes;
+    result.used_bytes_peak = this->used_bytes_peak;
+    result.streams = this->streams.size();
+    result.streams_trimmed = this->streams_trimmed;
+    for(const auto& [_, entry] : this->streams) {
+        result.streams_idle += entry.idle;
+        result.streams_throttled += entry.throttled;
+    }
+    return result;
+}
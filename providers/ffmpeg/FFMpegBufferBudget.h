@@ -0,0 +1,74 @@
+#pragma once
+
+#include <mutex>
+#include <chrono>
+#include <map>
+
+namespace music::player {
+    enum struct FFMPEGURLType;
+
+    /*
+     * Global memory budget for decoded audio.
+     * Every stream reports its buffer usage and receives the amount of bytes it's allowed to buffer.
+     * The quota limits refilling the buffer. Idle streams which still exceed their quota
+     * drop the tail of their buffer and get continued behind their remaining audio (see trim_target).
+     */
+    class FFMpegBufferBudget {
+        public:
+            struct Usage {
+                size_t budget_bytes{0}; /* zero means unlimited */
+                size_t used_bytes{0};
+                size_t used_bytes_peak{0};
+
+                size_t streams{0};
+                size_t streams_idle{0};
+                size_t streams_throttled{0};
+                size_t streams_trimmed{0};
+            };
+
+            explicit FFMpegBufferBudget(size_t /* budget bytes */, std::chrono::milliseconds /* idle timeout */, std::chrono::milliseconds /* idle quota */);
+            ~FFMpegBufferBudget();
+
+            void register_stream(const void* /* stream */, FFMPEGURLType /* type */, size_t /* bytes per second */);
+            void unregister_stream(const void* /* stream */);
+
+            /* a stream is considered as idle if nobody consumed any data since the idle timeout */
+            void stream_consumed(const void* /* stream */);
+
+            /* updates the streams usage and returns the amount of bytes up to which the stream may refill its buffer */
+            [[nodiscard]] size_t update_usage(const void* /* stream */, size_t /* used bytes */);
+            /* updates the streams usage and returns the amount of bytes the stream has to shrink its buffer to, SIZE_MAX if it may keep it */
+            [[nodiscard]] size_t trim_target(const void* /* stream */, size_t /* used bytes */);
+
+            [[nodiscard]] Usage usage();
+        private:
+            struct StreamEntry {
+                size_t weight{1};
+                size_t bytes_per_second{0};
+                size_t used_bytes{0};
+
+                bool idle{false};
+                bool throttled{false};
+                std::chrono::system_clock::time_point last_consumed{};
+            };
+
+            void update_idle_state(StreamEntry&, const std::chrono::system_clock::time_point& /* now */);
+            void update_idle_states(const std::chrono::system_clock::time_point& /* now */);
+            void account_usage(StreamEntry&, size_t /* used bytes */);
+
+            const size_t budget_bytes;
+            const std::chrono::milliseconds idle_timeout;
+            const std::chrono::milliseconds idle_quota;
+
+            std::mutex lock{};
+            std::map<const void*, StreamEntry> streams{};
+
+            size_t used_bytes{0};
+            size_t used_bytes_peak{0};
+            size_t active_weight{0};
+            size_t idle_reserved_bytes{0};
+            size_t streams_trimmed{0};
+
+            std::chrono::system_clock::time_point last_idle_update{};
+    };
+}
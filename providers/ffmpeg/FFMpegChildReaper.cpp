@@ -0,0 +1,199 @@
+#include <csignal>
+#include <utility>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <include/teaspeak/MusicPlayer.h>
+#include <providers/shared/libevent.h>
+#include "./FFMpegChildReaper.h"
+
+#ifndef __NR_pidfd_open
+    #define __NR_pidfd_open 434 /* same number on every architecture */
+#endif
+
+using namespace music;
+using namespace music::player;
+
+static constexpr auto kPollInterval = std::chrono::milliseconds{50};
+
+inline timeval to_timeval(const std::chrono::milliseconds& duration) {
+    timeval result{};
+    result.tv_sec = (time_t) std::chrono::duration_cast<std::chrono::seconds>(duration).count();
+    result.tv_usec = (suseconds_t) std::chrono::duration_cast<std::chrono::microseconds>(duration % std::chrono::seconds{1}).count();
+    return result;
+}
+
+FFMpegChildReaper* FFMpegChildReaper::instance{nullptr};
+
+FFMpegChildReaper::FFMpegChildReaper(void *event_base, std::chrono::milliseconds kill_timeout) : event_base{event_base}, kill_timeout{kill_timeout} {}
+
+FFMpegChildReaper::~FFMpegChildReaper() {
+    decltype(this->children) children{};
+    {
+        std::lock_guard lock_{this->lock};
+        children = std::move(this->children);
+    }
+
+    for(auto& [process, child] : children) {
+        if(child->owned)
+            process->kill(SIGKILL);
+        this->destroy_child(std::move(child), false);
+    }
+}
+
+FFMpegChildReaper::Child* FFMpegChildReaper::register_child(pl::Process *process) {
+    auto child = std::make_unique<Child>();
+    child->reaper = this;
+    child->process = process;
+    child->pidfd = (int) syscall(__NR_pidfd_open, process->pid(), 0);
+
+    child->event_exit = libevent::functions->event_new(this->event_base, child->pidfd, child->pidfd >= 0 ? EV_READ : 0, [](int, short, void* _child) {
+        auto child = reinterpret_cast<Child*>(_child);
+        child->reaper->handle_exit_event(child);
+    }, &*child);
+    child->event_deadline = libevent::functions->event_new(this->event_base, -1, 0, [](int, short, void* _child) {
+        auto child = reinterpret_cast<Child*>(_child);
+        child->reaper->handle_deadline_event(child);
+    }, &*child);
+
+    auto result = &*child;
+    this->children[process] = std::move(child);
+    return result;
+}
+
+std::unique_ptr<FFMpegChildReaper::Child> FFMpegChildReaper::unregister_child(Child *child) {
+    auto it = this->children.find(child->process);
+    if(it == this->children.end() || &*it->second != child)
+        return nullptr;
+
+    auto result = std::move(it->second);
+    this->children.erase(it);
+    return result;
+}
+
+void FFMpegChildReaper::destroy_child(std::unique_ptr<Child> child, bool event_loop) {
+    if(!child) return;
+
+    const auto delete_function = event_loop ? libevent::functions->event_del_noblock : libevent::functions->event_del_block;
+    for(auto event : {child->event_exit, child->event_deadline}) {
+        if(!event) continue;
+
+        delete_function(event);
+        libevent::functions->event_free(event);
+    }
+
+    if(child->pidfd >= 0)
+        ::close(child->pidfd);
+
+    if(child->owned)
+        delete child->process;
+}
+
+void FFMpegChildReaper::schedule_exit_check(Child *child) {
+    if(child->pidfd >= 0) {
+        libevent::functions->event_add(child->event_exit, nullptr);
+    } else {
+        auto interval = to_timeval(kPollInterval);
+        libevent::functions->event_add(child->event_exit, &interval);
+    }
+}
+
+bool FFMpegChildReaper::watch(pl::Process *process, callback_exit_t callback) {
+    std::unique_lock lock_{this->lock};
+    if(this->children.count(process))
+        return false;
+
+    auto child = this->register_child(process);
+    if(child->pidfd < 0) {
+        /* polling every stream for its whole lifetime isn't worth it */
+        auto entry = this->unregister_child(child);
+        lock_.unlock();
+        this->destroy_child(std::move(entry), false);
+        return false;
+    }
+
+    child->callback = std::move(callback);
+    this->schedule_exit_check(child);
+    return true;
+}
+
+void FFMpegChildReaper::release(pl::Process *process) {
+    std::unique_lock lock_{this->lock};
+    auto it = this->children.find(process);
+    if(it == this->children.end()) {
+        if(process->exited()) {
+            lock_.unlock();
+            delete process;
+            return;
+        }
+
+        auto child = this->register_child(process);
+        child->owned = true;
+        this->terminate(child);
+        return;
+    }
+
+    auto child = &*it->second;
+    child->owned = true;
+    child->callback = nullptr;
+
+    if(this->dispatching == child) {
+        /* the process already exited. The dispatching event deletes it as soon as the callback returns. */
+        if(this->dispatch_thread != std::this_thread::get_id())
+            this->dispatch_cv.wait(lock_, [&]{ return this->dispatching != child; });
+        return;
+    }
+
+    this->terminate(child);
+}
+
+void FFMpegChildReaper::terminate(Child *child) {
+    if(!child->process->exited()) {
+        child->process->kill(SIGQUIT);
+
+        auto timeout = to_timeval(this->kill_timeout);
+        libevent::functions->event_add(child->event_deadline, &timeout);
+    }
+
+    this->schedule_exit_check(child);
+}
+
+void FFMpegChildReaper::handle_exit_event(Child *child) {
+    std::unique_lock lock_{this->lock};
+    if(!this->children.count(child->process) || &*this->children[child->process] != child)
+        return; /* reaper is shutting down */
+
+    if(!child->process->exited()) {
+        this->schedule_exit_check(child);
+        return;
+    }
+
+    if(!child->owned) {
+        auto callback = std::exchange(child->callback, nullptr);
+        this->dispatching = child;
+        this->dispatch_thread = std::this_thread::get_id();
+        lock_.unlock();
+
+        if(callback)
+            callback(child->process->status());
+
+        lock_.lock();
+        this->dispatching = nullptr;
+        this->dispatch_cv.notify_all();
+    }
+
+    auto entry = this->unregister_child(child);
+    lock_.unlock();
+    this->destroy_child(std::move(entry), true);
+}
+
+void FFMpegChildReaper::handle_deadline_event(Child *child) {
+    std::lock_guard lock_{this->lock};
+    if(!this->children.count(child->process) || &*this->children[child->process] != child)
+        return;
+
+    if(child->process->exited())
+        return; /* the exit event will clean up */
+
+    log::log(log::debug, "[FFMPEG][Reaper] Process " + std::to_string(child->process->pid()) + " did not exit within " + std::to_string(this->kill_timeout.count()) + "ms. Sending SIGKILL.");
+    child->process->kill(SIGKILL);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <functional>
+#include <condition_variable>
+#include <providers/shared/ProcessLauncher.h>
+
+namespace music::player {
+    /*
+     * Central child process lifecycle management within the ffmpeg event loop.
+     * Every child gets a pidfd which becomes readable as soon as the child exited, so exits get noticed
+     * and reaped asynchronously without any extra thread. Kernels without pidfd support (< 5.3)
+     * fall back to polling the child within the event loop.
+     *
+     * signalfd has not been used since it requires SIGCHLD to be blocked in every thread of the host process.
+     */
+    class FFMpegChildReaper {
+        public:
+            /* nullptr if the provider has been shut down */
+            static FFMpegChildReaper* instance;
+
+            typedef std::function<void(int /* wait status */)> callback_exit_t;
+
+            FFMpegChildReaper(void* /* event base */, std::chrono::milliseconds /* kill timeout */);
+            /* kills and reaps all children which are still pending */
+            ~FFMpegChildReaper();
+
+            /*
+             * Calls the callback within the event loop once the process exited (the process has been reaped already).
+             * The caller keeps the ownership of the process and has to hand it over via release(...).
+             * Returns false if the process can't be watched.
+             */
+            bool watch(pl::Process* /* process */, callback_exit_t /* callback */);
+
+            /*
+             * Takes over the ownership of the process. A pending exit callback will be dropped (and awaited if it's currently executed by the event loop).
+             * Running processes receive SIGQUIT and SIGKILL if they haven't exited within the kill timeout.
+             * The process gets deleted asynchronously after it has been reaped.
+             */
+            void release(pl::Process* /* process */);
+        private:
+            struct Child {
+                FFMpegChildReaper* reaper{nullptr};
+                pl::Process* process{nullptr};
+                bool owned{false};
+
+                int pidfd{-1}; /* -1 if we've to poll */
+                void* event_exit{nullptr};
+                void* event_deadline{nullptr};
+
+                callback_exit_t callback{};
+            };
+
+            /* call only when lock is acquired */
+            [[nodiscard]] Child* register_child(pl::Process* /* process */);
+            void schedule_exit_check(Child* /* child */);
+            void terminate(Child* /* child */);
+            /* call only when lock is acquired. Returns the child which must be destroyed by the caller. */
+            [[nodiscard]] std::unique_ptr<Child> unregister_child(Child* /* child */);
+            void destroy_child(std::unique_ptr<Child> /* child */, bool /* within event loop */);
+
+            void handle_exit_event(Child* /* child */);
+            void handle_deadline_event(Child* /* child */);
+
+            void* const event_base;
+            const std::chrono::milliseconds kill_timeout;
+
+            std::mutex lock{};
+            std::map<pl::Process*, std::unique_ptr<Child>> children{};
+
+            /* the child of which the exit callback gets currently executed */
+            Child* dispatching{nullptr};
+            std::thread::id dispatch_thread{};
+            std::condition_variable dispatch_cv{};
+    };
+}
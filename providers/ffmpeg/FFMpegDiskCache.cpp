@@ -0,0 +1,293 @@
+#include <fstream>
+#include <algorithm>
+#include <experimental/filesystem>
+#include <include/teaspeak/MusicPlayer.h>
+#include "./FFMpegDiskCache.h"
+
+namespace fs = std::experimental::filesystem;
+
+using namespace music;
+using namespace music::player;
+
+FFMpegDiskCache* FFMpegDiskCache::instance{nullptr};
+
+constexpr static const char* kExtensionAudio{".audio"};
+constexpr static const char* kExtensionMeta{".meta"};
+constexpr static const char* kExtensionTemporary{".tmp"};
+
+inline std::string escape_line(const std::string& value) {
+    std::string result{};
+    result.reserve(value.length());
+    for(const auto& c : value) {
+        if(c == '\\')
+            result += "\\\\";
+        else if(c == '\n')
+            result += "\\n";
+        else if(c != '\r')
+            result += c;
+    }
+    return result;
+}
+
+inline std::string unescape_line(const std::string& value) {
+    std::string result{};
+    result.reserve(value.length());
+    for(size_t index{0}; index < value.length(); index++) {
+        if(value[index] == '\\' && index + 1 < value.length()) {
+            result += value[++index] == 'n' ? '\n' : value[index];
+        } else {
+            result += value[index];
+        }
+    }
+    return result;
+}
+
+FFMpegDiskCache::FFMpegDiskCache(std::string directory, size_t max_size) : directory{std::move(directory)}, max_size{max_size} {
+    this->metrics_.max_size_bytes = max_size;
+}
+
+FFMpegDiskCache::~FFMpegDiskCache() = default;
+
+std::string FFMpegDiskCache::file_name(const std::string &key) {
+    std::string result{key};
+    for(auto& c : result)
+        if(!isalnum(c) && c != '-' && c != '_' && c != '.')
+            c = '_';
+    return result;
+}
+
+std::string FFMpegDiskCache::path(const std::string &file_name, const char *extension) const {
+    return (fs::u8path(this->directory) / fs::u8path(file_name + extension)).string();
+}
+
+bool FFMpegDiskCache::initialize(std::string &error) {
+    std::error_code fs_error{};
+    if(!fs::exists(fs::u8path(this->directory), fs_error) && !fs::create_directories(fs::u8path(this->directory), fs_error)) {
+        error = "failed to create cache directory: " + fs_error.message();
+        return false;
+    }
+
+    std::vector<std::pair<fs::file_time_type, CacheEntry>> loaded{};
+    /* a single broken entry must not fail the whole listing, hence the separate error codes */
+    fs::directory_iterator file{fs::u8path(this->directory), fs_error};
+    for(; !fs_error && file != fs::directory_iterator{}; file.increment(fs_error)) {
+        const auto file_path = file->path();
+        const auto extension = file_path.extension().string();
+        std::error_code entry_error{};
+        if(extension == kExtensionTemporary) {
+            /* left over from a previous run */
+            fs::remove(file_path, entry_error);
+            continue;
+        }
+
+        if(extension != kExtensionMeta)
+            continue;
+
+        const auto name = file_path.stem().string();
+        const auto audio_path = fs::u8path(this->path(name, kExtensionAudio));
+        if(!fs::exists(audio_path, entry_error)) {
+            fs::remove(file_path, entry_error);
+            continue;
+        }
+
+        CacheEntry entry{};
+        entry.file_name = name;
+        {
+            std::ifstream meta_file{file_path.string()};
+            std::string line{};
+            if(!std::getline(meta_file, line) || line.empty()) {
+                fs::remove(file_path, entry_error);
+                fs::remove(audio_path, entry_error);
+                continue;
+            }
+            entry.key = unescape_line(line);
+
+            while(std::getline(meta_file, line)) {
+                const auto index = line.find('=');
+                if(index == std::string::npos)
+                    continue;
+
+                entry.metadata[unescape_line(line.substr(0, index))] = unescape_line(line.substr(index + 1));
+            }
+        }
+
+        entry.size = fs::file_size(audio_path, entry_error);
+        if(entry_error)
+            continue;
+
+        const auto last_write = fs::last_write_time(audio_path, entry_error);
+        if(entry_error)
+            continue;
+
+        loaded.emplace_back(last_write, std::move(entry));
+    }
+
+    if(fs_error) {
+        error = "failed to list cache directory: " + fs_error.message();
+        return false;
+    }
+
+    std::sort(loaded.begin(), loaded.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+
+    std::lock_guard lock_{this->lock};
+    for(auto& [_, entry] : loaded) {
+        if(this->entry_index.count(entry.key))
+            continue;
+
+        this->size += entry.size;
+        this->entries.push_back(std::move(entry));
+        this->entry_index[this->entries.back().key] = std::prev(this->entries.end());
+    }
+    this->evict();
+
+    log::log(log::info, "[FFMPEG][Cache] Loaded " + std::to_string(this->entries.size()) + " cached entries (" + std::to_string(this->size / 1024 / 1024) + "MB)");
+    return true;
+}
+
+std::optional<FFMpegDiskCache::Entry> FFMpegDiskCache::lookup(const std::vector<std::string> &keys) {
+    std::lock_guard lock_{this->lock};
+    for(const auto& key : keys) {
+        auto it = this->entry_index.find(key);
+        if(it == this->entry_index.end())
+            continue;
+
+        auto entry = it->second;
+        const auto audio_path = this->path(entry->file_name, kExtensionAudio);
+
+        std::error_code fs_error{};
+        if(!fs::exists(fs::u8path(audio_path), fs_error)) {
+            /* somebody deleted the file */
+            this->remove_entry(entry);
+            continue;
+        }
+
+        /* the modification time persists the usage order across restarts */
+        fs::last_write_time(fs::u8path(audio_path), fs::file_time_type::clock::now(), fs_error);
+        this->entries.splice(this->entries.begin(), this->entries, entry);
+
+        this->metrics_.hits++;
+        log::log(log::debug, "[FFMPEG][Cache] Cache hit for " + key + " (hits: " + std::to_string(this->metrics_.hits) + ", misses: " + std::to_string(this->metrics_.misses) + ")");
+        return Entry{entry->key, audio_path, entry->metadata, this->pin(entry->file_name)};
+    }
+
+    this->metrics_.misses++;
+    return std::nullopt;
+}
+
+std::string FFMpegDiskCache::reserve(const std::string &key) {
+    std::lock_guard lock_{this->lock};
+    return this->path(file_name(key) + "." + std::to_string(++this->reserve_index), kExtensionTemporary);
+}
+
+bool FFMpegDiskCache::commit(const std::string &key, const std::string &reserved_path, const std::map<std::string, std::string> &metadata) {
+    std::error_code fs_error{};
+    const auto size = fs::file_size(fs::u8path(reserved_path), fs_error);
+    if(fs_error || size == 0) {
+        this->discard(reserved_path);
+        return false;
+    }
+
+    const auto name = file_name(key);
+    const auto audio_path = this->path(name, kExtensionAudio);
+    const auto meta_path = this->path(name, kExtensionMeta);
+
+    std::lock_guard lock_{this->lock};
+    if(this->pins.count(name)) {
+        /* a player is still playing the current file of this key */
+        log::log(log::debug, "[FFMPEG][Cache] Not replacing " + key + " since it's in use");
+        fs::remove(fs::u8path(reserved_path), fs_error);
+        return false;
+    }
+
+    if(auto it{this->entry_index.find(key)}; it != this->entry_index.end())
+        this->remove_entry(it->second);
+
+    {
+        std::ofstream meta_file{meta_path, std::ios::trunc};
+        meta_file << escape_line(key) << "\n";
+        for(const auto& [meta_key, meta_value] : metadata)
+            meta_file << escape_line(meta_key) << "=" << escape_line(meta_value) << "\n";
+
+        if(!meta_file.good()) {
+            log::log(log::warn, "[FFMPEG][Cache] Failed to write cache meta file for " + key);
+            fs::remove(fs::u8path(meta_path), fs_error);
+            fs::remove(fs::u8path(reserved_path), fs_error);
+            return false;
+        }
+    }
+
+    fs::rename(fs::u8path(reserved_path), fs::u8path(audio_path), fs_error);
+    if(fs_error) {
+        log::log(log::warn, "[FFMPEG][Cache] Failed to move cache file for " + key + ": " + fs_error.message());
+        fs::remove(fs::u8path(meta_path), fs_error);
+        fs::remove(fs::u8path(reserved_path), fs_error);
+        return false;
+    }
+
+    this->entries.push_front(CacheEntry{key, name, size, metadata});
+    this->entry_index[key] = this->entries.begin();
+    this->size += size;
+    this->metrics_.stores++;
+    log::log(log::debug, "[FFMPEG][Cache] Stored " + key + " (" + std::to_string(size / 1024) + "kb)");
+
+    this->evict();
+    return true;
+}
+
+void FFMpegDiskCache::discard(const std::string &reserved_path) {
+    std::error_code fs_error{};
+    fs::remove(fs::u8path(reserved_path), fs_error);
+}
+
+void FFMpegDiskCache::remove_entry(std::list<CacheEntry>::iterator entry) {
+    std::error_code fs_error{};
+    fs::remove(fs::u8path(this->path(entry->file_name, kExtensionAudio)), fs_error);
+    fs::remove(fs::u8path(this->path(entry->file_name, kExtensionMeta)), fs_error);
+
+    this->size -= entry->size;
+    this->entry_index.erase(entry->key);
+    this->entries.erase(entry);
+}
+
+void FFMpegDiskCache::evict() {
+    /* pinned entries will be evicted once they've been unpinned */
+    auto next = this->entries.end();
+    while(this->size > this->max_size && next != this->entries.begin()) {
+        auto entry = std::prev(next);
+        if(this->pins.count(entry->file_name)) {
+            next = entry;
+            continue;
+        }
+
+        log::log(log::debug, "[FFMPEG][Cache] Evicting " + entry->key);
+        this->remove_entry(entry);
+        this->metrics_.evictions++;
+    }
+}
+
+std::shared_ptr<void> FFMpegDiskCache::pin(const std::string &file_name) {
+    this->pins[file_name]++;
+    return std::shared_ptr<void>{nullptr, [file_name](void*) {
+        /* the cache might have been shut down already */
+        if(auto cache{FFMpegDiskCache::instance}; cache)
+            cache->unpin(file_name);
+    }};
+}
+
+void FFMpegDiskCache::unpin(const std::string &file_name) {
+    std::lock_guard lock_{this->lock};
+    auto it = this->pins.find(file_name);
+    if(it == this->pins.end() || --it->second > 0)
+        return;
+
+    this->pins.erase(it);
+    this->evict();
+}
+
+FFMpegDiskCache::Metrics FFMpegDiskCache::metrics() {
+    std::lock_guard lock_{this->lock};
+    auto result = this->metrics_;
+    result.entries = this->entries.size();
+    result.size_bytes = this->size;
+    return result;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <map>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <optional>
+
+namespace music::player {
+    /*
+     * Least recently used on disk cache for fetched audio sources.
+     * Entries are written by ffmpeg into a temporary file while the stream is playing
+     * and only become visible after the source has been fully received.
+     */
+    class __attribute__((visibility("default"))) FFMpegDiskCache {
+        public:
+            /* nullptr if the cache has been disabled */
+            static FFMpegDiskCache* instance;
+
+            struct Entry {
+                std::string key{};
+                std::string path{};
+                std::map<std::string, std::string> metadata{};
+
+                /* the file won't be evicted or replaced while the pin is held (e.g. by the player playing it) */
+                std::shared_ptr<void> pin{};
+            };
+
+            struct Metrics {
+                size_t hits{0};
+                size_t misses{0};
+                size_t stores{0};
+                size_t evictions{0};
+
+                size_t entries{0};
+                size_t size_bytes{0};
+                size_t max_size_bytes{0};
+            };
+
+            FFMpegDiskCache(std::string /* directory */, size_t /* max size bytes */);
+            ~FFMpegDiskCache();
+
+            /* creates the cache directory and loads all existing entries */
+            bool initialize(std::string& /* error */);
+
+            /* returns the first cached entry of the given keys. Counts as one hit or miss. */
+            [[nodiscard]] std::optional<Entry> lookup(const std::vector<std::string>& /* keys */);
+
+            /* returns a path where the new entry should be written to */
+            [[nodiscard]] std::string reserve(const std::string& /* key */);
+            bool commit(const std::string& /* key */, const std::string& /* reserved path */, const std::map<std::string, std::string>& /* metadata */);
+            void discard(const std::string& /* reserved path */);
+
+            [[nodiscard]] Metrics metrics();
+        private:
+            struct CacheEntry {
+                std::string key{};
+                std::string file_name{};
+                size_t size{0};
+                std::map<std::string, std::string> metadata{};
+            };
+
+            [[nodiscard]] static std::string file_name(const std::string& /* key */);
+            [[nodiscard]] std::string path(const std::string& /* file name */, const char* /* extension */) const;
+
+            /* call only when lock is acquired */
+            void remove_entry(std::list<CacheEntry>::iterator);
+            void evict();
+            [[nodiscard]] std::shared_ptr<void> pin(const std::string& /* file name */);
+
+            void unpin(const std::string& /* file name */);
+
+            const std::string directory;
+            const size_t max_size;
+
+            std::mutex lock{};
+            std::list<CacheEntry> entries{}; /* most recently used first */
+            std::map<std::string, std::list<CacheEntry>::iterator> entry_index{};
+            size_t size{0};
+            size_t reserve_index{0};
+            std::map<std::string, size_t> pins{}; /* file name -> pin count */
+
+            Metrics metrics_{};
+    };
+}
@@ -0,0 +1,67 @@
+#include <algorithm>
+#include "./FFMpegEventDispatcher.h"
+
+using namespace music::player;
+
+FFMpegEventDispatcher* FFMpegEventDispatcher::instance{nullptr};
+
+FFMpegEventDispatcher::FFMpegEventDispatcher(size_t max_queue_size) : max_queue_size{max_queue_size} {
+    this->thread = std::thread{&FFMpegEventDispatcher::execute_tasks, this};
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+    pthread_setname_np(this->thread.native_handle(), "FFMpeg Events");
+#endif
+}
+
+FFMpegEventDispatcher::~FFMpegEventDispatcher() {
+    {
+        std::lock_guard lock_{this->lock};
+        this->shutdown = true;
+    }
+    this->notify.notify_all();
+
+    if(this->thread.joinable())
+        this->thread.join();
+}
+
+bool FFMpegEventDispatcher::execute(task_t task) {
+    {
+        std::lock_guard lock_{this->lock};
+        if(this->shutdown || (this->max_queue_size > 0 && this->tasks.size() >= this->max_queue_size)) {
+            this->metrics_.rejected++;
+            return false;
+        }
+
+        this->tasks.push_back(std::move(task));
+        this->metrics_.queued_peak = std::max(this->metrics_.queued_peak, this->tasks.size());
+    }
+    this->notify.notify_one();
+    return true;
+}
+
+void FFMpegEventDispatcher::execute_tasks() {
+    std::unique_lock lock_{this->lock};
+    while(true) {
+        this->notify.wait(lock_, [&]{ return this->shutdown || !this->tasks.empty(); });
+        if(this->tasks.empty())
+            return; /* shutdown requested and all events have been dispatched */
+
+        auto task = std::move(this->tasks.front());
+        this->tasks.pop_front();
+        lock_.unlock();
+
+        task();
+        task = nullptr;
+
+        lock_.lock();
+        this->metrics_.executed++;
+    }
+}
+
+FFMpegEventDispatcher::Metrics FFMpegEventDispatcher::metrics() {
+    std::lock_guard lock_{this->lock};
+
+    auto result = this->metrics_;
+    result.queued = this->tasks.size();
+    return result;
+}
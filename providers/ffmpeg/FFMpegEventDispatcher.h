@@ -0,0 +1,50 @@
+#pragma once
+
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+namespace music::player {
+    /*
+     * Dedicated thread which runs the player event handlers of the host (see MusicPlayer::eventExecutor).
+     * Slow handlers delay the events of other players but neither the ffmpeg event loop nor the worker pool.
+     */
+    class FFMpegEventDispatcher {
+        public:
+            /* nullptr if the provider has been shut down */
+            static FFMpegEventDispatcher* instance;
+
+            typedef std::function<void()> task_t;
+
+            struct Metrics {
+                size_t queued{0};
+                size_t queued_peak{0};
+
+                size_t executed{0};
+                size_t rejected{0};
+            };
+
+            explicit FFMpegEventDispatcher(size_t /* max queue size, 0 for unlimited */);
+            /* executes the remaining tasks and joins the thread */
+            ~FFMpegEventDispatcher();
+
+            /* returns false if the queue is full */
+            bool execute(task_t /* task */);
+
+            [[nodiscard]] Metrics metrics();
+        private:
+            void execute_tasks();
+
+            const size_t max_queue_size;
+
+            std::mutex lock{};
+            std::condition_variable notify{};
+            std::deque<task_t> tasks{};
+            bool shutdown{false};
+
+            Metrics metrics_{};
+            std::thread thread{};
+    };
+}
@@ -3,7 +3,6 @@
 #include <utility>
 #include <StringVariable.h>
 #include <teaspeak/MusicPlayer.h>
-#include <providers/shared/pstream.h>
 #include "./FFMpegMusicPlayer.h"
 
 using namespace std;
@@ -26,6 +25,22 @@ size_t FFMpegMusicPlayer::sampleRate() {
 bool FFMpegMusicPlayer::initialize(size_t channel) {
 	AbstractMusicPlayer::initialize(channel);
 	this->stream_successfull_started = false;
+
+	this->prefix_ = nullptr;
+	this->prefix_index = 0;
+	if(auto prefix_cache{FFMpegPrefixCache::instance}; prefix_cache && this->prefix_cache_enabled_ && this->start_offset.count() == 0 && this->output_format_ == OutputFormat::FORMAT_PCM_S16LE) {
+	    auto prefix = prefix_cache->lookup(this->prefix_cache_key_.empty() ? this->url_ : this->prefix_cache_key_);
+	    if(prefix && prefix->channels == this->stream_channel_count() && !prefix->segments.empty() && prefix->segments.front().max_sample_count == this->_preferredSampleCount) {
+	        /* play the cached prefix while the stream starts behind it */
+	        this->prefix_ = std::move(prefix);
+	        this->cached_stream_info.length = this->prefix_->stream_length;
+	        this->start_offset = PlayerUnits{this->prefix_->sample_count * 1000 / this->sampleRate()};
+	    }
+	}
+
+	if(auto seek_index{FFMpegSeekIndex::instance}; seek_index && this->url_type == FFMPEGURLType::FILE && !this->seek_index_)
+	    this->seek_index_ = seek_index->find(this->url_); /* schedules the index creation if the index isn't known yet */
+
 	this->spawn_stream();
     return this->good();
 }
@@ -43,6 +58,75 @@ bool FFMpegMusicPlayer::await_info(const std::chrono::system_clock::time_point &
     }
 }
 
+void FFMpegMusicPlayer::info_callback(std::function<void(const std::string &)> callback) {
+    {
+        std::lock_guard clock{this->info_callback_lock};
+        this->info_callback_ = std::move(callback);
+    }
+
+    std::unique_lock ilock{this->cached_stream_info.cv_lock};
+    if(this->cached_stream_info.up2date) {
+        ilock.unlock();
+        this->notify_info_loaded("");
+    }
+}
+
+void FFMpegMusicPlayer::notify_info_loaded(const std::string &error) {
+    std::function<void(const std::string&)> callback{};
+    {
+        std::lock_guard clock{this->info_callback_lock};
+        callback = std::exchange(this->info_callback_, nullptr);
+    }
+
+    if(callback)
+        callback(error);
+}
+
+void FFMpegMusicPlayer::buffer_watermarks(const FFMpegBufferWatermarks &watermarks) {
+    this->buffer_watermarks_ = watermarks;
+}
+
+void FFMpegMusicPlayer::disk_cache_entry(std::string key, std::map<std::string, std::string> metadata) {
+    this->disk_cache_key_ = std::move(key);
+    this->disk_cache_metadata_ = std::move(metadata);
+}
+
+void FFMpegMusicPlayer::prefix_cache_key(std::string key) {
+    this->prefix_cache_key_ = std::move(key);
+}
+
+void FFMpegMusicPlayer::prefix_cache_enabled(bool enabled) {
+    this->prefix_cache_enabled_ = enabled;
+}
+
+bool FFMpegMusicPlayer::prefix_playing() const {
+    return this->prefix_ && this->prefix_index < this->prefix_->segments.size();
+}
+
+void FFMpegMusicPlayer::record_prefix(const SampleSegment &segment) {
+    auto recording = this->prefix_recording;
+    auto& compressed = recording->segments.emplace_back();
+    compress_segment(segment, compressed);
+    recording->channels = segment.channels;
+    recording->sample_count += segment.segmentLength;
+
+    auto prefix_cache = FFMpegPrefixCache::instance;
+    if(!prefix_cache) {
+        this->prefix_recording = nullptr;
+        return;
+    }
+
+    if(recording->sample_count * 1000 / this->sampleRate() < (size_t) prefix_cache->prefix_length.count())
+        return;
+
+    this->prefix_recording = nullptr;
+    recording->stream_length = this->cached_stream_info.length;
+    if(recording->stream_length <= prefix_cache->prefix_length)
+        return; /* live stream or the source is too short */
+
+    prefix_cache->store(this->prefix_cache_key_.empty() ? this->url_ : this->prefix_cache_key_, std::move(recording));
+}
+
 void FFMpegMusicPlayer::play() {
     if(!this->stream)
         this->spawn_stream();
@@ -59,6 +143,7 @@ void FFMpegMusicPlayer::pause() {
 }
 
 void FFMpegMusicPlayer::stop() {
+    this->prefix_ = nullptr;
     this->destroy_stream();
     AbstractMusicPlayer::stop();
 }
@@ -68,6 +153,19 @@ PlayerUnits FFMpegMusicPlayer::length() {
 }
 
 PlayerUnits FFMpegMusicPlayer::currentIndex() {
+    if(this->prefix_playing()) {
+        size_t samples{0};
+        for(size_t index{0}; index < this->prefix_index; index++)
+            samples += this->prefix_->segments[index].sample_count;
+        return PlayerUnits{samples * 1000 / this->sampleRate()};
+    }
+
+    {
+        std::lock_guard dlock{this->draining_lock};
+        if(!this->draining_streams.empty())
+            return this->draining_streams.front()->current_playback_index();
+    }
+
     auto stream_ref = this->stream;
     if(!stream_ref) return this->start_offset;
 
@@ -92,10 +190,11 @@ void FFMpegMusicPlayer::rewind(const PlayerUnits &duration) {
     auto stream_ref = this->stream;
     if (!stream_ref) return;
 
-    auto target = stream_ref->current_playback_index() - duration;
+    auto target = this->currentIndex() - duration;
     if(target.count() < 0)
         target = PlayerUnits{0};
 
+    this->prefix_ = nullptr;
     this->destroy_stream();
 
     this->start_offset = target;
@@ -105,13 +204,14 @@ void FFMpegMusicPlayer::forward(const PlayerUnits &duration) {
     auto stream_ref = this->stream;
     if(!stream_ref) return;
 
-    auto target = stream_ref->current_playback_index() + duration;
+    auto target = this->currentIndex() + duration;
     auto& info = stream_ref->stream_info();
-    if(info.initialized && target > std::chrono::ceil<PlayerUnits>(info.stream_length)) {
+    if(this->seek_index_ ? target > this->seek_index_->length() : info.initialized && target > std::chrono::ceil<PlayerUnits>(info.stream_length)) {
         this->stop();
         return;
     }
 
+    this->prefix_ = nullptr;
     this->destroy_stream();
 
     this->start_offset = target;
@@ -122,6 +222,18 @@ bool FFMpegMusicPlayer::finished() { return this->stream == nullptr; }
 
 
 std::shared_ptr<SampleSegment> FFMpegMusicPlayer::peekNextSegment() {
+    if(this->prefix_playing()) {
+        auto& compressed = this->prefix_->segments[this->prefix_index];
+        auto segment = SampleSegment::allocate(compressed.max_sample_count, compressed.channels);
+        return decompress_segment(compressed, *segment) ? segment : nullptr;
+    }
+
+    {
+        std::lock_guard dlock{this->draining_lock};
+        if(!this->draining_streams.empty())
+            return this->draining_streams.front()->peek_next_segment();
+    }
+
     auto stream_ref = this->stream;
     if(!stream_ref) return nullptr;
 
@@ -129,24 +241,203 @@ std::shared_ptr<SampleSegment> FFMpegMusicPlayer::peekNextSegment() {
 }
 
 std::shared_ptr<SampleSegment> FFMpegMusicPlayer::popNextSegment() {
+    this->refill_trimmed_stream();
     auto stream_ref = this->stream;
     if(!stream_ref) goto flush_events;
 
     if(this->state() == PlayerState::STATE_STOPPED || this->state() == PlayerState::STATE_UNINIZALISIZED)
         goto flush_events;
 
-    if(auto buffer = stream_ref->pop_next_segment(); buffer)
+    if(this->prefix_playing()) {
+        auto& compressed = this->prefix_->segments[this->prefix_index++];
+        auto segment = SampleSegment::allocate(compressed.max_sample_count, compressed.channels);
+        if(decompress_segment(compressed, *segment))
+            return segment;
+
+        /* should never happen. Continue with the stream. */
+        this->prefix_index = this->prefix_->segments.size();
+    }
+
+    if(auto buffer = this->pop_draining_segment(); buffer)
+        return buffer;
+
+    if(auto buffer = stream_ref->pop_next_segment(); buffer) {
+        if(this->prefix_recording)
+            this->record_prefix(*buffer);
         return buffer;
+    }
+
+    flush_events:
+    this->flush_stream_events();
+    return nullptr;
+}
+
+size_t FFMpegMusicPlayer::popSegments(size_t max_segments, std::vector<std::shared_ptr<SampleSegment>> &target) {
+    this->refill_trimmed_stream();
+    auto stream_ref = this->stream;
+    if(!stream_ref || this->state() == PlayerState::STATE_STOPPED || this->state() == PlayerState::STATE_UNINIZALISIZED) {
+        this->flush_stream_events();
+        return 0;
+    }
+
+    /* the cached prefix segments have to be decompressed one by one anyways, replaced streams are rare */
+    size_t count{0};
+    while(count < max_segments && (this->prefix_playing() || this->draining())) {
+        auto segment = this->popNextSegment();
+        if(!segment) break;
+
+        target.push_back(std::move(segment));
+        count++;
+    }
+    if(count == max_segments)
+        return count;
+
+    const auto offset = target.size();
+    const auto popped = stream_ref->pop_next_segments(max_segments - count, target);
+    for(size_t index{offset}; index < target.size() && this->prefix_recording; index++)
+        this->record_prefix(*target[index]);
+
+    count += popped;
+    if(count == 0)
+        this->flush_stream_events();
+    return count;
+}
+
+size_t FFMpegMusicPlayer::readSamples(int16_t *target, size_t max_frames, bool mix) {
+    this->refill_trimmed_stream();
+
+    /* the cached prefix, its recording, replaced streams and the remainder of an already popped segment work on whole segments */
+    if(this->prefix_playing() || this->prefix_recording || this->_readSegment || this->draining())
+        return AbstractMusicPlayer::readSamples(target, max_frames, mix);
+
+    size_t written{0};
+    auto stream_ref = this->stream;
+    if(stream_ref && this->state() != PlayerState::STATE_STOPPED && this->state() != PlayerState::STATE_UNINIZALISIZED)
+        written = stream_ref->read_samples(target, max_frames, mix);
+
+    if(written == 0)
+        this->flush_stream_events();
+    return written;
+}
+
+bool FFMpegMusicPlayer::readyCallback(std::function<void()> callback, size_t threshold) {
+    bool enabled;
+    {
+        std::lock_guard rlock{this->ready_lock};
+        this->ready_callback_ = std::move(callback);
+        this->ready_threshold_ = threshold;
+        enabled = !!this->ready_callback_;
+    }
+
+    if(auto stream_ref{this->stream}; stream_ref)
+        stream_ref->ready_callback(enabled ? std::bind(&FFMpegMusicPlayer::notify_ready, this) : FFMpegStream::callback_ready_t{}, threshold);
+    if(this->prefix_playing())
+        this->notify_ready();
+    return true;
+}
+
+void FFMpegMusicPlayer::notify_ready() {
+    std::function<void()> callback{};
+    {
+        std::lock_guard rlock{this->ready_lock};
+        callback = this->ready_callback_;
+    }
+
+    if(callback)
+        callback();
+}
+
+std::shared_ptr<EncodedSegment> FFMpegMusicPlayer::popNextPacket() {
+    this->refill_trimmed_stream();
+    auto stream_ref = this->stream;
+    if(!stream_ref) goto flush_events;
+
+    if(this->state() == PlayerState::STATE_STOPPED || this->state() == PlayerState::STATE_UNINIZALISIZED)
+        goto flush_events;
+
+    {
+        std::lock_guard dlock{this->draining_lock};
+        while(!this->draining_streams.empty()) {
+            if(auto packet = this->draining_streams.front()->pop_next_packet(); packet)
+                return packet;
+
+            this->draining_streams.pop_front();
+        }
+    }
+
+    if(auto packet = stream_ref->pop_next_packet(); packet)
+        return packet;
 
     flush_events:
+    this->flush_stream_events();
+    return nullptr;
+}
+
+bool FFMpegMusicPlayer::draining() const {
+    std::lock_guard dlock{this->draining_lock};
+    return !this->draining_streams.empty();
+}
+
+std::shared_ptr<SampleSegment> FFMpegMusicPlayer::pop_draining_segment() {
+    std::lock_guard dlock{this->draining_lock};
+    while(!this->draining_streams.empty()) {
+        if(auto buffer = this->draining_streams.front()->pop_next_segment(); buffer)
+            return buffer;
+
+        this->draining_streams.pop_front();
+    }
+    return nullptr;
+}
+
+void FFMpegMusicPlayer::flush_stream_events() {
     if(this->stream_aborted) {
-        this->fireEvent(MusicEvent::EVENT_ABORT);
+        this->dispatchEvent(MusicEvent::EVENT_ABORT);
     } else if(this->stream_ended) {
-        this->fireEvent(MusicEvent::EVENT_END);
+        this->dispatchEvent(MusicEvent::EVENT_END);
     }
     this->stream_ended = false;
     this->stream_aborted = false;
-    return nullptr;
+}
+
+void FFMpegMusicPlayer::preferredSampleCount(size_t samples) {
+    if(samples == 0)
+        return;
+
+    AbstractMusicPlayer::preferredSampleCount(samples);
+    if(auto stream_ref{this->stream}; stream_ref)
+        stream_ref->frame_sample_count(samples);
+}
+
+bool FFMpegMusicPlayer::outputFormatSupported(OutputFormat format) {
+    switch (format) {
+        case OutputFormat::FORMAT_PCM_S16LE:
+            return true;
+        case OutputFormat::FORMAT_OPUS:
+            return FFMpegProvider::instance && FFMpegProvider::instance->configuration()->opus.enabled;
+        default:
+            return false;
+    }
+}
+
+OutputFormat FFMpegMusicPlayer::outputFormat() {
+    return this->output_format_;
+}
+
+bool FFMpegMusicPlayer::outputFormat(OutputFormat format) {
+    if(!this->outputFormatSupported(format))
+        return false;
+
+    if(this->output_format_ == format)
+        return true;
+
+    this->output_format_ = format;
+    if(auto stream_ref{this->stream}; stream_ref) {
+        /* already buffered data has the wrong format */
+        this->start_offset = this->currentIndex();
+        this->prefix_ = nullptr;
+        this->spawn_stream();
+    }
+    return true;
 }
 
 deque<shared_ptr<Thumbnail>> FFMpegMusicPlayer::thumbnails() {
@@ -156,8 +447,37 @@ deque<shared_ptr<Thumbnail>> FFMpegMusicPlayer::thumbnails() {
 
 void FFMpegMusicPlayer::spawn_stream() {
     std::string error{};
+    {
+        /* we're starting at a new position */
+        std::lock_guard dlock{this->draining_lock};
+        this->draining_streams.clear();
+    }
+
+    auto stream = std::make_shared<FFMpegStream>(this->url_, this->url_type, this->cached_stream_info.length.count() > 0 ? this->start_offset : PlayerUnits{0}, this->_preferredSampleCount, this->stream_channel_count(), this->sampleRate());
+    if(auto old_stream{this->stream}; old_stream) {
+        /* keep what the old stream learned about the source */
+        stream->buffer_watermarks(old_stream->buffer_watermarks());
+    } else if(this->buffer_watermarks_.has_value()) {
+        stream->buffer_watermarks(*this->buffer_watermarks_);
+    }
+
+    stream->output_format(this->output_format_, this->source_codec_ == "opus" && !this->copy_rejected_);
+    if(auto seek_index{FFMpegSeekIndex::instance}; seek_index && this->url_type == FFMPEGURLType::FILE && this->start_offset.count() > 0 && this->output_format_ == OutputFormat::FORMAT_PCM_S16LE) {
+        if(!this->seek_index_)
+            this->seek_index_ = seek_index->find(this->url_);
 
-    auto stream = std::make_shared<FFMpegStream>(this->url_, this->url_type, this->cached_stream_info.length.count() > 0 ? this->start_offset : PlayerUnits{0}, 960, 2, 48000);
+        if(this->seek_index_)
+            stream->seek_position(this->seek_index_->position(this->start_offset, this->sampleRate()));
+    }
+    if(!this->disk_cache_key_.empty())
+        stream->cache_entry(this->disk_cache_key_, this->disk_cache_metadata_);
+
+    this->prefix_recording = nullptr;
+    this->_readSegment = nullptr;
+    if(auto prefix_cache{FFMpegPrefixCache::instance}; prefix_cache && this->prefix_cache_enabled_ && !this->prefix_ && this->start_offset.count() == 0 && this->output_format_ == OutputFormat::FORMAT_PCM_S16LE) {
+        if(prefix_cache->wanted(this->prefix_cache_key_.empty() ? this->url_ : this->prefix_cache_key_))
+            this->prefix_recording = std::make_shared<FFMpegPrefixCache::Prefix>();
+    }
     if(!stream->initialize(error)) {
         this->apply_error(error);
         return;
@@ -167,6 +487,11 @@ void FFMpegMusicPlayer::spawn_stream() {
     stream->callback_ended = std::bind(&FFMpegMusicPlayer::callback_stream_ended, this);
     stream->callback_abort = std::bind(&FFMpegMusicPlayer::callback_stream_aborted, this);
     stream->callback_connect_error = std::bind(&FFMpegMusicPlayer::callback_stream_connect_error, this, std::placeholders::_1);
+    {
+        std::lock_guard rlock{this->ready_lock};
+        if(this->ready_callback_)
+            stream->ready_callback(std::bind(&FFMpegMusicPlayer::notify_ready, this), this->ready_threshold_);
+    }
 
     this->stream_aborted = false;
     this->stream_ended = false;
@@ -177,20 +502,31 @@ void FFMpegMusicPlayer::spawn_stream() {
         stream->callback_info_initialized = nullptr;
         stream->callback_ended = nullptr;
         stream->callback_abort = nullptr;
+        stream->ready_callback(nullptr, 0);
     }
+
+    /* the cached prefix is available immediately */
+    if(this->prefix_playing())
+        this->notify_ready();
 }
 
 void FFMpegMusicPlayer::destroy_stream() {
+    {
+        std::lock_guard dlock{this->draining_lock};
+        this->draining_streams.clear();
+    }
+
     auto old_stream = std::exchange(this->stream, nullptr);
     if(!old_stream) return;
 
     old_stream->callback_info_initialized = nullptr;
     old_stream->callback_ended = nullptr;
     old_stream->callback_abort = nullptr;
+    old_stream->ready_callback(nullptr, 0);
 }
 
 void FFMpegMusicPlayer::callback_stream_info() {
-    std::lock_guard info_lock{this->cached_stream_info.cv_lock};
+    std::unique_lock info_lock{this->cached_stream_info.cv_lock};
     this->cached_stream_info.update_cv.notify_all();
     if(this->cached_stream_info.up2date) return;
 
@@ -198,10 +534,11 @@ void FFMpegMusicPlayer::callback_stream_info() {
     if(!stream_ref) return;
 
     auto& info = stream_ref->stream_info();
-    std::lock_guard lock{info.lock};
+    std::unique_lock lock{info.lock};
     if(!info.initialized) return;
 
-    this->cached_stream_info.length = info.stream_length;
+    /* ffmpeg only knows the length of the remaining part if we've started at a byte offset */
+    this->cached_stream_info.length = this->seek_index_ ? this->seek_index_->length() : info.stream_length;
 
     this->cached_stream_info.has_title = false;
     for(const auto& key : {"title", "StreamTitle"}) {
@@ -224,30 +561,100 @@ void FFMpegMusicPlayer::callback_stream_info() {
     this->cached_stream_info.up2date = true;
     this->stream_successfull_started = true;
     this->stream_fail_count = 0;
-    this->fireEvent(EVENT_INFO_UPDATE);
+    this->dispatchEvent(EVENT_INFO_UPDATE);
+
+    lock.unlock();
+    info_lock.unlock();
+    this->notify_info_loaded("");
 }
 
 void FFMpegMusicPlayer::callback_stream_ended() {
     this->stream_ended = true;
+    this->notify_ready();
+    this->notify_info_loaded("stream ended without any info");
 }
 
 void FFMpegMusicPlayer::callback_stream_aborted() {
-    this->stream_aborted = true;
-
     auto stream_ref = this->stream;
-    if(!stream_ref) return;
+    if(!stream_ref) {
+        this->stream_aborted = true;
+        this->notify_ready();
+        this->notify_info_loaded("stream aborted");
+        return;
+    }
+
+    if(stream_ref->copy_rejected()) {
+        log::log(log::debug, "FFmpeg stream can't pass through the opus source. Restarting the stream with transcoding.");
+        this->copy_rejected_ = true;
+        this->resume_stream(this->url_);
+        return;
+    }
+
+    if(this->stream_successfull_started && this->handle_stream_abort(*stream_ref)) {
+        log::log(log::debug, "FFmpeg stream aborted. The player restarts the stream.");
+        return;
+    }
 
     if(this->stream_successfull_started && this->stream_fail_count++ < 3) {
         log::log(log::debug, "FFmpeg stream aborted. Abort count: " + std::to_string(this->stream_fail_count) + ". Restarting stream.");
-        this->start_offset = stream->current_playback_index(); //TODO Save already buffered samples!
-        this->spawn_stream();
+        this->resume_stream(this->url_);
     } else {
         log::log(log::debug, "FFmpeg stream aborted. Abort count: " + std::to_string(this->stream_fail_count) + ". Stream failed totally.");
-        this->apply_error("failed to reconnect to stream");
-        this->fireEvent(MusicEvent::EVENT_ERROR);
+        this->abort_stream("failed to reconnect to stream");
     }
 }
 
+void* FFMpegMusicPlayer::event_base() {
+    auto provider = FFMpegProvider::instance;
+    return provider ? provider->readerBase : nullptr;
+}
+
+void FFMpegMusicPlayer::resume_stream(std::string url) {
+    auto old_stream = this->stream;
+    if(!old_stream) return;
+
+    old_stream->complete_buffer();
+    std::deque<std::shared_ptr<FFMpegStream>> draining{};
+    {
+        std::lock_guard dlock{this->draining_lock};
+        draining = std::move(this->draining_streams);
+    }
+
+    this->url_ = std::move(url);
+    this->start_offset = old_stream->current_buffer_index();
+    this->spawn_stream();
+    if(this->stream == old_stream)
+        return; /* failed to spawn the new stream */
+
+    {
+        std::lock_guard dlock{this->draining_lock};
+        this->draining_streams = std::move(draining);
+        this->draining_streams.push_back(std::move(old_stream));
+    }
+    this->notify_ready();
+}
+
+void FFMpegMusicPlayer::refill_trimmed_stream() {
+    auto stream_ref = this->stream;
+    if(!stream_ref || !stream_ref->refill_requested())
+        return;
+
+    if(this->state() == PlayerState::STATE_STOPPED || this->state() == PlayerState::STATE_UNINIZALISIZED)
+        return;
+
+    log::log(log::debug, "FFmpeg stream dropped buffered audio while being idle. Continuing with a new stream.");
+    this->resume_stream(this->url_);
+}
+
+void FFMpegMusicPlayer::abort_stream(const std::string &error) {
+    this->stream_aborted = true;
+    this->notify_ready();
+
+    this->apply_error(error);
+    this->dispatchEvent(MusicEvent::EVENT_ERROR);
+    this->notify_info_loaded(error);
+}
+
 void FFMpegMusicPlayer::callback_stream_connect_error(const std::string &error) {
     auto stream_ref = this->stream;
     if(!stream_ref) return;
@@ -258,5 +665,7 @@ void FFMpegMusicPlayer::callback_stream_connect_error(const std::string &error)
 
     log::log(log::debug, "FFMpeg failed to connect: " + error);
     this->apply_error(error);
-    this->fireEvent(MusicEvent::EVENT_ERROR);
+    this->dispatchEvent(MusicEvent::EVENT_ERROR);
+    this->notify_ready();
+    this->notify_info_loaded(error);
 }
\ No newline at end of file
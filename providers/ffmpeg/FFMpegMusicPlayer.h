@@ -1,9 +1,21 @@
+#pragma once
+
 #include <include/teaspeak/MusicPlayer.h>
 #include <thread>
 #include <sstream>
 #include <memory>
 #include <map>
+#include <atomic>
+#include <optional>
+#include <sys/uio.h>
 #include "providers/shared/libevent.h"
+#include "providers/shared/ProcessLauncher.h"
+#include "providers/shared/libopus.h"
+#include "providers/ffmpeg/FFMpegProvider.h"
+#include "providers/ffmpeg/SampleCompression.h"
+#include "providers/ffmpeg/OggDemuxer.h"
+#include "providers/ffmpeg/FFMpegPrefixCache.h"
+#include "providers/ffmpeg/FFMpegSeekIndex.h"
 
 #define DEBUG_FFMPEG
 template <typename T>
@@ -14,6 +26,8 @@ inline std::string to_string(T* ptr) {
 }
 
 namespace music::player {
+    class FFMpegUringReader;
+
     enum struct FFMPEGURLType {
         STREAM,
         FILE
@@ -26,17 +40,25 @@ namespace music::player {
             };
 
             typedef std::function<void(const void* /* buffer */, size_t /* length */)> ReadCallback;
+            /*
+             * Scatter reads straight into the consumers memory. The prepare callback fills the target buffers
+             * (and the objects which have to be kept alive until the read finished), commit receives the bytes read.
+             */
+            typedef std::function<size_t(iovec* /* vectors */, size_t /* max vectors */, std::vector<std::shared_ptr<void>>& /* keep alive */)> PrepareReadCallback;
+            typedef std::function<void(size_t /* length */)> CommitReadCallback;
             typedef std::function<void(ErrorCode /* code */, int /* detail */)> ErrorCallback;
             typedef std::function<void()> EOFCallback;
             typedef std::function<void()> TimerCallback;
 
-#ifdef REDI_PSTREAM_H_SEEN //So you could include this header event without the extra libs
-            typedef redi::pstream pstream_t;
-#else
-            typedef void* pstream_t;
-#endif
+            /* totals of all process handles */
+            struct IOMetrics {
+                size_t wakeups{0}; /* read events dispatched by the event loop */
+                size_t reads{0};
+                size_t bytes{0};
+            };
+            [[nodiscard]] static IOMetrics io_metrics();
 
-            explicit FFMpegProcessHandle(pstream_t* stream) : process_handle{stream} {}
+            explicit FFMpegProcessHandle(pl::Process* process) : process_handle{process} {}
             ~FFMpegProcessHandle();
 
             bool initialize_events();
@@ -51,7 +73,7 @@ namespace music::player {
             //Attention: Pointer might be dangling at any state except before initialize.
             //We cant ensure that within the event loop process handle hasn't been deleted!
             //but we don't really need to because that's not from interest
-            pstream_t* process_handle;
+            pl::Process* process_handle;
 
             /* event stuff */
             struct _io {
@@ -63,19 +85,44 @@ namespace music::player {
                 void *event_out{nullptr};
                 void *event_err{nullptr};
                 void *event_timer{nullptr};
-
+                void *event_resume{nullptr}; /* re-enables event_out in batched mode or submits the next io_uring read */
             } io;
 
+            /*
+             * Read the output via io_uring instead of libevent. Requires the prepare/commit output callbacks.
+             * Must be set before initialize_events().
+             */
+            FFMpegUringReader* uring{nullptr};
+            bool uring_pending{false}; /* protected by io.lock */
+
             bool buffering{false};
 
+            /*
+             * Batched read mode: Every wakeup drains the output pipe and the output event gets paused for batch_interval.
+             * This coalesces the small writes of ffmpeg into fewer wakeups. Zero reads on every wakeup.
+             * Must be set before initialize_events().
+             */
+            std::chrono::milliseconds batch_interval{0};
+
             /* callbacks are called within the event loop! */
             ReadCallback callback_read_error{};
             ReadCallback callback_read_output{};
+            PrepareReadCallback callback_prepare_output{}; /* takes precedence over callback_read_output */
+            CommitReadCallback callback_commit_output{};
             TimerCallback callback_timer{};
             ErrorCallback callback_error = [](ErrorCode, int) {};
             EOFCallback callback_eof = [](){};
+
+            /* called by the io_uring reader within the event loop */
+            void callback_uring_read(int /* result */);
         private:
             void callback_read(int, bool);
+            ssize_t read_buffered(int, bool);
+            ssize_t read_scattered(int);
+            /* call only when io.lock is not acquired */
+            void submit_uring_read();
+            /* detaches from the io_uring reader and reads the output via libevent. Call only within the event loop. */
+            void fallback_uring_read();
     };
 
     struct FFMpegStream {
@@ -84,6 +131,7 @@ namespace music::player {
             typedef std::function<void()> callback_abort_t;
             typedef std::function<void()> callback_info_update_t;
             typedef std::function<void(const std::string&)> callback_connect_error_t;
+            typedef std::function<void()> callback_ready_t;
 
             struct stream_info {
                 std::mutex lock{};
@@ -107,14 +155,53 @@ namespace music::player {
 
             [[nodiscard]] std::shared_ptr<SampleSegment> peek_next_segment();
             [[nodiscard]] std::shared_ptr<SampleSegment> pop_next_segment();
+            /* pops up to max segments within one buffer access. Returns the amount of segments appended to the target. */
+            size_t pop_next_segments(size_t /* max */, std::vector<std::shared_ptr<SampleSegment>>& /* target */);
+            /* copies (or mixes) up to max frames out of the buffer, including segments which are still being filled */
+            [[nodiscard]] size_t read_samples(int16_t* /* target */, size_t /* max frames */, bool /* mix */);
+            [[nodiscard]] std::shared_ptr<EncodedSegment> pop_next_packet();
 
             [[nodiscard]] struct stream_info& stream_info() { return this->_stream_info; }
             [[nodiscard]] PlayerUnits current_playback_index();
             [[nodiscard]] PlayerUnits current_buffer_index();
 
+            /* initial watermarks. Defaults to the provider configuration for the url type. */
+            void buffer_watermarks(const FFMpegBufferWatermarks&);
+            [[nodiscard]] FFMpegBufferWatermarks buffer_watermarks() const;
+
+            /* must be called before initialize. Copy the source codec instead of encoding if copy is set (source must be opus encoded). */
+            void output_format(OutputFormat /* format */, bool /* copy */);
+            [[nodiscard]] inline OutputFormat output_format() const { return this->output_format_; }
+
+            /* must be called before initialize. File playback starts at the indexed position instead of seeking via ffmpeg (pcm output only). */
+            void seek_position(const FFMpegSeekIndex::Position& /* position */);
+
+            /* must be called before initialize. Stores the fetched source within the disk cache if the stream has been fully received. */
+            void cache_entry(const std::string& /* key */, const std::map<std::string, std::string>& /* metadata */);
+
+            /*
+             * Called within the event loop when the buffered samples reached the threshold (zero for one frame).
+             * Rearmed once the consumer drained the buffer below the threshold.
+             */
+            void ready_callback(callback_ready_t /* callback */, size_t /* threshold samples */);
+
+            /* no more audio will be received (e.g. the stream got replaced after an abort). The incomplete last segment will be returned as well. */
+            void complete_buffer();
+
+            /* last http error status ffmpeg reported (e.g. 403 for an expired url), zero if none */
+            [[nodiscard]] inline int http_status() const { return this->http_status_; }
+
+            /* copy mode only: the source doesn't match the requested channel count. The stream aborts and has to be replaced by a transcoding one. */
+            [[nodiscard]] inline bool copy_rejected() const { return this->copy_rejected_; }
+            /* the tail of the buffer has been dropped (see FFMpegBufferBudget) and the stream has to be continued by a new one. Resets the request. */
+            [[nodiscard]] inline bool refill_requested() { return this->buffer_state.refill_requested.exchange(false); }
+
+            /* samples per channel of the segments returned by pop_next_segment. Might be changed at any time, already buffered audio will be reframed. */
+            void frame_sample_count(size_t /* samples */);
+            [[nodiscard]] inline size_t frame_sample_count() const { return this->frame_sample_count_; }
+
             const std::string url;
             const FFMPEGURLType url_type;
-            const size_t frame_sample_count;
             const size_t channel_count;
             const size_t sample_rate;
 
@@ -126,34 +213,126 @@ namespace music::player {
             callback_connect_error_t callback_connect_error{};
         private:
             /* call only when sample_lock is acquired */
-            std::shared_ptr<SampleSegment> get_sample_buffer();
-            [[nodiscard]] size_t buffered_sample_count(bool);
+            [[nodiscard]] size_t buffered_sample_count(bool, size_t* /* memory bytes */ = nullptr);
 
-            void callback_read_output(const void* /* buffer */, size_t /* length */);
+            /* call only when sample_lock is acquired */
+            void compress_buffered();
+            void decompress_buffered();
+            /* call only when sample_lock is acquired */
+            void decode_packets();
+            /* call only when sample_lock is acquired */
+            void decompress_next();
+            /* call only when sample_lock is acquired. Collects the next segment out of buffered segments with another frame size. */
+            [[nodiscard]] std::shared_ptr<SampleSegment> reframe_buffered(size_t /* frame samples */);
+            /* call only when sample_lock is acquired. Takes the next full segment out of the buffer. */
+            [[nodiscard]] std::shared_ptr<SampleSegment> take_next_segment(size_t /* frame samples */);
+            /* call only when sample_lock is acquired. Updates the playback position and the buffer state after the consumer took samples. */
+            void samples_consumed(size_t /* samples */);
+
+            [[nodiscard]] size_t prepare_output(iovec* /* vectors */, size_t /* max vectors */, std::vector<std::shared_ptr<void>>& /* keep alive */);
+            void commit_output(size_t /* length */);
+            void callback_read_packets(const void* /* buffer */, size_t /* length */);
+            void callback_packet(const uint8_t* /* packet */, size_t /* length */, bool /* header */);
             void callback_read_err(const void* /* buffer */, size_t /* length */);
             void callback_eof();
             void callback_error(FFMpegProcessHandle::ErrorCode, int);
+            void callback_process_exit(int /* wait status */);
+            void handle_eof(bool /* exited */, int /* exit code */);
+            void handle_io_error(int /* error */, bool /* exited */, int /* exit code */);
             void update_buffer_state(bool /* lock */);
+            /* called within the event loop. Drops the tail of the buffer if the stream is idle and exceeds its quota. */
+            void enforce_buffer_budget();
+            /* call only when sample_lock is acquired. Drops segments from the end of the buffer. Returns the dropped samples. */
+            size_t trim_buffered(size_t /* max memory bytes */);
+            /* stops ffmpeg but keeps the buffered audio */
+            void stop_process();
+            void update_ready_state(size_t /* buffered samples */, bool /* samples added */);
+            void adapt_buffer_speed(const std::string& /* ffmpeg speed property */);
+            void adapt_buffer_underrun();
+
+            std::atomic<size_t> frame_sample_count_;
 
             std::mutex process_lock{};
-#ifdef REDI_PSTREAM_H_SEEN //So you could include this header event without the extra libs
-            typedef redi::pstream pstream_t;
-#else
-            typedef void pstream_t;
-#endif
-            pstream_t* process_stream{nullptr};
+            pl::Process* process_stream{nullptr};
             std::shared_ptr<FFMpegProcessHandle> process_handle{nullptr};
 
+            /* protected by process_lock. The pipes might close before the process exits, so we await the exit status published by the reaper. */
+            struct _process_exit {
+                bool watched{false};
+                std::optional<int> status{};
+
+                bool pending_eof{false};
+                int pending_io_error{0};
+            } process_exit;
+
             struct _audio {
                 std::mutex lock{};
                 std::deque<std::shared_ptr<SampleSegment>> buffered{};
+                size_t front_offset{0}; /* samples of buffered.front() which have been returned already (only after a frame size change) */
 
-                char overhead_buffer[0xF]{}; //Buffer to store unusable read overhead (max. 8 full samples)
+                /* bytes of an incomplete frame which have been read into the tail of buffered.back() already */
                 size_t overhead_index = 0;
+                /* empty segments the next read scatters into after the current one has been filled */
+                std::vector<std::shared_ptr<SampleSegment>> spare{};
+                std::shared_ptr<SampleSegment> read_target{}; /* the segment which has been prepared as the first read target */
+                std::shared_ptr<char> discard{}; /* read target for skip_bytes */
+
+                size_t skip_bytes{0}; /* output in front of the seek target (see seek_position) */
+
+                /*
+                 * Compressed segments are logically located in front of buffered[compressed_index].
+                 * Only the first decode_ahead segments will be kept decoded. Zero disables compression.
+                 */
+                size_t decode_ahead{0};
+                size_t compressed_index{0};
+                std::deque<CompressedSegment> compressed{};
+
+                /* opus output or compressed transport */
+                std::deque<std::shared_ptr<EncodedSegment>> packets{};
+                size_t packet_skip{0}; /* opus output only: pre skip samples (48kHz) which still have to be dropped */
+
+                /* compressed transport only. Packets get decoded when pop_next_segment requires their samples. */
+                void* decoder{nullptr};
+                std::shared_ptr<libopus::function_handle> decoder_library{}; /* keeps libopus loaded while the decoder exists */
+                size_t decode_skip{0}; /* opus pre skip */
+                std::vector<int16_t> decode_buffer{};
             } audio;
 
+            OutputFormat output_format_{OutputFormat::FORMAT_PCM_S16LE};
+            bool output_copy{false};
+            bool copy_rejected_{false}; /* only accessed within the event loop */
+            bool transport_compressed{false}; /* pcm output via ogg/opus (see FFMpegProviderConfig::transport) */
+            std::optional<FFMpegSeekIndex::Position> seek_position_{};
+            OggDemuxer demuxer{}; /* only accessed within the event loop */
+
+            struct _cache {
+                std::string key{};
+                std::string file{}; /* empty if the source isn't cached */
+                std::map<std::string, std::string> metadata{};
+                bool completed{false};
+            } cache;
+
+            struct _ready_state {
+                std::mutex lock{};
+                callback_ready_t callback{};
+
+                size_t threshold{0};
+                std::atomic<bool> signalled{false};
+            } ready_state;
+
+            struct _buffer_state {
+                std::atomic<size_t> low_ms{0};
+                std::atomic<size_t> high_ms{0};
+
+                bool underrun{false}; /* protected by audio.lock */
+                std::atomic<bool> trimmed{false}; /* the process has been stopped because the buffer has been trimmed */
+                std::atomic<bool> refill_requested{false};
+                bool speed_adapted{false}; /* only accessed within the event loop */
+            } buffer_state;
+
             std::string meta_info_buffer{};
             bool meta_output_tag{false};
+            std::atomic<int> http_status_{0};
 
             PlayerUnits stream_seek_offset;
             size_t stream_sample_offset{0};
@@ -174,6 +353,22 @@ namespace music::player {
 
             bool initialize(size_t) override;
             [[nodiscard]] bool await_info(const std::chrono::system_clock::time_point& /* timeout */) const;
+            /*
+             * Will be called once as soon as the stream info has been loaded (empty error) or the stream failed before.
+             * Called within the event loop, or immediately if the info has been loaded already. The player must not be deleted within the callback.
+             */
+            void info_callback(std::function<void(const std::string& /* error */)> /* callback */);
+
+            /* overrides the provider default buffer watermarks. Applies to the next spawned stream. */
+            void buffer_watermarks(const FFMpegBufferWatermarks&);
+
+            /* store the source within the disk cache once it has been played from the beginning till the end */
+            void disk_cache_entry(std::string /* key */, std::map<std::string, std::string> /* metadata */);
+
+            /* stable key of the source for the prefix cache. Defaults to the url. Must be set before initialize. */
+            void prefix_cache_key(std::string /* key */);
+            /* players which don't play the source (e.g. info queries) must not count as a play. Must be set before initialize. */
+            void prefix_cache_enabled(bool /* enabled */);
 
             void pause() override;
 
@@ -193,6 +388,18 @@ namespace music::player {
 
             std::shared_ptr<SampleSegment> popNextSegment() override;
             std::shared_ptr<SampleSegment> peekNextSegment() override;
+            size_t popSegments(size_t /* max segments */, std::vector<std::shared_ptr<SampleSegment>>& /* target */) override;
+            size_t readSamples(int16_t* /* target */, size_t /* max frames */, bool /* mix */) override;
+            bool readyCallback(std::function<void()> /* callback */, size_t /* threshold frames */) override;
+
+            using AbstractMusicPlayer::preferredSampleCount;
+            /* applies to the current stream without restarting it */
+            void preferredSampleCount(size_t) override;
+
+            bool outputFormatSupported(OutputFormat) override;
+            OutputFormat outputFormat() override;
+            bool outputFormat(OutputFormat) override;
+            std::shared_ptr<EncodedSegment> popNextPacket() override;
 
             std::deque<std::shared_ptr<Thumbnail>> thumbnails() override;
 
@@ -200,7 +407,32 @@ namespace music::player {
             std::string songTitle() override;
             std::string songDescription() override;
 
+        protected:
+            /* codec of the source as far as known. Opus sources will be passed through in opus output mode. */
+            std::string source_codec_{};
+            bool copy_rejected_{false}; /* the source has been opus but couldn't be passed through */
+
+            /*
+             * Called within the event loop when a stream which has been playing already aborted.
+             * Return true if the player restarts the stream itself (resume_stream or abort_stream), e.g. after resolving a new url.
+             */
+            virtual bool handle_stream_abort(FFMpegStream& /* stream */) { return false; }
+
+            /* restarts the stream with the url at the end of the buffered audio. The audio buffered by the current stream will be played first. */
+            void resume_stream(std::string /* url */);
+            /* continues a stream which dropped the tail of its buffer while it has been idle */
+            void refill_trimmed_stream();
+            /* gives up on the stream, the player reports the error */
+            void abort_stream(const std::string& /* error */);
+            /* applies to the next spawned stream */
+            inline void stream_url(std::string url) { this->url_ = std::move(url); }
+
+            /* event base the streams are dispatched on. Exported for players of other provider libraries. Null if the provider has been shut down. */
+            [[nodiscard]] static void* event_base();
+
         private:
+            [[nodiscard]] inline size_t stream_channel_count() const { return this->_channelCount > 0 ? this->_channelCount : 2; }
+
             struct CachedStreamInfo {
                 bool has_title{false};
                 bool has_description{false};
@@ -223,11 +455,36 @@ namespace music::player {
             void callback_stream_connect_error(const std::string&);
 
             void handle_stream_fail();
+            void flush_stream_events();
+            void notify_ready();
+
+            [[nodiscard]] bool draining() const;
+            [[nodiscard]] std::shared_ptr<SampleSegment> pop_draining_segment();
+
+            [[nodiscard]] bool prefix_playing() const;
+            void record_prefix(const SampleSegment&);
 
             std::string url_;
             FFMPEGURLType url_type{FFMPEGURLType::STREAM};
             std::shared_ptr<FFMpegStream> stream{};
 
+            /* replaced streams which still have buffered audio. Played in front of the current stream. */
+            mutable std::mutex draining_lock{};
+            std::deque<std::shared_ptr<FFMpegStream>> draining_streams{};
+
+            std::optional<FFMpegBufferWatermarks> buffer_watermarks_{};
+            std::string disk_cache_key_{};
+            std::map<std::string, std::string> disk_cache_metadata_{};
+
+            std::shared_ptr<const FFMpegSeekIndex::Index> seek_index_{}; /* local mpeg audio files only */
+
+            std::string prefix_cache_key_{};
+            bool prefix_cache_enabled_{true};
+            std::shared_ptr<const FFMpegPrefixCache::Prefix> prefix_{}; /* prefix segments will be played before the stream */
+            size_t prefix_index{0};
+            std::shared_ptr<FFMpegPrefixCache::Prefix> prefix_recording{};
+            OutputFormat output_format_{OutputFormat::FORMAT_PCM_S16LE};
+
             CachedStreamInfo cached_stream_info{};
             FallbackStreamInfo fallback_stream_info{};
 
@@ -236,5 +493,13 @@ namespace music::player {
 
             bool stream_successfull_started{false};
             size_t stream_fail_count{0};
+
+            std::mutex ready_lock{};
+            std::function<void()> ready_callback_{};
+            size_t ready_threshold_{0};
+
+            std::mutex info_callback_lock{};
+            std::function<void(const std::string&)> info_callback_{};
+            void notify_info_loaded(const std::string& /* error */);
     };
 }
\ No newline at end of file
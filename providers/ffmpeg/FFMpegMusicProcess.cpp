@@ -1,13 +1,27 @@
 #include <map>
-#include <providers/shared/pstream.h>
+#include <atomic>
+#include <fcntl.h>
 #include "./FFMpegMusicPlayer.h"
 #include "./FFMpegProvider.h"
+#include "./FFMpegUringReader.h"
 
 using namespace std;
 using namespace std::chrono;
 using namespace music;
 using namespace music::player;
 
+static std::atomic<size_t> io_wakeups{0};
+static std::atomic<size_t> io_reads{0};
+static std::atomic<size_t> io_bytes{0};
+
+FFMpegProcessHandle::IOMetrics FFMpegProcessHandle::io_metrics() {
+    IOMetrics result{};
+    result.wakeups = io_wakeups + (FFMpegUringReader::instance ? FFMpegUringReader::instance->wakeups() : 0);
+    result.reads = io_reads;
+    result.bytes = io_bytes;
+    return result;
+}
+
 inline bool enable_non_block(int fd) {
 	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
 	return true;
@@ -21,10 +35,18 @@ void FFMpegProcessHandle::finalize() {
     const auto is_event_thread = std::this_thread::get_id() == this->io.event_thread;
     unique_lock io_lock{this->io.lock, defer_lock};
 
+    /* the read might fall back to libevent within the event loop */
+    if(!is_event_thread) io_lock.lock();
+    auto uring = this->uring;
+    if(io_lock.owns_lock()) io_lock.unlock();
+    if(uring)
+        uring->detach(this);
+
     if(!is_event_thread) io_lock.lock();
     auto event_out = std::exchange(this->io.event_out, nullptr);
     auto event_err = std::exchange(this->io.event_err, nullptr);
     auto event_timer = std::exchange(this->io.event_timer, nullptr);
+    auto event_resume = std::exchange(this->io.event_resume, nullptr);
     if(io_lock.owns_lock()) io_lock.unlock();
 
     const auto delete_function = is_event_thread ? libevent::functions->event_del_noblock : libevent::functions->event_del_block;
@@ -40,6 +62,10 @@ void FFMpegProcessHandle::finalize() {
         delete_function(event_timer);
         libevent::functions->event_free(event_timer);
     }
+    if(event_resume) {
+        delete_function(event_resume);
+        libevent::functions->event_free(event_resume);
+    }
 }
 
 bool FFMpegProcessHandle::initialize_events() {
@@ -48,11 +74,16 @@ bool FFMpegProcessHandle::initialize_events() {
 		return false;
 	}
 
-	auto fd_err = this->process_handle->rdbuf()->rpipe(redi::basic_pstreambuf<char>::buf_read_src::rsrc_err);
-	auto fd_out = this->process_handle->rdbuf()->rpipe(redi::basic_pstreambuf<char>::buf_read_src::rsrc_out);
+	auto fd_err = this->process_handle->fd_err();
+	auto fd_out = this->process_handle->fd_out();
 
     enable_non_block(fd_err);
-    enable_non_block(fd_out);
+    if(this->uring) {
+        /* io_uring would fail with EAGAIN instead of polling the pipe */
+        fcntl(fd_out, F_SETFL, fcntl(fd_out, F_GETFL, 0) & ~O_NONBLOCK);
+    } else {
+        enable_non_block(fd_out);
+    }
 
 	log::log(log::debug, "Got ffmpeg file descriptors for err " + to_string(fd_err) + " and out " + to_string(fd_out));
 	if(fd_err > 0)
@@ -60,7 +91,7 @@ bool FFMpegProcessHandle::initialize_events() {
 		    auto handle = reinterpret_cast<FFMpegProcessHandle*>(_handle);
 		    handle->callback_read(fd, true);
         }, this);
-	if(fd_out > 0)
+	if(fd_out > 0 && !this->uring)
 		this->io.event_out = libevent::functions->event_new(this->io.event_base, fd_out, EV_READ | EV_PERSIST, [](int fd, short, void* _handle) {
             auto handle = reinterpret_cast<FFMpegProcessHandle*>(_handle);
             handle->callback_read(fd, false);
@@ -72,7 +103,21 @@ bool FFMpegProcessHandle::initialize_events() {
             callback();
 	}, this);
 
-	if(!this->io.event_out) {
+    if(this->batch_interval.count() > 0 || this->uring) {
+        this->io.event_resume = libevent::functions->event_new(this->io.event_base, -1, 0, [](int, short, void* _handle) {
+            auto handle = reinterpret_cast<FFMpegProcessHandle*>(_handle);
+            if(handle->uring) {
+                handle->submit_uring_read();
+                return;
+            }
+
+            std::lock_guard io_lock{handle->io.lock};
+            if(handle->buffering && handle->io.event_out)
+                libevent::functions->event_add(handle->io.event_out, nullptr);
+        }, this);
+    }
+
+	if(!this->io.event_out && !this->uring) {
         log::log(log::err, "Missing output file descriptor");
         return false;
 	}
@@ -81,29 +126,162 @@ bool FFMpegProcessHandle::initialize_events() {
 	return true;
 }
 
-void FFMpegProcessHandle::callback_read(int fd, bool is_err_stream) {
-    constexpr auto buffer_size = 1024 * 1024;
-	ssize_t read_buffer_length{buffer_size};
+ssize_t FFMpegProcessHandle::read_scattered(int fd) {
+    constexpr auto kMaxVectors = 64;
+    iovec vectors[kMaxVectors];
+    std::vector<std::shared_ptr<void>> keep_alive{};
+
+    const auto vector_count = this->callback_prepare_output(vectors, kMaxVectors, keep_alive);
+    const auto result = readv(fd, vectors, (int) vector_count);
+    if(result > 0)
+        this->callback_commit_output((size_t) result);
+    return result;
+}
+
+ssize_t FFMpegProcessHandle::read_buffered(int fd, bool is_err_stream) {
+    constexpr auto buffer_size = 64 * 1024; /* default pipe capacity */
 	char buffer[buffer_size];
 
-    read_buffer_length = read(fd, buffer, read_buffer_length);
+    const auto read_buffer_length = read(fd, buffer, buffer_size);
     //log::log(log::trace, "Received " + std::to_string(read_buffer_length) + " at " + std::to_string(fd) + " " + (is_err_stream ? "err" : "out"));
-	if(read_buffer_length <= 0) {
-	    if(errno == EAGAIN) return;
-
-        if(this->io.event_out) libevent::functions->event_del_noblock(this->io.event_out);
-        if(this->io.event_err) libevent::functions->event_del_noblock(this->io.event_err);
-
-		if(read_buffer_length == 0)
-			this->callback_eof();
-		else
-            this->callback_error(ErrorCode::IO_ERROR, errno);
-		//This pointer might be dangling now because callbacks are allowed delete us!
-		return;
-	}
+    if(read_buffer_length > 0) {
+        auto callback = is_err_stream ? this->callback_read_error : this->callback_read_output;
+        if(callback) callback(buffer, read_buffer_length);
+    }
+    return read_buffer_length;
+}
+
+void FFMpegProcessHandle::callback_read(int fd, bool is_err_stream) {
+    constexpr auto kMaxBatchReads = 32;
+    const auto batched = !is_err_stream && this->io.event_resume && this->batch_interval.count() > 0;
+    io_wakeups++;
+
+    for(size_t reads{1};; reads++) {
+        ssize_t read_buffer_length;
+        if(!is_err_stream && this->callback_prepare_output)
+            read_buffer_length = this->read_scattered(fd);
+        else
+            read_buffer_length = this->read_buffered(fd, is_err_stream);
+
+        if(read_buffer_length <= 0) {
+            if(read_buffer_length < 0 && errno == EAGAIN) break;
+
+            if(this->io.event_out) libevent::functions->event_del_noblock(this->io.event_out);
+            if(this->io.event_err) libevent::functions->event_del_noblock(this->io.event_err);
+
+            if(read_buffer_length == 0)
+                this->callback_eof();
+            else
+                this->callback_error(ErrorCode::IO_ERROR, errno);
+            //This pointer might be dangling now because callbacks are allowed delete us!
+            return;
+        }
+
+        io_reads++;
+        io_bytes += (size_t) read_buffer_length;
+        if(!batched || reads >= kMaxBatchReads)
+            break;
+
+        /* the stream might have reached its high watermark */
+        std::lock_guard io_lock{this->io.lock};
+        if(!this->buffering)
+            break;
+    }
 
-	auto callback = is_err_stream ? this->callback_read_error : this->callback_read_output;
-	if(callback) callback(buffer, read_buffer_length);
+    if(batched) {
+        std::lock_guard io_lock{this->io.lock};
+        if(this->buffering && this->io.event_out) {
+            libevent::functions->event_del_noblock(this->io.event_out);
+
+            const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(this->batch_interval);
+            struct timeval time{(time_t) (micros.count() / 1000000), (suseconds_t) (micros.count() % 1000000)};
+            libevent::functions->event_add(this->io.event_resume, &time);
+        }
+    }
+}
+
+void FFMpegProcessHandle::submit_uring_read() {
+    {
+        std::lock_guard io_lock{this->io.lock};
+        if(!this->buffering || this->uring_pending || !this->io.event_resume)
+            return;
+        this->uring_pending = true;
+    }
+
+    constexpr auto kMaxVectors = 64;
+    iovec vectors[kMaxVectors];
+    std::vector<std::shared_ptr<void>> keep_alive{};
+    const auto vector_count = this->callback_prepare_output ? this->callback_prepare_output(vectors, kMaxVectors, keep_alive) : 0;
+
+    std::string error{};
+    if(vector_count == 0 || !this->uring->submit_read(this, this->process_handle->fd_out(), vectors, vector_count, std::move(keep_alive), error)) {
+        if(vector_count > 0) {
+            log::log(log::err, "[FFMPEG] Failed to submit io_uring read, falling back to libevent: " + error);
+            this->fallback_uring_read();
+            return;
+        }
+
+        std::lock_guard io_lock{this->io.lock};
+        this->uring_pending = false;
+    }
+}
+
+void FFMpegProcessHandle::fallback_uring_read() {
+    this->uring->detach(this);
+
+    auto fd_out = this->process_handle->fd_out();
+    enable_non_block(fd_out);
+
+    std::lock_guard io_lock{this->io.lock};
+    this->uring = nullptr;
+    this->uring_pending = false;
+    if(!this->io.event_resume) return; /* we've been finalized */
+
+    this->io.event_out = libevent::functions->event_new(this->io.event_base, fd_out, EV_READ | EV_PERSIST, [](int fd, short, void* _handle) {
+        auto handle = reinterpret_cast<FFMpegProcessHandle*>(_handle);
+        handle->callback_read(fd, false);
+    }, this);
+    if(this->buffering && this->io.event_out)
+        libevent::functions->event_add(this->io.event_out, nullptr);
+}
+
+void FFMpegProcessHandle::callback_uring_read(int result) {
+    {
+        std::lock_guard io_lock{this->io.lock};
+        this->uring_pending = false;
+    }
+
+    if(result > 0) {
+        io_reads++;
+        io_bytes += (size_t) result;
+        this->callback_commit_output((size_t) result);
+
+        if(this->batch_interval.count() > 0) {
+            const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(this->batch_interval);
+            struct timeval time{(time_t) (micros.count() / 1000000), (suseconds_t) (micros.count() % 1000000)};
+
+            std::lock_guard io_lock{this->io.lock};
+            if(this->io.event_resume) libevent::functions->event_add(this->io.event_resume, &time);
+        } else {
+            this->submit_uring_read();
+        }
+        return;
+    }
+
+    if(result == -EAGAIN || result == -EINTR) {
+        this->submit_uring_read();
+        return;
+    }
+
+    if(result == -ECANCELED)
+        return;
+
+    if(this->io.event_err) libevent::functions->event_del_noblock(this->io.event_err);
+    if(result == 0)
+        this->callback_eof();
+    else
+        this->callback_error(ErrorCode::IO_ERROR, -result);
+    //This pointer might be dangling now because callbacks are allowed delete us!
 }
 
 void FFMpegProcessHandle::enable_buffering() {
@@ -113,7 +291,13 @@ void FFMpegProcessHandle::enable_buffering() {
     this->buffering = true;
 
     /* add the events to read more data */
-    if(this->io.event_out) libevent::functions->event_add(this->io.event_out, nullptr);
+    if(this->uring) {
+        /* the prepare callback must not be called while our callers hold their locks */
+        struct timeval now{0, 0};
+        if(this->io.event_resume) libevent::functions->event_add(this->io.event_resume, &now);
+    } else if(this->io.event_out) {
+        libevent::functions->event_add(this->io.event_out, nullptr);
+    }
 }
 
 void FFMpegProcessHandle::disable_buffering() {
@@ -0,0 +1,102 @@
+#include <include/teaspeak/MusicPlayer.h>
+#include "./FFMpegPrefixCache.h"
+
+using namespace music;
+using namespace music::player;
+
+FFMpegPrefixCache* FFMpegPrefixCache::instance{nullptr};
+
+/* play counters are kept for more sources than prefixes so we're able to detect popular sources */
+constexpr static size_t kTrackedSourcesFactor{16};
+
+FFMpegPrefixCache::FFMpegPrefixCache(std::chrono::milliseconds prefix_length, size_t min_plays, size_t max_prefixes)
+    : prefix_length{prefix_length}, min_plays{min_plays}, max_prefixes{max_prefixes} { }
+
+FFMpegPrefixCache::~FFMpegPrefixCache() = default;
+
+std::shared_ptr<const FFMpegPrefixCache::Prefix> FFMpegPrefixCache::lookup(const std::string &key) {
+    std::lock_guard lock_{this->lock};
+
+    auto it = this->entry_index.find(key);
+    if(it == this->entry_index.end()) {
+        this->entries.push_front(Entry{key, 0, nullptr, 0});
+        it = this->entry_index.emplace(key, this->entries.begin()).first;
+        this->evict();
+    } else {
+        this->entries.splice(this->entries.begin(), this->entries, it->second);
+    }
+
+    auto& entry = *it->second;
+    entry.plays++;
+    if(!entry.prefix) {
+        this->metrics_.misses++;
+        return nullptr;
+    }
+
+    this->metrics_.hits++;
+    return entry.prefix;
+}
+
+bool FFMpegPrefixCache::wanted(const std::string &key) {
+    std::lock_guard lock_{this->lock};
+
+    auto it = this->entry_index.find(key);
+    if(it == this->entry_index.end())
+        return false;
+
+    return !it->second->prefix && it->second->plays >= this->min_plays;
+}
+
+void FFMpegPrefixCache::store(const std::string &key, std::shared_ptr<const Prefix> prefix) {
+    size_t memory_bytes{sizeof(Prefix)};
+    for(const auto& segment : prefix->segments)
+        memory_bytes += sizeof(segment) + segment.data.capacity();
+
+    std::lock_guard lock_{this->lock};
+    auto it = this->entry_index.find(key);
+    if(it == this->entry_index.end())
+        return; /* the source is not popular any more */
+
+    auto& entry = *it->second;
+    if(entry.prefix) {
+        this->metrics_.prefixes--;
+        this->metrics_.memory_bytes -= entry.memory_bytes;
+    }
+
+    entry.prefix = std::move(prefix);
+    entry.memory_bytes = memory_bytes;
+
+    this->metrics_.stores++;
+    this->metrics_.prefixes++;
+    this->metrics_.memory_bytes += memory_bytes;
+    log::log(log::debug, "[FFMPEG][PrefixCache] Stored prefix for " + key + " (" + std::to_string(memory_bytes / 1024) + "kb)");
+
+    this->evict();
+}
+
+void FFMpegPrefixCache::evict() {
+    const auto max_entries = std::max((size_t) 1, this->max_prefixes) * kTrackedSourcesFactor;
+
+    auto it = this->entries.end();
+    while(it != this->entries.begin() && (this->metrics_.prefixes > this->max_prefixes || this->entries.size() > max_entries)) {
+        auto& entry = *--it;
+        if(entry.prefix) {
+            this->metrics_.prefixes--;
+            this->metrics_.memory_bytes -= entry.memory_bytes;
+        }
+
+        if(this->entries.size() > max_entries) {
+            this->entry_index.erase(entry.key);
+            it = this->entries.erase(it);
+        } else {
+            /* keep the play counter */
+            entry.prefix = nullptr;
+            entry.memory_bytes = 0;
+        }
+    }
+}
+
+FFMpegPrefixCache::Metrics FFMpegPrefixCache::metrics() {
+    std::lock_guard lock_{this->lock};
+    return this->metrics_;
+}
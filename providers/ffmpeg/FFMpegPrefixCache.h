@@ -0,0 +1,72 @@
+#pragma once
+
+#include <map>
+#include <list>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include "./SampleCompression.h"
+
+namespace music::player {
+    /*
+     * In memory cache of the first seconds of frequently played sources.
+     * A player with a cached prefix can emit audio immediately while the real stream
+     * gets spawned seeked to the end of the prefix.
+     */
+    class FFMpegPrefixCache {
+        public:
+            /* nullptr if the cache has been disabled */
+            static FFMpegPrefixCache* instance;
+
+            struct Prefix {
+                size_t channels{0};
+                size_t sample_count{0}; /* samples per channel of all segments */
+                std::chrono::milliseconds stream_length{};
+
+                std::vector<CompressedSegment> segments{};
+            };
+
+            struct Metrics {
+                size_t hits{0};
+                size_t misses{0};
+                size_t stores{0};
+
+                size_t prefixes{0};
+                size_t memory_bytes{0};
+            };
+
+            FFMpegPrefixCache(std::chrono::milliseconds /* prefix length */, size_t /* min plays */, size_t /* max prefixes */);
+            ~FFMpegPrefixCache();
+
+            /* counts a play of the source and returns the prefix if cached */
+            [[nodiscard]] std::shared_ptr<const Prefix> lookup(const std::string& /* key */);
+
+            /* returns true if the source has been played often enough to record its prefix */
+            [[nodiscard]] bool wanted(const std::string& /* key */);
+            void store(const std::string& /* key */, std::shared_ptr<const Prefix> /* prefix */);
+
+            [[nodiscard]] Metrics metrics();
+
+            const std::chrono::milliseconds prefix_length;
+        private:
+            struct Entry {
+                std::string key{};
+                size_t plays{0};
+                std::shared_ptr<const Prefix> prefix{};
+                size_t memory_bytes{0};
+            };
+
+            /* call only when lock is acquired */
+            void evict();
+
+            const size_t min_plays;
+            const size_t max_prefixes;
+
+            std::mutex lock{};
+            std::list<Entry> entries{}; /* most recently played first */
+            std::map<std::string, std::list<Entry>::iterator> entry_index{};
+
+            Metrics metrics_{};
+    };
+}
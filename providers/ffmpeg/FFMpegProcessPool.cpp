@@ -0,0 +1,148 @@
+#include <csignal>
+#include <providers/shared/WorkerPool.h>
+#include "./FFMpegProcessPool.h"
+
+using namespace music;
+using namespace music::player;
+
+/* reads one line with the quoted command line. If the control pipe gets closed without a job the shim just exits. */
+static constexpr auto kShimCommand = R"(read -r command || exit 0; exec </dev/null; eval "exec $command")";
+
+FFMpegProcessPool* FFMpegProcessPool::instance{nullptr};
+
+FFMpegProcessPool::FFMpegProcessPool(size_t size) : size{size} {}
+
+FFMpegProcessPool::~FFMpegProcessPool() {
+    std::deque<std::unique_ptr<pl::Process>> processes{};
+    {
+        std::lock_guard lock_{this->lock};
+        this->shutdown = true;
+        processes = std::move(this->idle);
+    }
+
+    /* closing the control pipe lets the shim exit. The destructor reaps it. */
+    for(auto& process : processes)
+        process->close_input();
+    processes.clear();
+
+    const auto& metrics = this->metrics_;
+    log::log(log::debug, "[FFMPEG][ProcessPool] Process pool shut down. Hits: " + std::to_string(metrics.hits) + ", misses: " + std::to_string(metrics.misses));
+}
+
+void FFMpegProcessPool::initialize() {
+    this->schedule_fill();
+}
+
+std::unique_ptr<pl::Process> FFMpegProcessPool::acquire() {
+    std::lock_guard lock_{this->lock};
+    while(!this->idle.empty()) {
+        auto process = std::move(this->idle.front());
+        this->idle.pop_front();
+
+        /* the shim might have been killed in the meantime */
+        if(!process->exited())
+            return process;
+    }
+    return nullptr;
+}
+
+std::unique_ptr<pl::Process> FFMpegProcessPool::spawn(const std::vector<std::string> &argv, std::string &error) {
+    if(argv.empty()) {
+        error = "missing executable";
+        return nullptr;
+    }
+
+    std::string command_line{};
+    bool transferable{true};
+    for(const auto& argument : argv) {
+        /* the shim reads exactly one line */
+        if(argument.find('\n') != std::string::npos) {
+            transferable = false;
+            break;
+        }
+
+        if(!command_line.empty())
+            command_line += ' ';
+        command_line += pl::shell_quote(argument);
+    }
+    command_line += '\n';
+
+    std::unique_ptr<pl::Process> process{};
+    while(transferable && (process = this->acquire())) {
+        if(process->write_input(command_line)) {
+            process->close_input();
+            break;
+        }
+
+        log::log(log::debug, "[FFMPEG][ProcessPool] Failed to hand over the command to helper " + std::to_string(process->pid()) + ". Trying next one.");
+        process->kill(SIGKILL);
+        process = nullptr;
+    }
+
+    {
+        std::lock_guard lock_{this->lock};
+        if(process)
+            this->metrics_.hits++;
+        else
+            this->metrics_.misses++;
+    }
+    this->schedule_fill();
+
+    if(process) {
+        log::log(log::trace, "[FFMPEG][ProcessPool] Using warm helper " + std::to_string(process->pid()) + " for " + argv[0]);
+        return process;
+    }
+
+    return pl::spawn(argv, error);
+}
+
+FFMpegProcessPool::Metrics FFMpegProcessPool::metrics() {
+    std::lock_guard lock_{this->lock};
+    auto result = this->metrics_;
+    result.idle = this->idle.size();
+    return result;
+}
+
+void FFMpegProcessPool::schedule_fill() {
+    {
+        std::lock_guard lock_{this->lock};
+        if(this->shutdown || this->fill_scheduled || this->idle.size() >= this->size)
+            return;
+        this->fill_scheduled = true;
+    }
+
+    /* the reject callback might get called within our thread, so we must not hold the lock */
+    wp::execute([this]{
+        this->fill();
+    }, [this](const std::string&) {
+        std::lock_guard lock_{this->lock};
+        this->fill_scheduled = false;
+    });
+}
+
+void FFMpegProcessPool::fill() {
+    while(!wp::shutdown_requested()) {
+        {
+            std::lock_guard lock_{this->lock};
+            if(this->shutdown || this->idle.size() >= this->size)
+                break;
+        }
+
+        std::string error{};
+        auto process = pl::spawn_shell(kShimCommand, error, true);
+        if(!process) {
+            log::log(log::warn, "[FFMPEG][ProcessPool] Failed to start helper process: " + error);
+            break;
+        }
+
+        std::lock_guard lock_{this->lock};
+        if(this->shutdown) {
+            process->close_input();
+            break;
+        }
+        this->idle.push_back(std::move(process));
+    }
+
+    std::lock_guard lock_{this->lock};
+    this->fill_scheduled = false;
+}
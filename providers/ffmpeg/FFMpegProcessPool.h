@@ -0,0 +1,53 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <providers/shared/ProcessLauncher.h>
+
+namespace music::player {
+    /*
+     * Pool of pre-started helper processes waiting for a job.
+     * Every helper is a tiny /bin/sh shim which blocks on a control pipe (its stdin) until it receives
+     * the command line and then execs it in place. The process creation (posix_spawn, shell startup and pipe setup)
+     * has already been paid when a song starts, the ffmpeg binary itself gets loaded by the exec.
+     */
+    class FFMpegProcessPool {
+        public:
+            /* nullptr if the pool has been disabled */
+            static FFMpegProcessPool* instance;
+
+            struct Metrics {
+                size_t hits{0};
+                size_t misses{0};
+                size_t idle{0};
+            };
+
+            explicit FFMpegProcessPool(size_t /* size */);
+            /* terminates all idle helpers */
+            ~FFMpegProcessPool();
+
+            /* starts filling the pool in the background */
+            void initialize();
+
+            /* executes the command within a warm helper or spawns it directly if no helper is available */
+            [[nodiscard]] std::unique_ptr<pl::Process> spawn(const std::vector<std::string>& /* argv */, std::string& /* error */);
+
+            [[nodiscard]] Metrics metrics();
+        private:
+            [[nodiscard]] std::unique_ptr<pl::Process> acquire();
+            void schedule_fill();
+            void fill();
+
+            const size_t size;
+
+            std::mutex lock{};
+            bool shutdown{false};
+            bool fill_scheduled{false};
+            std::deque<std::unique_ptr<pl::Process>> idle{};
+
+            Metrics metrics_{};
+    };
+}
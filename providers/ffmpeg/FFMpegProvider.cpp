@@ -3,9 +3,22 @@
 #include <StringVariable.h>
 #include <providers/shared/INIParser.h>
 #include <providers/shared/pstream.h>
+#include <providers/shared/WorkerPool.h>
+#include <providers/shared/libopus.h>
 #include "./string_utils.h"
 #include "./FFMpegProvider.h"
 #include "./FFMpegMusicPlayer.h"
+#include "./FFMpegBufferBudget.h"
+#include "./FFMpegBroadcast.h"
+#include "./FFMpegDiskCache.h"
+#include "./FFMpegPrefixCache.h"
+#include "./FFMpegSeekIndex.h"
+#include "./FFMpegProcessPool.h"
+#include "./FFMpegChildReaper.h"
+#include "./FFMpegUringReader.h"
+#include "./FFMpegEventDispatcher.h"
+#include "./NativeMusicPlayer.h"
+#include "./MappedMusicPlayer.h"
 
 using namespace std;
 using namespace std::chrono;
@@ -45,11 +58,81 @@ inline pair<string, string> executeCommand(const string& cmd){
 };
 
 threads::Future<std::shared_ptr<music::MusicPlayer>> FFMpegProvider::createPlayer(const std::string &url, void* custom_data, void*) {
+	return this->create_player(url, custom_data, true);
+}
+
+threads::Future<std::shared_ptr<music::MusicPlayer>> FFMpegProvider::createPlayer(const std::string &url, void* custom_data, void*, const std::shared_ptr<CancellationToken>& token) {
+	/* the custom data will be freed within create_player. The player itself does nothing until it gets initialized. */
+	auto future = this->create_player(url, custom_data, true);
+	if(!token)
+		return future;
+
+	if(token->cancelled()) {
+		threads::Future<std::shared_ptr<music::MusicPlayer>> cancelled{};
+		cancelled.executionFailed("cancelled");
+		return cancelled;
+	}
+
+	/* the player has been created already. Tear its stream down if the request gets cancelled before the stream info has been loaded. */
+	if(!future.failed()) {
+		if(auto player = dynamic_pointer_cast<music::player::FFMpegMusicPlayer>(*future.get()); player) {
+			token->onCancel([weak_player = std::weak_ptr<music::player::FFMpegMusicPlayer>{player}]{
+				if(auto player = weak_player.lock(); player && !player->await_info({}))
+					player->stop();
+			});
+		}
+	}
+	return future;
+}
+
+/* returns the path if the url points to a local file */
+inline std::string local_file_path(const std::string& url) {
+	std::string path{url};
+	if(path.find("file://") == 0)
+		path = path.substr(7);
+	else if(path.find("://") != std::string::npos)
+		return "";
+
+	std::error_code error{};
+	return fs::is_regular_file(fs::u8path(path), error) ? path : "";
+}
+
+inline std::shared_ptr<music::MusicPlayer> create_native_player(const std::string& path, const music::player::FFMpegMusicPlayer::FallbackStreamInfo& fallback_info, const music::FFMpegProviderConfig& config) {
+	std::string error{};
+	if(config.memory_mapped.enabled) {
+		auto mapped = music::player::MappedMusicPlayer::open(path, config.memory_mapped.raw_channel_count, config.memory_mapped.max_convert_mb * 1024 * 1024, fallback_info, error);
+		if(mapped)
+			return mapped;
+	}
+
+	if(!config.native_decoders)
+		return nullptr;
+
+	auto decoder = music::player::open_native_decoder(path, error);
+	if(!decoder) {
+		log::log(log::trace, "[FFMPEG] Using ffmpeg for " + path + " (" + error + ")");
+		return nullptr;
+	}
+
+	return std::make_shared<music::player::NativeMusicPlayer>(path, std::move(decoder), fallback_info);
+}
+
+threads::Future<std::shared_ptr<music::MusicPlayer>> FFMpegProvider::create_player(const std::string &url, void* custom_data, bool allow_fast_paths) {
 	auto future = threads::Future<std::shared_ptr<music::MusicPlayer>>();
 
 	//custom_data
 	std::shared_ptr<music::MusicPlayer> player;
-	if(!custom_data) {
+	const auto native_players = allow_fast_paths && (this->config->native_decoders || this->config->memory_mapped.enabled);
+	if(!custom_data && native_players) {
+		if(auto path{local_file_path(url)}; !path.empty())
+			player = create_native_player(path, {}, *this->config);
+	}
+
+	if(player) {
+		/* local file played by a native decoder */
+	} else if(!custom_data && allow_fast_paths && this->config->broadcast.enabled && this->live_url(url)) {
+		player = std::make_shared<music::player::FFMpegBroadcastPlayer>(url);
+	} else if(!custom_data) {
 		player = std::make_shared<music::player::FFMpegMusicPlayer>(url, player::FFMPEGURLType::STREAM, music::player::FFMpegMusicPlayer::FallbackStreamInfo{});
 	} else {
 		std::shared_ptr<FFMpegData::Header> data;
@@ -74,7 +157,10 @@ threads::Future<std::shared_ptr<music::MusicPlayer>> FFMpegProvider::createPlaye
             music::player::FFMpegMusicPlayer::FallbackStreamInfo fallback_info{};
             fallback_info.title = cast_data->file_title ? std::string{cast_data->file_title} : "";
             fallback_info.description = cast_data->file_description ? std::string{cast_data->file_description} : "";
-			player = std::make_shared<music::player::FFMpegMusicPlayer>(std::string{cast_data->file_path}, player::FFMPEGURLType::FILE, fallback_info);
+			if(native_players)
+				player = create_native_player(std::string{cast_data->file_path}, fallback_info, *this->config);
+			if(!player)
+				player = std::make_shared<music::player::FFMpegMusicPlayer>(std::string{cast_data->file_path}, player::FFMPEGURLType::FILE, fallback_info);
 
 			/* free content */
             cast_data->_free(cast_data->file_title);
@@ -89,6 +175,14 @@ threads::Future<std::shared_ptr<music::MusicPlayer>> FFMpegProvider::createPlaye
 		future.executionFailed("could not create a valid player");
 		return future;
 	}
+	if(this->config->executor.dispatch_events) {
+		/* the host may replace the executor. Rejected tasks (queue full or shutdown) will be executed inline. */
+		player->eventExecutor([](std::function<void()> task) {
+			auto dispatcher = player::FFMpegEventDispatcher::instance;
+			if(!dispatcher || !dispatcher->execute(task))
+				task();
+		});
+	}
     future.executionSucceed(std::dynamic_pointer_cast<music::MusicPlayer>(player));
     return future;
 }
@@ -186,6 +280,10 @@ extern "C" std::shared_ptr<music::manager::PlayerProvider> EXPORT create_provide
 				music::log::log(music::log::err, "[FFMPEG] Could not parse config! Using default values");
 			} else {
 				config->ffmpeg_command = ini_reader.Get("general", "ffmpeg_command", config->ffmpeg_command);
+				config->native_decoders = ini_reader.GetBoolean("general", "native_decoders", config->native_decoders);
+				config->memory_mapped.enabled = ini_reader.GetBoolean("memory_mapped", "enabled", config->memory_mapped.enabled);
+				config->memory_mapped.raw_channel_count = ini_reader.GetInteger("memory_mapped", "raw_channel_count", config->memory_mapped.raw_channel_count);
+				config->memory_mapped.max_convert_mb = ini_reader.GetInteger("memory_mapped", "max_convert_mb", config->memory_mapped.max_convert_mb);
 				config->commands.version = ini_reader.Get("commands", "version", config->commands.version);
 				config->commands.protocols = ini_reader.Get("commands", "protocols", config->commands.protocols);
 				config->commands.formats = ini_reader.Get("commands", "formats", config->commands.formats);
@@ -195,6 +293,69 @@ extern "C" std::shared_ptr<music::manager::PlayerProvider> EXPORT create_provide
 
                 config->commands.file_playback = ini_reader.Get("commands", "file_playback", config->commands.file_playback);
                 config->commands.file_playback_seek = ini_reader.Get("commands", "file_playback_seek", config->commands.file_playback_seek);
+                config->commands.file_playback_offset = ini_reader.Get("commands", "file_playback_offset", config->commands.file_playback_offset);
+
+				config->commands.opus_playback = ini_reader.Get("commands", "opus_playback", config->commands.opus_playback);
+				config->commands.opus_playback_seek = ini_reader.Get("commands", "opus_playback_seek", config->commands.opus_playback_seek);
+				config->commands.opus_file_playback = ini_reader.Get("commands", "opus_file_playback", config->commands.opus_file_playback);
+				config->commands.opus_file_playback_seek = ini_reader.Get("commands", "opus_file_playback_seek", config->commands.opus_file_playback_seek);
+
+				config->opus.enabled = ini_reader.GetBoolean("opus", "enabled", config->opus.enabled);
+				config->opus.bitrate = ini_reader.Get("opus", "bitrate", config->opus.bitrate);
+				config->opus.encode_arguments = ini_reader.Get("opus", "encode_arguments", config->opus.encode_arguments);
+				config->opus.copy_arguments = ini_reader.Get("opus", "copy_arguments", config->opus.copy_arguments);
+
+				config->transport.compressed = ini_reader.GetBoolean("transport", "compressed", config->transport.compressed);
+				config->transport.bitrate = ini_reader.Get("transport", "bitrate", config->transport.bitrate);
+				config->transport.arguments = ini_reader.Get("transport", "arguments", config->transport.arguments);
+
+				config->buffering.stream.low_ms = ini_reader.GetInteger("buffering", "stream_low_ms", config->buffering.stream.low_ms);
+				config->buffering.stream.high_ms = ini_reader.GetInteger("buffering", "stream_high_ms", config->buffering.stream.high_ms);
+				config->buffering.file.low_ms = ini_reader.GetInteger("buffering", "file_low_ms", config->buffering.file.low_ms);
+				config->buffering.file.high_ms = ini_reader.GetInteger("buffering", "file_high_ms", config->buffering.file.high_ms);
+				config->buffering.adaptive = ini_reader.GetBoolean("buffering", "adaptive", config->buffering.adaptive);
+				config->buffering.adaptive_fast_speed = ini_reader.GetReal("buffering", "adaptive_fast_speed", config->buffering.adaptive_fast_speed);
+				config->buffering.adaptive_underrun_step_ms = ini_reader.GetInteger("buffering", "adaptive_underrun_step_ms", config->buffering.adaptive_underrun_step_ms);
+				config->buffering.adaptive_min.low_ms = ini_reader.GetInteger("buffering", "adaptive_min_low_ms", config->buffering.adaptive_min.low_ms);
+				config->buffering.adaptive_min.high_ms = ini_reader.GetInteger("buffering", "adaptive_min_high_ms", config->buffering.adaptive_min.high_ms);
+				config->buffering.adaptive_max.low_ms = ini_reader.GetInteger("buffering", "adaptive_max_low_ms", config->buffering.adaptive_max.low_ms);
+				config->buffering.adaptive_max.high_ms = ini_reader.GetInteger("buffering", "adaptive_max_high_ms", config->buffering.adaptive_max.high_ms);
+
+				config->buffering.global_budget_kb = ini_reader.GetInteger("buffering", "global_budget_kb", config->buffering.global_budget_kb);
+				config->buffering.idle_timeout_ms = ini_reader.GetInteger("buffering", "idle_timeout_ms", config->buffering.idle_timeout_ms);
+				config->buffering.idle_quota_ms = ini_reader.GetInteger("buffering", "idle_quota_ms", config->buffering.idle_quota_ms);
+
+				config->buffering.compress = ini_reader.GetBoolean("buffering", "compress", config->buffering.compress);
+				config->buffering.compress_decode_ahead = ini_reader.GetInteger("buffering", "compress_decode_ahead", config->buffering.compress_decode_ahead);
+
+				config->executor.worker_count = ini_reader.GetInteger("executor", "worker_count", config->executor.worker_count);
+				config->executor.max_queue_size = ini_reader.GetInteger("executor", "max_queue_size", config->executor.max_queue_size);
+				config->executor.dispatch_events = ini_reader.GetBoolean("executor", "dispatch_events", config->executor.dispatch_events);
+
+				config->cache.enabled = ini_reader.GetBoolean("cache", "enabled", config->cache.enabled);
+				config->cache.directory = ini_reader.Get("cache", "directory", config->cache.directory);
+				config->cache.max_size_mb = ini_reader.GetInteger("cache", "max_size_mb", config->cache.max_size_mb);
+				config->cache.arguments = ini_reader.Get("cache", "arguments", config->cache.arguments);
+
+				config->prefix_cache.enabled = ini_reader.GetBoolean("prefix_cache", "enabled", config->prefix_cache.enabled);
+				config->prefix_cache.length_ms = ini_reader.GetInteger("prefix_cache", "length_ms", config->prefix_cache.length_ms);
+				config->prefix_cache.min_plays = ini_reader.GetInteger("prefix_cache", "min_plays", config->prefix_cache.min_plays);
+				config->prefix_cache.max_entries = ini_reader.GetInteger("prefix_cache", "max_entries", config->prefix_cache.max_entries);
+
+				config->seek_index.enabled = ini_reader.GetBoolean("seek_index", "enabled", config->seek_index.enabled);
+				config->seek_index.directory = ini_reader.Get("seek_index", "directory", config->seek_index.directory);
+
+				config->process_pool.size = ini_reader.GetInteger("process_pool", "size", config->process_pool.size);
+				config->process.kill_timeout_ms = ini_reader.GetInteger("process", "kill_timeout_ms", config->process.kill_timeout_ms);
+
+				config->pipes.capacity_kb = ini_reader.GetInteger("pipes", "capacity_kb", config->pipes.capacity_kb);
+				config->pipes.batch_interval_ms = ini_reader.GetInteger("pipes", "batch_interval_ms", config->pipes.batch_interval_ms);
+				config->pipes.metrics_interval_s = ini_reader.GetInteger("pipes", "metrics_interval_s", config->pipes.metrics_interval_s);
+				config->pipes.io_backend = ini_reader.Get("pipes", "io_backend", config->pipes.io_backend);
+				config->pipes.uring_entries = ini_reader.GetInteger("pipes", "uring_entries", config->pipes.uring_entries);
+
+				config->broadcast.enabled = ini_reader.GetBoolean("broadcast", "enabled", config->broadcast.enabled);
+				config->broadcast.ring_length_ms = ini_reader.GetInteger("broadcast", "ring_length_ms", config->broadcast.ring_length_ms);
 				music::log::log(music::log::info, "[FFMPEG] Config successfully loaded");
 			}
 		} else {
@@ -249,6 +410,30 @@ FFMpegProvider::FFMpegProvider(shared_ptr<FFMpegProviderConfig>  cfg) : config(s
 
 FFMpegProvider::~FFMpegProvider() {
 	FFMpegProvider::instance = nullptr;
+	player::FFMpegDiskCache::instance = nullptr;
+	player::FFMpegPrefixCache::instance = nullptr;
+	player::FFMpegSeekIndex::instance = nullptr;
+	player::FFMpegProcessPool::instance = nullptr;
+
+	/* finish all pending work while the event loop is still alive (streams may unregister their events) */
+	wp::finalize();
+
+	/* players which are still alive keep their decoder libraries loaded */
+	player::finalize_native_decoders();
+	libopus::release_functions(); /* resolved for the compressed transport even without native decoders */
+
+	/* kills the remaining children and removes their events while the event loop is still alive */
+	player::FFMpegChildReaper::instance = nullptr;
+	this->child_reaper_ = nullptr;
+
+	player::FFMpegUringReader::instance = nullptr;
+	this->uring_reader_ = nullptr;
+
+    if(this->io_metrics_event) {
+        libevent::functions->event_del_block(this->io_metrics_event);
+        libevent::functions->event_free(this->io_metrics_event);
+        this->io_metrics_event = nullptr;
+    }
 
     if(this->readerBase) {
         libevent::functions->event_base_loopexit(this->readerBase, nullptr);
@@ -264,6 +449,10 @@ FFMpegProvider::~FFMpegProvider() {
 	    this->readerBase = nullptr;
     }
 
+    /* dispatches the remaining events */
+    player::FFMpegEventDispatcher::instance = nullptr;
+    this->event_dispatcher_ = nullptr;
+
     libevent::release_functions();
 }
 
@@ -274,7 +463,89 @@ bool FFMpegProvider::initialize() {
         return false;
     }
 
+    if(!wp::initialize("[FFMPEG]", this->config->executor.worker_count, this->config->executor.max_queue_size, error)) {
+        log::log(log::err, "failed to initialize worker pool: " + error);
+        return false;
+    }
+
+    if(this->config->executor.dispatch_events) {
+        this->event_dispatcher_ = std::make_unique<player::FFMpegEventDispatcher>(this->config->executor.max_queue_size);
+        player::FFMpegEventDispatcher::instance = &*this->event_dispatcher_;
+    }
+
+    this->buffer_budget_ = std::make_unique<player::FFMpegBufferBudget>(
+            this->config->buffering.global_budget_kb * 1024,
+            std::chrono::milliseconds{this->config->buffering.idle_timeout_ms},
+            std::chrono::milliseconds{this->config->buffering.idle_quota_ms}
+    );
+
+    if(this->config->cache.enabled) {
+        this->disk_cache_ = std::make_unique<player::FFMpegDiskCache>(this->config->cache.directory, this->config->cache.max_size_mb * 1024 * 1024);
+        if(this->disk_cache_->initialize(error)) {
+            player::FFMpegDiskCache::instance = &*this->disk_cache_;
+        } else {
+            log::log(log::warn, "failed to initialize the disk cache (" + error + "). Disabling cache.");
+            this->disk_cache_ = nullptr;
+        }
+    }
+
+    if(this->config->seek_index.enabled) {
+        this->seek_index_ = std::make_unique<player::FFMpegSeekIndex>(this->config->seek_index.directory);
+        if(this->seek_index_->initialize(error)) {
+            player::FFMpegSeekIndex::instance = &*this->seek_index_;
+        } else {
+            log::log(log::warn, "failed to initialize the seek index (" + error + "). Disabling seek index.");
+            this->seek_index_ = nullptr;
+        }
+    }
+
+    if(this->config->process_pool.size > 0) {
+        this->process_pool_ = std::make_unique<player::FFMpegProcessPool>(this->config->process_pool.size);
+        this->process_pool_->initialize();
+        player::FFMpegProcessPool::instance = &*this->process_pool_;
+    }
+
+    if(this->config->native_decoders)
+        player::initialize_native_decoders();
+
+    if(this->config->transport.compressed && !libopus::functions && !libopus::resolve_functions(error))
+        log::log(log::warn, "libopus is unavailable (" + error + "). Using the pcm transport.");
+
+    if(this->config->prefix_cache.enabled && this->config->prefix_cache.length_ms > 0) {
+        this->prefix_cache_ = std::make_unique<player::FFMpegPrefixCache>(
+                std::chrono::milliseconds{this->config->prefix_cache.length_ms},
+                this->config->prefix_cache.min_plays,
+                this->config->prefix_cache.max_entries
+        );
+        player::FFMpegPrefixCache::instance = &*this->prefix_cache_;
+    }
+
     this->readerBase = libevent::functions->event_base_new();
+    this->child_reaper_ = std::make_unique<player::FFMpegChildReaper>(this->readerBase, std::chrono::milliseconds{this->config->process.kill_timeout_ms});
+    player::FFMpegChildReaper::instance = &*this->child_reaper_;
+
+    if(this->config->pipes.io_backend == "io_uring") {
+        this->uring_reader_ = std::make_unique<player::FFMpegUringReader>(this->readerBase);
+        if(this->uring_reader_->initialize(this->config->pipes.uring_entries, error)) {
+            player::FFMpegUringReader::instance = &*this->uring_reader_;
+        } else {
+            log::log(log::warn, "failed to initialize the io_uring reader (" + error + "). Using libevent.");
+            this->uring_reader_ = nullptr;
+        }
+    } else if(this->config->pipes.io_backend != "libevent") {
+        log::log(log::warn, "unknown pipe io backend \"" + this->config->pipes.io_backend + "\". Using libevent.");
+    }
+
+    if(this->config->pipes.metrics_interval_s > 0) {
+        this->io_metrics_timestamp = std::chrono::steady_clock::now();
+        this->io_metrics_event = libevent::functions->event_new(this->readerBase, -1, EV_PERSIST, [](int, short, void* _provider) {
+            auto provider = reinterpret_cast<FFMpegProvider*>(_provider);
+            provider->log_io_metrics();
+        }, this);
+
+        struct timeval interval{(time_t) this->config->pipes.metrics_interval_s, 0};
+        libevent::functions->event_add(this->io_metrics_event, &interval);
+    }
     this->readerDispatch = std::thread([&]{
         while(!libevent::functions->event_base_got_exit(this->readerBase))
             libevent::functions->event_base_loop(this->readerBase, 0x04); //EVLOOP_NO_EXIT_ON_EMPTY
@@ -287,27 +558,133 @@ bool FFMpegProvider::initialize() {
     return true;
 }
 
+void FFMpegProvider::log_io_metrics() {
+    const auto metrics = player::FFMpegProcessHandle::io_metrics();
+    const auto now = std::chrono::steady_clock::now();
+    const auto seconds = std::max(std::chrono::duration_cast<std::chrono::duration<double>>(now - this->io_metrics_timestamp).count(), 0.001);
+
+    const auto wakeups = (size_t) ((metrics.wakeups - this->io_metrics_wakeups) / seconds);
+    const auto reads = (size_t) ((metrics.reads - this->io_metrics_reads) / seconds);
+    const auto kbytes = (size_t) ((metrics.bytes - this->io_metrics_bytes) / seconds / 1024);
+    log::log(log::debug, "[FFMPEG] IO loop: " + std::to_string(wakeups) + " wakeups/s, " + std::to_string(reads) + " reads/s, " + std::to_string(kbytes) + " KiB/s");
+
+    this->io_metrics_timestamp = now;
+    this->io_metrics_wakeups = metrics.wakeups;
+    this->io_metrics_reads = metrics.reads;
+    this->io_metrics_bytes = metrics.bytes;
+
+    {
+        const auto pool = wp::metrics();
+        const auto average_wait = pool.executed > 0 ? pool.total_wait_time.count() / pool.executed : 0;
+        log::log(log::debug, "[FFMPEG] Worker pool: " + std::to_string(pool.active) + "/" + std::to_string(pool.worker_count) + " active, " + std::to_string(pool.queued) + " queued (peak " + std::to_string(pool.queued_peak) + "), " +
+                             std::to_string(pool.executed) + " executed, " + std::to_string(pool.rejected) + " rejected, " + std::to_string(average_wait) + "us average wait");
+    }
+
+    {
+        const auto launcher = pl::metrics();
+        const auto average_spawn = launcher.spawned > 0 ? launcher.total_spawn_time.count() / launcher.spawned : 0;
+        log::log(log::debug, "[FFMPEG] Process launcher: " + std::to_string(launcher.spawned) + " spawned, " + std::to_string(launcher.failed) + " failed, " +
+                             std::to_string(average_spawn) + "us average spawn time (max " + std::to_string(launcher.max_spawn_time.count()) + "us)");
+    }
+
+    if(auto dispatcher{player::FFMpegEventDispatcher::instance}; dispatcher) {
+        const auto events = dispatcher->metrics();
+        log::log(log::debug, "[FFMPEG] Event dispatcher: " + std::to_string(events.queued) + " queued (peak " + std::to_string(events.queued_peak) + "), " +
+                             std::to_string(events.executed) + " executed, " + std::to_string(events.rejected) + " rejected");
+    }
+
+    if(this->buffer_budget_) {
+        const auto budget = this->buffer_budget_->usage();
+        const auto limit = budget.budget_bytes > 0 ? std::to_string(budget.budget_bytes / 1024) + " KiB" : std::string{"unlimited"};
+        log::log(log::debug, "[FFMPEG] Buffer budget: " + std::to_string(budget.used_bytes / 1024) + " KiB used (peak " + std::to_string(budget.used_bytes_peak / 1024) + " KiB) of " + limit + ", " +
+                             std::to_string(budget.streams) + " streams, " + std::to_string(budget.streams_idle) + " idle, " + std::to_string(budget.streams_throttled) + " throttled, " + std::to_string(budget.streams_trimmed) + " trimmed");
+    }
+
+    if(auto process_pool{player::FFMpegProcessPool::instance}; process_pool) {
+        const auto pool = process_pool->metrics();
+        const auto requests = pool.hits + pool.misses;
+        const auto hit_rate = requests > 0 ? pool.hits * 100 / requests : 0;
+        log::log(log::debug, "[FFMPEG] Process pool: " + std::to_string(pool.idle) + " idle, " + std::to_string(pool.hits) + " hits, " + std::to_string(pool.misses) + " misses (" + std::to_string(hit_rate) + "% hit rate)");
+    }
+
+    if(auto disk_cache{player::FFMpegDiskCache::instance}; disk_cache) {
+        const auto cache = disk_cache->metrics();
+        log::log(log::debug, "[FFMPEG] Disk cache: " + std::to_string(cache.entries) + " entries, " + std::to_string(cache.size_bytes / 1024 / 1024) + "/" + std::to_string(cache.max_size_bytes / 1024 / 1024) + " MiB, " +
+                             std::to_string(cache.hits) + " hits, " + std::to_string(cache.misses) + " misses, " + std::to_string(cache.stores) + " stores, " + std::to_string(cache.evictions) + " evictions");
+    }
+
+    if(auto prefix_cache{player::FFMpegPrefixCache::instance}; prefix_cache) {
+        const auto cache = prefix_cache->metrics();
+        log::log(log::debug, "[FFMPEG] Prefix cache: " + std::to_string(cache.prefixes) + " prefixes, " + std::to_string(cache.memory_bytes / 1024) + " KiB, " +
+                             std::to_string(cache.hits) + " hits, " + std::to_string(cache.misses) + " misses, " + std::to_string(cache.stores) + " stores");
+    }
+}
+
+void FFMpegProvider::live_url(const std::string &url, bool live) {
+    constexpr static auto kMaxLiveUrls{256};
+
+    std::lock_guard llock{this->live_urls_lock};
+    this->live_urls.erase(std::remove(this->live_urls.begin(), this->live_urls.end(), url), this->live_urls.end());
+    if(!live)
+        return;
+
+    this->live_urls.push_back(url);
+    while(this->live_urls.size() > kMaxLiveUrls)
+        this->live_urls.pop_front();
+}
+
+bool FFMpegProvider::live_url(const std::string &url) {
+    std::lock_guard llock{this->live_urls_lock};
+    return std::find(this->live_urls.begin(), this->live_urls.end(), url) != this->live_urls.end();
+}
+
 threads::Future<shared_ptr<UrlInfo>> FFMpegProvider::query_info(const std::string &url, void *custom_data, void *pVoid1) {
+    return this->query_info(url, custom_data, pVoid1, nullptr);
+}
+
+/* a pending query_info request. The event loop releases the player once the request has been completed. */
+struct InfoQuery {
+    std::mutex lock{};
+    bool completed{false};
+    std::shared_ptr<music::player::FFMpegMusicPlayer> player{};
+    void* timeout_event{nullptr};
+
+    std::function<void(const std::string& /* error */)> complete{};
+    std::shared_ptr<InfoQuery> self{};
+};
+
+threads::Future<shared_ptr<UrlInfo>> FFMpegProvider::query_info(const std::string &url, void *custom_data, void *, const std::shared_ptr<CancellationToken>& token) {
     auto future = threads::Future<shared_ptr<UrlInfo>>();
 
-    auto player_fut = createPlayer(url, custom_data, pVoid1);
+    auto player_fut = this->create_player(url, custom_data, false);
     player_fut.wait();
     if(player_fut.failed()) {
         future.executionFailed(player_fut.errorMegssage());
-    } else {
-        auto player = dynamic_pointer_cast<music::player::FFMpegMusicPlayer>(*player_fut.get());
-        std::thread([player, future]{
-            if(!player->initialize(0)) {
-                future.executionFailed("failed to initialize player");
-                return;
-            }
+        return future;
+    }
 
-            auto timeout = std::chrono::system_clock::now();
-            timeout += std::chrono::seconds{30};
-            if(!player->await_info(timeout)) {
-                future.executionFailed("info load timeout");
-                return;
-            }
+    auto query = make_shared<InfoQuery>();
+    query->player = dynamic_pointer_cast<music::player::FFMpegMusicPlayer>(*player_fut.get());
+    query->player->prefix_cache_enabled(false);
+    query->self = query;
+
+    query->complete = [this, custom_data, future, weak_query = std::weak_ptr<InfoQuery>{query}](const std::string& error) {
+        auto query = weak_query.lock();
+        if(!query) return;
+
+        std::shared_ptr<music::player::FFMpegMusicPlayer> player{};
+        {
+            std::lock_guard qlock{query->lock};
+            if(query->completed) return;
+            query->completed = true;
+            player = query->player;
+        }
+
+        if(!error.empty()) {
+            future.executionFailed(error);
+        } else {
+            if(!custom_data)
+                this->live_url(player->url(), player->length().count() == 0);
 
             auto info = make_shared<UrlSongInfo>();
 
@@ -318,9 +695,60 @@ threads::Future<shared_ptr<UrlInfo>> FFMpegProvider::query_info(const std::strin
             info->metadata = {};
 
             future.executionSucceed(info);
-        }).detach();
+        }
+
+        /* the player must not be deleted within its own callbacks. Dropping the last reference kills the ffmpeg process. */
+        std::lock_guard qlock{query->lock};
+        if(query->timeout_event) {
+            struct timeval now{0, 0};
+            libevent::functions->event_add(query->timeout_event, &now);
+        }
+    };
+
+    query->timeout_event = libevent::functions->event_new(this->readerBase, -1, 0, [](int, short, void* _query) {
+        auto query = reinterpret_cast<InfoQuery*>(_query);
+        query->complete("info load timeout");
+
+        std::shared_ptr<InfoQuery> self{};
+        std::shared_ptr<music::player::FFMpegMusicPlayer> player{};
+        {
+            std::lock_guard qlock{query->lock};
+            libevent::functions->event_del_noblock(query->timeout_event);
+            libevent::functions->event_free(query->timeout_event);
+            query->timeout_event = nullptr;
+
+            player = std::move(query->player);
+            self = std::move(query->self);
+        }
+    }, &*query);
+
+    {
+        struct timeval timeout{30, 0};
+        libevent::functions->event_add(query->timeout_event, &timeout);
     }
 
-    return future;
+    query->player->info_callback(query->complete);
+    if(token) {
+        /* completes the future immediately, the event loop kills the ffmpeg process afterwards */
+        token->onCancel([weak_query = std::weak_ptr<InfoQuery>{query}]{
+            if(auto query = weak_query.lock(); query)
+                query->complete("cancelled");
+        });
+    }
+
+    wp::execute([query]{
+        std::shared_ptr<music::player::FFMpegMusicPlayer> player{};
+        {
+            std::lock_guard qlock{query->lock};
+            if(query->completed) return;
+            player = query->player;
+        }
 
+        if(!player->initialize(0))
+            query->complete("failed to initialize player");
+    }, [query](const std::string& reason) {
+        query->complete("failed to schedule info query (" + reason + ")");
+    });
+
+    return future;
 }
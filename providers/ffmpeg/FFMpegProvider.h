@@ -7,21 +7,165 @@ extern "C" {
     std::shared_ptr<music::manager::PlayerProvider> EXPORT create_provider();
 }
 
+namespace music::player {
+	class FFMpegBufferBudget;
+	class FFMpegDiskCache;
+	class FFMpegPrefixCache;
+	class FFMpegSeekIndex;
+	class FFMpegProcessPool;
+	class FFMpegChildReaper;
+	class FFMpegUringReader;
+	class FFMpegEventDispatcher;
+}
+
 namespace music {
+	struct FFMpegBufferWatermarks {
+		size_t low_ms{0};  /* resume reading when less than this is buffered */
+		size_t high_ms{0}; /* stop reading when more than this is buffered */
+	};
+
 	struct FFMpegProviderConfig {
 		std::string ffmpeg_command = "ffmpeg";
 
+		/* decode wav, flac, ogg/opus and mp3 files in process. Other formats (or missing codec libraries) will use ffmpeg. */
+		bool native_decoders = true;
+
+		/* play wav and raw pcm files (*.pcm, *.raw, *.s16le) straight out of a file mapping (see MappedMusicPlayer) */
+		struct {
+			bool enabled = true;
+			size_t raw_channel_count = 2; /* raw pcm files are expected to be 48kHz s16le */
+			size_t max_convert_mb = 64; /* files in any other sample format get converted once in memory up to this size */
+		} memory_mapped;
+
 		struct {
 			std::string version = "${command} -version";
 			std::string formats = "${command} -formats";
 			std::string protocols = "${command} -protocols";
 
-			std::string playback = "${command} -reconnect '1' -reconnect_streamed '1' -reconnect_delay_max '5' -hide_banner -stats -i \"${path}\" -vn -bufsize '512k' -ac '${channel_count}' -ar '48000' -f 's16le' -acodec 'pcm_s16le' pipe:1";
+			std::string playback = "${command} -reconnect '1' -reconnect_streamed '1' -reconnect_delay_max '5' -hide_banner -stats -i \"${path}\" -vn -bufsize '512k' -ac '${channel_count}' -ar '48000' -f 's16le' -acodec 'pcm_s16le' pipe:1 ${cache_arguments}";
 			std::string playback_seek = "${command} -reconnect 1 -reconnect_streamed 1 -reconnect_delay_max 5 -hide_banner -ss ${seek_offset} -stats -i \"${path}\" -vn -bufsize 512k -ac ${channel_count} -ar 48000 -f s16le -acodec pcm_s16le pipe:1";
 
 			std::string file_playback = "${command} -hide_banner -stats -i \"${path}\" -vn -bufsize 512k -ac ${channel_count} -ar 48000 -f s16le -acodec pcm_s16le pipe:1";
             std::string file_playback_seek = "${command} -hide_banner -ss ${seek_offset} -stats -i \"${path}\" -vn -bufsize 512k -ac ${channel_count} -ar 48000 -f s16le -acodec pcm_s16le pipe:1";
+            /* seek within indexed files (see seek_index). Decoding starts at the frame at ${seek_byte_offset}. */
+            std::string file_playback_offset = "${command} -hide_banner -skip_initial_bytes ${seek_byte_offset} -stats -i \"${path}\" -vn -bufsize 512k -ac ${channel_count} -ar 48000 -f s16le -acodec pcm_s16le pipe:1";
+
+			/* ${codec_arguments} will be replaced with opus.encode_arguments or opus.copy_arguments */
+			std::string opus_playback = "${command} -reconnect 1 -reconnect_streamed 1 -reconnect_delay_max 5 -hide_banner -stats -i \"${path}\" -vn ${codec_arguments} -f ogg pipe:1 ${cache_arguments}";
+			std::string opus_playback_seek = "${command} -reconnect 1 -reconnect_streamed 1 -reconnect_delay_max 5 -hide_banner -ss ${seek_offset} -stats -i \"${path}\" -vn ${codec_arguments} -f ogg pipe:1";
+
+			std::string opus_file_playback = "${command} -hide_banner -stats -i \"${path}\" -vn ${codec_arguments} -f ogg pipe:1";
+			std::string opus_file_playback_seek = "${command} -hide_banner -ss ${seek_offset} -stats -i \"${path}\" -vn ${codec_arguments} -f ogg pipe:1";
         } commands;
+
+		/* opus output mode (see music::OutputFormat::FORMAT_OPUS) */
+		struct {
+			bool enabled = true;
+			std::string bitrate = "128k";
+
+			/* ${frame_duration} matches the players preferred sample count (20ms if opus doesn't support it) */
+			std::string encode_arguments = "-c:a libopus -b:a ${bitrate} -vbr on -frame_duration ${frame_duration} -application audio -ac ${channel_count} -ar 48000";
+			std::string copy_arguments = "-c:a copy"; /* used if the source is already opus encoded */
+		} opus;
+
+		/*
+		 * Transport between ffmpeg and the provider in pcm output mode.
+		 * If compressed is set ffmpeg encodes ogg/opus (using the opus_* commands) and the packets only get decoded in process
+		 * when the samples are consumed. Cuts the pipe bandwidth and the buffer memory by ~10x. Requires libopus.
+		 */
+		struct {
+			bool compressed = false;
+			std::string bitrate = "160k";
+
+			std::string arguments = "-c:a libopus -b:a ${bitrate} -vbr on -frame_duration 20 -application audio -ac ${channel_count} -ar 48000";
+		} transport;
+
+		/* on disk cache for fetched sources. ${cache_arguments} of the playback commands will be replaced with cache.arguments */
+		struct {
+			bool enabled = false;
+			std::string directory = "providers/cache_ffmpeg";
+			size_t max_size_mb = 2048;
+
+			std::string arguments = "-vn -c:a copy -f matroska -y \"${cache_file}\"";
+		} cache;
+
+		/* keep the first seconds of popular sources in memory to start playback instantly (see FFMpegPrefixCache) */
+		struct {
+			bool enabled = false;
+			size_t length_ms = 5000;
+			size_t min_plays = 2;
+			size_t max_entries = 64;
+		} prefix_cache;
+
+		/* time to byte offset index for sample accurate seeks within local mp3 and aac files (see FFMpegSeekIndex) */
+		struct {
+			bool enabled = true;
+			std::string directory = "providers/cache_ffmpeg/seek_index";
+		} seek_index;
+
+		/* pre-started helper processes which exec ffmpeg as soon as a song starts (see FFMpegProcessPool). Zero disables the pool. */
+		struct {
+			size_t size = 2;
+		} process_pool;
+
+		/* stopped ffmpeg processes receive SIGQUIT and get killed if they haven't exited within kill_timeout_ms (see FFMpegChildReaper) */
+		struct {
+			size_t kill_timeout_ms = 2000;
+		} process;
+
+		/* output pipes of the ffmpeg processes */
+		struct {
+			size_t capacity_kb = 0; /* F_SETPIPE_SZ of stdout. Zero keeps the system default (64 KiB). Limited by /proc/sys/fs/pipe-max-size. */
+			size_t batch_interval_ms = 0; /* drain the pipes at most every batch_interval_ms instead of on every write. Zero disables batching. */
+			size_t metrics_interval_s = 0; /* log the IO wakeups per second, the worker pool, process launcher and cache metrics. Zero disables the log. */
+
+			/* "libevent" or "io_uring" (Linux 5.7+). io_uring falls back to libevent if it's not available. */
+			std::string io_backend = "libevent";
+			size_t uring_entries = 1024;
+		} pipes;
+
+		struct {
+			FFMpegBufferWatermarks stream{10000, 20000};
+			FFMpegBufferWatermarks file{5000, 10000};
+
+			/*
+			 * Adapt the watermarks at runtime:
+			 * - files which are decoded way faster than realtime shrink to adaptive_min
+			 * - streams grow by adaptive_underrun_step_ms (up to adaptive_max) every time the buffer ran dry
+			 */
+			bool adaptive = true;
+			double adaptive_fast_speed = 2;
+			size_t adaptive_underrun_step_ms = 2000;
+			FFMpegBufferWatermarks adaptive_min{500, 1000};
+			FFMpegBufferWatermarks adaptive_max{30000, 60000};
+
+			/*
+			 * Memory budget for decoded audio across all streams (zero for unlimited).
+			 * Streams which haven't been consumed for idle_timeout_ms only refill up to idle_quota_ms of audio.
+			 * Idle streams which buffered more than that drop the tail of their buffer and fetch it again once they get consumed.
+			 */
+			size_t global_budget_kb = 0;
+			size_t idle_timeout_ms = 5000;
+			size_t idle_quota_ms = 1000;
+
+			/* keep the read ahead buffer lossless compressed and only decode compress_decode_ahead segments in advance */
+			bool compress = false;
+			size_t compress_decode_ahead = 2;
+		} buffering;
+
+		struct {
+			size_t worker_count = 4;
+			size_t max_queue_size = 512; /* 0 for unlimited */
+
+			/* dispatch player events within a dedicated thread instead of the ffmpeg io thread */
+			bool dispatch_events = true;
+		} executor;
+
+		struct {
+			/* share one ffmpeg upstream between all players playing the same live url. Only urls which info query found no length are live. */
+			bool enabled = false;
+			size_t ring_length_ms = 5000;
+		} broadcast;
 	};
 
 	struct FFMpegData {
@@ -54,8 +198,10 @@ namespace music {
             bool initialize();
 
 		    threads::Future<std::shared_ptr<UrlInfo>> query_info(const std::string &string, void *pVoid, void *pVoid1) override;
+		    threads::Future<std::shared_ptr<UrlInfo>> query_info(const std::string &, void *, void *, const std::shared_ptr<CancellationToken>&) override;
 
 		    threads::Future<std::shared_ptr<music::MusicPlayer>> createPlayer(const std::string &, void*, void*) override;
+		    threads::Future<std::shared_ptr<music::MusicPlayer>> createPlayer(const std::string &, void*, void*, const std::shared_ptr<CancellationToken>&) override;
 
             std::vector<std::string> availableFormats() override {
                 return av_fmt;
@@ -72,7 +218,32 @@ namespace music {
 		    std::thread readerDispatch;
 
 		    inline std::shared_ptr<FFMpegProviderConfig> configuration() { return this->config; }
+		    inline player::FFMpegBufferBudget& buffer_budget() { return *this->buffer_budget_; }
     	private:
+		    /* called within the event loop */
+		    void log_io_metrics();
+
+		    threads::Future<std::shared_ptr<music::MusicPlayer>> create_player(const std::string& /* url */, void* /* custom data */, bool /* allow non ffmpeg players */);
+
+		    /* remembers the result of the last info queries. Finite urls must not be broadcasted, they would lose seek and length. */
+		    void live_url(const std::string& /* url */, bool /* live */);
+		    [[nodiscard]] bool live_url(const std::string& /* url */);
+
 		    std::shared_ptr<FFMpegProviderConfig> config;
+		    std::unique_ptr<player::FFMpegBufferBudget> buffer_budget_;
+		    std::unique_ptr<player::FFMpegDiskCache> disk_cache_;
+		    std::unique_ptr<player::FFMpegPrefixCache> prefix_cache_;
+		    std::unique_ptr<player::FFMpegSeekIndex> seek_index_;
+		    std::unique_ptr<player::FFMpegProcessPool> process_pool_;
+		    std::unique_ptr<player::FFMpegChildReaper> child_reaper_;
+		    std::unique_ptr<player::FFMpegUringReader> uring_reader_;
+		    std::unique_ptr<player::FFMpegEventDispatcher> event_dispatcher_;
+
+		    std::mutex live_urls_lock{};
+		    std::deque<std::string> live_urls{}; /* most recent last */
+
+		    void* io_metrics_event{nullptr};
+		    std::chrono::steady_clock::time_point io_metrics_timestamp{};
+		    size_t io_metrics_wakeups{0}, io_metrics_reads{0}, io_metrics_bytes{0};
     };
 }
\ No newline at end of file
@@ -0,0 +1,429 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <experimental/filesystem>
+#include <providers/shared/WorkerPool.h>
+#include "./FFMpegSeekIndex.h"
+
+namespace fs = std::experimental::filesystem;
+
+using namespace music;
+using namespace music::player;
+
+FFMpegSeekIndex* FFMpegSeekIndex::instance{nullptr};
+
+constexpr static uint32_t kIndexMagic{0x58495354}; /* "TSIX" */
+constexpr static uint32_t kIndexVersion{1};
+
+/* one entry every 16 frames (~400ms for mp3) */
+constexpr static size_t kEntryFrameInterval{16};
+/* decode a few frames in front of the target. Mp3 frames may reference up to 511 bytes of the previous frames. */
+constexpr static size_t kPrerollFrames{8};
+constexpr static size_t kMaxLoadedIndices{256};
+/* the first frame has to be found within the first bytes after the id3 tag */
+constexpr static size_t kMaxSyncSearch{64 * 1024};
+
+namespace mpeg {
+    struct FrameHeader {
+        bool adts{false};
+        size_t length{0};
+        uint32_t sample_rate{0};
+        uint32_t samples{0};
+        size_t side_info_length{0}; /* layer 3 only */
+    };
+
+    /* https://www.mp3-tech.org/programmer/frame_header.html */
+    constexpr static uint16_t kBitrates[2][3][15]{
+        {
+            {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448}, /* layer 1 */
+            {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384}, /* layer 2 */
+            {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320} /* layer 3 */
+        },
+        {
+            {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+            {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+            {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160}
+        }
+    };
+    constexpr static uint32_t kSampleRates[3]{44100, 48000, 32000};
+    constexpr static uint32_t kAdtsSampleRates[13]{96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350};
+
+    inline bool parse_header(const uint8_t* data, size_t available, FrameHeader& result) {
+        if(available < 4 || data[0] != 0xFF || (data[1] & 0xE0U) != 0xE0U)
+            return false;
+
+        const auto version = (data[1] >> 3U) & 0x03U; /* 3 = mpeg 1, 2 = mpeg 2, 0 = mpeg 2.5 */
+        const auto layer = (data[1] >> 1U) & 0x03U; /* 3 = layer 1, 2 = layer 2, 1 = layer 3 */
+        if(layer == 0) {
+            /* https://wiki.multimedia.cx/index.php/ADTS */
+            if(available < 7 || (data[1] & 0xF6U) != 0xF0U)
+                return false;
+
+            const auto rate_index = (data[2] >> 2U) & 0x0FU;
+            if(rate_index >= 13)
+                return false;
+
+            result.adts = true;
+            result.sample_rate = kAdtsSampleRates[rate_index];
+            result.length = ((data[3] & 0x03U) << 11U) | (data[4] << 3U) | (data[5] >> 5U);
+            result.samples = 1024 * ((data[6] & 0x03U) + 1);
+            result.side_info_length = 0;
+            return result.length >= 7;
+        }
+
+        const auto bitrate_index = data[2] >> 4U;
+        const auto rate_index = (data[2] >> 2U) & 0x03U;
+        if(version == 1 || bitrate_index == 0 || bitrate_index == 15 || rate_index == 3)
+            return false;
+
+        const auto mpeg1 = version == 3;
+        const auto bitrate = (uint32_t) kBitrates[mpeg1 ? 0 : 1][3 - layer][bitrate_index] * 1000;
+        const auto padding = (data[2] >> 1U) & 0x01U;
+        const auto mono = (data[3] >> 6U) == 3;
+
+        result.adts = false;
+        result.sample_rate = kSampleRates[rate_index] >> (mpeg1 ? 0U : version == 2 ? 1U : 2U);
+        if(layer == 3) {
+            result.samples = 384;
+            result.length = (12 * bitrate / result.sample_rate + padding) * 4;
+        } else if(layer == 2 || mpeg1) {
+            result.samples = 1152;
+            result.length = 144 * bitrate / result.sample_rate + padding;
+        } else {
+            result.samples = 576;
+            result.length = 72 * bitrate / result.sample_rate + padding;
+        }
+
+        if(layer == 1)
+            result.side_info_length = mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17);
+        else
+            result.side_info_length = 0;
+        return result.length > 4;
+    }
+
+    /* a frame is only accepted if it's followed by another frame of the same kind (or the end of the file) */
+    inline bool valid_frame(const uint8_t* data, size_t available, FrameHeader& result) {
+        if(!parse_header(data, available, result))
+            return false;
+
+        if(result.length >= available)
+            return result.length == available;
+
+        FrameHeader next{};
+        return parse_header(data + result.length, available - result.length, next) && next.adts == result.adts && next.sample_rate == result.sample_rate;
+    }
+
+    struct InfoTag {
+        bool lame{false};
+        uint32_t encoder_delay{0};
+        uint32_t encoder_padding{0};
+    };
+
+    /* http://gabriel.mp3-tech.org/mp3infotag.html */
+    inline bool parse_info_tag(const uint8_t* frame, const FrameHeader& header, InfoTag& result) {
+        if(header.adts || header.side_info_length == 0)
+            return false;
+
+        if(header.length >= 4 + 32 + 4 && memcmp(frame + 4 + 32, "VBRI", 4) == 0)
+            return true;
+
+        auto offset = 4 + header.side_info_length;
+        if(offset + 8 > header.length || (memcmp(frame + offset, "Xing", 4) != 0 && memcmp(frame + offset, "Info", 4) != 0))
+            return false;
+
+        const auto flags = frame[offset + 7];
+        offset += 8;
+        if(flags & 0x01U) offset += 4; /* frame count */
+        if(flags & 0x02U) offset += 4; /* byte count */
+        if(flags & 0x04U) offset += 100; /* toc */
+        if(flags & 0x08U) offset += 4; /* quality */
+
+        if(offset + 24 <= header.length && (memcmp(frame + offset, "LAME", 4) == 0 || memcmp(frame + offset, "Lavf", 4) == 0 || memcmp(frame + offset, "Lavc", 4) == 0)) {
+            result.lame = true;
+            result.encoder_delay = ((uint32_t) frame[offset + 21] << 4U) | ((uint32_t) frame[offset + 22] >> 4U);
+            result.encoder_padding = (((uint32_t) frame[offset + 22] & 0x0FU) << 8U) | (uint32_t) frame[offset + 23];
+        }
+        return true;
+    }
+}
+
+FFMpegSeekIndex::Position FFMpegSeekIndex::Index::position(const PlayerUnits &target, size_t output_sample_rate) const {
+    const auto target_ms = (uint64_t) std::max((int64_t) 0, (int64_t) target.count());
+    const auto sample = std::min(target_ms * this->sample_rate / 1000, this->sample_count) + this->start_padding;
+
+    const auto preroll = (uint64_t) kPrerollFrames * this->samples_per_frame;
+    const auto search = sample > preroll ? sample - preroll : 0;
+
+    /* last entry in front of the preroll */
+    auto entry = std::upper_bound(this->entries.begin(), this->entries.end(), search, [](uint64_t value, const Entry& entry) { return value < entry.sample; });
+    if(entry != this->entries.begin())
+        entry--;
+
+    Position result{};
+    result.byte_offset = entry->byte_offset;
+    result.skip_samples = (sample - entry->sample) * output_sample_rate / this->sample_rate;
+    return result;
+}
+
+PlayerUnits FFMpegSeekIndex::Index::length() const {
+    return PlayerUnits{this->sample_count * 1000 / this->sample_rate};
+}
+
+FFMpegSeekIndex::FFMpegSeekIndex(std::string directory) : directory{std::move(directory)} {}
+FFMpegSeekIndex::~FFMpegSeekIndex() = default;
+
+bool FFMpegSeekIndex::initialize(std::string &error) {
+    std::error_code fs_error{};
+    if(!fs::exists(fs::u8path(this->directory), fs_error) && !fs::create_directories(fs::u8path(this->directory), fs_error)) {
+        error = "failed to create index directory: " + fs_error.message();
+        return false;
+    }
+    return true;
+}
+
+std::shared_ptr<const FFMpegSeekIndex::Index> FFMpegSeekIndex::find(const std::string &path) {
+    FileState state{};
+    {
+        std::error_code fs_error{};
+        state.size = fs::file_size(fs::u8path(path), fs_error);
+        if(fs_error) return nullptr;
+
+        state.modify_time = (int64_t) fs::last_write_time(fs::u8path(path), fs_error).time_since_epoch().count();
+        if(fs_error) return nullptr;
+    }
+
+    std::lock_guard lock_{this->lock};
+    if(auto it{this->indices.find(path)}; it != this->indices.end()) {
+        if(it->second.state == state)
+            return it->second.index;
+
+        /* the file has been modified */
+        this->indices.erase(it);
+    }
+
+    if(this->pending.count(path))
+        return nullptr;
+    this->pending.insert(path);
+
+    auto executed = wp::execute([this, path, state]{
+        auto index = this->load(path, state);
+        if(!index) {
+            std::string error{};
+            auto begin = std::chrono::system_clock::now();
+            index = build(path, error);
+            if(index) {
+                auto end = std::chrono::system_clock::now();
+                log::log(log::debug, "[FFMPEG][SeekIndex] Indexed " + path + " (" + std::to_string(index->entries.size()) + " entries) within " + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count()) + "ms");
+                this->store(path, state, *index);
+            } else {
+                log::log(log::trace, "[FFMPEG][SeekIndex] Not indexing " + path + ": " + error);
+            }
+        }
+
+        std::lock_guard lock_{this->lock};
+        this->pending.erase(path);
+        this->indices[path] = LoadedIndex{state, std::move(index)};
+        this->index_order.push_back(path);
+
+        while(this->indices.size() > kMaxLoadedIndices && !this->index_order.empty()) {
+            this->indices.erase(this->index_order.front());
+            this->index_order.pop_front();
+        }
+        if(this->index_order.size() > kMaxLoadedIndices * 2) {
+            /* drop order entries of paths which have been replaced in the meantime */
+            this->index_order.erase(std::remove_if(this->index_order.begin(), this->index_order.end(), [&](const auto& entry) { return !this->indices.count(entry); }), this->index_order.end());
+        }
+    }, [this, path](const std::string&) {
+        std::lock_guard lock_{this->lock};
+        this->pending.erase(path);
+    });
+
+    if(!executed)
+        log::log(log::trace, "[FFMPEG][SeekIndex] Failed to schedule index creation for " + path);
+    return nullptr;
+}
+
+std::shared_ptr<FFMpegSeekIndex::Index> FFMpegSeekIndex::build(const std::string &path, std::string &error) {
+    const auto file_descriptor = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(file_descriptor < 0) {
+        error = "failed to open file: " + std::string{strerror(errno)};
+        return nullptr;
+    }
+
+    struct stat file_stat{};
+    if(fstat(file_descriptor, &file_stat) != 0 || file_stat.st_size < 4) {
+        ::close(file_descriptor);
+        error = "file too small";
+        return nullptr;
+    }
+
+    const auto size = (size_t) file_stat.st_size;
+    auto mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+    ::close(file_descriptor);
+    if(mapping == MAP_FAILED) {
+        error = "failed to map file: " + std::string{strerror(errno)};
+        return nullptr;
+    }
+    madvise(mapping, size, MADV_SEQUENTIAL);
+
+    const auto data = (const uint8_t*) mapping;
+    size_t offset{0};
+    if(size >= 10 && memcmp(data, "ID3", 3) == 0) {
+        const auto tag_size = ((size_t) (data[6] & 0x7FU) << 21U) | ((size_t) (data[7] & 0x7FU) << 14U) | ((size_t) (data[8] & 0x7FU) << 7U) | (size_t) (data[9] & 0x7FU);
+        offset = 10 + tag_size + (data[5] & 0x10U ? 10 : 0);
+    }
+
+    auto index = std::make_shared<Index>();
+    mpeg::FrameHeader header{};
+    mpeg::InfoTag info_tag{};
+
+    bool first_frame{true};
+    const size_t audio_start{offset};
+    uint64_t frame_count{0}, frame_bytes{0}, sample{0};
+    while(offset + 4 <= size) {
+        if(!mpeg::valid_frame(data + offset, size - offset, header) || (index->sample_rate > 0 && header.sample_rate != index->sample_rate)) {
+            if(first_frame && offset - audio_start > kMaxSyncSearch) {
+                error = "no mpeg audio frame found";
+                break;
+            }
+
+            /* junk in between (or trailing tags), search the next frame */
+            offset++;
+            continue;
+        }
+
+        if(first_frame) {
+            first_frame = false;
+            index->sample_rate = header.sample_rate;
+            index->samples_per_frame = header.samples;
+            if(mpeg::parse_info_tag(data + offset, header, info_tag)) {
+                /* the info frame itself doesn't contain any audio */
+                offset += header.length;
+                continue;
+            }
+        }
+
+        if(frame_count % kEntryFrameInterval == 0)
+            index->entries.push_back(Index::Entry{offset, sample});
+
+        frame_count++;
+        frame_bytes += header.length;
+        sample += header.samples;
+        offset += header.length;
+    }
+    munmap(mapping, size);
+
+    if(index->entries.empty()) {
+        if(error.empty())
+            error = "no mpeg audio frame found";
+        return nullptr;
+    }
+
+    /* random frame syncs within other formats won't chain up over the whole file */
+    if(frame_bytes * 10 < (size - audio_start) * 9) {
+        error = "not a mpeg audio file";
+        return nullptr;
+    }
+
+    if(info_tag.lame) {
+        /* ffmpeg drops the encoder delay and the decoder delay (529 samples) at the start and the padding at the end */
+        index->start_padding = info_tag.encoder_delay + 529;
+        index->sample_count = sample - std::min(sample, (uint64_t) info_tag.encoder_delay + info_tag.encoder_padding);
+    } else {
+        index->sample_count = sample;
+    }
+    return index;
+}
+
+std::string FFMpegSeekIndex::index_path(const std::string &path) const {
+    char buffer[17];
+    snprintf(buffer, sizeof(buffer), "%016zx", std::hash<std::string>{}(path));
+    return (fs::u8path(this->directory) / fs::u8path(std::string{buffer} + ".idx")).string();
+}
+
+template <typename T>
+inline void write_value(std::ostream& stream, const T& value) {
+    stream.write((const char*) &value, sizeof(T));
+}
+
+template <typename T>
+inline bool read_value(std::istream& stream, T& value) {
+    return !!stream.read((char*) &value, sizeof(T));
+}
+
+std::shared_ptr<FFMpegSeekIndex::Index> FFMpegSeekIndex::load(const std::string &path, const FileState &state) const {
+    std::ifstream file{this->index_path(path), std::ios::binary};
+    if(!file.good())
+        return nullptr;
+
+    uint32_t magic{0}, version{0}, path_length{0};
+    FileState stored_state{};
+    if(!read_value(file, magic) || !read_value(file, version) || magic != kIndexMagic || version != kIndexVersion)
+        return nullptr;
+
+    if(!read_value(file, stored_state.size) || !read_value(file, stored_state.modify_time) || !(stored_state == state))
+        return nullptr;
+
+    /* the hash of the path might collide */
+    std::string stored_path{};
+    if(!read_value(file, path_length) || path_length != path.length())
+        return nullptr;
+    stored_path.resize(path_length);
+    if(!file.read(stored_path.data(), path_length) || stored_path != path)
+        return nullptr;
+
+    auto index = std::make_shared<Index>();
+    uint64_t entry_count{0};
+    if(!read_value(file, index->sample_rate) || !read_value(file, index->samples_per_frame) || !read_value(file, index->start_padding) || !read_value(file, index->sample_count) || !read_value(file, entry_count))
+        return nullptr;
+
+    if(index->sample_rate == 0 || entry_count == 0 || entry_count > state.size)
+        return nullptr;
+
+    index->entries.resize(entry_count);
+    for(auto& entry : index->entries)
+        if(!read_value(file, entry.byte_offset) || !read_value(file, entry.sample))
+            return nullptr;
+
+    return index;
+}
+
+void FFMpegSeekIndex::store(const std::string &path, const FileState &state, const Index &index) const {
+    const auto index_path = this->index_path(path);
+    const auto temp_path = index_path + ".tmp";
+    {
+        std::ofstream file{temp_path, std::ios::binary | std::ios::trunc};
+        write_value(file, kIndexMagic);
+        write_value(file, kIndexVersion);
+        write_value(file, state.size);
+        write_value(file, state.modify_time);
+        write_value(file, (uint32_t) path.length());
+        file.write(path.data(), path.length());
+
+        write_value(file, index.sample_rate);
+        write_value(file, index.samples_per_frame);
+        write_value(file, index.start_padding);
+        write_value(file, index.sample_count);
+        write_value(file, (uint64_t) index.entries.size());
+        for(const auto& entry : index.entries) {
+            write_value(file, entry.byte_offset);
+            write_value(file, entry.sample);
+        }
+
+        if(!file.good()) {
+            log::log(log::warn, "[FFMPEG][SeekIndex] Failed to write index file for " + path);
+            std::error_code fs_error{};
+            fs::remove(fs::u8path(temp_path), fs_error);
+            return;
+        }
+    }
+
+    std::error_code fs_error{};
+    fs::rename(fs::u8path(temp_path), fs::u8path(index_path), fs_error);
+    if(fs_error)
+        log::log(log::warn, "[FFMPEG][SeekIndex] Failed to move index file for " + path + ": " + fs_error.message());
+}
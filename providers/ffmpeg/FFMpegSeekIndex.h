@@ -0,0 +1,87 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <include/teaspeak/MusicPlayer.h>
+
+namespace music::player {
+    /*
+     * Time to byte offset index for local mpeg audio files (mp3 and adts aac).
+     * ffmpeg seeks within those by a bitrate estimate which is way off for VBR files without a TOC.
+     * Using the index ffmpeg starts decoding at a frame boundary in front of the target and
+     * the stream drops the residual samples, which makes seeks sample accurate.
+     *
+     * Indices are created in the background on first use and persisted within the index directory.
+     */
+    class FFMpegSeekIndex {
+        public:
+            /* nullptr if the seek index has been disabled */
+            static FFMpegSeekIndex* instance;
+
+            struct Position {
+                uint64_t byte_offset{0};
+                uint64_t skip_samples{0}; /* samples at the output rate to drop after decoding started at byte_offset */
+            };
+
+            class Index {
+                public:
+                    [[nodiscard]] Position position(const PlayerUnits& /* target */, size_t /* output sample rate */) const;
+                    [[nodiscard]] PlayerUnits length() const;
+                private:
+                    friend class FFMpegSeekIndex;
+
+                    struct Entry {
+                        uint64_t byte_offset{0};
+                        uint64_t sample{0}; /* first sample of the frame, including the start padding */
+                    };
+
+                    uint32_t sample_rate{0};
+                    uint32_t samples_per_frame{0};
+                    uint32_t start_padding{0}; /* samples the decoder drops when playing from the beginning */
+                    uint64_t sample_count{0}; /* playable samples without any padding */
+                    std::vector<Entry> entries{};
+            };
+
+            explicit FFMpegSeekIndex(std::string /* directory */);
+            ~FFMpegSeekIndex();
+
+            /* creates the index directory */
+            bool initialize(std::string& /* error */);
+
+            /*
+             * Returns the index of the file if it has been loaded already.
+             * Otherwise the index gets loaded or created in the background and nullptr will be returned.
+             */
+            [[nodiscard]] std::shared_ptr<const Index> find(const std::string& /* path */);
+        private:
+            struct FileState {
+                uint64_t size{0};
+                int64_t modify_time{0};
+
+                [[nodiscard]] inline bool operator==(const FileState& other) const { return this->size == other.size && this->modify_time == other.modify_time; }
+            };
+
+            struct LoadedIndex {
+                FileState state{};
+                std::shared_ptr<const Index> index{}; /* nullptr if the file can't be indexed */
+            };
+
+            [[nodiscard]] static std::shared_ptr<Index> build(const std::string& /* path */, std::string& /* error */);
+
+            [[nodiscard]] std::string index_path(const std::string& /* path */) const;
+            [[nodiscard]] std::shared_ptr<Index> load(const std::string& /* path */, const FileState& /* state */) const;
+            void store(const std::string& /* path */, const FileState& /* state */, const Index& /* index */) const;
+
+            const std::string directory;
+
+            std::mutex lock{};
+            std::map<std::string, LoadedIndex> indices{};
+            std::deque<std::string> index_order{}; /* oldest first */
+            std::set<std::string> pending{};
+    };
+}
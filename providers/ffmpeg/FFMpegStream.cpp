@@ -2,15 +2,26 @@
 // Created by WolverinDEV on 21/02/2020.
 //
 #include <regex>
+#include <cassert>
 #include <algorithm>
+#include <fcntl.h>
+#include <sys/uio.h>
 #include <StringVariable.h>
-#include <providers/shared/pstream.h>
 #include "./FFMpegMusicPlayer.h"
 #include "./FFMpegProvider.h"
+#include "./FFMpegBufferBudget.h"
+#include "./FFMpegDiskCache.h"
+#include "./FFMpegProcessPool.h"
+#include "./FFMpegChildReaper.h"
+#include "./FFMpegUringReader.h"
+#include <providers/shared/libopus.h>
 #include "./string_utils.h"
 
 using namespace music::player;
 
+/* idle streams get checked against their buffer quota in this interval */
+constexpr static std::chrono::seconds kBudgetCheckInterval{1};
+
 namespace ffmpeg {
     /**
      * @param time format: '00:03:53.50'
@@ -40,11 +51,26 @@ namespace ffmpeg {
 
         auto milli = duration_cast<milliseconds>(units);
 
-        char buffer[11 + 1];
-        sprintf(buffer, "%02d:%02d:%02d.%02d", (int) hour.count(), (int) minute.count(), (int) second.count(), (int) milli.count() / 10);
+        char buffer[12 + 1];
+        sprintf(buffer, "%02d:%02d:%02d.%03d", (int) hour.count(), (int) minute.count(), (int) second.count(), (int) milli.count());
         return std::string{buffer};
     }
 
+    /* libopus frame duration in milliseconds for the frame size (48kHz). Unsupported frame sizes fall back to 20ms. */
+    inline std::string opus_frame_duration(size_t frame_samples) {
+        switch (frame_samples) {
+            case 120: return "2.5";
+            case 240: return "5";
+            case 480: return "10";
+            case 1920: return "40";
+            case 2880: return "60";
+            case 3840: return "80";
+            case 4800: return "100";
+            case 5760: return "120";
+            default: return "20";
+        }
+    }
+
     struct MetaEntry {
         std::string log_prefix;
         std::string entry;
@@ -182,7 +208,11 @@ Press [q] to stop, [?] for help
 }
 
 FFMpegStream::FFMpegStream(std::string url, FFMPEGURLType type, PlayerUnits seek, size_t fsc, size_t channels, size_t sample_rate)
-    : url{std::move(url)}, url_type{type}, frame_sample_count{fsc}, channel_count{channels}, sample_rate{sample_rate}, stream_seek_offset{seek} {
+    : url{std::move(url)}, url_type{type}, channel_count{channels}, sample_rate{sample_rate}, frame_sample_count_{fsc}, stream_seek_offset{seek} {
+    const auto config = FFMpegProvider::instance->configuration();
+    this->buffer_watermarks(this->url_type == FFMPEGURLType::FILE ? config->buffering.file : config->buffering.stream);
+    if(config->buffering.compress)
+        this->audio.decode_ahead = std::max(config->buffering.compress_decode_ahead, (size_t) 1);
 }
 
 FFMpegStream::~FFMpegStream() {
@@ -232,19 +262,59 @@ bool FFMpegStream::initialize(std::string &error) {
     {
         const auto is_seek = this->stream_seek_offset.count() > 0;
         const auto config = FFMpegProvider::instance->configuration();
-        switch (this->url_type) {
-            case FFMPEGURLType::STREAM:
-                ffmpeg_command = is_seek ? config->commands.playback_seek : config->commands.playback;
-                break;
-            case FFMPEGURLType::FILE:
-                ffmpeg_command = is_seek ? config->commands.file_playback_seek : config->commands.file_playback;
-                break;
+        this->transport_compressed = this->output_format_ == OutputFormat::FORMAT_PCM_S16LE && config->transport.compressed && libopus::functions;
+
+        std::string codec_arguments{};
+        if(this->output_format_ == OutputFormat::FORMAT_OPUS || this->transport_compressed) {
+            switch (this->url_type) {
+                case FFMPEGURLType::STREAM:
+                    ffmpeg_command = is_seek ? config->commands.opus_playback_seek : config->commands.opus_playback;
+                    break;
+                case FFMPEGURLType::FILE:
+                    ffmpeg_command = is_seek ? config->commands.opus_file_playback_seek : config->commands.opus_file_playback;
+                    break;
+            }
+
+            if(this->transport_compressed) {
+                codec_arguments = strvar::transform(config->transport.arguments,
+                                                    strvar::StringValue{"bitrate", config->transport.bitrate},
+                                                    strvar::StringValue{"channel_count", std::to_string(this->channel_count)}
+                );
+            } else {
+                codec_arguments = strvar::transform(this->output_copy ? config->opus.copy_arguments : config->opus.encode_arguments,
+                                                    strvar::StringValue{"bitrate", config->opus.bitrate},
+                                                    strvar::StringValue{"channel_count", std::to_string(this->channel_count)},
+                                                    strvar::StringValue{"frame_duration", ffmpeg::opus_frame_duration(this->frame_sample_count_)}
+                );
+            }
+        } else {
+            switch (this->url_type) {
+                case FFMPEGURLType::STREAM:
+                    ffmpeg_command = is_seek ? config->commands.playback_seek : config->commands.playback;
+                    break;
+                case FFMPEGURLType::FILE:
+                    if(is_seek && this->seek_position_.has_value())
+                        ffmpeg_command = config->commands.file_playback_offset;
+                    else
+                        ffmpeg_command = is_seek ? config->commands.file_playback_seek : config->commands.file_playback;
+                    break;
+            }
+        }
+        std::string cache_arguments{};
+        if(auto disk_cache{FFMpegDiskCache::instance}; disk_cache && !this->cache.key.empty() && !is_seek && this->url_type == FFMPEGURLType::STREAM) {
+            this->cache.file = disk_cache->reserve(this->cache.key);
+            this->cache.completed = false;
+            cache_arguments = strvar::transform(config->cache.arguments, strvar::StringValue{"cache_file", this->cache.file});
         }
+
         ffmpeg_command = strvar::transform(ffmpeg_command,
                                            strvar::StringValue{"command", FFMpegProvider::instance->configuration()->ffmpeg_command},
                                            strvar::StringValue{"path", this->url},
                                            strvar::StringValue{"channel_count", std::to_string(this->channel_count)},
-                                           strvar::StringValue{"seek_offset", ffmpeg::build_time(this->stream_seek_offset)}
+                                           strvar::StringValue{"seek_offset", ffmpeg::build_time(this->stream_seek_offset)},
+                                           strvar::StringValue{"seek_byte_offset", std::to_string(this->seek_position_.has_value() ? this->seek_position_->byte_offset : 0)},
+                                           strvar::StringValue{"codec_arguments", codec_arguments},
+                                           strvar::StringValue{"cache_arguments", cache_arguments}
         );
     }
 
@@ -258,148 +328,368 @@ bool FFMpegStream::initialize(std::string &error) {
         return false;
     }
 
-    this->process_stream = new redi::pstream{ffmpeg_command_argv[0], ffmpeg_command_argv, redi::pstreams::pstderr | redi::pstreams::pstdout};
+    if(this->output_format_ == OutputFormat::FORMAT_PCM_S16LE && this->url_type == FFMPEGURLType::FILE && this->seek_position_.has_value() && !this->transport_compressed) {
+        std::lock_guard buffer_lock{this->audio.lock};
+        this->audio.skip_bytes = this->seek_position_->skip_samples * this->channel_count * sizeof(uint16_t);
+    }
+
+    if(this->transport_compressed) {
+        std::lock_guard buffer_lock{this->audio.lock};
+
+        this->audio.decoder_library = libopus::functions;
+        if(!this->audio.decoder_library) {
+            error = "libopus has been released";
+            return false;
+        }
+
+        int error_code{0};
+        this->audio.decoder = this->audio.decoder_library->opus_decoder_create((int32_t) this->sample_rate, (int) this->channel_count, &error_code);
+        if(!this->audio.decoder || error_code != OPUS_OK) {
+            error = std::string{"failed to create opus decoder: "} + this->audio.decoder_library->opus_strerror(error_code);
+            return false;
+        }
+
+        constexpr static auto kMaxPacketFrames{5760}; /* 120ms */
+        this->audio.decode_buffer.resize(kMaxPacketFrames * this->channel_count);
+    }
+
+    if(auto pool = FFMpegProcessPool::instance; pool)
+        this->process_stream = pool->spawn(ffmpeg_command_argv, error).release();
+    else
+        this->process_stream = pl::spawn(ffmpeg_command_argv, error).release();
+    if(!this->process_stream)
+        return false;
+
+    this->process_exit = {};
+    if(auto reaper = FFMpegChildReaper::instance; reaper)
+        this->process_exit.watched = reaper->watch(this->process_stream, std::bind(&FFMpegStream::callback_process_exit, this, std::placeholders::_1));
+
+    const auto& pipe_config = FFMpegProvider::instance->configuration()->pipes;
+    if(pipe_config.capacity_kb > 0 && fcntl(this->process_stream->fd_out(), F_SETPIPE_SZ, (int) (pipe_config.capacity_kb * 1024)) < 0)
+        log::log(log::debug, "[FFMPEG][" + to_string(this) + "] Failed to resize the output pipe to " + std::to_string(pipe_config.capacity_kb) + " KiB: " + strerror(errno));
+
     this->process_handle = std::make_shared<FFMpegProcessHandle>(this->process_stream);
+    this->process_handle->batch_interval = std::chrono::milliseconds{pipe_config.batch_interval_ms};
+    if(this->output_format_ == OutputFormat::FORMAT_PCM_S16LE && !this->transport_compressed)
+        this->process_handle->uring = FFMpegUringReader::instance;
 
     this->process_handle->io.event_base = FFMpegProvider::instance->readerBase;
     this->process_handle->io.event_thread = FFMpegProvider::instance->readerDispatch.get_id();
     this->process_handle->initialize_events();
 
     this->process_handle->callback_read_error = std::bind(&FFMpegStream::callback_read_err, this, std::placeholders::_1, std::placeholders::_2);
-    this->process_handle->callback_read_output = std::bind(&FFMpegStream::callback_read_output, this, std::placeholders::_1, std::placeholders::_2);
+    if(this->output_format_ == OutputFormat::FORMAT_OPUS || this->transport_compressed) {
+        this->demuxer.reset();
+        this->demuxer.callback_packet = std::bind(&FFMpegStream::callback_packet, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+        this->process_handle->callback_read_output = std::bind(&FFMpegStream::callback_read_packets, this, std::placeholders::_1, std::placeholders::_2);
+    } else {
+        this->process_handle->callback_prepare_output = std::bind(&FFMpegStream::prepare_output, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+        this->process_handle->callback_commit_output = std::bind(&FFMpegStream::commit_output, this, std::placeholders::_1);
+    }
     this->process_handle->callback_error = std::bind(&FFMpegStream::callback_error, this, std::placeholders::_1, std::placeholders::_2);
     this->process_handle->callback_eof = std::bind(&FFMpegStream::callback_eof, this);
+    FFMpegProvider::instance->buffer_budget().register_stream(this, this->url_type, this->sample_rate * this->channel_count * sizeof(int16_t));
+    if(FFMpegProvider::instance->buffer_budget().usage().budget_bytes > 0) {
+        this->process_handle->callback_timer = std::bind(&FFMpegStream::enforce_buffer_budget, this);
+        this->process_handle->schedule_timer(std::chrono::system_clock::now() + kBudgetCheckInterval);
+    }
     this->process_handle->enable_buffering();
     return true;
 }
 
 void FFMpegStream::finalize() {
+    this->stop_process();
+
+    if(auto provider{FFMpegProvider::instance}; provider)
+        provider->buffer_budget().unregister_stream(this);
+
+    {
+        std::lock_guard block{this->audio.lock};
+        this->audio.front_offset = 0;
+        this->audio.overhead_index = 0;
+        this->audio.spare.clear();
+        this->audio.read_target = nullptr;
+        this->audio.skip_bytes = 0;
+        this->audio.buffered.clear();
+        this->audio.compressed.clear();
+        this->audio.compressed_index = 0;
+        this->audio.packets.clear();
+        this->audio.packet_skip = 0;
+
+        if(this->audio.decoder)
+            this->audio.decoder_library->opus_decoder_destroy(std::exchange(this->audio.decoder, nullptr));
+        this->audio.decoder_library = nullptr;
+        this->audio.decode_skip = 0;
+        this->audio.decode_buffer = {};
+        this->stream_sample_offset = 0;
+    }
+
+    if(!this->cache.file.empty()) {
+        /* the process has been exited at this point, ffmpeg has been finished writing the file */
+        if(auto disk_cache{FFMpegDiskCache::instance}; disk_cache) {
+            if(this->cache.completed)
+                disk_cache->commit(this->cache.key, this->cache.file, this->cache.metadata);
+            else
+                disk_cache->discard(this->cache.file);
+        }
+
+        this->cache.file.clear();
+        this->cache.completed = false;
+    }
+
+    this->meta_info_buffer = "";
+}
+
+void FFMpegStream::stop_process() {
     /*
      * The destruction will block 'till callback_read_output or callback_read_error have finished.
      * Bt callback_read_output/callback_read_error acquire the process lock
      */
     std::shared_ptr<FFMpegProcessHandle> phandle{};
+    pl::Process* process{nullptr};
     {
         std::lock_guard plock{this->process_lock};
 
         if(this->process_handle)
             std::swap(phandle, this->process_handle);
 
-        if(this->process_stream) {
-            std::string send_signals{};
-            if(!this->process_stream->rdbuf()->exited()) {
-                this->process_stream->rdbuf()->kill(SIGQUIT);
-                send_signals += "SIGQUIT";
-            }
+        process = std::exchange(this->process_stream, nullptr);
+        this->process_exit = {};
+    }
 
-            if(!this->process_stream->rdbuf()->exited()) {
-                this->process_stream->rdbuf()->kill(SIGKILL);
-                send_signals += ", SIGKILL";
-            }
+    /* must not be called while holding the process lock, the reaper might await our exit callback */
+    if(process) {
+        if(auto reaper{FFMpegChildReaper::instance}; reaper) {
+            /* SIGQUIT, SIGKILL after the deadline and reaping happen asynchronously within the event loop */
+            reaper->release(process);
+        } else {
+            /* the provider is shutting down, SIGKILL will not take long */
+            process->kill(SIGKILL);
+            delete process;
+        }
+    }
+}
 
-            if(this->process_stream->rdbuf()->exited()) {
-                delete this->process_stream;
-            } else {
-                /* not the best practice, but we do not want the bot to hang */
-                log::log(log::debug, "[FFMPEG] Failed to exit ffmpeg process handle. Deleting process handle (" + std::to_string((uintptr_t) this->process_stream) + ") within another thread (signals send: " + (send_signals.empty() ? "none" : send_signals) + ").");
-                std::thread([stream{this->process_stream}]{
-                    while(!stream->rdbuf()->exited()) {
-                        stream->rdbuf()->kill(SIGKILL);
-                        std::this_thread::sleep_for(std::chrono::milliseconds{500});
-                    }
-                    stream->close();
-                    delete stream;
-                    log::log(log::debug, "[FFMPEG] Deleting process handle (" + std::to_string((uintptr_t) stream) + ") done.");
-                }).detach();
-            }
+void FFMpegStream::cache_entry(const std::string &key, const std::map<std::string, std::string> &metadata) {
+    this->cache.key = key;
+    this->cache.metadata = metadata;
+}
 
-            this->process_stream = nullptr;
-        }
+void FFMpegStream::compress_buffered() {
+    if(this->audio.decode_ahead == 0)
+        return;
+
+    if(this->audio.compressed.empty())
+        this->audio.compressed_index = this->audio.decode_ahead;
+
+    auto& buffered = this->audio.buffered;
+    while(this->audio.compressed_index < buffered.size() && buffered[this->audio.compressed_index]->full) {
+        auto& compressed = this->audio.compressed.emplace_back();
+        compress_segment(*buffered[this->audio.compressed_index], compressed);
+        buffered.erase(buffered.begin() + this->audio.compressed_index);
     }
+}
 
-    {
-        std::lock_guard block{this->audio.lock};
-        this->audio.overhead_index = 0;
-        this->audio.buffered.clear();
+void FFMpegStream::decompress_buffered() {
+    while(!this->audio.compressed.empty() && this->audio.compressed_index < this->audio.decode_ahead)
+        this->decompress_next();
+}
 
-        this->stream_sample_offset = 0;
+void FFMpegStream::decompress_next() {
+    const auto& compressed = this->audio.compressed.front();
+
+    auto segment = SampleSegment::allocate(compressed.max_sample_count, compressed.channels);
+    if(!decompress_segment(compressed, *segment)) {
+        /* should never happen. Drop the segment and don't let the playback hang */
+        log::log(log::critical, "[FFMPEG][" + to_string(this) + "] Failed to decompress buffered segment. Dropping it.");
+    } else {
+        this->audio.buffered.insert(this->audio.buffered.begin() + this->audio.compressed_index, std::move(segment));
+        this->audio.compressed_index++;
     }
 
-    this->meta_info_buffer = "";
+    this->audio.compressed.pop_front();
 }
 
-std::shared_ptr<music::SampleSegment> FFMpegStream::get_sample_buffer() {
-    if(!this->audio.buffered.empty()) {
-        auto last = this->audio.buffered.back();
-        if(!last->full) return last;
+size_t FFMpegStream::prepare_output(iovec *vectors, size_t max_vectors, std::vector<std::shared_ptr<void>> &keep_alive) {
+    const auto frame_samples = this->frame_sample_count_.load();
+    const auto bytes_per_frame = this->channel_count * sizeof(uint16_t);
+    const auto segment_bytes = frame_samples * bytes_per_frame;
+    if(max_vectors < 2)
+        return 0;
+
+    std::lock_guard buffer_lock{this->audio.lock};
+    if(this->audio.skip_bytes > 0) {
+        /* decoding started in front of the seek target */
+        constexpr auto kDiscardSize = 16 * 1024;
+        if(!this->audio.discard)
+            this->audio.discard = std::shared_ptr<char>{new char[kDiscardSize], std::default_delete<char[]>()};
+
+        vectors[0].iov_base = &*this->audio.discard;
+        vectors[0].iov_len = std::min(this->audio.skip_bytes, (size_t) kDiscardSize);
+        keep_alive.push_back(this->audio.discard);
+        this->audio.read_target = nullptr;
+        return 1;
     }
 
-    auto buffer = SampleSegment::allocate(this->frame_sample_count, this->channel_count);
-    this->audio.buffered.push_back(buffer);
-    return buffer;
+    /*
+     * Read straight into the free tail of the current segment followed by spare segments.
+     * Incomplete frames stay at the tail of their segment (overhead_index) and get completed by the next read.
+     */
+    constexpr auto kMaxReadBytes = 64 * 1024; /* default pipe capacity */
+    const auto spare_count = std::clamp(kMaxReadBytes / std::max(segment_bytes, (size_t) 1), (size_t) 1, max_vectors - 1);
+
+    size_t vector_count{0};
+    this->audio.read_target = nullptr;
+    if(!this->audio.buffered.empty() && !this->audio.buffered.back()->full) {
+        auto& current = this->audio.read_target = this->audio.buffered.back();
+
+        const auto used_bytes = current->segmentLength * bytes_per_frame + this->audio.overhead_index;
+        vectors[vector_count].iov_base = (char*) current->segments + used_bytes;
+        vectors[vector_count].iov_len = current->maxSegmentLength * bytes_per_frame - used_bytes;
+        keep_alive.push_back(current);
+        vector_count++;
+    } else {
+        assert(this->audio.overhead_index == 0);
+    }
+
+    /* the frame size might have been changed */
+    auto& spare = this->audio.spare;
+    spare.erase(std::remove_if(spare.begin(), spare.end(), [&](const auto& segment) { return segment->maxSegmentLength != frame_samples; }), spare.end());
+    while(spare.size() < spare_count)
+        spare.push_back(SampleSegment::allocate(frame_samples, this->channel_count));
+
+    for(size_t index{0}; index < spare_count; index++) {
+        vectors[vector_count].iov_base = this->audio.spare[index]->segments;
+        vectors[vector_count].iov_len = segment_bytes;
+        keep_alive.push_back(this->audio.spare[index]);
+        vector_count++;
+    }
+    return vector_count;
 }
 
-void FFMpegStream::callback_read_output(const void *buffer, size_t length) {
+void FFMpegStream::commit_output(size_t length) {
     const auto bytes_per_frame = this->channel_count * sizeof(uint16_t);
 
     {
         std::lock_guard buffer_lock{this->audio.lock};
-        auto sample_buffer{this->get_sample_buffer()};
+        if(this->audio.skip_bytes > 0) {
+            this->audio.skip_bytes -= std::min(this->audio.skip_bytes, length);
+            return;
+        }
 
-        char* target_byte_buffer{(char*) (sample_buffer->segments + sample_buffer->channels * sample_buffer->segmentLength)};
-        size_t target_byte_length = (sample_buffer->maxSegmentLength - sample_buffer->segmentLength) * sample_buffer->channels * sizeof(uint16_t);
+        auto remaining = length;
+        if(auto current = std::exchange(this->audio.read_target, nullptr); current) {
+            const auto free_bytes = current->maxSegmentLength * bytes_per_frame - current->segmentLength * bytes_per_frame - this->audio.overhead_index;
+            const auto received = std::min(remaining, free_bytes);
+            remaining -= received;
 
-        if(this->audio.overhead_index > 0) {
-            /* check whatever the last frame has been completed */
-            if(this->audio.overhead_index + length < bytes_per_frame) {
-                /* we've not enough data to buffer */
-                memcpy(this->audio.overhead_buffer + this->audio.overhead_index, buffer, length);
-                this->audio.overhead_index += length;
-                return;
-            } else {
-                const auto required_bytes{bytes_per_frame - this->audio.overhead_index};
-                memcpy(target_byte_buffer, this->audio.overhead_buffer, this->audio.overhead_index);
-                memcpy(target_byte_buffer + this->audio.overhead_index, buffer, required_bytes);
+            const auto available = this->audio.overhead_index + received;
+            current->segmentLength += available / bytes_per_frame;
+            current->full = current->segmentLength == current->maxSegmentLength;
+            this->audio.overhead_index = available % bytes_per_frame;
+        }
 
-                length -= required_bytes;
-                buffer = (const char*) buffer + required_bytes;
-                //this->overhead_index = 0; //Will be set later, no need to do that here
+        size_t used_spares{0};
+        while(remaining > 0 && used_spares < this->audio.spare.size()) {
+            auto& segment = this->audio.spare[used_spares++];
+            const auto received = std::min(remaining, segment->maxSegmentLength * bytes_per_frame);
+            remaining -= received;
 
-                sample_buffer->segmentLength++;
-                target_byte_buffer += bytes_per_frame;
-                target_byte_length -= bytes_per_frame;
-            }
+            segment->segmentLength = received / bytes_per_frame;
+            segment->full = segment->segmentLength == segment->maxSegmentLength;
+            this->audio.overhead_index = received % bytes_per_frame;
+            this->audio.buffered.push_back(std::move(segment));
         }
+        this->audio.spare.erase(this->audio.spare.begin(), this->audio.spare.begin() + used_spares);
 
-        while(length >= bytes_per_frame) {
-            if(target_byte_length < bytes_per_frame) {
-                assert(target_byte_length == 0);
-                sample_buffer = this->get_sample_buffer(); /* new buffer must not be a total empty one but in theory should be */
+        this->compress_buffered();
+    }
 
-                target_byte_buffer = (char*) (sample_buffer->segments + sample_buffer->channels * sample_buffer->segmentLength);
-                target_byte_length = (sample_buffer->maxSegmentLength - sample_buffer->segmentLength) * sample_buffer->channels * sizeof(uint16_t);
-            }
+    this->update_buffer_state(true);
+}
 
-            const auto samples_read = std::min(target_byte_length, length) / bytes_per_frame;
-            const auto byte_read = samples_read * bytes_per_frame;
-            memcpy(target_byte_buffer, buffer, byte_read);
+void FFMpegStream::callback_read_packets(const void *buffer, size_t length) {
+    if(!this->demuxer.feed(buffer, length)) {
+        log::log(log::err, "[FFMPEG][" + to_string(this) + "] Failed to demux ffmpeg output: " + this->demuxer.error());
+        this->demuxer.callback_packet = nullptr;
 
-            buffer = (const char*) buffer + byte_read;
-            length -= byte_read;
+        if(auto callback{this->callback_abort}; callback)
+            callback();
+        return;
+    }
 
-            target_byte_buffer += byte_read;
-            target_byte_length -= byte_read;
-            sample_buffer->segmentLength += samples_read;
-            sample_buffer->full = sample_buffer->segmentLength == sample_buffer->maxSegmentLength;
-        }
+    if(this->copy_rejected_) {
+        this->demuxer.callback_packet = nullptr;
 
-        memcpy(this->audio.overhead_buffer, buffer, length);
-        this->audio.overhead_index = length;
+        if(auto callback{this->callback_abort}; callback)
+            callback();
+        return;
     }
 
     this->update_buffer_state(true);
 }
 
+void FFMpegStream::callback_packet(const uint8_t *data, size_t length, bool header) {
+    if(header) {
+        if(auto channels{opus::header_channel_count(data, length)}; channels > 0) {
+            log::log(log::trace, "[FFMPEG][" + to_string(this) + "] Received opus header. Channel count: " + std::to_string(channels));
+
+            if(this->transport_compressed) {
+                std::lock_guard block{this->audio.lock};
+                this->audio.decode_skip = opus::header_pre_skip(data, length) * this->sample_rate / 48000;
+            } else if(this->output_copy && channels != this->channel_count) {
+                /* ffmpeg copies the source as it is, only the encoder applies the channel count */
+                log::log(log::debug, "[FFMPEG][" + to_string(this) + "] Copied opus stream has " + std::to_string(channels) + " channels instead of " + std::to_string(this->channel_count) + ". Falling back to transcoding.");
+                this->copy_rejected_ = true;
+            } else {
+                std::lock_guard block{this->audio.lock};
+                this->audio.packet_skip = opus::header_pre_skip(data, length);
+            }
+        }
+        return;
+    }
+    if(this->copy_rejected_)
+        return;
+
+    const auto sample_count = opus::packet_sample_count(data, length);
+    if(sample_count == 0) {
+        log::log(log::trace, "[FFMPEG][" + to_string(this) + "] Dropping invalid opus packet");
+        return;
+    }
+
+    auto packet = EncodedSegment::allocate(length);
+    memcpy(packet->data, data, length);
+    packet->length = length;
+    packet->sampleCount = sample_count;
+
+    std::lock_guard block{this->audio.lock};
+    if(this->audio.packet_skip > 0 && !this->transport_compressed) {
+        /* opus packets can't be cut, only the packets which lie completely within the pre skip get dropped */
+        if(sample_count <= this->audio.packet_skip) {
+            this->audio.packet_skip -= sample_count;
+            return;
+        }
+        this->audio.packet_skip = 0;
+    }
+    this->audio.packets.push_back(std::move(packet));
+}
+
+/* e.g. "HTTP error 403 Forbidden" or "Server returned 403 Forbidden (access denied)" */
+inline int parse_http_status(const std::string_view& message) {
+    for(const auto& prefix : {"HTTP error ", "Server returned "}) {
+        auto index = message.find(prefix);
+        if(index == std::string::npos)
+            continue;
+
+        index += strlen(prefix);
+        if(index + 3 > message.length() || !isdigit(message[index]) || !isdigit(message[index + 1]) || !isdigit(message[index + 2]))
+            continue;
+
+        return (message[index] - '0') * 100 + (message[index + 1] - '0') * 10 + (message[index + 2] - '0');
+    }
+    return 0;
+}
+
 void FFMpegStream::callback_read_err(const void *_buffer, size_t length) {
     std::unique_lock ilock{this->_stream_info.lock};
     if(length > 0) this->meta_info_buffer.append((const char*) _buffer, length);
@@ -407,8 +697,12 @@ void FFMpegStream::callback_read_err(const void *_buffer, size_t length) {
     if(!this->_stream_info.initialized) {
         constexpr static auto head_tail = "Press [q] to stop, [?] for help";
         auto tail = this->meta_info_buffer.find(head_tail);
-        if(tail == std::string::npos)
+        if(tail == std::string::npos) {
+            /* connecting failed */
+            if(auto status{parse_http_status(this->meta_info_buffer)}; status > 0)
+                this->http_status_ = status;
             return;
+        }
 
         auto data = ffmpeg::parse_metadata(this->meta_info_buffer.substr(0, tail));
         this->meta_info_buffer = this->meta_info_buffer.substr(tail + strlen(head_tail) + 1);
@@ -456,12 +750,19 @@ void FFMpegStream::callback_read_err(const void *_buffer, size_t length) {
         strings::split_lines(lines, this->meta_info_buffer);
 
         /* evaluate only fulfilled lines */
-        if(lines.size() > 1 && !strings::trim(lines.back()).empty())
+        if(!strings::trim(lines.back()).empty())
             this->meta_info_buffer = lines.back();
         else
             this->meta_info_buffer = "";
         lines.pop_back(); //last entry will be empty or stored for later
 
+        /* ffmpeg never emits lines this long. Don't let a stream without line breaks grow the buffer. */
+        constexpr static auto kMaxPartialLineLength{4096};
+        if(this->meta_info_buffer.length() > kMaxPartialLineLength) {
+            log::log(log::debug, "[FFMPEG][" + to_string(this) + "] Dropping " + std::to_string(this->meta_info_buffer.length()) + " bytes of err output without a line break");
+            this->meta_info_buffer = "";
+        }
+
 
         bool error_send = false;
         for(const auto& line : lines) {
@@ -484,6 +785,9 @@ void FFMpegStream::callback_read_err(const void *_buffer, size_t length) {
                         this->_stream_info.stream_properties[index->operator[](1).str()] = index->operator[](3).str();
                     }
 
+                    if(auto speed{this->_stream_info.stream_properties.find("speed")}; speed != this->_stream_info.stream_properties.end())
+                        this->adapt_buffer_speed(speed->second);
+
 #if false
                     log::log(log::trace, "[FFMPEG][" + to_string(this) + "] Got " + std::to_string(this->_stream_info.stream_properties.size()) + " property values on err stream. (Attention: These properties may differ with the known expected properties!)");
                     for(const auto& [key, value] : this->_stream_info.stream_properties)
@@ -517,6 +821,9 @@ void FFMpegStream::callback_read_err(const void *_buffer, size_t length) {
             } else if(this->meta_output_tag)
                 continue;
 
+            if(auto status{parse_http_status(line)}; status > 0)
+                this->http_status_ = status;
+
             if(!error_send) {
                 log::log(log::err, "[FFMPEG][" + to_string(this) + "] Got error message from FFMpeg:");
                 error_send = true;
@@ -538,12 +845,39 @@ void FFMpegStream::callback_eof() {
         if(!this->process_stream) {
             exited = true;
             exit_code = 0;
+        } else if(this->process_exit.status.has_value()) {
+            exited = true;
+            exit_code = *this->process_exit.status;
+        } else if(this->process_exit.watched) {
+            /* ffmpeg closed its output but hasn't exited yet */
+            this->process_exit.pending_eof = true;
+            return;
         } else {
-            exited = this->process_stream->rdbuf()->exited();
-            exit_code = this->process_stream->rdbuf()->status();
+            exited = this->process_stream->exited();
+            exit_code = this->process_stream->status();
         }
     }
 
+    this->handle_eof(exited, exit_code);
+}
+
+void FFMpegStream::callback_process_exit(int status) {
+    bool eof{false};
+    int io_error{0};
+    {
+        std::lock_guard plock{this->process_lock};
+        this->process_exit.status = status;
+        eof = std::exchange(this->process_exit.pending_eof, false);
+        io_error = std::exchange(this->process_exit.pending_io_error, 0);
+    }
+
+    if(eof)
+        this->handle_eof(true, status);
+    else if(io_error)
+        this->handle_io_error(io_error, true, status);
+}
+
+void FFMpegStream::handle_eof(bool exited, int exit_code) {
     log::log(log::debug, "Received EOF from FFMPEG process stream. Exited: " + std::string{exited ? "yes" : "no"} + ", Code: " + std::to_string(exit_code));
     if(!exited || exit_code != 0) {
         log::log(log::err, "FFMPEG process ended with invalid exit code: " + std::to_string(exit_code));
@@ -555,10 +889,12 @@ void FFMpegStream::callback_eof() {
 
     {
         std::lock_guard block{this->audio.lock};
-        if(!this->audio.buffered.empty())
+        /* packets left will be decoded by pop_next_segment which completes the last segment then */
+        if(!this->audio.buffered.empty() && !this->audio.decoder)
             this->audio.buffered.back()->full = true;
 
         this->end_reached = true;
+        this->cache.completed = true;
     }
     if(auto callback{this->callback_ended}; callback)
         callback();
@@ -572,84 +908,515 @@ void FFMpegStream::callback_error(FFMpegProcessHandle::ErrorCode code, int data)
             if(!this->process_stream) {
                 exited = true;
                 exit_code = 0;
+            } else if(this->process_exit.status.has_value()) {
+                exited = true;
+                exit_code = *this->process_exit.status;
+            } else if(this->process_exit.watched) {
+                this->process_exit.pending_io_error = data;
+                return;
             } else {
-                exited = this->process_stream->rdbuf()->exited();
-                exit_code = this->process_stream->rdbuf()->status();;
+                exited = this->process_stream->exited();
+                exit_code = this->process_stream->status();
             }
         }
 
-        if(exited && exit_code == 0) {
-            /* Normal ending, may pipe is broken or something. */
-            {
-                std::lock_guard block{this->audio.lock};
-                if (this->end_reached) return; /* check if we're not already having called the end callback */
-            }
+        this->handle_io_error(data, exited, exit_code);
+        return;
+    }
+    if(auto callback{this->callback_abort}; callback)
+        callback();
+}
 
-            if (auto callback{this->callback_ended}; callback)
-                callback();
-            return;
-        }
-        log::log(log::err, "Invalid read/write (error). Code: " + std::to_string(data) + " Message: " + strerror(data) + ": Exit: " + std::to_string(exited) + " (" + std::to_string(exit_code) + ")");
-        if(!this->_stream_info.initialized) {
-            if(auto callback{this->callback_connect_error}; callback)
-                callback(this->meta_info_buffer.empty() ? "ffmpeg exited with " + std::to_string(data) : this->meta_info_buffer);
-            return; /* the this pointer might dangle here */
+void FFMpegStream::handle_io_error(int data, bool exited, int exit_code) {
+    if(exited && exit_code == 0) {
+        /* Normal ending, may pipe is broken or something. */
+        {
+            std::lock_guard block{this->audio.lock};
+            if (this->end_reached) return; /* check if we're not already having called the end callback */
         }
+
+        if (auto callback{this->callback_ended}; callback)
+            callback();
+        return;
+    }
+    log::log(log::err, "Invalid read/write (error). Code: " + std::to_string(data) + " Message: " + strerror(data) + ": Exit: " + std::to_string(exited) + " (" + std::to_string(exit_code) + ")");
+    if(!this->_stream_info.initialized) {
+        if(auto callback{this->callback_connect_error}; callback)
+            callback(this->meta_info_buffer.empty() ? "ffmpeg exited with " + std::to_string(data) : this->meta_info_buffer);
+        return; /* the this pointer might dangle here */
     }
+
     if(auto callback{this->callback_abort}; callback)
         callback();
 }
 
+void FFMpegStream::complete_buffer() {
+    std::lock_guard block{this->audio.lock};
+    /* packets left will be decoded by pop_next_segment which completes the last segment then */
+    if(!this->audio.buffered.empty() && !this->audio.decoder)
+        this->audio.buffered.back()->full = true;
+
+    this->end_reached = true;
+}
+
 void FFMpegStream::update_buffer_state(bool lock) {
     if(this->end_reached) return;
 
-    auto buffered_samples{this->buffered_sample_count(lock)};
-    auto buffered_seconds{buffered_samples / this->sample_rate};
+    size_t buffered_bytes{0};
+    auto buffered_samples{this->buffered_sample_count(lock, &buffered_bytes)};
+    /* the buffer is only filled while we're not holding the audio lock */
+    this->update_ready_state(buffered_samples, lock);
+    auto buffered_ms{buffered_samples * 1000 / this->sample_rate};
+
+    /* the global budget might force us to buffer less than we want to */
+    size_t high_ms{this->buffer_state.high_ms}, low_ms{this->buffer_state.low_ms};
+    if(auto provider{FFMpegProvider::instance}; provider) {
+        const auto quota = provider->buffer_budget().update_usage(this, buffered_bytes);
+        if(quota != SIZE_MAX) {
+            /* compressed buffers hold more audio per byte */
+            const auto bytes_per_second = buffered_samples > 0 ? buffered_bytes * this->sample_rate / buffered_samples : this->sample_rate * this->channel_count * sizeof(int16_t);
+            const auto quota_ms = bytes_per_second > 0 ? quota * 1000 / bytes_per_second : 0;
+            if(quota_ms < high_ms) {
+                high_ms = quota_ms;
+                low_ms = std::min(low_ms, high_ms / 2);
+            }
+        }
+    }
 
     {
         std::lock_guard plock{this->process_lock};
-        if(!this->process_handle) return;
+        if(!this->process_handle) {
+            /* the tail of the buffer has been dropped, a new stream has to continue behind our audio */
+            if(this->buffer_state.trimmed && buffered_ms <= low_ms)
+                this->buffer_state.refill_requested = true;
+            return;
+        }
 
-        if(buffered_seconds > 20 && this->process_handle->buffering) {
+        if(buffered_ms > high_ms && this->process_handle->buffering) {
             log::log(log::debug, "[FFMPEG][" + to_string(this) + "] Stop buffering");
             this->process_handle->disable_buffering();
         }
 
-        if(buffered_seconds < 10 && !this->process_handle->buffering) {
+        if(buffered_ms < low_ms && !this->process_handle->buffering) {
             log::log(log::debug, "[FFMPEG][" + to_string(this) + "] Start buffering");
             this->process_handle->enable_buffering();
         }
     }
 }
 
-size_t FFMpegStream::buffered_sample_count(bool lock) {
+void FFMpegStream::enforce_buffer_budget() {
+    auto provider = FFMpegProvider::instance;
+    if(!provider) return;
+
+    size_t dropped_samples{0};
+    {
+        std::lock_guard block{this->audio.lock};
+
+        size_t buffered_bytes{0};
+        (void) this->buffered_sample_count(false, &buffered_bytes);
+
+        /* the process will exit anyways, the remaining audio fits into the high watermark */
+        if(!this->end_reached) {
+            const auto target = provider->buffer_budget().trim_target(this, buffered_bytes);
+            if(target != SIZE_MAX)
+                dropped_samples = this->trim_buffered(target);
+        }
+    }
+
+    if(dropped_samples == 0) {
+        std::lock_guard plock{this->process_lock};
+        if(this->process_handle)
+            this->process_handle->schedule_timer(std::chrono::system_clock::now() + kBudgetCheckInterval);
+        return;
+    }
+
+    log::log(log::debug, "[FFMPEG][" + to_string(this) + "] Stream exceeded its idle buffer quota. Dropped " + std::to_string(dropped_samples * 1000 / this->sample_rate) + "ms of buffered audio.");
+
+    /* the dropped audio will be fetched again by a new stream, starting at current_buffer_index() */
+    this->buffer_state.trimmed = true;
+    this->stop_process();
+    this->update_buffer_state(true);
+}
+
+size_t FFMpegStream::trim_buffered(size_t max_bytes) {
+    auto& buffered = this->audio.buffered;
+    auto& compressed = this->audio.compressed;
+    auto& packets = this->audio.packets;
+
+    size_t memory{0}, dropped{0};
+    (void) this->buffered_sample_count(false, &memory);
+
+    /* logical order: buffered[0, compressed_index), compressed, buffered[compressed_index, end), packets */
+    while(memory > max_bytes && !packets.empty()) {
+        memory -= packets.back()->maxLength;
+        dropped += packets.back()->sampleCount;
+        packets.pop_back();
+    }
+
+    const auto drop_buffered = [&]{
+        const auto& segment = buffered.back();
+        memory -= segment->maxSegmentLength * segment->channels * sizeof(int16_t);
+        dropped += segment->segmentLength;
+        buffered.pop_back();
+    };
+
+    if(!compressed.empty()) {
+        while(memory > max_bytes && buffered.size() > this->audio.compressed_index)
+            drop_buffered();
+
+        while(memory > max_bytes && !compressed.empty()) {
+            memory -= compressed.back().data.size();
+            dropped += compressed.back().sample_count;
+            compressed.pop_back();
+        }
+    }
+
+    /* the front segment might have been partially returned already */
+    while(memory > max_bytes && buffered.size() > 1)
+        drop_buffered();
+
+    if(dropped > 0) {
+        /* the read targets are gone, the process will not write any more data */
+        this->audio.overhead_index = 0;
+        this->audio.spare.clear();
+        this->audio.read_target = nullptr;
+    }
+    return dropped;
+}
+
+void FFMpegStream::update_ready_state(size_t buffered_samples, bool added) {
+    callback_ready_t callback{};
+    {
+        /* threshold and callback are replaced together */
+        std::lock_guard rlock{this->ready_state.lock};
+        if(buffered_samples < this->ready_state.threshold) {
+            this->ready_state.signalled = false;
+            return;
+        }
+
+        if(!added || this->ready_state.signalled.exchange(true))
+            return;
+
+        callback = this->ready_state.callback;
+    }
+    if(callback)
+        callback();
+}
+
+void FFMpegStream::ready_callback(callback_ready_t callback, size_t threshold) {
+    {
+        std::lock_guard rlock{this->ready_state.lock};
+        this->ready_state.callback = std::move(callback);
+        this->ready_state.threshold = threshold > 0 ? threshold : this->frame_sample_count_.load();
+        this->ready_state.signalled = false;
+    }
+
+    /* we might have enough data buffered already */
+    this->update_ready_state(this->buffered_sample_count(true), true);
+}
+
+void FFMpegStream::buffer_watermarks(const FFMpegBufferWatermarks &watermarks) {
+    this->buffer_state.low_ms = watermarks.low_ms;
+    this->buffer_state.high_ms = std::max(watermarks.low_ms, watermarks.high_ms);
+}
+
+music::FFMpegBufferWatermarks FFMpegStream::buffer_watermarks() const {
+    return FFMpegBufferWatermarks{this->buffer_state.low_ms, this->buffer_state.high_ms};
+}
+
+/* ffmpeg reports the speed like "1.01x", " 124x" or "N/A" */
+void FFMpegStream::adapt_buffer_speed(const std::string &speed_property) {
+    if(this->url_type != FFMPEGURLType::FILE || this->buffer_state.speed_adapted)
+        return;
+
+    const auto config = FFMpegProvider::instance->configuration();
+    if(!config->buffering.adaptive)
+        return;
+
+    double speed;
+    if(sscanf(speed_property.c_str(), "%lfx", &speed) != 1)
+        return;
+
+    if(speed < config->buffering.adaptive_fast_speed)
+        return;
+
+    /* we could refill the buffer way faster than it gets played back, no need to hold much data */
+    this->buffer_state.speed_adapted = true;
+    this->buffer_state.low_ms = std::min((size_t) this->buffer_state.low_ms, config->buffering.adaptive_min.low_ms);
+    this->buffer_state.high_ms = std::min((size_t) this->buffer_state.high_ms, config->buffering.adaptive_min.high_ms);
+    log::log(log::debug, "[FFMPEG][" + to_string(this) + "] Decoding speed is " + std::to_string(speed) + "x. Lowering buffer watermarks to " + std::to_string(this->buffer_state.low_ms) + "ms/" + std::to_string(this->buffer_state.high_ms) + "ms");
+}
+
+void FFMpegStream::adapt_buffer_underrun() {
+    if(this->url_type != FFMPEGURLType::STREAM)
+        return;
+
+    const auto config = FFMpegProvider::instance->configuration();
+    if(!config->buffering.adaptive)
+        return;
+
+    const auto step = config->buffering.adaptive_underrun_step_ms;
+    this->buffer_state.low_ms = std::min(this->buffer_state.low_ms + step, config->buffering.adaptive_max.low_ms);
+    this->buffer_state.high_ms = std::min(this->buffer_state.high_ms + step, config->buffering.adaptive_max.high_ms);
+    log::log(log::debug, "[FFMPEG][" + to_string(this) + "] Buffer underrun. Raising buffer watermarks to " + std::to_string(this->buffer_state.low_ms) + "ms/" + std::to_string(this->buffer_state.high_ms) + "ms");
+}
+
+size_t FFMpegStream::buffered_sample_count(bool lock, size_t* memory_bytes) {
     if(lock) {
         std::lock_guard block{this->audio.lock};
-        return this->buffered_sample_count(false);
+        return this->buffered_sample_count(false, memory_bytes);
     }
 
-    size_t result{0};
-    for(auto& buffer : this->audio.buffered)
+    size_t result{0}, memory{0};
+    for(auto& buffer : this->audio.buffered) {
         result += buffer->segmentLength;
+        memory += buffer->maxSegmentLength * buffer->channels * sizeof(int16_t);
+    }
+    result -= std::min(result, this->audio.front_offset);
+
+    for(auto& buffer : this->audio.compressed) {
+        result += buffer.sample_count;
+        memory += buffer.data.size();
+    }
+
+    for(auto& packet : this->audio.packets) {
+        result += packet->sampleCount;
+        memory += packet->maxLength;
+    }
+
+    if(memory_bytes)
+        *memory_bytes = memory;
     return result;
 }
 
+void FFMpegStream::decode_packets() {
+    if(!this->audio.decoder)
+        return;
+
+    /* decode just enough packets to complete the next segment */
+    auto& buffered = this->audio.buffered;
+    while(!this->audio.packets.empty() && (buffered.empty() || !buffered.front()->full)) {
+        auto packet = std::move(this->audio.packets.front());
+        this->audio.packets.pop_front();
+
+        const auto max_frames = this->audio.decode_buffer.size() / this->channel_count;
+        const auto result = this->audio.decoder_library->opus_decode(this->audio.decoder, packet->data, (int32_t) packet->length, this->audio.decode_buffer.data(), (int) max_frames, 0);
+        if(result < 0) {
+            log::log(log::trace, "[FFMPEG][" + to_string(this) + "] Failed to decode opus packet: " + this->audio.decoder_library->opus_strerror(result));
+            continue;
+        }
+
+        auto frames = (size_t) result;
+        auto samples = this->audio.decode_buffer.data();
+
+        const auto skip = std::min(frames, this->audio.decode_skip);
+        this->audio.decode_skip -= skip;
+        frames -= skip;
+        samples += skip * this->channel_count;
+
+        while(frames > 0) {
+            if(buffered.empty() || buffered.back()->full)
+                buffered.push_back(SampleSegment::allocate(this->frame_sample_count_, this->channel_count));
+
+            auto& segment = buffered.back();
+            const auto count = std::min(frames, segment->maxSegmentLength - segment->segmentLength);
+            memcpy(segment->segments + segment->segmentLength * this->channel_count, samples, count * this->channel_count * sizeof(int16_t));
+            segment->segmentLength += count;
+            segment->full = segment->segmentLength == segment->maxSegmentLength;
+
+            frames -= count;
+            samples += count * this->channel_count;
+        }
+    }
+
+    if(this->end_reached && this->audio.packets.empty() && !buffered.empty())
+        buffered.back()->full = true;
+}
+
 std::shared_ptr<music::SampleSegment> FFMpegStream::peek_next_segment() {
     std::lock_guard block{this->audio.lock};
+    this->decode_packets();
     return this->audio.buffered.empty() ? nullptr : this->audio.buffered.back();
 }
 
-std::shared_ptr<music::SampleSegment> FFMpegStream::pop_next_segment() {
-    std::lock_guard block{this->audio.lock};
+std::shared_ptr<music::SampleSegment> FFMpegStream::take_next_segment(size_t frame_samples) {
+    this->decode_packets();
+    this->decompress_buffered();
+
     if(this->audio.buffered.empty() || !this->audio.buffered.front()->full)
         return nullptr;
+
+    if(this->audio.buffered.front()->maxSegmentLength != frame_samples || this->audio.front_offset != 0)
+        return this->reframe_buffered(frame_samples);
+
     auto buffer = std::move(this->audio.buffered.front());
     this->audio.buffered.pop_front();
-    this->stream_sample_offset += buffer->segmentLength;
+    if(!this->audio.compressed.empty()) {
+        this->audio.compressed_index--;
+        this->decompress_buffered();
+    }
+    return buffer;
+}
+
+void FFMpegStream::samples_consumed(size_t samples) {
+    if(samples == 0) {
+        this->ready_state.signalled = false;
+        if(!this->end_reached && this->stream_sample_offset > 0 && !this->buffer_state.underrun) {
+            this->buffer_state.underrun = true;
+            this->adapt_buffer_underrun();
+        }
+        return;
+    }
+
+    this->buffer_state.underrun = false;
+    if(auto provider{FFMpegProvider::instance}; provider)
+        provider->buffer_budget().stream_consumed(this);
+    this->stream_sample_offset += samples;
     this->update_buffer_state(false);
+}
+
+std::shared_ptr<music::SampleSegment> FFMpegStream::pop_next_segment() {
+    std::lock_guard block{this->audio.lock};
+    auto buffer = this->take_next_segment(this->frame_sample_count_);
+    this->samples_consumed(buffer ? buffer->segmentLength : 0);
     return buffer;
 }
 
+size_t FFMpegStream::pop_next_segments(size_t max, std::vector<std::shared_ptr<SampleSegment>> &target) {
+    std::lock_guard block{this->audio.lock};
+    const auto frame_samples = this->frame_sample_count_.load();
+
+    size_t count{0}, samples{0};
+    while(count < max) {
+        auto buffer = this->take_next_segment(frame_samples);
+        if(!buffer) break;
+
+        samples += buffer->segmentLength;
+        target.push_back(std::move(buffer));
+        count++;
+    }
+
+    this->samples_consumed(samples);
+    return count;
+}
+
+size_t FFMpegStream::read_samples(int16_t *target, size_t max_frames, bool mix) {
+    std::lock_guard block{this->audio.lock};
+    auto& buffered = this->audio.buffered;
+
+    size_t written{0};
+    while(written < max_frames) {
+        this->decode_packets();
+        this->decompress_buffered();
+        if(buffered.empty())
+            break;
+
+        /* the front segment might still be filled by the reader, its first segmentLength samples are valid already */
+        const auto& segment = buffered.front();
+        const auto frames = std::min(max_frames - written, segment->segmentLength - this->audio.front_offset);
+        write_samples(target + written * this->channel_count, segment->segments + this->audio.front_offset * this->channel_count, frames * this->channel_count, mix);
+        written += frames;
+        this->audio.front_offset += frames;
+
+        if(this->audio.front_offset < segment->segmentLength || !segment->full)
+            break;
+
+        buffered.pop_front();
+        this->audio.front_offset = 0;
+        if(!this->audio.compressed.empty())
+            this->audio.compressed_index--;
+    }
+
+    this->samples_consumed(written);
+    return written;
+}
+
+std::shared_ptr<music::SampleSegment> FFMpegStream::reframe_buffered(size_t frame_samples) {
+    auto& buffered = this->audio.buffered;
+    auto& compressed = this->audio.compressed;
+
+    /* count the samples of the completed segments, decompress more segments if required */
+    size_t available{0}, index{0};
+    bool complete{false}; /* nothing will follow the counted samples */
+    while(available < frame_samples) {
+        if(!compressed.empty() && index == this->audio.compressed_index)
+            this->decompress_next();
+
+        if(index == buffered.size()) {
+            complete = this->end_reached && compressed.empty() && this->audio.packets.empty();
+            break;
+        }
+
+        const auto& segment = buffered[index];
+        if(!segment->full)
+            break;
+
+        available += segment->segmentLength - (index == 0 ? this->audio.front_offset : 0);
+        index++;
+    }
+
+    if(available < frame_samples && (!complete || available == 0))
+        return nullptr;
+
+    auto result = SampleSegment::allocate(frame_samples, this->channel_count);
+    const auto frame_bytes = this->channel_count * sizeof(int16_t);
+    while(result->segmentLength < frame_samples && !buffered.empty() && buffered.front()->full) {
+        const auto& segment = buffered.front();
+        const auto count = std::min(frame_samples - result->segmentLength, segment->segmentLength - this->audio.front_offset);
+        memcpy(result->segments + result->segmentLength * this->channel_count, segment->segments + this->audio.front_offset * this->channel_count, count * frame_bytes);
+        result->segmentLength += count;
+        this->audio.front_offset += count;
+
+        if(this->audio.front_offset == segment->segmentLength) {
+            buffered.pop_front();
+            this->audio.front_offset = 0;
+            if(!compressed.empty())
+                this->audio.compressed_index--;
+        }
+    }
+    result->full = true;
+
+    this->decompress_buffered();
+    return result;
+}
+
+void FFMpegStream::frame_sample_count(size_t samples) {
+    if(samples == 0)
+        return;
+
+    this->frame_sample_count_ = samples;
+}
+
+std::shared_ptr<music::EncodedSegment> FFMpegStream::pop_next_packet() {
+    std::lock_guard block{this->audio.lock};
+    if(this->audio.packets.empty()) {
+        this->ready_state.signalled = false;
+        if(!this->end_reached && this->stream_sample_offset > 0 && !this->buffer_state.underrun) {
+            this->buffer_state.underrun = true;
+            this->adapt_buffer_underrun();
+        }
+        return nullptr;
+    }
+    this->buffer_state.underrun = false;
+    if(auto provider{FFMpegProvider::instance}; provider)
+        provider->buffer_budget().stream_consumed(this);
+
+    auto packet = std::move(this->audio.packets.front());
+    this->audio.packets.pop_front();
+    this->stream_sample_offset += packet->sampleCount;
+    this->update_buffer_state(false);
+    return packet;
+}
+
+void FFMpegStream::seek_position(const FFMpegSeekIndex::Position &position) {
+    this->seek_position_ = position;
+}
+
+void FFMpegStream::output_format(OutputFormat format, bool copy) {
+    this->output_format_ = format;
+    this->output_copy = copy;
+}
+
 music::PlayerUnits FFMpegStream::current_playback_index() {
     return std::chrono::floor<PlayerUnits>(this->stream_seek_offset + std::chrono::microseconds{(int64_t) ((this->stream_sample_offset * 1e6) / this->sample_rate)});
 }
@@ -0,0 +1,288 @@
+#include <poll.h>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <include/teaspeak/MusicPlayer.h>
+#include <providers/shared/libevent.h>
+#include "./FFMpegUringReader.h"
+#include "./FFMpegMusicPlayer.h"
+
+using namespace music;
+using namespace music::player;
+
+/* we don't want to depend on liburing */
+inline int uring_setup(unsigned entries, io_uring_params* params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+inline int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+inline int uring_register(int fd, unsigned opcode, const void* arg, unsigned arg_count) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, arg_count);
+}
+
+FFMpegUringReader* FFMpegUringReader::instance{nullptr};
+
+FFMpegUringReader::FFMpegUringReader(void *event_base) : event_base{event_base} {}
+
+FFMpegUringReader::~FFMpegUringReader() {
+    if(this->event_completion) {
+        libevent::functions->event_del_block(this->event_completion);
+        libevent::functions->event_free(this->event_completion);
+    }
+
+    if(this->ring_fd >= 0)
+        this->cancel_pending();
+
+    if(this->sqes) munmap(this->sqes, this->sqes_size);
+    if(this->cq_ring && this->cq_ring != this->sq_ring) munmap(this->cq_ring, this->cq_ring_size);
+    if(this->sq_ring) munmap(this->sq_ring, this->sq_ring_size);
+
+    if(this->event_fd >= 0) ::close(this->event_fd);
+    if(this->ring_fd >= 0) ::close(this->ring_fd);
+}
+
+bool FFMpegUringReader::initialize(size_t entries, std::string &error) {
+    io_uring_params params{};
+    this->ring_fd = uring_setup((unsigned) entries, &params);
+    if(this->ring_fd < 0) {
+        error = "io_uring_setup failed: " + std::string{strerror(errno)};
+        return false;
+    }
+
+    this->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    this->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const auto single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(single_mmap)
+        this->sq_ring_size = this->cq_ring_size = std::max(this->sq_ring_size, this->cq_ring_size);
+
+    auto ring = mmap(nullptr, this->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ring_fd, IORING_OFF_SQ_RING);
+    if(ring == MAP_FAILED) {
+        error = "failed to map the submission ring: " + std::string{strerror(errno)};
+        return false;
+    }
+    this->sq_ring = ring;
+
+    if(single_mmap) {
+        this->cq_ring = this->sq_ring;
+    } else {
+        ring = mmap(nullptr, this->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ring_fd, IORING_OFF_CQ_RING);
+        if(ring == MAP_FAILED) {
+            error = "failed to map the completion ring: " + std::string{strerror(errno)};
+            return false;
+        }
+        this->cq_ring = ring;
+    }
+
+    this->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    ring = mmap(nullptr, this->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ring_fd, IORING_OFF_SQES);
+    if(ring == MAP_FAILED) {
+        error = "failed to map the submission entries: " + std::string{strerror(errno)};
+        return false;
+    }
+    this->sqes = ring;
+
+    auto sq_base = (char*) this->sq_ring;
+    this->sq_head = (unsigned*) (sq_base + params.sq_off.head);
+    this->sq_tail = (unsigned*) (sq_base + params.sq_off.tail);
+    this->sq_mask = (unsigned*) (sq_base + params.sq_off.ring_mask);
+    this->sq_entries = (unsigned*) (sq_base + params.sq_off.ring_entries);
+    this->sq_array = (unsigned*) (sq_base + params.sq_off.array);
+
+    auto cq_base = (char*) this->cq_ring;
+    this->cq_head = (unsigned*) (cq_base + params.cq_off.head);
+    this->cq_tail = (unsigned*) (cq_base + params.cq_off.tail);
+    this->cq_mask = (unsigned*) (cq_base + params.cq_off.ring_mask);
+    this->cqes = cq_base + params.cq_off.cqes;
+
+    this->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(this->event_fd < 0) {
+        error = "failed to create eventfd: " + std::string{strerror(errno)};
+        return false;
+    }
+
+    if(uring_register(this->ring_fd, IORING_REGISTER_EVENTFD, &this->event_fd, 1) != 0) {
+        error = "failed to register eventfd: " + std::string{strerror(errno)};
+        return false;
+    }
+
+    this->event_completion = libevent::functions->event_new(this->event_base, this->event_fd, EV_READ | EV_PERSIST, [](int, short, void* _reader) {
+        auto reader = reinterpret_cast<FFMpegUringReader*>(_reader);
+        reader->process_completions();
+    }, this);
+    libevent::functions->event_add(this->event_completion, nullptr);
+
+    if(!(params.features & IORING_FEAT_FAST_POLL))
+        log::log(log::warn, "[FFMPEG][io_uring] Kernel does not support fast poll. Pending pipe reads will occupy kernel worker threads.");
+    log::log(log::debug, "[FFMPEG][io_uring] Initialized io_uring reader with " + std::to_string(params.sq_entries) + " entries");
+    return true;
+}
+
+bool FFMpegUringReader::submit_read(FFMpegProcessHandle *handle, int fd, const iovec *vectors, size_t vector_count, std::vector<std::shared_ptr<void>> keep_alive, std::string &error) {
+    auto read = std::make_unique<Read>();
+    read->handle = handle;
+    read->vectors.assign(vectors, vectors + vector_count);
+    read->keep_alive = std::move(keep_alive);
+
+    std::lock_guard lock_{this->lock};
+    if(this->ring_fd < 0) {
+        error = "reader not initialized";
+        return false;
+    }
+
+    if(!this->push_entry(IORING_OP_READV, fd, (uintptr_t) read->vectors.data(), (uint32_t) read->vectors.size(), (uintptr_t) &*read)) {
+        error = "submission queue is full";
+        return false;
+    }
+
+    /* reads resubmitted while dispatching completions are submitted at once afterwards */
+    if(!this->processing_completions && !this->submit_entries(error)) {
+        /* the entry is queued already and will be submitted with the next call */
+        log::log(log::warn, "[FFMPEG][io_uring] Failed to submit read: " + error);
+        error.clear();
+    }
+
+    this->handle_reads[handle] = &*read;
+    this->pending[&*read] = std::move(read);
+    return true;
+}
+
+bool FFMpegUringReader::push_entry(uint8_t opcode, int fd, uint64_t address, uint32_t length, uint64_t user_data) {
+    const auto tail = *this->sq_tail;
+    const auto head = __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+    if(tail - head >= *this->sq_entries)
+        return false;
+
+    const auto index = tail & *this->sq_mask;
+    auto entry = &((io_uring_sqe*) this->sqes)[index];
+    memset(entry, 0, sizeof(io_uring_sqe));
+    entry->opcode = opcode;
+    entry->fd = fd;
+    entry->addr = address;
+    entry->len = length;
+    entry->off = (uint64_t) -1; /* pipes don't have an offset */
+    entry->user_data = user_data;
+
+    this->sq_array[index] = index;
+    __atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool FFMpegUringReader::submit_entries(std::string &error) {
+    while(true) {
+        const auto queued = *this->sq_tail - __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+        if(queued == 0)
+            return true;
+
+        if(uring_enter(this->ring_fd, queued, 0, 0) < 0) {
+            if(errno == EINTR)
+                continue;
+
+            error = strerror(errno);
+            return false;
+        }
+    }
+}
+
+void FFMpegUringReader::detach(FFMpegProcessHandle *handle) {
+    std::unique_lock lock_{this->lock};
+    if(auto it = this->handle_reads.find(handle); it != this->handle_reads.end()) {
+        auto read = it->second;
+        read->handle = nullptr;
+        this->handle_reads.erase(it);
+
+        /* the buffers will be kept alive until the kernel reports the cancellation */
+        std::string error{};
+        if(this->push_entry(IORING_OP_ASYNC_CANCEL, -1, (uintptr_t) read, 0, 0))
+            this->submit_entries(error);
+    }
+
+    if(this->dispatching == handle && this->dispatch_thread != std::this_thread::get_id())
+        this->dispatch_cv.wait(lock_, [&]{ return this->dispatching != handle; });
+}
+
+void FFMpegUringReader::process_completions() {
+    uint64_t counter{0};
+    while(::read(this->event_fd, &counter, sizeof(counter)) > 0);
+    this->wakeups_++;
+
+    std::unique_lock lock_{this->lock};
+    this->processing_completions = true;
+    while(true) {
+        const auto head = *this->cq_head;
+        const auto tail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+        if(head == tail)
+            break;
+
+        const auto completion = ((io_uring_cqe*) this->cqes)[head & *this->cq_mask];
+        __atomic_store_n(this->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        /* cancel requests don't have any user data */
+        auto it = this->pending.find((Read*) (uintptr_t) completion.user_data);
+        if(it == this->pending.end())
+            continue;
+
+        /* the buffers must stay alive until the handle has committed the read */
+        auto read = std::move(it->second);
+        this->pending.erase(it);
+
+        auto handle = read->handle;
+        if(!handle)
+            continue;
+
+        this->handle_reads.erase(handle);
+        this->dispatching = handle;
+        this->dispatch_thread = std::this_thread::get_id();
+        lock_.unlock();
+
+        handle->callback_uring_read(completion.res);
+        read = nullptr;
+
+        lock_.lock();
+        this->dispatching = nullptr;
+        this->dispatch_cv.notify_all();
+    }
+    this->processing_completions = false;
+
+    std::string error{};
+    if(!this->submit_entries(error))
+        log::log(log::warn, "[FFMPEG][io_uring] Failed to submit reads: " + error);
+}
+
+void FFMpegUringReader::cancel_pending() {
+    {
+        std::lock_guard lock_{this->lock};
+        this->handle_reads.clear();
+        for(auto& [address, read] : this->pending) {
+            read->handle = nullptr;
+            (void) this->push_entry(IORING_OP_ASYNC_CANCEL, -1, (uintptr_t) address, 0, 0);
+        }
+
+        std::string error{};
+        this->submit_entries(error);
+    }
+
+    /* the kernel might still write into the buffers until the cancellation has been completed */
+    for(size_t attempt{0}; attempt < 20; attempt++) {
+        {
+            std::lock_guard lock_{this->lock};
+            if(this->pending.empty())
+                return;
+        }
+
+        pollfd poll_fd{this->event_fd, POLLIN, 0};
+        poll(&poll_fd, 1, 100);
+        this->process_completions();
+    }
+
+    std::lock_guard lock_{this->lock};
+    log::log(log::warn, "[FFMPEG][io_uring] " + std::to_string(this->pending.size()) + " reads have not been cancelled. Leaking their buffers.");
+    for(auto& [address, read] : this->pending)
+        (void) read.release();
+    this->pending.clear();
+}
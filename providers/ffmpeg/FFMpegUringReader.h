@@ -0,0 +1,95 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include <cstdint>
+#include <sys/uio.h>
+
+namespace music::player {
+    struct FFMpegProcessHandle;
+
+    /*
+     * io_uring based reader for the ffmpeg output pipes (see pipes.io_backend).
+     * Scatter reads get submitted straight into the segment memory of the streams. The completions are signalled via an eventfd
+     * which is part of the provider event loop, so one wakeup handles the completed reads of all streams without any read syscall.
+     */
+    class FFMpegUringReader {
+        public:
+            /* nullptr if the libevent backend is used */
+            static FFMpegUringReader* instance;
+
+            explicit FFMpegUringReader(void* /* event base */);
+            /* cancels all pending reads. Must be called while the event loop is still alive. */
+            ~FFMpegUringReader();
+
+            bool initialize(size_t /* entries */, std::string& /* error */);
+
+            /* submits one read for the handle. The buffers must stay valid until the read completed, hence keep alive. */
+            bool submit_read(FFMpegProcessHandle* /* handle */, int /* fd */, const iovec* /* vectors */, size_t /* vector count */, std::vector<std::shared_ptr<void>> /* keep alive */, std::string& /* error */);
+
+            /*
+             * The completion of a pending read of the handle will be dropped.
+             * If the completion is currently dispatched within another thread we'll wait for it.
+             */
+            void detach(FFMpegProcessHandle* /* handle */);
+
+            [[nodiscard]] inline size_t wakeups() const { return this->wakeups_; }
+        private:
+            struct Read {
+                FFMpegProcessHandle* handle{nullptr}; /* nullptr if detached */
+                std::vector<iovec> vectors{};
+                std::vector<std::shared_ptr<void>> keep_alive{};
+            };
+
+            /* call only when lock is acquired */
+            [[nodiscard]] bool push_entry(uint8_t /* opcode */, int /* fd */, uint64_t /* address */, uint32_t /* length */, uint64_t /* user data */);
+            /* call only when lock is acquired */
+            bool submit_entries(std::string& /* error */);
+
+            void process_completions();
+            void cancel_pending();
+
+            void* const event_base;
+            void* event_completion{nullptr};
+
+            int ring_fd{-1};
+            int event_fd{-1};
+
+            /* mapped ring memory */
+            void* sq_ring{nullptr};
+            size_t sq_ring_size{0};
+            void* cq_ring{nullptr};
+            size_t cq_ring_size{0};
+            void* sqes{nullptr};
+            size_t sqes_size{0};
+
+            unsigned* sq_head{nullptr};
+            unsigned* sq_tail{nullptr};
+            unsigned* sq_mask{nullptr};
+            unsigned* sq_entries{nullptr};
+            unsigned* sq_array{nullptr};
+
+            unsigned* cq_head{nullptr};
+            unsigned* cq_tail{nullptr};
+            unsigned* cq_mask{nullptr};
+            void* cqes{nullptr};
+
+            std::mutex lock{};
+            std::map<Read*, std::unique_ptr<Read>> pending{};
+            std::map<FFMpegProcessHandle*, Read*> handle_reads{};
+
+            /* the handle of which the completion gets currently dispatched */
+            FFMpegProcessHandle* dispatching{nullptr};
+            std::thread::id dispatch_thread{};
+            bool processing_completions{false}; /* defer the submission of new reads until all completions have been dispatched */
+            std::condition_variable dispatch_cv{};
+
+            std::atomic<size_t> wakeups_{0};
+    };
+}
@@ -0,0 +1,303 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <algorithm>
+#include <experimental/filesystem>
+#include "./MappedMusicPlayer.h"
+
+namespace fs = std::experimental::filesystem;
+
+using namespace music;
+using namespace music::player;
+
+MappedMusicPlayer::Mapping::~Mapping() {
+    if(this->address)
+        munmap(this->address, this->length);
+}
+
+std::shared_ptr<MappedMusicPlayer> MappedMusicPlayer::open(const std::string &path, size_t raw_channel_count, size_t max_convert_size, FFMpegMusicPlayer::FallbackStreamInfo fallback, std::string &error) {
+    auto extension = fs::u8path(path).extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    const auto raw = extension == ".pcm" || extension == ".raw" || extension == ".s16le";
+
+    WavFormat format{};
+    {
+        auto file = fopen(path.c_str(), "rb");
+        if(!file) {
+            error = "failed to open file";
+            return nullptr;
+        }
+
+        if(raw) {
+            fseeko(file, 0, SEEK_END);
+            format.sample_rate = 48000;
+            format.channels = raw_channel_count;
+            format.bits = 16;
+            format.block_align = raw_channel_count * sizeof(int16_t);
+            format.data_size = (uint64_t) ftello(file);
+        } else if(!parse_wav_header(file, format, error)) {
+            fclose(file);
+            return nullptr;
+        }
+        fclose(file);
+    }
+
+    if(format.channels < 1 || format.channels > 2) {
+        error = "unsupported channel count";
+        return nullptr;
+    }
+
+    const auto matching = format.sample_rate == 48000 && format.bits == 16 && !format.floating && format.data_offset % sizeof(int16_t) == 0;
+    if(!matching) {
+        /* estimate with the maximal output channel count */
+        const auto converted_size = format.data_size / format.block_align * 48000 / format.sample_rate * 2 * sizeof(int16_t);
+        if(converted_size > max_convert_size) {
+            error = "file is too large to be converted in memory";
+            return nullptr;
+        }
+    }
+
+    const auto file_descriptor = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(file_descriptor < 0) {
+        error = "failed to open file: " + std::string{strerror(errno)};
+        return nullptr;
+    }
+
+    return std::make_shared<MappedMusicPlayer>(path, file_descriptor, format, std::move(fallback));
+}
+
+MappedMusicPlayer::MappedMusicPlayer(std::string path, int file_descriptor, WavFormat format, FFMpegMusicPlayer::FallbackStreamInfo fallback)
+    : path_{std::move(path)}, fallback_info{std::move(fallback)}, file_descriptor{file_descriptor}, format{format} {
+    this->_preferredSampleCount = 960;
+}
+
+MappedMusicPlayer::~MappedMusicPlayer() {
+    if(this->file_descriptor >= 0)
+        ::close(this->file_descriptor);
+}
+
+bool MappedMusicPlayer::initialize(size_t channel) {
+    AbstractMusicPlayer::initialize(channel);
+    const auto channels = this->_channelCount > 0 ? this->_channelCount : 2;
+
+    std::lock_guard lock_{this->lock};
+    if(!this->mapping) {
+        const auto matching = this->format.sample_rate == 48000 && this->format.bits == 16 && !this->format.floating &&
+                this->format.channels == channels && this->format.data_offset % sizeof(int16_t) == 0;
+
+        std::string error{};
+        if((!matching && !this->convert(channels, error)) || !this->map(error)) {
+            this->apply_error(error);
+            return false;
+        }
+
+        log::log(log::debug, "[FFMPEG] Playing " + this->path_ + " from a memory mapping" + (matching ? "" : " (converted)"));
+    }
+
+    this->dispatchEvent(MusicEvent::EVENT_INFO_UPDATE);
+    return true;
+}
+
+bool MappedMusicPlayer::convert(size_t channels, std::string &error) {
+    auto decoder = open_pcm_decoder(this->path_, this->format, error);
+    if(!decoder)
+        return false;
+
+    NativeStream stream{std::move(decoder), this->sampleRate(), channels};
+    const auto frame_size = channels * sizeof(int16_t);
+    const auto expected_frames = stream.length();
+
+    const auto memory = memfd_create("music_converted", MFD_CLOEXEC);
+    if(memory < 0) {
+        error = "failed to create memory file: " + std::string{strerror(errno)};
+        return false;
+    }
+
+    uint64_t written{0};
+    if(expected_frames > 0) {
+        if(ftruncate(memory, (off_t) (expected_frames * frame_size)) != 0) {
+            error = "failed to resize memory file: " + std::string{strerror(errno)};
+            ::close(memory);
+            return false;
+        }
+
+        auto address = mmap(nullptr, expected_frames * frame_size, PROT_READ | PROT_WRITE, MAP_SHARED, memory, 0);
+        if(address == MAP_FAILED) {
+            error = "failed to map memory file: " + std::string{strerror(errno)};
+            ::close(memory);
+            return false;
+        }
+
+        /* decode straight into the memory file */
+        auto target = (int16_t*) address;
+        while(written < expected_frames) {
+            const auto read = stream.read(target + written * channels, (size_t) std::min(expected_frames - written, (uint64_t) 48000));
+            if(read == 0)
+                break;
+            written += read;
+        }
+        munmap(address, expected_frames * frame_size);
+
+        if(const auto& decoder_error = stream.decoder().error(); !decoder_error.empty())
+            log::log(log::warn, "[FFMPEG] Failed to convert " + this->path_ + " completely: " + decoder_error);
+    }
+
+    ::close(this->file_descriptor);
+    this->file_descriptor = memory;
+
+    this->format = WavFormat{};
+    this->format.sample_rate = this->sampleRate();
+    this->format.channels = channels;
+    this->format.bits = 16;
+    this->format.block_align = frame_size;
+    this->format.data_size = written * frame_size;
+    return true;
+}
+
+uint64_t MappedMusicPlayer::file_frames(uint64_t frames) {
+    struct stat info{};
+    if(fstat(this->file_descriptor, &info) != 0 || (uint64_t) info.st_size <= this->format.data_offset)
+        return 0;
+
+    return std::min(frames, ((uint64_t) info.st_size - this->format.data_offset) / this->format.block_align);
+}
+
+bool MappedMusicPlayer::map(std::string &error) {
+    auto new_mapping = std::make_shared<Mapping>();
+
+    /* the file might have been truncated since we've parsed its header */
+    const auto frame_count = this->file_frames(this->format.data_size / this->format.block_align);
+    if(frame_count > 0) {
+        /* mmap requires a page aligned offset */
+        const auto page_size = (uint64_t) sysconf(_SC_PAGESIZE);
+        const auto map_offset = this->format.data_offset - this->format.data_offset % page_size;
+        new_mapping->length = (size_t) (this->format.data_offset - map_offset + frame_count * this->format.block_align);
+
+        auto address = mmap(nullptr, new_mapping->length, PROT_READ | PROT_WRITE, MAP_PRIVATE, this->file_descriptor, (off_t) map_offset);
+        if(address == MAP_FAILED) {
+            error = "failed to map file: " + std::string{strerror(errno)};
+            return false;
+        }
+
+        madvise(address, new_mapping->length, MADV_SEQUENTIAL);
+        new_mapping->address = address;
+        new_mapping->samples = (int16_t*) ((char*) address + (this->format.data_offset - map_offset));
+    }
+
+    this->mapping = std::move(new_mapping);
+    this->frame_count = frame_count;
+    return true;
+}
+
+void MappedMusicPlayer::stop() {
+    {
+        std::lock_guard lock_{this->lock};
+        this->position = 0;
+        this->end_notified = false;
+
+        std::string error{};
+        if(this->mapping && !this->map(error))
+            log::log(log::warn, "[FFMPEG] Failed to remap " + this->path_ + ": " + error);
+    }
+
+    AbstractMusicPlayer::stop();
+}
+
+bool MappedMusicPlayer::finished() {
+    std::lock_guard lock_{this->lock};
+    return !this->mapping || this->position >= this->frame_count;
+}
+
+void MappedMusicPlayer::seek(PlayerUnits target) {
+    std::lock_guard lock_{this->lock};
+    if(!this->mapping) return;
+
+    if(target.count() < 0)
+        target = PlayerUnits{0};
+
+    this->position = std::min((uint64_t) target.count() * this->sampleRate() / 1000, this->frame_count);
+    this->end_notified = false;
+
+    /* drop any sample modifications done by the consumer */
+    std::string error{};
+    if(!this->map(error))
+        log::log(log::warn, "[FFMPEG] Failed to remap " + this->path_ + ": " + error);
+}
+
+void MappedMusicPlayer::forward(const PlayerUnits &duration) {
+    this->seek(this->currentIndex() + duration);
+}
+
+void MappedMusicPlayer::rewind(const PlayerUnits &duration) {
+    this->seek(this->currentIndex() - duration);
+}
+
+PlayerUnits MappedMusicPlayer::length() {
+    std::lock_guard lock_{this->lock};
+    return PlayerUnits{this->frame_count * 1000 / this->sampleRate()};
+}
+
+PlayerUnits MappedMusicPlayer::currentIndex() {
+    std::lock_guard lock_{this->lock};
+    return PlayerUnits{this->position * 1000 / this->sampleRate()};
+}
+
+PlayerUnits MappedMusicPlayer::bufferedUntil() {
+    /* everything is available locally */
+    return this->length();
+}
+
+std::shared_ptr<SampleSegment> MappedMusicPlayer::segment_at(uint64_t frame) {
+    if(!this->mapping || frame >= this->frame_count)
+        return nullptr;
+
+    /* pages behind the end of a truncated file raise SIGBUS instead of reading zeros */
+    if(const auto available{this->file_frames(this->frame_count)}; available < this->frame_count) {
+        log::log(log::warn, "[FFMPEG] " + this->path_ + " has been truncated while playing. Stopping at " + std::to_string(available * 1000 / this->sampleRate()) + "ms.");
+        this->frame_count = available;
+        if(frame >= this->frame_count)
+            return nullptr;
+    }
+
+    const auto channels = this->format.channels;
+    const auto frames = (size_t) std::min((uint64_t) this->_preferredSampleCount, this->frame_count - frame);
+
+    auto segment = std::shared_ptr<SampleSegment>(new SampleSegment{this->mapping->samples + frame * channels, frames, channels}, [mapping = this->mapping](SampleSegment* segment) {
+        delete segment;
+    });
+    segment->segmentLength = frames;
+    segment->full = true;
+    return segment;
+}
+
+std::shared_ptr<SampleSegment> MappedMusicPlayer::peekNextSegment() {
+    std::lock_guard lock_{this->lock};
+    return this->segment_at(this->position);
+}
+
+std::shared_ptr<SampleSegment> MappedMusicPlayer::popNextSegment() {
+    if(this->state() == PlayerState::STATE_STOPPED || this->state() == PlayerState::STATE_UNINIZALISIZED)
+        return nullptr;
+
+    std::unique_lock lock_{this->lock};
+    auto segment = this->segment_at(this->position);
+    if(segment) {
+        this->position += segment->segmentLength;
+    } else if(this->mapping && !std::exchange(this->end_notified, true)) {
+        lock_.unlock();
+        this->dispatchEvent(MusicEvent::EVENT_END);
+    }
+    return segment;
+}
+
+std::string MappedMusicPlayer::songTitle() {
+    if(!this->fallback_info.title.empty())
+        return this->fallback_info.title;
+    return file_title(this->path_);
+}
+
+std::string MappedMusicPlayer::songDescription() {
+    return this->fallback_info.description;
+}
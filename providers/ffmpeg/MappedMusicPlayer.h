@@ -0,0 +1,82 @@
+#pragma once
+
+#include <mutex>
+#include "./FFMpegMusicPlayer.h"
+#include "./NativeDecoder.h"
+
+namespace music::player {
+    /*
+     * Plays wav and raw pcm files straight out of a private file mapping.
+     * Sources which already match the output format (48kHz s16le) are handed out as views into the mapping.
+     * Every other sample format gets converted once into an anonymous memory file which is mapped the same way.
+     */
+    class MappedMusicPlayer : public AbstractMusicPlayer {
+        public:
+            /*
+             * Returns nullptr if the file isn't a wav or raw pcm (*.pcm, *.raw, *.s16le) file.
+             * Raw pcm files are expected to be 48kHz s16le with the given channel count.
+             */
+            [[nodiscard]] static std::shared_ptr<MappedMusicPlayer> open(const std::string& /* path */, size_t /* raw channel count */, size_t /* max convert size */, FFMpegMusicPlayer::FallbackStreamInfo /* fallback info */, std::string& /* error */);
+
+            MappedMusicPlayer(std::string /* path */, int /* file descriptor */, WavFormat /* format */, FFMpegMusicPlayer::FallbackStreamInfo /* fallback info */);
+            ~MappedMusicPlayer() override;
+
+            bool initialize(size_t) override;
+
+            void stop() override;
+            bool finished() override;
+
+            void forward(const PlayerUnits&) override;
+            void rewind(const PlayerUnits&) override;
+
+            PlayerUnits length() override;
+            PlayerUnits currentIndex() override;
+            PlayerUnits bufferedUntil() override;
+
+            size_t sampleRate() override { return 48000; }
+
+            std::shared_ptr<SampleSegment> popNextSegment() override;
+            std::shared_ptr<SampleSegment> peekNextSegment() override;
+
+            std::string songTitle() override;
+            std::string songDescription() override;
+            std::deque<std::shared_ptr<Thumbnail>> thumbnails() override { return {}; }
+
+            [[nodiscard]] std::string url() const { return this->path_; }
+        private:
+            struct Mapping {
+                void* address{nullptr};
+                size_t length{0};
+                int16_t* samples{nullptr};
+
+                ~Mapping();
+            };
+
+            /* call only when lock is acquired */
+            [[nodiscard]] bool convert(size_t /* channel count */, std::string& /* error */);
+            [[nodiscard]] bool map(std::string& /* error */);
+            /* the given frame count limited to the frames the file currently contains */
+            [[nodiscard]] uint64_t file_frames(uint64_t /* frames */);
+            [[nodiscard]] std::shared_ptr<SampleSegment> segment_at(uint64_t /* frame */);
+            void seek(PlayerUnits /* target */);
+
+            std::string path_;
+            FFMpegMusicPlayer::FallbackStreamInfo fallback_info;
+
+            std::mutex lock{};
+            int file_descriptor;
+            WavFormat format; /* format of the file descriptor content */
+
+            /*
+             * Segments keep the mapping they're pointing into alive.
+             * The mapping is private, modifications of the samples never reach the file and
+             * get dropped as soon we remap on seek or stop.
+             * The file size gets checked before every segment is handed out since a truncated file
+             * would raise SIGBUS. Segments which have already been handed out aren't covered by that.
+             */
+            std::shared_ptr<Mapping> mapping{};
+            uint64_t frame_count{0};
+            uint64_t position{0};
+            bool end_notified{false};
+    };
+}
@@ -0,0 +1,976 @@
+#include <cmath>
+#include <deque>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <algorithm>
+#include <include/teaspeak/MusicPlayer.h>
+#include <providers/shared/libopus.h>
+#include <providers/shared/libmpg123.h>
+#include <providers/shared/libflac.h>
+#include "./NativeDecoder.h"
+#include "./OggDemuxer.h"
+
+using namespace music;
+using namespace music::player;
+
+inline uint16_t read_le16(const uint8_t* buffer) {
+    return (uint16_t) buffer[0] | (uint16_t) ((uint16_t) buffer[1] << 8U);
+}
+
+inline uint32_t read_le32(const uint8_t* buffer) {
+    return (uint32_t) buffer[0] | ((uint32_t) buffer[1] << 8U) | ((uint32_t) buffer[2] << 16U) | ((uint32_t) buffer[3] << 24U);
+}
+
+inline uint64_t read_le64(const uint8_t* buffer) {
+    return (uint64_t) read_le32(buffer) | ((uint64_t) read_le32(buffer + 4) << 32U);
+}
+
+/* vorbis comment block as used by OpusTags (https://tools.ietf.org/html/rfc7845#section-5.2) */
+inline void parse_vorbis_comments(const uint8_t* buffer, size_t length, std::map<std::string, std::string>& result) {
+    if(length < 4) return;
+    size_t offset = 4 + (size_t) read_le32(buffer); /* vendor string */
+    if(offset + 4 > length) return;
+
+    auto count = read_le32(buffer + offset);
+    offset += 4;
+    while(count-- > 0 && offset + 4 <= length) {
+        const size_t comment_length = read_le32(buffer + offset);
+        offset += 4;
+        if(comment_length > length - offset) return;
+
+        std::string comment{(const char*) buffer + offset, comment_length};
+        offset += comment_length;
+
+        const auto separator = comment.find('=');
+        if(separator == std::string::npos || separator == 0) continue;
+
+        auto key = comment.substr(0, separator);
+        std::transform(key.begin(), key.end(), key.begin(), [](char c) { return (char) tolower(c); });
+        result.emplace(std::move(key), comment.substr(separator + 1));
+    }
+}
+
+inline int16_t clamp_s16(int32_t value) {
+    return (int16_t) std::clamp(value, (int32_t) INT16_MIN, (int32_t) INT16_MAX);
+}
+
+bool music::player::parse_wav_header(FILE *file, WavFormat &result, std::string &error) {
+    uint8_t header[40];
+    if(fread(header, 1, 12, file) != 12 || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+        error = "invalid riff header";
+        return false;
+    }
+
+    bool format_found{false};
+    while(true) {
+        if(fread(header, 1, 8, file) != 8) {
+            error = "missing data chunk";
+            return false;
+        }
+
+        const auto chunk_size = read_le32(header + 4);
+        if(memcmp(header, "fmt ", 4) == 0) {
+            if(chunk_size < 16 || fread(header, 1, std::min(chunk_size, (uint32_t) sizeof(header)), file) != std::min(chunk_size, (uint32_t) sizeof(header))) {
+                error = "invalid fmt chunk";
+                return false;
+            }
+
+            auto format_tag = read_le16(header);
+            result.channels = read_le16(header + 2);
+            result.sample_rate = read_le32(header + 4);
+            result.block_align = read_le16(header + 12);
+            result.bits = read_le16(header + 14);
+            if(format_tag == 0xFFFE && chunk_size >= 26)
+                format_tag = read_le16(header + 24); /* WAVE_FORMAT_EXTENSIBLE, first two bytes of the sub format guid */
+
+            if(format_tag == 3)
+                result.floating = true;
+            else if(format_tag != 1) {
+                error = "unsupported wav format " + std::to_string(format_tag);
+                return false;
+            }
+
+            if(chunk_size > sizeof(header))
+                fseeko(file, chunk_size - sizeof(header), SEEK_CUR);
+            if(chunk_size & 1U)
+                fseeko(file, 1, SEEK_CUR);
+            format_found = true;
+        } else if(memcmp(header, "data", 4) == 0) {
+            if(!format_found) {
+                error = "data chunk before the fmt chunk";
+                return false;
+            }
+
+            result.data_offset = ftello(file);
+            result.data_size = chunk_size;
+
+            fseeko(file, 0, SEEK_END);
+            const auto file_size = (uint64_t) ftello(file);
+            if(chunk_size == 0 || chunk_size == 0xFFFFFFFF || result.data_offset + result.data_size > file_size) {
+                /* streamed or truncated wav files don't know their size */
+                result.data_size = file_size - std::min(file_size, result.data_offset);
+            }
+            break;
+        } else {
+            fseeko(file, chunk_size + (chunk_size & 1U), SEEK_CUR);
+        }
+    }
+
+    const auto valid_bits = result.floating ? (result.bits == 32 || result.bits == 64) : (result.bits == 8 || result.bits == 16 || result.bits == 24 || result.bits == 32);
+    if(!valid_bits || result.channels == 0 || result.sample_rate == 0 || result.block_align != result.channels * result.bits / 8) {
+        error = "unsupported sample format";
+        return false;
+    }
+
+    return true;
+}
+
+namespace decoder {
+    /* https://docs.microsoft.com/en-us/windows/win32/medfound/waveformatex */
+    class WavDecoder : public NativeDecoder {
+        public:
+            ~WavDecoder() override {
+                if(this->file)
+                    fclose(this->file);
+            }
+
+            bool open(const std::string& path, std::string& error) {
+                this->file = fopen(path.c_str(), "rb");
+                if(!this->file) {
+                    error = "failed to open file";
+                    return false;
+                }
+
+                WavFormat format_{};
+                if(!parse_wav_header(this->file, format_, error))
+                    return false;
+
+                this->apply_format(format_);
+                return true;
+            }
+
+            /* headerless pcm data with a known format */
+            bool open(const std::string& path, const WavFormat& format_, std::string& error) {
+                this->file = fopen(path.c_str(), "rb");
+                if(!this->file) {
+                    error = "failed to open file";
+                    return false;
+                }
+
+                this->apply_format(format_);
+                return true;
+            }
+
+            [[nodiscard]] const char* format() const override { return "wav"; }
+            [[nodiscard]] size_t sample_rate() const override { return this->rate; }
+            [[nodiscard]] size_t channel_count() const override { return this->channels; }
+            [[nodiscard]] uint64_t length() const override { return this->frames; }
+
+            [[nodiscard]] size_t read(int16_t *target, size_t max_frames) override {
+                max_frames = (size_t) std::min((uint64_t) max_frames, this->frames - std::min(this->position, this->frames));
+                if(max_frames == 0)
+                    return 0;
+
+                this->buffer.resize(max_frames * this->block_align);
+                const auto read_frames = fread(this->buffer.data(), this->block_align, max_frames, this->file);
+                this->position += read_frames;
+
+                const auto sample_count = read_frames * this->channels;
+                const auto source = this->buffer.data();
+                if(this->floating) {
+                    for(size_t index{0}; index < sample_count; index++) {
+                        double value;
+                        if(this->bits == 32) {
+                            float fvalue;
+                            memcpy(&fvalue, source + index * 4, 4);
+                            value = fvalue;
+                        } else {
+                            memcpy(&value, source + index * 8, 8);
+                        }
+                        target[index] = clamp_s16((int32_t) lrint(value * 32767.0));
+                    }
+                } else {
+                    switch (this->bits) {
+                        case 8:
+                            for(size_t index{0}; index < sample_count; index++)
+                                target[index] = (int16_t) (((int16_t) source[index] - 128) << 8U);
+                            break;
+                        case 16:
+                            memcpy(target, source, sample_count * sizeof(int16_t));
+                            break;
+                        case 24:
+                            for(size_t index{0}; index < sample_count; index++)
+                                target[index] = (int16_t) read_le16(source + index * 3 + 1);
+                            break;
+                        case 32:
+                        default:
+                            for(size_t index{0}; index < sample_count; index++)
+                                target[index] = (int16_t) read_le16(source + index * 4 + 2);
+                            break;
+                    }
+                }
+
+                return read_frames;
+            }
+
+            bool seek(uint64_t frame) override {
+                this->position = std::min(frame, this->frames);
+                return fseeko(this->file, this->data_offset + this->position * this->block_align, SEEK_SET) == 0;
+            }
+
+        private:
+            void apply_format(const WavFormat& format_) {
+                this->rate = format_.sample_rate;
+                this->channels = format_.channels;
+                this->bits = format_.bits;
+                this->block_align = format_.block_align;
+                this->floating = format_.floating;
+                this->data_offset = format_.data_offset;
+                this->data_size = format_.data_size;
+
+                this->frames = this->data_size / this->block_align;
+                fseeko(this->file, this->data_offset, SEEK_SET);
+            }
+
+            FILE* file{nullptr};
+
+            size_t rate{0};
+            size_t channels{0};
+            size_t bits{0};
+            size_t block_align{0};
+            bool floating{false};
+
+            uint64_t data_offset{0};
+            uint64_t data_size{0};
+            uint64_t frames{0};
+            uint64_t position{0};
+
+            std::vector<uint8_t> buffer{};
+    };
+
+    /* https://tools.ietf.org/html/rfc7845 */
+    class OggOpusDecoder : public NativeDecoder {
+        public:
+            /* the opus decoder needs 80ms to converge after a seek */
+            constexpr static uint64_t kSeekPreroll{3840};
+            constexpr static size_t kMaxPacketFrames{5760};
+
+            ~OggOpusDecoder() override {
+                if(this->decoder)
+                    this->library->opus_decoder_destroy(this->decoder);
+                if(this->file)
+                    fclose(this->file);
+            }
+
+            bool open(const std::string& path, std::string& error) {
+                this->file = fopen(path.c_str(), "rb");
+                if(!this->file) {
+                    error = "failed to open file";
+                    return false;
+                }
+
+                if(!this->index_pages(error))
+                    return false;
+
+                /* parse the OpusHead and OpusTags packets */
+                size_t header_packets{0};
+                this->demuxer.header_packet_count = 2;
+                this->demuxer.callback_packet = [&](const uint8_t* packet, size_t length, bool header) {
+                    if(!header)
+                        return;
+
+                    if(header_packets++ == 0) {
+                        this->channels = opus::header_channel_count(packet, length);
+                        if(length >= 19) {
+                            this->pre_skip = read_le16(packet + 10);
+                            this->mapping_family = packet[18];
+                        }
+                    } else if(length >= 8 && memcmp(packet, "OpusTags", 8) == 0) {
+                        parse_vorbis_comments(packet + 8, length - 8, this->tags_);
+                    }
+                };
+
+                while(header_packets < 2 && this->next_page < this->pages.size()) {
+                    if(!this->feed_page()) {
+                        error = "failed to read header pages";
+                        return false;
+                    }
+                }
+
+                if(header_packets < 2 || this->channels == 0 || this->mapping_family != 0) {
+                    error = "unsupported opus header";
+                    return false;
+                }
+
+                this->first_audio_page = this->next_page;
+                int64_t last_granule{0};
+                for(size_t index{this->first_audio_page}; index < this->pages.size(); index++) {
+                    auto& page = this->pages[index];
+                    page.start_granule = last_granule;
+                    if(page.granule >= 0)
+                        last_granule = page.granule;
+                }
+                this->end_granule = last_granule;
+
+                int error_code{0};
+                this->decoder = this->library->opus_decoder_create(48000, (int) this->channels, &error_code);
+                if(!this->decoder || error_code != OPUS_OK) {
+                    error = std::string{"failed to create opus decoder: "} + this->library->opus_strerror(error_code);
+                    return false;
+                }
+
+                this->demuxer.callback_packet = [&](const uint8_t* packet, size_t length, bool) {
+                    this->packets.emplace_back(packet, packet + length);
+                };
+                this->pcm.resize(kMaxPacketFrames * this->channels);
+                return this->seek(0);
+            }
+
+            [[nodiscard]] const char* format() const override { return "opus"; }
+            [[nodiscard]] size_t sample_rate() const override { return 48000; }
+            [[nodiscard]] size_t channel_count() const override { return this->channels; }
+            [[nodiscard]] uint64_t length() const override {
+                return this->end_granule > (int64_t) this->pre_skip ? this->end_granule - this->pre_skip : 0;
+            }
+
+            [[nodiscard]] size_t read(int16_t *target, size_t max_frames) override {
+                size_t written{0};
+                while(written < max_frames) {
+                    if(this->pcm_offset < this->pcm_length) {
+                        const auto skip = std::min((uint64_t) (this->pcm_length - this->pcm_offset), this->skip_frames);
+                        if(skip > 0) {
+                            this->pcm_offset += skip;
+                            this->skip_frames -= skip;
+                            continue;
+                        }
+
+                        auto frames = std::min(this->pcm_length - this->pcm_offset, max_frames - written);
+
+                        /* the last page granule position trims the end of the stream */
+                        const auto granule = this->pcm_granule + (int64_t) this->pcm_offset;
+                        if(this->end_granule > 0)
+                            frames = (size_t) std::max((int64_t) 0, std::min((int64_t) frames, this->end_granule - granule));
+                        if(frames == 0)
+                            break;
+
+                        memcpy(target + written * this->channels, this->pcm.data() + this->pcm_offset * this->channels, frames * this->channels * sizeof(int16_t));
+                        this->pcm_offset += frames;
+                        written += frames;
+                        continue;
+                    }
+
+                    if(this->packets.empty()) {
+                        if(this->next_page >= this->pages.size() || !this->feed_page())
+                            break;
+                        continue;
+                    }
+
+                    const auto& packet = this->packets.front();
+                    const auto frames = this->library->opus_decode(this->decoder, packet.data(), (int32_t) packet.size(), this->pcm.data(), kMaxPacketFrames, 0);
+                    this->packets.pop_front();
+                    if(frames < 0) {
+                        this->error_ = std::string{"failed to decode opus packet: "} + this->library->opus_strerror(frames);
+                        break;
+                    }
+
+                    this->pcm_granule += (int64_t) this->pcm_length;
+                    this->pcm_length = (size_t) frames;
+                    this->pcm_offset = 0;
+                }
+
+                return written;
+            }
+
+            bool seek(uint64_t frame) override {
+                const auto target = (int64_t) (frame + this->pre_skip);
+                const auto preroll_target = std::max((int64_t) 0, target - (int64_t) kSeekPreroll);
+
+                /* find the last page which starts a new packet in front of the preroll target */
+                auto page_index = this->first_audio_page;
+                for(size_t index{this->first_audio_page}; index < this->pages.size(); index++) {
+                    const auto& page = this->pages[index];
+                    if(page.start_granule > preroll_target)
+                        break;
+
+                    if(!page.continued)
+                        page_index = index;
+                }
+
+                this->demuxer.reset();
+                this->demuxer.header_packet_count = 0;
+                this->packets.clear();
+                this->library->opus_decoder_ctl(this->decoder, OPUS_RESET_STATE);
+
+                this->next_page = page_index;
+                this->pcm_granule = page_index < this->pages.size() ? this->pages[page_index].start_granule : this->end_granule;
+                this->pcm_offset = 0;
+                this->pcm_length = 0;
+                this->skip_frames = (uint64_t) std::max((int64_t) 0, target - this->pcm_granule);
+                this->error_.clear();
+                return true;
+            }
+
+        private:
+            struct Page {
+                uint64_t offset{0};
+                size_t length{0};
+                int64_t granule{-1}; /* -1 if no packet ends on this page */
+                int64_t start_granule{0}; /* granule position of the first sample of the first packet starting on this page */
+                bool continued{false};
+            };
+
+            bool index_pages(std::string& error) {
+                uint8_t header[27 + 255];
+                uint64_t offset{0};
+                uint32_t serial{0};
+
+                while(true) {
+                    if(fseeko(this->file, offset, SEEK_SET) != 0 || fread(header, 1, 27, this->file) != 27)
+                        break;
+
+                    if(memcmp(header, "OggS", 4) != 0) {
+                        error = "invalid ogg page";
+                        return false;
+                    }
+
+                    const auto segment_count = header[26];
+                    if(fread(header + 27, 1, segment_count, this->file) != segment_count)
+                        break;
+
+                    size_t body_length{0};
+                    for(size_t index{0}; index < segment_count; index++)
+                        body_length += header[27 + index];
+
+                    const auto page_serial = read_le32(header + 14);
+                    if(this->pages.empty()) {
+                        serial = page_serial;
+                    } else if(page_serial != serial) {
+                        error = "multiplexed or chained ogg streams are not supported";
+                        return false;
+                    }
+
+                    auto& page = this->pages.emplace_back();
+                    page.offset = offset;
+                    page.length = 27 + segment_count + body_length;
+                    page.granule = (int64_t) read_le64(header + 6);
+                    page.continued = (header[5] & 0x01U) != 0;
+                    offset += page.length;
+                }
+
+                if(this->pages.empty()) {
+                    error = "missing ogg pages";
+                    return false;
+                }
+                return true;
+            }
+
+            bool feed_page() {
+                const auto& page = this->pages[this->next_page++];
+                this->page_buffer.resize(page.length);
+                if(fseeko(this->file, page.offset, SEEK_SET) != 0 || fread(this->page_buffer.data(), 1, page.length, this->file) != page.length) {
+                    this->error_ = "failed to read ogg page";
+                    return false;
+                }
+
+                if(!this->demuxer.feed(this->page_buffer.data(), this->page_buffer.size())) {
+                    this->error_ = this->demuxer.error();
+                    return false;
+                }
+                return true;
+            }
+
+            FILE* file{nullptr};
+            void* decoder{nullptr};
+
+            size_t channels{0};
+            size_t pre_skip{0};
+            uint8_t mapping_family{0};
+
+            std::vector<Page> pages{};
+            size_t first_audio_page{0};
+            size_t next_page{0};
+            int64_t end_granule{0};
+
+            OggDemuxer demuxer{};
+            std::vector<uint8_t> page_buffer{};
+            std::deque<std::vector<uint8_t>> packets{};
+
+            std::vector<int16_t> pcm{};
+            int64_t pcm_granule{0}; /* granule position of pcm[0] */
+            size_t pcm_offset{0};
+            size_t pcm_length{0};
+            uint64_t skip_frames{0};
+
+            /* keeps the library loaded until the decoder has been destroyed */
+            std::shared_ptr<libopus::function_handle> library{libopus::functions};
+    };
+
+    class Mp3Decoder : public NativeDecoder {
+        public:
+            ~Mp3Decoder() override {
+                if(this->handle) {
+                    this->library->mpg123_close(this->handle);
+                    this->library->mpg123_delete(this->handle);
+                }
+            }
+
+            bool open(const std::string& path, std::string& error) {
+                int error_code{0};
+                this->handle = this->library->mpg123_new(nullptr, &error_code);
+                if(!this->handle) {
+                    error = "failed to create mpg123 handle";
+                    return false;
+                }
+
+                this->library->mpg123_param(this->handle, MPG123_ADD_FLAGS, MPG123_QUIET | MPG123_GAPLESS, 0);
+                if(this->library->mpg123_open(this->handle, path.c_str()) != MPG123_OK) {
+                    error = this->library->mpg123_strerror(this->handle);
+                    return false;
+                }
+
+                long rate_;
+                int channels_, encoding_;
+                if(this->library->mpg123_getformat(this->handle, &rate_, &channels_, &encoding_) != MPG123_OK) {
+                    error = this->library->mpg123_strerror(this->handle);
+                    return false;
+                }
+
+                this->rate = (size_t) rate_;
+                this->channels = (size_t) channels_;
+                this->library->mpg123_format_none(this->handle);
+                this->library->mpg123_format(this->handle, rate_, channels_, MPG123_ENC_SIGNED_16);
+
+                /* the scan is required for an exact length and sample accurate seeking */
+                this->library->mpg123_scan(this->handle);
+                const auto length_ = this->library->mpg123_length(this->handle);
+                this->frames = length_ > 0 ? (uint64_t) length_ : 0;
+                return true;
+            }
+
+            [[nodiscard]] const char* format() const override { return "mp3"; }
+            [[nodiscard]] size_t sample_rate() const override { return this->rate; }
+            [[nodiscard]] size_t channel_count() const override { return this->channels; }
+            [[nodiscard]] uint64_t length() const override { return this->frames; }
+
+            [[nodiscard]] size_t read(int16_t *target, size_t max_frames) override {
+                const auto frame_size = this->channels * sizeof(int16_t);
+                while(true) {
+                    size_t done{0};
+                    const auto result = this->library->mpg123_read(this->handle, target, max_frames * frame_size, &done);
+                    if(done > 0)
+                        return done / frame_size;
+
+                    if(result == MPG123_NEW_FORMAT) {
+                        long rate_;
+                        int channels_, encoding_;
+                        this->library->mpg123_getformat(this->handle, &rate_, &channels_, &encoding_);
+                        if((size_t) rate_ != this->rate || (size_t) channels_ != this->channels) {
+                            this->error_ = "the stream format changed";
+                            return 0;
+                        }
+                        continue;
+                    }
+
+                    if(result != MPG123_OK && result != MPG123_DONE)
+                        this->error_ = this->library->mpg123_strerror(this->handle);
+                    return 0;
+                }
+            }
+
+            bool seek(uint64_t frame) override {
+                if(this->library->mpg123_seek(this->handle, (off_t) frame, SEEK_SET) < 0) {
+                    this->error_ = this->library->mpg123_strerror(this->handle);
+                    return false;
+                }
+                return true;
+            }
+
+        private:
+            void* handle{nullptr};
+
+            size_t rate{0};
+            size_t channels{0};
+            uint64_t frames{0};
+
+            /* keeps the library loaded until the decoder has been destroyed */
+            std::shared_ptr<libmpg123::function_handle> library{libmpg123::functions};
+    };
+
+    class FlacDecoder : public NativeDecoder {
+        public:
+            ~FlacDecoder() override {
+                if(this->decoder) {
+                    this->library->FLAC__stream_decoder_finish(this->decoder);
+                    this->library->FLAC__stream_decoder_delete(this->decoder);
+                }
+            }
+
+            bool open(const std::string& path, std::string& error) {
+                this->decoder = this->library->FLAC__stream_decoder_new();
+                if(!this->decoder) {
+                    error = "failed to create flac decoder";
+                    return false;
+                }
+
+                const auto result = this->library->FLAC__stream_decoder_init_file(this->decoder, path.c_str(), &FlacDecoder::callback_write, &FlacDecoder::callback_metadata, &FlacDecoder::callback_error, this);
+                if(result != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+                    error = "failed to initialize flac decoder (" + std::to_string(result) + ")";
+                    return false;
+                }
+
+                if(!this->library->FLAC__stream_decoder_process_until_end_of_metadata(this->decoder) || this->rate == 0) {
+                    error = "failed to read flac stream info";
+                    return false;
+                }
+
+                if(this->bits < 4 || this->bits > 32) {
+                    error = "unsupported bits per sample";
+                    return false;
+                }
+                return true;
+            }
+
+            [[nodiscard]] const char* format() const override { return "flac"; }
+            [[nodiscard]] size_t sample_rate() const override { return this->rate; }
+            [[nodiscard]] size_t channel_count() const override { return this->channels; }
+            [[nodiscard]] uint64_t length() const override { return this->frames; }
+
+            [[nodiscard]] size_t read(int16_t *target, size_t max_frames) override {
+                while(this->pcm.size() - this->pcm_offset < max_frames * this->channels) {
+                    if(this->library->FLAC__stream_decoder_get_state(this->decoder) == FLAC__STREAM_DECODER_END_OF_STREAM)
+                        break;
+
+                    if(!this->library->FLAC__stream_decoder_process_single(this->decoder)) {
+                        this->error_ = "failed to decode flac frame";
+                        break;
+                    }
+                }
+
+                const auto frames = std::min(max_frames, (this->pcm.size() - this->pcm_offset) / this->channels);
+                memcpy(target, this->pcm.data() + this->pcm_offset, frames * this->channels * sizeof(int16_t));
+                this->pcm_offset += frames * this->channels;
+
+                if(this->pcm_offset == this->pcm.size()) {
+                    this->pcm.clear();
+                    this->pcm_offset = 0;
+                }
+                return frames;
+            }
+
+            bool seek(uint64_t frame) override {
+                this->pcm.clear();
+                this->pcm_offset = 0;
+
+                if(this->frames > 0 && frame >= this->frames)
+                    frame = this->frames - 1;
+
+                if(!this->library->FLAC__stream_decoder_seek_absolute(this->decoder, frame)) {
+                    if(this->library->FLAC__stream_decoder_get_state(this->decoder) == FLAC__STREAM_DECODER_SEEK_ERROR)
+                        this->library->FLAC__stream_decoder_flush(this->decoder);
+
+                    this->error_ = "failed to seek";
+                    return false;
+                }
+                return true;
+            }
+
+        private:
+            static int callback_write(const void*, const libflac::Frame* frame, const int32_t* const buffer[], void* client_data) {
+                auto decoder = (FlacDecoder*) client_data;
+                const auto block_size = frame->header.blocksize;
+                const auto channels = std::min((size_t) frame->header.channels, decoder->channels);
+                const auto shift = (int) frame->header.bits_per_sample - 16;
+
+                auto offset = decoder->pcm.size();
+                decoder->pcm.resize(offset + block_size * decoder->channels);
+                for(size_t sample{0}; sample < block_size; sample++) {
+                    for(size_t channel{0}; channel < channels; channel++) {
+                        const auto value = buffer[channel][sample];
+                        decoder->pcm[offset++] = clamp_s16(shift >= 0 ? value >> shift : value << -shift);
+                    }
+                    offset += decoder->channels - channels;
+                }
+                return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+            }
+
+            static void callback_metadata(const void*, const libflac::StreamMetadata* metadata, void* client_data) {
+                auto decoder = (FlacDecoder*) client_data;
+                if(metadata->type != FLAC__METADATA_TYPE_STREAMINFO)
+                    return;
+
+                decoder->rate = metadata->data.stream_info.sample_rate;
+                decoder->channels = metadata->data.stream_info.channels;
+                decoder->bits = metadata->data.stream_info.bits_per_sample;
+                decoder->frames = metadata->data.stream_info.total_samples;
+            }
+
+            static void callback_error(const void*, int status, void* client_data) {
+                auto decoder = (FlacDecoder*) client_data;
+                decoder->error_ = "flac stream error (" + std::to_string(status) + ")";
+            }
+
+            void* decoder{nullptr};
+
+            size_t rate{0};
+            size_t channels{0};
+            size_t bits{0};
+            uint64_t frames{0};
+
+            std::vector<int16_t> pcm{};
+            size_t pcm_offset{0};
+
+            /* keeps the library loaded until the decoder has been destroyed */
+            std::shared_ptr<libflac::function_handle> library{libflac::functions};
+    };
+}
+
+void player::initialize_native_decoders() {
+    std::string error{};
+    if(!libopus::resolve_functions(error))
+        log::log(log::debug, "[FFMPEG] Native opus decoding unavailable (" + error + ")");
+    if(!libmpg123::resolve_functions(error))
+        log::log(log::debug, "[FFMPEG] Native mp3 decoding unavailable (" + error + ")");
+    if(!libflac::resolve_functions(error))
+        log::log(log::debug, "[FFMPEG] Native flac decoding unavailable (" + error + ")");
+}
+
+void player::finalize_native_decoders() {
+    libopus::release_functions();
+    libmpg123::release_functions();
+    libflac::release_functions();
+}
+
+template <typename decoder_t>
+inline std::unique_ptr<NativeDecoder> open_decoder(const std::string& path, std::string& error) {
+    auto result = std::make_unique<decoder_t>();
+    if(!result->open(path, error))
+        return nullptr;
+    return result;
+}
+
+std::unique_ptr<NativeDecoder> player::open_native_decoder(const std::string &path, std::string &error) {
+    uint8_t header[64]{};
+    size_t header_length;
+    {
+        auto file = fopen(path.c_str(), "rb");
+        if(!file) {
+            error = "failed to open file";
+            return nullptr;
+        }
+
+        header_length = fread(header, 1, sizeof(header), file);
+        fclose(file);
+    }
+
+    std::unique_ptr<NativeDecoder> result{};
+    if(header_length >= 12 && memcmp(header, "RIFF", 4) == 0 && memcmp(header + 8, "WAVE", 4) == 0) {
+        result = open_decoder<decoder::WavDecoder>(path, error);
+    } else if(header_length >= 28 && memcmp(header, "OggS", 4) == 0) {
+        const size_t body_offset = 27 + (size_t) header[26];
+        if(body_offset + 8 > header_length || memcmp(header + body_offset, "OpusHead", 8) != 0) {
+            error = "unsupported ogg codec";
+            return nullptr;
+        }
+
+        if(!libopus::functions) {
+            error = "libopus is not available";
+            return nullptr;
+        }
+        result = open_decoder<decoder::OggOpusDecoder>(path, error);
+    } else if(header_length >= 4 && memcmp(header, "fLaC", 4) == 0) {
+        if(!libflac::functions) {
+            error = "libFLAC is not available";
+            return nullptr;
+        }
+        result = open_decoder<decoder::FlacDecoder>(path, error);
+    } else if(header_length >= 3 && (memcmp(header, "ID3", 3) == 0 || (header[0] == 0xFF && (header[1] & 0xE0U) == 0xE0U && (header[1] & 0x06U) != 0))) {
+        /* frame sync with a layer set (aac adts streams have no layer) */
+        if(!libmpg123::functions) {
+            error = "libmpg123 is not available";
+            return nullptr;
+        }
+        result = open_decoder<decoder::Mp3Decoder>(path, error);
+    } else {
+        error = "unknown format";
+        return nullptr;
+    }
+
+    if(result && (result->channel_count() < 1 || result->channel_count() > 2 || result->sample_rate() == 0)) {
+        error = "unsupported channel count or sample rate";
+        return nullptr;
+    }
+    return result;
+}
+
+std::unique_ptr<NativeDecoder> player::open_pcm_decoder(const std::string &path, const WavFormat &format, std::string &error) {
+    auto result = std::make_unique<decoder::WavDecoder>();
+    if(!result->open(path, format, error))
+        return nullptr;
+    return result;
+}
+
+std::string player::file_title(const std::string &path) {
+    auto name = path.substr(path.find_last_of('/') + 1);
+    if(auto extension{name.find_last_of('.')}; extension != std::string::npos && extension > 0)
+        name = name.substr(0, extension);
+    return name;
+}
+
+/* filter taps used for upsampling. Downsampling widens the filter accordingly. */
+constexpr static size_t kResamplerTaps{32};
+constexpr static size_t kResamplerMaxPhases{1024};
+constexpr static size_t kInputChunkFrames{1024};
+
+NativeStream::NativeStream(std::unique_ptr<NativeDecoder> decoder, size_t sample_rate, size_t channel_count) : sample_rate{sample_rate}, channel_count{channel_count}, decoder_{std::move(decoder)} {
+    const auto divisor = std::gcd(this->decoder_->sample_rate(), sample_rate);
+    this->upsample = sample_rate / divisor;
+    this->downsample = this->decoder_->sample_rate() / divisor;
+
+    if(this->upsample == this->downsample)
+        return;
+
+    if(this->upsample > kResamplerMaxPhases) {
+        /* fall back to the closest supported ratio, the pitch difference is not audible */
+        this->downsample = (size_t) std::max(1.0, std::round((double) this->downsample * kResamplerMaxPhases / this->upsample));
+        this->upsample = kResamplerMaxPhases;
+    }
+
+    const auto cutoff = 0.95 * std::min(1.0, (double) this->upsample / (double) this->downsample);
+    this->filter_taps = (size_t) std::ceil(kResamplerTaps / cutoff / 2) * 2;
+    this->filter.resize(this->upsample * this->filter_taps);
+
+    const auto half_taps = (double) this->filter_taps / 2;
+    for(size_t phase{0}; phase < this->upsample; phase++) {
+        const auto fraction = (double) phase / (double) this->upsample;
+        auto coefficients = this->filter.data() + phase * this->filter_taps;
+
+        double sum{0};
+        for(size_t tap{0}; tap < this->filter_taps; tap++) {
+            const auto distance = fraction + half_taps - 1 - (double) tap;
+            const auto x = cutoff * distance * M_PI;
+            const auto sinc = std::abs(x) < 1e-9 ? 1.0 : std::sin(x) / x;
+            const auto window = std::abs(distance) >= half_taps ? 0.0 : 0.5 * (1 + std::cos(M_PI * distance / half_taps));
+
+            coefficients[tap] = (float) (sinc * window);
+            sum += coefficients[tap];
+        }
+
+        for(size_t tap{0}; tap < this->filter_taps; tap++)
+            coefficients[tap] = (float) (coefficients[tap] / sum);
+    }
+}
+
+NativeStream::~NativeStream() = default;
+
+uint64_t NativeStream::length() const {
+    const auto length = this->decoder_->length();
+    return (length * this->upsample + this->downsample - 1) / this->downsample;
+}
+
+void NativeStream::fill_input(uint64_t frame) {
+    const auto channels = this->decoder_->channel_count();
+    while(!this->input_end && this->input_offset + this->input.size() / channels < frame) {
+        const auto offset = this->input.size();
+        this->input.resize(offset + kInputChunkFrames * channels);
+
+        const auto read = this->decoder_->read(this->input.data() + offset, kInputChunkFrames);
+        this->input.resize(offset + read * channels);
+        if(read == 0)
+            this->input_end = true;
+    }
+}
+
+void NativeStream::convert_channels(const int16_t *source, int16_t *target, size_t frames) const {
+    const auto source_channels = this->decoder_->channel_count();
+    if(source_channels == this->channel_count) {
+        memcpy(target, source, frames * source_channels * sizeof(int16_t));
+    } else if(source_channels == 1) {
+        for(size_t frame{0}; frame < frames; frame++)
+            for(size_t channel{0}; channel < this->channel_count; channel++)
+                target[frame * this->channel_count + channel] = source[frame];
+    } else {
+        /* downmix to mono */
+        for(size_t frame{0}; frame < frames; frame++) {
+            int32_t sum{0};
+            for(size_t channel{0}; channel < source_channels; channel++)
+                sum += source[frame * source_channels + channel];
+            target[frame] = (int16_t) (sum / (int32_t) source_channels);
+        }
+    }
+}
+
+size_t NativeStream::read(int16_t *target, size_t max_frames) {
+    const auto channels = this->decoder_->channel_count();
+    if(this->upsample == this->downsample) {
+        if(channels == this->channel_count) {
+            const auto read = this->decoder_->read(target, max_frames);
+            this->output_index += read;
+            return read;
+        }
+
+        this->input.resize(max_frames * channels);
+        const auto read = this->decoder_->read(this->input.data(), max_frames);
+        this->convert_channels(this->input.data(), target, read);
+        this->output_index += read;
+        return read;
+    }
+
+    const auto half_taps = (int64_t) this->filter_taps / 2;
+    int16_t frame_buffer[8];
+
+    size_t written{0};
+    while(written < max_frames) {
+        const auto position = this->output_index * this->downsample;
+        const auto base = (int64_t) (position / this->upsample);
+        const auto phase = position % this->upsample;
+        const auto first = base - half_taps + 1;
+
+        this->fill_input(base + half_taps + 1);
+        const auto available = (int64_t) (this->input_offset + this->input.size() / channels);
+        if(this->input_end && base >= available)
+            break;
+
+        /* drop samples we'll never use again */
+        if(first > (int64_t) this->input_offset + (int64_t) kInputChunkFrames) {
+            const auto drop = (size_t) (first - (int64_t) this->input_offset);
+            this->input.erase(this->input.begin(), this->input.begin() + drop * channels);
+            this->input_offset += drop;
+        }
+
+        const auto coefficients = this->filter.data() + phase * this->filter_taps;
+        for(size_t channel{0}; channel < channels; channel++) {
+            float sum{0};
+            for(size_t tap{0}; tap < this->filter_taps; tap++) {
+                const auto index = first + (int64_t) tap;
+                if(index < (int64_t) this->input_offset || index >= available)
+                    continue;
+
+                sum += coefficients[tap] * (float) this->input[(index - this->input_offset) * channels + channel];
+            }
+            frame_buffer[channel] = clamp_s16((int32_t) lrintf(sum));
+        }
+
+        this->convert_channels(frame_buffer, target + written * this->channel_count, 1);
+        this->output_index++;
+        written++;
+    }
+
+    return written;
+}
+
+bool NativeStream::seek(uint64_t frame) {
+    this->input.clear();
+    this->input_end = false;
+    this->output_index = frame;
+
+    if(this->upsample == this->downsample) {
+        this->input_offset = frame;
+        return this->decoder_->seek(frame);
+    }
+
+    /* the first output sample requires the input samples in front of it */
+    const auto base = (int64_t) (frame * this->downsample / this->upsample);
+    this->input_offset = (uint64_t) std::max((int64_t) 0, base - (int64_t) this->filter_taps / 2 + 1);
+    return this->decoder_->seek(this->input_offset);
+}
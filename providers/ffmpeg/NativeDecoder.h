@@ -0,0 +1,103 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+
+namespace music::player {
+    /*
+     * In process decoder for local files.
+     * Decoders output interleaved s16 samples with the source channel count and sample rate.
+     */
+    class NativeDecoder {
+        public:
+            virtual ~NativeDecoder() = default;
+
+            [[nodiscard]] virtual const char* format() const = 0;
+            [[nodiscard]] virtual size_t sample_rate() const = 0;
+            [[nodiscard]] virtual size_t channel_count() const = 0;
+            [[nodiscard]] virtual uint64_t length() const = 0; /* in frames, zero if unknown */
+
+            /* returns the amount of frames read. Zero indicates the end of the stream or an error (see error()). */
+            [[nodiscard]] virtual size_t read(int16_t* /* buffer */, size_t /* max frames */) = 0;
+
+            /* sample accurate seek. The next read will return the given frame. */
+            virtual bool seek(uint64_t /* frame */) = 0;
+
+            [[nodiscard]] inline const std::string& error() const { return this->error_; }
+            /* lower case tag names, e.g. "title" or "artist". Empty for formats without tag support. */
+            [[nodiscard]] inline const std::map<std::string, std::string>& tags() const { return this->tags_; }
+        protected:
+            std::string error_{};
+            std::map<std::string, std::string> tags_{};
+    };
+
+    struct WavFormat {
+        size_t sample_rate{0};
+        size_t channels{0};
+        size_t bits{0};
+        size_t block_align{0};
+        bool floating{false};
+
+        uint64_t data_offset{0};
+        uint64_t data_size{0};
+    };
+
+    /* parses the RIFF header and locates the data chunk. The file position is undefined afterwards. */
+    [[nodiscard]] extern bool parse_wav_header(FILE* /* file */, WavFormat& /* result */, std::string& /* error */);
+
+    /* resolves the optional codec libraries. Formats with missing libraries will be played via ffmpeg. */
+    extern void initialize_native_decoders();
+    extern void finalize_native_decoders();
+
+    /* detects the file format by its header. Returns nullptr if the format isn't supported or the file can't be opened. */
+    [[nodiscard]] extern std::unique_ptr<NativeDecoder> open_native_decoder(const std::string& /* path */, std::string& /* error */);
+
+    /* decodes the pcm data of a wav or raw pcm file with an already known format */
+    [[nodiscard]] extern std::unique_ptr<NativeDecoder> open_pcm_decoder(const std::string& /* path */, const WavFormat& /* format */, std::string& /* error */);
+
+    /* title of files without any tags: the file name without its extension */
+    [[nodiscard]] extern std::string file_title(const std::string& /* path */);
+
+    /*
+     * Converts the decoder output to the requested sample rate and channel count.
+     * Resampling uses a windowed sinc polyphase filter.
+     */
+    class NativeStream {
+        public:
+            NativeStream(std::unique_ptr<NativeDecoder> /* decoder */, size_t /* sample rate */, size_t /* channel count */);
+            ~NativeStream();
+
+            [[nodiscard]] inline NativeDecoder& decoder() { return *this->decoder_; }
+
+            /* returns the amount of frames written. Zero indicates the end of the stream. */
+            [[nodiscard]] size_t read(int16_t* /* buffer */, size_t /* max frames */);
+            bool seek(uint64_t /* frame */);
+
+            [[nodiscard]] uint64_t length() const; /* in output frames, zero if unknown */
+            [[nodiscard]] inline uint64_t position() const { return this->output_index; }
+
+            const size_t sample_rate;
+            const size_t channel_count;
+        private:
+            void fill_input(uint64_t /* until frame (exclusive) */);
+            void convert_channels(const int16_t* /* source */, int16_t* /* target */, size_t /* frames */) const;
+
+            std::unique_ptr<NativeDecoder> decoder_;
+
+            /* resampling ratio output/input = upsample / downsample */
+            size_t upsample{1};
+            size_t downsample{1};
+            size_t filter_taps{0};
+            std::vector<float> filter{}; /* upsample phases with filter_taps coefficients each */
+
+            std::vector<int16_t> input{}; /* interleaved with the decoder channel count */
+            uint64_t input_offset{0}; /* frame index of input[0] */
+            bool input_end{false};
+
+            uint64_t output_index{0};
+    };
+}
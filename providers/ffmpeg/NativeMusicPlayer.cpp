@@ -0,0 +1,165 @@
+#include "./NativeMusicPlayer.h"
+
+using namespace music;
+using namespace music::player;
+
+NativeMusicPlayer::NativeMusicPlayer(std::string path, std::unique_ptr<NativeDecoder> decoder, FFMpegMusicPlayer::FallbackStreamInfo fallback)
+    : path_{std::move(path)}, fallback_info{std::move(fallback)}, pending_decoder{std::move(decoder)} {
+    this->_preferredSampleCount = 960;
+}
+
+NativeMusicPlayer::~NativeMusicPlayer() = default;
+
+bool NativeMusicPlayer::initialize(size_t channel) {
+    AbstractMusicPlayer::initialize(channel);
+
+    std::lock_guard lock_{this->lock};
+    if(this->pending_decoder) {
+        log::log(log::debug, "[FFMPEG] Playing " + this->path_ + " with the native " + this->pending_decoder->format() + " decoder");
+        this->stream = std::make_unique<NativeStream>(std::move(this->pending_decoder), this->sampleRate(), this->_channelCount > 0 ? this->_channelCount : 2);
+    }
+
+    if(!this->stream) {
+        this->apply_error("decoder has already been closed");
+        return false;
+    }
+
+    this->dispatchEvent(MusicEvent::EVENT_INFO_UPDATE);
+    return true;
+}
+
+void NativeMusicPlayer::stop() {
+    {
+        std::lock_guard lock_{this->lock};
+        this->peeked_segment = nullptr;
+        this->stream_ended = false;
+        this->end_notified = false;
+        this->decode_error = "";
+        if(this->stream)
+            this->stream->seek(0);
+    }
+
+    AbstractMusicPlayer::stop();
+}
+
+bool NativeMusicPlayer::finished() {
+    std::lock_guard lock_{this->lock};
+    return !this->stream || this->stream_ended;
+}
+
+void NativeMusicPlayer::seek(PlayerUnits target) {
+    std::lock_guard lock_{this->lock};
+    if(!this->stream) return;
+
+    if(target.count() < 0)
+        target = PlayerUnits{0};
+
+    auto frame = (uint64_t) target.count() * this->stream->sample_rate / 1000;
+    if(const auto length = this->stream->length(); length > 0 && frame > length)
+        frame = length;
+
+    this->peeked_segment = nullptr;
+    this->stream_ended = false;
+    this->end_notified = false;
+    this->decode_error = "";
+    if(!this->stream->seek(frame))
+        log::log(log::warn, "[FFMPEG] Failed to seek native stream: " + this->stream->decoder().error());
+}
+
+void NativeMusicPlayer::forward(const PlayerUnits &duration) {
+    this->seek(this->currentIndex() + duration);
+}
+
+void NativeMusicPlayer::rewind(const PlayerUnits &duration) {
+    this->seek(this->currentIndex() - duration);
+}
+
+PlayerUnits NativeMusicPlayer::length() {
+    std::lock_guard lock_{this->lock};
+    if(!this->stream) return PlayerUnits{0};
+
+    return PlayerUnits{this->stream->length() * 1000 / this->stream->sample_rate};
+}
+
+PlayerUnits NativeMusicPlayer::currentIndex() {
+    std::lock_guard lock_{this->lock};
+    if(!this->stream) return PlayerUnits{0};
+
+    auto position = this->stream->position();
+    if(this->peeked_segment)
+        position -= this->peeked_segment->segmentLength;
+    return PlayerUnits{position * 1000 / this->stream->sample_rate};
+}
+
+PlayerUnits NativeMusicPlayer::bufferedUntil() {
+    /* everything is available locally */
+    return this->length();
+}
+
+std::shared_ptr<SampleSegment> NativeMusicPlayer::decode_segment() {
+    if(!this->stream || this->stream_ended)
+        return nullptr;
+
+    auto segment = SampleSegment::allocate(this->_preferredSampleCount, this->stream->channel_count);
+    segment->segmentLength = this->stream->read(segment->segments, segment->maxSegmentLength);
+    if(segment->segmentLength == 0) {
+        this->stream_ended = true;
+        if(const auto& error = this->stream->decoder().error(); !error.empty()) {
+            log::log(log::warn, "[FFMPEG] Native decoder failed: " + error);
+            this->decode_error = error;
+        }
+        return nullptr;
+    }
+
+    segment->full = segment->segmentLength == segment->maxSegmentLength;
+    return segment;
+}
+
+std::shared_ptr<SampleSegment> NativeMusicPlayer::peekNextSegment() {
+    std::lock_guard lock_{this->lock};
+    if(!this->peeked_segment)
+        this->peeked_segment = this->decode_segment();
+
+    return this->peeked_segment;
+}
+
+std::shared_ptr<SampleSegment> NativeMusicPlayer::popNextSegment() {
+    if(this->state() == PlayerState::STATE_STOPPED || this->state() == PlayerState::STATE_UNINIZALISIZED)
+        return nullptr;
+
+    std::unique_lock lock_{this->lock};
+    auto segment = std::exchange(this->peeked_segment, nullptr);
+    if(!segment)
+        segment = this->decode_segment();
+
+    if(!segment && this->stream_ended && !std::exchange(this->end_notified, true)) {
+        auto error = std::exchange(this->decode_error, "");
+        lock_.unlock();
+        if(!error.empty()) {
+            this->apply_error("decoding failed (" + error + ")");
+            this->dispatchEvent(MusicEvent::EVENT_ERROR);
+        } else {
+            this->dispatchEvent(MusicEvent::EVENT_END);
+        }
+    }
+    return segment;
+}
+
+std::string NativeMusicPlayer::songTitle() {
+    {
+        std::lock_guard lock_{this->lock};
+        auto decoder = this->stream ? &this->stream->decoder() : this->pending_decoder.get();
+        if(decoder) {
+            if(auto title{decoder->tags().find("title")}; title != decoder->tags().end() && !title->second.empty())
+                return title->second;
+        }
+    }
+
+    if(!this->fallback_info.title.empty())
+        return this->fallback_info.title;
+    return file_title(this->path_);
+}
+
+std::string NativeMusicPlayer::songDescription() {
+    return this->fallback_info.description;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <mutex>
+#include "./FFMpegMusicPlayer.h"
+#include "./NativeDecoder.h"
+
+namespace music::player {
+    /* plays local files with an in process decoder instead of spawning ffmpeg */
+    class NativeMusicPlayer : public AbstractMusicPlayer {
+        public:
+            NativeMusicPlayer(std::string /* path */, std::unique_ptr<NativeDecoder> /* decoder */, FFMpegMusicPlayer::FallbackStreamInfo /* fallback info */);
+            ~NativeMusicPlayer() override;
+
+            bool initialize(size_t) override;
+
+            void stop() override;
+            bool finished() override;
+
+            void forward(const PlayerUnits&) override;
+            void rewind(const PlayerUnits&) override;
+
+            PlayerUnits length() override;
+            PlayerUnits currentIndex() override;
+            PlayerUnits bufferedUntil() override;
+
+            size_t sampleRate() override { return 48000; }
+
+            std::shared_ptr<SampleSegment> popNextSegment() override;
+            std::shared_ptr<SampleSegment> peekNextSegment() override;
+
+            std::string songTitle() override;
+            std::string songDescription() override;
+            std::deque<std::shared_ptr<Thumbnail>> thumbnails() override { return {}; }
+
+            [[nodiscard]] std::string url() const { return this->path_; }
+        private:
+            /* call only when lock is acquired */
+            [[nodiscard]] std::shared_ptr<SampleSegment> decode_segment();
+            void seek(PlayerUnits /* target */);
+
+            std::string path_;
+            FFMpegMusicPlayer::FallbackStreamInfo fallback_info;
+
+            std::mutex lock{};
+            std::unique_ptr<NativeDecoder> pending_decoder{}; /* the stream will be created as soon we know the channel count */
+            std::unique_ptr<NativeStream> stream{};
+            std::shared_ptr<SampleSegment> peeked_segment{};
+
+            bool stream_ended{false};
+            bool end_notified{false};
+            std::string decode_error{}; /* reported instead of the end */
+    };
+}
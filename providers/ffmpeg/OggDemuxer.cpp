@@ -0,0 +1,159 @@
+#include <cstring>
+#include "./OggDemuxer.h"
+
+using namespace music::player;
+
+/* https://tools.ietf.org/html/rfc3533#section-6 */
+constexpr static size_t kPageHeaderLength{27};
+constexpr static size_t kMaxPacketLength{1024 * 1024};
+
+constexpr static uint8_t kHeaderTypeContinued{0x01};
+
+inline uint32_t read_le32(const uint8_t* buffer) {
+    return (uint32_t) buffer[0] | ((uint32_t) buffer[1] << 8U) | ((uint32_t) buffer[2] << 16U) | ((uint32_t) buffer[3] << 24U);
+}
+
+void OggDemuxer::reset() {
+    this->buffer.clear();
+    this->packet.clear();
+    this->serial_known = false;
+    this->serial = 0;
+    this->packet_index = 0;
+    this->error_.clear();
+}
+
+bool OggDemuxer::feed(const void *data, size_t length) {
+    if(!this->error_.empty())
+        return false;
+
+    this->buffer.insert(this->buffer.end(), (const uint8_t*) data, (const uint8_t*) data + length);
+
+    size_t offset{0};
+    while(this->buffer.size() - offset >= kPageHeaderLength) {
+        const auto page = this->buffer.data() + offset;
+        if(memcmp(page, "OggS", 4) != 0 || page[4] != 0) {
+            this->error_ = "invalid ogg page header";
+            return false;
+        }
+
+        const size_t segment_count = page[26];
+        if(this->buffer.size() - offset < kPageHeaderLength + segment_count)
+            break;
+
+        size_t body_length{0};
+        for(size_t index{0}; index < segment_count; index++)
+            body_length += page[kPageHeaderLength + index];
+
+        const auto page_length = kPageHeaderLength + segment_count + body_length;
+        if(this->buffer.size() - offset < page_length)
+            break;
+
+        if(!this->parse_page(page, kPageHeaderLength + segment_count))
+            return false;
+
+        offset += page_length;
+    }
+
+    this->buffer.erase(this->buffer.begin(), this->buffer.begin() + offset);
+    return true;
+}
+
+bool OggDemuxer::parse_page(const uint8_t *page, size_t header_length) {
+    const auto header_type = page[5];
+    const auto serial_number = read_le32(page + 14);
+
+    if(!this->serial_known) {
+        this->serial_known = true;
+        this->serial = serial_number;
+    } else if(this->serial != serial_number) {
+        /* we're only interested within the first logical stream */
+        return true;
+    }
+
+    if(!(header_type & kHeaderTypeContinued))
+        this->packet.clear(); /* the packet hasn't been finished, but the next page does not continue it */
+
+    const auto segment_count = page[26];
+    auto body = page + header_length;
+    for(size_t index{0}; index < segment_count; index++) {
+        const auto segment_length = page[kPageHeaderLength + index];
+        this->packet.insert(this->packet.end(), body, body + segment_length);
+        body += segment_length;
+
+        if(this->packet.size() > kMaxPacketLength) {
+            this->error_ = "ogg packet too large";
+            return false;
+        }
+
+        if(segment_length == 255)
+            continue; /* packet continues within the next segment */
+
+        const auto header_packet = this->packet_index++ < this->header_packet_count;
+        if(auto callback{this->callback_packet}; callback)
+            callback(this->packet.data(), this->packet.size(), header_packet);
+        this->packet.clear();
+    }
+
+    return true;
+}
+
+/* https://tools.ietf.org/html/rfc6716#section-3.1 */
+size_t opus::packet_sample_count(const uint8_t *packet, size_t length) {
+    if(length < 1)
+        return 0;
+
+    const auto toc = packet[0];
+    const auto config = toc >> 3U;
+
+    size_t frame_samples;
+    if(config < 12) {
+        /* SILK only: 10, 20, 40, 60ms */
+        constexpr size_t samples[4]{480, 960, 1920, 2880};
+        frame_samples = samples[config & 0x3U];
+    } else if(config < 16) {
+        /* Hybrid: 10, 20ms */
+        frame_samples = (config & 0x1U) ? 960 : 480;
+    } else {
+        /* CELT only: 2.5, 5, 10, 20ms */
+        constexpr size_t samples[4]{120, 240, 480, 960};
+        frame_samples = samples[config & 0x3U];
+    }
+
+    size_t frame_count;
+    switch (toc & 0x3U) {
+        case 0:
+            frame_count = 1;
+            break;
+        case 1:
+        case 2:
+            frame_count = 2;
+            break;
+        case 3:
+        default:
+            if(length < 2)
+                return 0;
+            frame_count = packet[1] & 0x3FU;
+            break;
+    }
+
+    const auto samples = frame_count * frame_samples;
+    return samples > 5760 ? 0 : samples; /* a packet must not exceed 120ms */
+}
+
+/* https://tools.ietf.org/html/rfc7845#section-5.1 */
+size_t opus::header_channel_count(const uint8_t *packet, size_t length) {
+    if(length < 19 || memcmp(packet, "OpusHead", 8) != 0)
+        return 0;
+
+    if((packet[8] & 0xF0U) != 0)
+        return 0; /* unsupported major version */
+
+    return packet[9];
+}
+
+size_t opus::header_pre_skip(const uint8_t *packet, size_t length) {
+    if(length < 19 || memcmp(packet, "OpusHead", 8) != 0)
+        return 0;
+
+    return (size_t) packet[10] | ((size_t) packet[11] << 8U);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <functional>
+
+namespace music::player {
+    /*
+     * Minimal incremental Ogg demuxer. Only the first logical stream will be read.
+     * Used to extract the opus packets ffmpeg writes with "-f ogg" into a pipe.
+     */
+    class OggDemuxer {
+        public:
+            typedef std::function<void(const uint8_t* /* packet */, size_t /* length */, bool /* header packet */)> callback_packet_t;
+
+            OggDemuxer() = default;
+            ~OggDemuxer() = default;
+
+            /* returns false if the stream is corrupted */
+            bool feed(const void* /* buffer */, size_t /* length */);
+            void reset();
+
+            [[nodiscard]] inline const std::string& error() const { return this->error_; }
+
+            /* the first header_packet_count packets of the logical stream will be flagged as header packets (OpusHead, OpusTags) */
+            size_t header_packet_count{2};
+            callback_packet_t callback_packet{};
+        private:
+            bool parse_page(const uint8_t* /* page */, size_t /* header length */);
+
+            std::vector<uint8_t> buffer{};
+            std::vector<uint8_t> packet{};
+
+            bool serial_known{false};
+            uint32_t serial{0};
+            size_t packet_index{0};
+
+            std::string error_{};
+    };
+
+    namespace opus {
+        /* samples per channel (at 48kHz) of an opus packet or zero if the packet is invalid */
+        [[nodiscard]] extern size_t packet_sample_count(const uint8_t* /* packet */, size_t /* length */);
+
+        /* validates the OpusHead header and returns the channel count (zero on failure) */
+        [[nodiscard]] extern size_t header_channel_count(const uint8_t* /* packet */, size_t /* length */);
+
+        /* samples (at 48kHz) the decoder has to drop at the beginning of the stream */
+        [[nodiscard]] extern size_t header_pre_skip(const uint8_t* /* packet */, size_t /* length */);
+    }
+}
@@ -0,0 +1,244 @@
+#include <cstring>
+#include <include/teaspeak/MusicPlayer.h>
+#include "./SampleCompression.h"
+
+using namespace music;
+using namespace music::player;
+
+namespace compression {
+    constexpr static uint8_t kFormatCompressed{0};
+    constexpr static uint8_t kFormatRaw{1};
+
+    constexpr static uint32_t kMaxPredictorOrder{2};
+    constexpr static uint32_t kMaxRiceParameter{18};
+
+    /* quotients above this will be written as escape sequence followed by the raw value */
+    constexpr static uint32_t kEscapeQuotient{24};
+    constexpr static uint32_t kEscapeValueBits{19}; /* a second order residual of s16 samples fits into 18 bits + sign */
+
+    struct BitWriter {
+        std::vector<uint8_t>& target;
+        uint64_t buffer{0};
+        uint32_t buffer_bits{0};
+
+        explicit BitWriter(std::vector<uint8_t>& target) : target{target} {}
+
+        inline void write(uint32_t value, uint32_t bits) {
+            /* bits must not exceed 32 */
+            this->buffer = (this->buffer << bits) | (value & ((1ULL << bits) - 1));
+            this->buffer_bits += bits;
+
+            while(this->buffer_bits >= 8) {
+                this->buffer_bits -= 8;
+                this->target.push_back((uint8_t) (this->buffer >> this->buffer_bits));
+            }
+        }
+
+        inline void write_ones(uint32_t count) {
+            while(count > 0) {
+                auto bits = std::min(count, 32U);
+                this->write(0xFFFFFFFFU, bits);
+                count -= bits;
+            }
+        }
+
+        inline void flush() {
+            if(this->buffer_bits > 0)
+                this->write(0, 8 - this->buffer_bits);
+        }
+    };
+
+    struct BitReader {
+        const uint8_t* data;
+        size_t length;
+        size_t index{0};
+
+        uint64_t buffer{0};
+        uint32_t buffer_bits{0};
+
+        BitReader(const uint8_t* data, size_t length) : data{data}, length{length} {}
+
+        inline bool fill(uint32_t bits) {
+            while(this->buffer_bits < bits) {
+                if(this->index >= this->length)
+                    return false;
+
+                this->buffer = (this->buffer << 8) | this->data[this->index++];
+                this->buffer_bits += 8;
+            }
+            return true;
+        }
+
+        inline bool read(uint32_t& value, uint32_t bits) {
+            if(bits == 0) {
+                value = 0;
+                return true;
+            }
+
+            if(!this->fill(bits))
+                return false;
+
+            this->buffer_bits -= bits;
+            value = (uint32_t) (this->buffer >> this->buffer_bits) & ((1ULL << bits) - 1);
+            return true;
+        }
+
+        inline bool read_unary(uint32_t& value, uint32_t max) {
+            value = 0;
+            while(value < max) {
+                uint32_t bit;
+                if(!this->read(bit, 1))
+                    return false;
+
+                if(!bit)
+                    return true;
+                value++;
+            }
+            return true;
+        }
+    };
+
+    inline int32_t predict(const int16_t* samples, size_t index, size_t stride, uint32_t order) {
+        switch (order) {
+            case 0:
+                return 0;
+            case 1:
+                return samples[(index - 1) * stride];
+            case 2:
+            default:
+                return 2 * (int32_t) samples[(index - 1) * stride] - (int32_t) samples[(index - 2) * stride];
+        }
+    }
+
+    inline uint32_t zigzag(int32_t value) { return ((uint32_t) value << 1U) ^ (uint32_t) (value >> 31); }
+    inline int32_t unzigzag(uint32_t value) { return (int32_t) (value >> 1U) ^ -(int32_t) (value & 1U); }
+
+    void encode_channel(BitWriter& writer, const int16_t* samples, size_t sample_count, size_t stride) {
+        /* find the predictor with the smallest residuals */
+        uint32_t order{0};
+        uint64_t residual_sum{UINT64_MAX};
+        for(uint32_t current_order{0}; current_order <= kMaxPredictorOrder && current_order < sample_count; current_order++) {
+            uint64_t sum{0};
+            for(size_t index{current_order}; index < sample_count; index++)
+                sum += zigzag((int32_t) samples[index * stride] - predict(samples, index, stride, current_order));
+
+            if(sum < residual_sum) {
+                residual_sum = sum;
+                order = current_order;
+            }
+        }
+        if(order >= sample_count)
+            order = 0;
+
+        uint32_t rice_parameter{0};
+        {
+            const auto residual_count = sample_count - order;
+            const auto mean = residual_count > 0 ? residual_sum / residual_count : 0;
+            while(rice_parameter < kMaxRiceParameter && (1ULL << (rice_parameter + 1)) <= mean)
+                rice_parameter++;
+        }
+
+        writer.write(order, 2);
+        writer.write(rice_parameter, 5);
+        for(size_t index{0}; index < order; index++)
+            writer.write((uint16_t) samples[index * stride], 16);
+
+        for(size_t index{order}; index < sample_count; index++) {
+            const auto value = zigzag((int32_t) samples[index * stride] - predict(samples, index, stride, order));
+            const auto quotient = value >> rice_parameter;
+            if(quotient >= kEscapeQuotient) {
+                writer.write_ones(kEscapeQuotient);
+                writer.write(value, kEscapeValueBits);
+            } else {
+                writer.write_ones(quotient);
+                writer.write(0, 1);
+                writer.write(value, rice_parameter);
+            }
+        }
+    }
+
+    bool decode_channel(BitReader& reader, int16_t* samples, size_t sample_count, size_t stride) {
+        uint32_t order, rice_parameter;
+        if(!reader.read(order, 2) || !reader.read(rice_parameter, 5))
+            return false;
+
+        if(order > kMaxPredictorOrder || order > sample_count || rice_parameter > kMaxRiceParameter)
+            return false;
+
+        for(size_t index{0}; index < order; index++) {
+            uint32_t value;
+            if(!reader.read(value, 16))
+                return false;
+
+            samples[index * stride] = (int16_t) value;
+        }
+
+        for(size_t index{order}; index < sample_count; index++) {
+            uint32_t quotient, value;
+            if(!reader.read_unary(quotient, kEscapeQuotient))
+                return false;
+
+            if(quotient >= kEscapeQuotient) {
+                if(!reader.read(value, kEscapeValueBits))
+                    return false;
+            } else {
+                if(!reader.read(value, rice_parameter))
+                    return false;
+
+                value |= quotient << rice_parameter;
+            }
+
+            samples[index * stride] = (int16_t) (unzigzag(value) + predict(samples, index, stride, order));
+        }
+        return true;
+    }
+}
+
+void player::compress_segment(const SampleSegment &source, CompressedSegment &target) {
+    const auto raw_length = source.segmentLength * source.channels * sizeof(int16_t);
+
+    target.sample_count = source.segmentLength;
+    target.max_sample_count = source.maxSegmentLength;
+    target.channels = source.channels;
+    target.data.clear();
+    target.data.reserve(raw_length / 2 + 1);
+    target.data.push_back(compression::kFormatCompressed);
+
+    {
+        compression::BitWriter writer{target.data};
+        for(size_t channel{0}; channel < source.channels; channel++)
+            compression::encode_channel(writer, source.segments + channel, source.segmentLength, source.channels);
+        writer.flush();
+    }
+
+    if(target.data.size() > raw_length + 1) {
+        /* noise or something similar, just store the samples */
+        target.data.resize(raw_length + 1);
+        target.data[0] = compression::kFormatRaw;
+        memcpy(target.data.data() + 1, source.segments, raw_length);
+    }
+
+    target.data.shrink_to_fit();
+}
+
+bool player::decompress_segment(const CompressedSegment &source, SampleSegment &target) {
+    if(target.channels != source.channels || target.maxSegmentLength < source.sample_count || source.data.empty())
+        return false;
+
+    if(source.data[0] == compression::kFormatRaw) {
+        const auto raw_length = source.sample_count * source.channels * sizeof(int16_t);
+        if(source.data.size() != raw_length + 1)
+            return false;
+
+        memcpy(target.segments, source.data.data() + 1, raw_length);
+    } else {
+        compression::BitReader reader{source.data.data() + 1, source.data.size() - 1};
+        for(size_t channel{0}; channel < source.channels; channel++)
+            if(!compression::decode_channel(reader, target.segments + channel, source.sample_count, source.channels))
+                return false;
+    }
+
+    target.segmentLength = source.sample_count;
+    target.full = true;
+    return true;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace music {
+    struct SampleSegment;
+}
+
+namespace music::player {
+    /*
+     * Lossless compressed representation of a SampleSegment.
+     * Every channel is encoded with the best fixed linear predictor (order 0 to 2) and the residuals are rice coded (like FLAC does).
+     * Synthetic test signals compress to 47% (pure tone) up to 72% - 91% (chords with noise, white noise) of the raw s16le size,
+     * at a fraction of the cost of a real codec. Real music lies in between, depending on its loudness and noise floor.
+     */
+    struct CompressedSegment {
+        size_t sample_count{0};
+        size_t max_sample_count{0};
+        size_t channels{0};
+
+        std::vector<uint8_t> data{};
+    };
+
+    extern void compress_segment(const SampleSegment& /* source */, CompressedSegment& /* target */);
+
+    /* the target segment must be able to hold at least sample_count samples with the same channel count */
+    [[nodiscard]] extern bool decompress_segment(const CompressedSegment& /* source */, SampleSegment& /* target */);
+}
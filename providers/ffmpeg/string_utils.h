@@ -27,11 +27,17 @@ namespace strings {
 
     template <typename T, typename V, std::enable_if_t<enable_is_string_similar<T>::value, int> = 0>
     void split_lines(V& result, const T& str) {
+        /* lines may end with \n, \r\n or \r (ffmpeg's progress lines) */
         size_t index = 0;
-        do {
-            auto found = str.find('\n', index);
+        while(true) {
+            auto found = str.find_first_of("\r\n", index);
+            if(found == std::string::npos) {
+                result.push_back(str.substr(index));
+                break;
+            }
+
             result.push_back(str.substr(index, found - index));
-            index = found + 1;
-        } while(index != 0 && index > str.length());
+            index = found + (str[found] == '\r' && found + 1 < str.length() && str[found + 1] == '\n' ? 2 : 1);
+        }
     }
 }
\ No newline at end of file
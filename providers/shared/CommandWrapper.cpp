@@ -11,7 +11,7 @@
 
 #include "./CommandWrapper.h"
 #include "./libevent.h"
-#include "./pstream.h"
+#include "./ProcessLauncher.h"
 
 using namespace cw;
 
@@ -27,12 +27,13 @@ struct WrapperInstance {
 
     std::deque<std::shared_ptr<CommandExecutionImpl>> errored_commands{};
     std::deque<std::shared_ptr<CommandExecutionImpl>> finished_commands{};
+    std::deque<std::shared_ptr<CommandExecutionImpl>> cancelled_commands{}; /* shut down within the event loop */
 
     void* event_dispatch_finished{nullptr};
 };
 
 struct ExecuteData {
-    redi::pstream* pstream{nullptr};
+    std::unique_ptr<pl::Process> process{};
 
     int fd_err{-1}, fd_out{-1};
 
@@ -58,6 +59,7 @@ timeval kTimeoutProcessClosed{0, 1000};
 void event_callback_closed(int, short, void*);
 void event_callback_read(int, short, void*);
 void dispatch_finished_callbacks(int, short, void*);
+void dispatch_command_errored(const std::shared_ptr<CommandExecutionImpl>&, const std::string&);
 
 thread_local bool is_dispatcher_thread{false};
 void event_base_dispatcher(WrapperInstance* instance) {
@@ -96,6 +98,13 @@ void dispatch_finished_callbacks(int, short, void* ptr_instance) {
     auto instance = (WrapperInstance*) ptr_instance;
 
     std::unique_lock pc_lock{instance->pending_commands_lock};
+    auto cancelled = std::exchange(instance->cancelled_commands, {});
+    pc_lock.unlock();
+
+    for(const auto& command : cancelled)
+        dispatch_command_errored(command, "cancelled");
+
+    pc_lock.lock();
     auto errored = std::exchange(instance->errored_commands, {});
     auto finished = std::exchange(instance->finished_commands, {});
     pc_lock.unlock();
@@ -182,11 +191,9 @@ inline void shutdown_command_execution(const std::shared_ptr<CommandExecutionImp
 
     edata->fd_err = -1;
     edata->fd_out = -1;
-    if(auto pstream{std::exchange(edata->pstream, nullptr)}; pstream) {
-        if(!pstream->rdbuf()->exited())
-            pstream->rdbuf()->kill(SIGKILL);
-
-        delete pstream;
+    if(auto process{std::move(edata->process)}; process) {
+        if(!process->exited())
+            process->kill(SIGKILL);
     }
 
     delete edata;
@@ -196,25 +203,17 @@ inline bool initialize_command(const std::shared_ptr<CommandExecutionImpl>& comm
     auto edata = new ExecuteData{};
     command->execution_data = edata;
 
-    edata->pstream = new redi::pstream{};
-
     music::log::log(music::log::debug, wrapper_instance->prefix + " Executing video query command \"" + command->command + "\"");
-    edata->pstream->open(command->command, redi::pstreams::pstderr | redi::pstreams::pstdout);
-
-    edata->fd_err = edata->pstream->rdbuf()->rpipe(redi::basic_pstreambuf<char>::buf_read_src::rsrc_err);
-    edata->fd_out = edata->pstream->rdbuf()->rpipe(redi::basic_pstreambuf<char>::buf_read_src::rsrc_out);
-
-    if(fcntl(edata->fd_err, F_SETFL, fcntl(edata->fd_err, F_GETFL, 0) | O_NONBLOCK) == -1) {
+    /* youtube-dl might start other processes (e.g. ffmpeg). Kill them as well. */
+    edata->process = pl::spawn_shell(command->command, error, false, true);
+    if(!edata->process) {
         shutdown_command_execution(command);
-        error = "failed to enable non blocking mode for stderr";
         return false;
     }
 
-    if(fcntl(edata->fd_out, F_SETFL, fcntl(edata->fd_out, F_GETFL, 0) | O_NONBLOCK) == -1) {
-        shutdown_command_execution(command);
-        error = "failed to enable non blocking mode for stdout";
-        return false;
-    }
+    /* the pipes are non blocking already */
+    edata->fd_err = edata->process->fd_err();
+    edata->fd_out = edata->process->fd_out();
 
     edata->event_process_closed = libevent::functions->event_new(wrapper_instance->event_base, -1, 0, event_callback_closed, &*command);
     if(!edata->event_process_closed) {
@@ -266,8 +265,6 @@ std::shared_ptr<ExecutionHandle> cw::execute(const std::string &command, const c
 }
 
 void dispatch_command_errored(const std::shared_ptr<CommandExecutionImpl>& command, const std::string& error) {
-    command->error = error;
-
     {
         std::lock_guard elock{wrapper_instance->pending_commands_lock};
         auto pindex = std::find_if(wrapper_instance->pending_commands.begin(), wrapper_instance->pending_commands.end(), [&](const auto& cmd){
@@ -276,6 +273,7 @@ void dispatch_command_errored(const std::shared_ptr<CommandExecutionImpl>& comma
         if(pindex == wrapper_instance->pending_commands.end())
             return;
 
+        command->error = error;
         wrapper_instance->pending_commands.erase(pindex);
         wrapper_instance->errored_commands.push_back(command);
     }
@@ -284,6 +282,18 @@ void dispatch_command_errored(const std::shared_ptr<CommandExecutionImpl>& comma
     libevent::functions->event_add(wrapper_instance->event_dispatch_finished, &kTimeoutZero);
 }
 
+void cw::cancel(const std::shared_ptr<ExecutionHandle> &handle) {
+    if(!handle || !wrapper_instance)
+        return;
+
+    /* the execution data belongs to the event loop. A no op if the command already finished. */
+    {
+        std::lock_guard elock{wrapper_instance->pending_commands_lock};
+        wrapper_instance->cancelled_commands.push_back(std::static_pointer_cast<CommandExecutionImpl>(handle));
+    }
+    libevent::functions->event_add(wrapper_instance->event_dispatch_finished, &kTimeoutZero);
+}
+
 void dispatch_command_finished(const std::shared_ptr<CommandExecutionImpl>& command) {
     {
         std::lock_guard elock{wrapper_instance->pending_commands_lock};
@@ -343,11 +353,11 @@ void event_callback_closed(int, short, void* ptr_command) {
     auto command = ((CommandExecutionImpl*) ptr_command)->shared_from_this();
     auto edata = (ExecuteData*) command->execution_data;
 
-    if(!edata->pstream->rdbuf()->exited()) {
+    if(!edata->process->exited()) {
         libevent::functions->event_add(edata->event_process_closed, &kTimeoutProcessClosed);
         return;
     }
 
-    command->result.exit_code = edata->pstream->rdbuf()->status();
+    command->result.exit_code = edata->process->status();
     dispatch_command_finished(command);
 }
\ No newline at end of file
@@ -38,4 +38,10 @@ namespace cw {
             const callback_finish_t& /* finish callback */,
             const callback_error_t& /* error callback */
     );
+
+    /*
+     * Kills the command (including all processes it started) within the event loop if it's still running.
+     * The error callback will be called with "cancelled".
+     */
+    extern void cancel(const std::shared_ptr<ExecutionHandle>& /* handle */);
 }
\ No newline at end of file
@@ -0,0 +1,232 @@
+#include <spawn.h>
+#include <fcntl.h>
+#include <csignal>
+#include <cstring>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <include/teaspeak/MusicPlayer.h>
+#include "./ProcessLauncher.h"
+
+extern char** environ;
+
+using namespace pl;
+
+static std::mutex metrics_lock{};
+static Metrics metrics_{};
+
+Process::Process(pid_t pid, int fd_in, int fd_out, int fd_err, bool group_leader) : pid_{pid}, group_leader_{group_leader}, fd_in_{fd_in}, fd_out_{fd_out}, fd_err_{fd_err} {}
+
+Process::~Process() {
+    this->close_input();
+    if(this->fd_out_ >= 0)
+        ::close(this->fd_out_);
+    if(this->fd_err_ >= 0)
+        ::close(this->fd_err_);
+
+    this->wait();
+}
+
+bool Process::write_input(const std::string &data) {
+    /* the child might have died already. Don't let SIGPIPE terminate the bot. */
+    sigset_t pipe_signal{}, previous_mask{};
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, &previous_mask);
+
+    size_t written{0};
+    while(this->fd_in_ >= 0 && written < data.length()) {
+        const auto result = ::write(this->fd_in_, data.data() + written, data.length() - written);
+        if(result < 0) {
+            if(errno == EINTR)
+                continue;
+
+            if(errno == EPIPE && !sigismember(&previous_mask, SIGPIPE)) {
+                /* consume the pending signal before unblocking it again */
+                timespec timeout{0, 0};
+                sigtimedwait(&pipe_signal, nullptr, &timeout);
+            }
+            break;
+        }
+        written += (size_t) result;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &previous_mask, nullptr);
+    return written == data.length();
+}
+
+void Process::close_input() {
+    if(this->fd_in_ >= 0)
+        ::close(this->fd_in_);
+    this->fd_in_ = -1;
+}
+
+bool Process::exited() {
+    std::lock_guard lock_{this->lock};
+    if(this->exited_)
+        return true;
+
+    int status{0};
+    const auto result = waitpid(this->pid_, &status, WNOHANG);
+    if(result == this->pid_) {
+        this->exited_ = true;
+        this->status_ = status;
+    } else if(result < 0 && errno == ECHILD) {
+        /* somebody else reaped our child */
+        this->exited_ = true;
+    }
+    return this->exited_;
+}
+
+int Process::status() {
+    std::lock_guard lock_{this->lock};
+    return this->status_;
+}
+
+bool Process::kill(int signal) {
+    std::lock_guard lock_{this->lock};
+    if(this->exited_)
+        return false;
+
+    return ::kill(this->group_leader_ ? -this->pid_ : this->pid_, signal) == 0;
+}
+
+void Process::wait() {
+    std::lock_guard lock_{this->lock};
+    if(this->exited_)
+        return;
+
+    int status{0};
+    while(true) {
+        const auto result = waitpid(this->pid_, &status, 0);
+        if(result == this->pid_) {
+            this->status_ = status;
+            break;
+        } else if(result < 0 && errno != EINTR) {
+            break;
+        }
+    }
+    this->exited_ = true;
+}
+
+inline void close_pipe(int (&fds)[2]) {
+    if(fds[0] >= 0) ::close(fds[0]);
+    if(fds[1] >= 0) ::close(fds[1]);
+    fds[0] = fds[1] = -1;
+}
+
+inline void record_spawn(bool success, const std::chrono::microseconds& time) {
+    std::lock_guard lock_{metrics_lock};
+    if(success) {
+        metrics_.spawned++;
+        metrics_.total_spawn_time += time;
+        metrics_.max_spawn_time = std::max(metrics_.max_spawn_time, time);
+    } else {
+        metrics_.failed++;
+    }
+}
+
+static std::unique_ptr<Process> spawn_process(const char* file, char* const* argv, bool stdin_pipe, bool process_group, std::string& error) {
+    int pipe_in[2]{-1, -1}, pipe_out[2]{-1, -1}, pipe_err[2]{-1, -1};
+    if((stdin_pipe && pipe2(pipe_in, O_CLOEXEC) != 0) || pipe2(pipe_out, O_CLOEXEC) != 0 || pipe2(pipe_err, O_CLOEXEC) != 0) {
+        error = "failed to create pipes: " + std::string{strerror(errno)};
+        close_pipe(pipe_in);
+        close_pipe(pipe_out);
+        close_pipe(pipe_err);
+        return nullptr;
+    }
+
+    posix_spawn_file_actions_t file_actions{};
+    posix_spawn_file_actions_init(&file_actions);
+    if(stdin_pipe)
+        posix_spawn_file_actions_adddup2(&file_actions, pipe_in[0], STDIN_FILENO);
+    else
+        posix_spawn_file_actions_addopen(&file_actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    /* dup2 clears the close on exec flag of the target */
+    posix_spawn_file_actions_adddup2(&file_actions, pipe_out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&file_actions, pipe_err[1], STDERR_FILENO);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+    /* the host may have opened descriptors without close on exec */
+    posix_spawn_file_actions_addclosefrom_np(&file_actions, STDERR_FILENO + 1);
+#endif
+
+    /* the bot threads might have blocked or ignored some signals */
+    posix_spawnattr_t attributes{};
+    posix_spawnattr_init(&attributes);
+
+    sigset_t signals{};
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attributes, &signals);
+    sigaddset(&signals, SIGPIPE);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGQUIT);
+    posix_spawnattr_setsigdefault(&attributes, &signals);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | (process_group ? POSIX_SPAWN_SETPGROUP : 0));
+    posix_spawnattr_setpgroup(&attributes, 0);
+
+    pid_t pid{0};
+    const auto begin = std::chrono::steady_clock::now();
+    const auto result = posix_spawnp(&pid, file, &file_actions, &attributes, argv, environ);
+    const auto spawn_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin);
+
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&file_actions);
+    if(pipe_in[0] >= 0)
+        ::close(pipe_in[0]);
+    ::close(pipe_out[1]);
+    ::close(pipe_err[1]);
+
+    record_spawn(result == 0, spawn_time);
+    if(result != 0) {
+        error = "failed to spawn process: " + std::string{strerror(result)};
+        if(pipe_in[1] >= 0)
+            ::close(pipe_in[1]);
+        ::close(pipe_out[0]);
+        ::close(pipe_err[0]);
+        return nullptr;
+    }
+
+    fcntl(pipe_out[0], F_SETFL, fcntl(pipe_out[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(pipe_err[0], F_SETFL, fcntl(pipe_err[0], F_GETFL, 0) | O_NONBLOCK);
+
+    music::log::log(music::log::trace, "Spawned process " + std::string{file} + " (" + std::to_string(pid) + ") within " + std::to_string(spawn_time.count()) + "us");
+    return std::make_unique<Process>(pid, pipe_in[1], pipe_out[0], pipe_err[0], process_group);
+}
+
+std::unique_ptr<Process> pl::spawn(const std::vector<std::string> &arguments, std::string &error) {
+    if(arguments.empty()) {
+        error = "missing executable";
+        return nullptr;
+    }
+
+    std::vector<char*> argv{};
+    argv.reserve(arguments.size() + 1);
+    for(const auto& argument : arguments)
+        argv.push_back(const_cast<char*>(argument.c_str()));
+    argv.push_back(nullptr);
+
+    return spawn_process(argv[0], argv.data(), false, false, error);
+}
+
+std::unique_ptr<Process> pl::spawn_shell(const std::string &command, std::string &error, bool stdin_pipe, bool process_group) {
+    char* argv[]{(char*) "/bin/sh", (char*) "-c", const_cast<char*>(command.c_str()), nullptr};
+    return spawn_process(argv[0], argv, stdin_pipe, process_group, error);
+}
+
+std::string pl::shell_quote(const std::string &argument) {
+    std::string result{"'"};
+    result.reserve(argument.length() + 2);
+    for(const auto& c : argument) {
+        if(c == '\'')
+            result += "'\\''";
+        else
+            result += c;
+    }
+    result += "'";
+    return result;
+}
+
+Metrics pl::metrics() {
+    std::lock_guard lock_{metrics_lock};
+    return metrics_;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+/*
+ * Spawns child processes via posix_spawn (vfork semantics) instead of forking the whole bot process.
+ * The children get stdin connected to /dev/null (or a pipe if requested) and stdout/stderr connected to non blocking pipes.
+ * No other file descriptor of the bot will be inherited.
+ */
+namespace pl {
+    struct Metrics {
+        size_t spawned{0};
+        size_t failed{0};
+
+        std::chrono::microseconds total_spawn_time{0};
+        std::chrono::microseconds max_spawn_time{0};
+    };
+
+    class Process {
+        public:
+            Process(pid_t /* pid */, int /* stdin */, int /* stdout */, int /* stderr */, bool /* process group leader */ = false);
+            /* closes the pipes and waits for the process to exit */
+            ~Process();
+
+            [[nodiscard]] inline pid_t pid() const { return this->pid_; }
+            [[nodiscard]] inline int fd_in() const { return this->fd_in_; } /* -1 if stdin is /dev/null */
+            [[nodiscard]] inline int fd_out() const { return this->fd_out_; }
+            [[nodiscard]] inline int fd_err() const { return this->fd_err_; }
+
+            /* writes the whole buffer to the blocking stdin pipe */
+            bool write_input(const std::string& /* data */);
+            void close_input();
+
+            /* checks (without blocking) if the process has exited and reaps it if so */
+            [[nodiscard]] bool exited();
+            /* status as reported by waitpid. Only valid if exited() returned true. */
+            [[nodiscard]] int status();
+
+            /* signals the whole process group if the process has been spawned as group leader */
+            bool kill(int /* signal */);
+            /* blocks until the process has exited */
+            void wait();
+        private:
+            const pid_t pid_;
+            const bool group_leader_;
+            int fd_in_;
+            int fd_out_;
+            int fd_err_;
+
+            std::mutex lock{};
+            bool exited_{false};
+            int status_{0};
+    };
+
+    /* argv[0] will be looked up within PATH */
+    [[nodiscard]] extern std::unique_ptr<Process> spawn(const std::vector<std::string>& /* argv */, std::string& /* error */);
+    /*
+     * executes the command via /bin/sh -c.
+     * With a process group the shell and everything it started can be killed at once.
+     */
+    [[nodiscard]] extern std::unique_ptr<Process> spawn_shell(const std::string& /* command */, std::string& /* error */, bool /* stdin pipe */ = false, bool /* own process group */ = false);
+
+    /* quotes the argument for /bin/sh */
+    [[nodiscard]] extern std::string shell_quote(const std::string& /* argument */);
+
+    [[nodiscard]] extern Metrics metrics();
+}
@@ -0,0 +1,170 @@
+#include <cassert>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <pthread.h>
+
+#include "./WorkerPool.h"
+
+using namespace wp;
+
+struct PendingTask {
+    task_t task{};
+    callback_reject_t callback_reject{};
+
+    std::chrono::system_clock::time_point timestamp_enqueued{};
+};
+
+struct PoolInstance {
+    std::string prefix{};
+    size_t max_queue_size{0};
+
+    bool shutdown{false};
+    std::vector<std::thread> workers{};
+
+    std::mutex queue_lock{};
+    std::condition_variable queue_cv{};
+    std::deque<PendingTask> queue{};
+
+    Metrics metrics{};
+};
+
+static std::mutex pool_instance_lock{};
+static PoolInstance* pool_instance{nullptr};
+
+void worker_loop(PoolInstance* instance) {
+    std::unique_lock qlock{instance->queue_lock};
+    while(true) {
+        instance->queue_cv.wait(qlock, [&]{ return instance->shutdown || !instance->queue.empty(); });
+        if(instance->queue.empty())
+            break; /* shutdown */
+
+        auto task = std::move(instance->queue.front());
+        instance->queue.pop_front();
+
+        const auto timestamp_begin = std::chrono::system_clock::now();
+        instance->metrics.queued = instance->queue.size();
+        instance->metrics.active++;
+        instance->metrics.total_wait_time += std::chrono::floor<std::chrono::microseconds>(timestamp_begin - task.timestamp_enqueued);
+        qlock.unlock();
+
+        try {
+            task.task();
+        } catch (std::exception& ex) {
+            music::log::log(music::log::err, instance->prefix + " Worker task threw an exception: " + ex.what());
+        }
+
+        const auto timestamp_end = std::chrono::system_clock::now();
+        qlock.lock();
+        instance->metrics.active--;
+        instance->metrics.executed++;
+        instance->metrics.total_execute_time += std::chrono::floor<std::chrono::microseconds>(timestamp_end - timestamp_begin);
+    }
+}
+
+bool wp::initialize(const std::string &prefix, size_t worker_count, size_t max_queue_size, std::string &error) {
+    std::lock_guard ilock{pool_instance_lock};
+    assert(!pool_instance);
+
+    if(worker_count == 0) {
+        error = "invalid worker count";
+        return false;
+    }
+
+    auto instance = new PoolInstance{};
+    instance->prefix = prefix;
+    instance->max_queue_size = max_queue_size;
+    instance->metrics.worker_count = worker_count;
+    instance->metrics.max_queue_size = max_queue_size;
+
+    instance->workers.reserve(worker_count);
+    for(size_t index{0}; index < worker_count; index++) {
+        instance->workers.emplace_back(worker_loop, instance);
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+        pthread_setname_np(instance->workers.back().native_handle(), "Provider Worker");
+#endif
+    }
+
+    pool_instance = instance;
+    return true;
+}
+
+void wp::finalize() {
+    PoolInstance* instance;
+    {
+        std::lock_guard ilock{pool_instance_lock};
+        instance = std::exchange(pool_instance, nullptr);
+    }
+    if(!instance)
+        return;
+
+    std::unique_lock qlock{instance->queue_lock};
+    instance->shutdown = true;
+    auto dropped_tasks = std::exchange(instance->queue, {});
+    instance->metrics.rejected += dropped_tasks.size();
+    instance->metrics.queued = 0;
+    qlock.unlock();
+    instance->queue_cv.notify_all();
+
+    for(const auto& task : dropped_tasks)
+        if(task.callback_reject)
+            task.callback_reject("shutdown");
+
+    for(auto& worker : instance->workers)
+        worker.join();
+
+    const auto& metrics = instance->metrics;
+    music::log::log(music::log::debug, instance->prefix + " Worker pool shut down. Executed " + std::to_string(metrics.executed) + " tasks, rejected " +
+        std::to_string(metrics.rejected) + " tasks. Peak queue size: " + std::to_string(metrics.queued_peak));
+    delete instance;
+}
+
+bool wp::shutdown_requested() {
+    std::lock_guard ilock{pool_instance_lock};
+    return !pool_instance;
+}
+
+bool wp::execute(const task_t &task, const callback_reject_t &callback_reject) {
+    std::unique_lock ilock{pool_instance_lock};
+    auto instance = pool_instance;
+    if(!instance) {
+        ilock.unlock();
+        if(callback_reject)
+            callback_reject("worker pool not running");
+        return false;
+    }
+
+    std::unique_lock qlock{instance->queue_lock};
+    ilock.unlock();
+
+    instance->metrics.submitted++;
+    if(instance->max_queue_size > 0 && instance->queue.size() >= instance->max_queue_size) {
+        instance->metrics.rejected++;
+        qlock.unlock();
+
+        music::log::log(music::log::warn, instance->prefix + " Rejecting worker task. Queue is full (" + std::to_string(instance->max_queue_size) + " tasks)");
+        if(callback_reject)
+            callback_reject("worker queue full");
+        return false;
+    }
+
+    instance->queue.push_back(PendingTask{task, callback_reject, std::chrono::system_clock::now()});
+    instance->metrics.queued = instance->queue.size();
+    instance->metrics.queued_peak = std::max(instance->metrics.queued_peak, instance->metrics.queued);
+    qlock.unlock();
+
+    instance->queue_cv.notify_one();
+    return true;
+}
+
+Metrics wp::metrics() {
+    std::lock_guard ilock{pool_instance_lock};
+    if(!pool_instance)
+        return Metrics{};
+
+    std::lock_guard qlock{pool_instance->queue_lock};
+    return pool_instance->metrics;
+}
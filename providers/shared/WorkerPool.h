@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include <chrono>
+#include <functional>
+#include <include/teaspeak/MusicPlayer.h>
+
+/*
+ * Bounded worker pool shared by all providers.
+ * Use it for blocking work (awaiting process info, reaping processes) instead of detaching threads.
+ */
+namespace wp {
+    struct Metrics {
+        size_t worker_count{0};
+        size_t max_queue_size{0};
+
+        size_t queued{0};
+        size_t queued_peak{0};
+        size_t active{0};
+
+        size_t submitted{0};
+        size_t executed{0};
+        size_t rejected{0};
+
+        std::chrono::microseconds total_wait_time{0};
+        std::chrono::microseconds total_execute_time{0};
+    };
+
+    typedef std::function<void()> task_t;
+    typedef std::function<void(const std::string& /* reason */)> callback_reject_t;
+
+    EXPORT extern bool initialize(const std::string& /* prefix */, size_t /* worker count */, size_t /* max queue size */, std::string& /* error */);
+
+    /*
+     * Stops accepting new tasks, rejects all tasks which haven't been started yet and joins all workers.
+     * Tasks which are currently executed will be finished.
+     */
+    EXPORT extern void finalize();
+
+    /* true if finalize has been called. Long running tasks should check this and return early */
+    EXPORT extern bool shutdown_requested();
+
+    /*
+     * Returns false if the task has been rejected (queue full or pool not running).
+     * The reject callback will be called as well if the task got rejected or dropped due to a shutdown.
+     * Attention: The reject callback might be called within the callers thread!
+     */
+    EXPORT extern bool execute(const task_t& /* task */, const callback_reject_t& /* reject callback */ = nullptr);
+
+    EXPORT extern Metrics metrics();
+}
@@ -0,0 +1,48 @@
+#include "./libflac.h"
+#include <dlfcn.h>
+#include <cassert>
+
+std::shared_ptr<libflac::function_handle> libflac::functions{nullptr};
+
+#define _str(x) #x
+
+#define resolve_method(name) \
+functions->name = (decltype(functions->name)) dlsym(functions->dl_handle, _str(name)); \
+if(!functions->name) { error = std::string{"failed to resolve function " _str(name)}; goto error_cleanup; }
+
+bool libflac::resolve_functions(std::string& error) {
+    assert(!functions);
+
+    functions = std::shared_ptr<libflac::function_handle>{new libflac::function_handle{}, [](auto handle) {
+        if(handle->dl_handle)
+            dlclose(handle->dl_handle);
+        delete handle;
+    }};
+    for(const auto& library : {"libFLAC.so.12", "libFLAC.so.8", "libFLAC.so"})
+        if((functions->dl_handle = dlopen(library, RTLD_NOW | RTLD_LOCAL)))
+            break;
+
+    if(!functions->dl_handle) {
+        error = "failed to load libFLAC";
+        goto error_cleanup;
+    }
+
+    resolve_method(FLAC__stream_decoder_new)
+    resolve_method(FLAC__stream_decoder_delete)
+    resolve_method(FLAC__stream_decoder_init_file)
+    resolve_method(FLAC__stream_decoder_finish)
+    resolve_method(FLAC__stream_decoder_process_single)
+    resolve_method(FLAC__stream_decoder_process_until_end_of_metadata)
+    resolve_method(FLAC__stream_decoder_seek_absolute)
+    resolve_method(FLAC__stream_decoder_get_state)
+    resolve_method(FLAC__stream_decoder_flush)
+    return true;
+
+    error_cleanup:
+    libflac::release_functions();
+    return false;
+}
+
+void libflac::release_functions() {
+    functions = nullptr;
+}
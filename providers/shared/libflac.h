@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+/* libFLAC will be resolved at runtime. Used for in process flac decoding. */
+namespace libflac {
+    /* only the leading members of the libFLAC structures we're accessing */
+    struct FrameHeader {
+        uint32_t blocksize;
+        uint32_t sample_rate;
+        uint32_t channels;
+        int channel_assignment;
+        uint32_t bits_per_sample;
+    };
+
+    struct Frame {
+        FrameHeader header;
+    };
+
+    struct StreamInfo {
+        uint32_t min_blocksize, max_blocksize;
+        uint32_t min_framesize, max_framesize;
+        uint32_t sample_rate;
+        uint32_t channels;
+        uint32_t bits_per_sample;
+        uint64_t total_samples;
+    };
+
+    struct StreamMetadata {
+        int type;
+        int is_last;
+        uint32_t length;
+        union {
+            StreamInfo stream_info;
+        } data;
+    };
+
+    typedef int(write_callback_t)(const void* decoder, const Frame* frame, const int32_t* const buffer[], void* client_data);
+    typedef void(metadata_callback_t)(const void* decoder, const StreamMetadata* metadata, void* client_data);
+    typedef void(error_callback_t)(const void* decoder, int status, void* client_data);
+
+    struct function_handle {
+        void* dl_handle;
+
+        void*(*FLAC__stream_decoder_new)();
+        void(*FLAC__stream_decoder_delete)(void* decoder);
+        int(*FLAC__stream_decoder_init_file)(void* decoder, const char* filename, write_callback_t* write_callback, metadata_callback_t* metadata_callback, error_callback_t* error_callback, void* client_data);
+        int(*FLAC__stream_decoder_finish)(void* decoder);
+        int(*FLAC__stream_decoder_process_single)(void* decoder);
+        int(*FLAC__stream_decoder_process_until_end_of_metadata)(void* decoder);
+        int(*FLAC__stream_decoder_seek_absolute)(void* decoder, uint64_t sample);
+        int(*FLAC__stream_decoder_get_state)(const void* decoder);
+        int(*FLAC__stream_decoder_flush)(void* decoder);
+    };
+    /* users (e.g. decoders) keep a reference, the library will be unloaded once the last reference has been released */
+    extern std::shared_ptr<function_handle> functions;
+
+    bool resolve_functions(std::string& error);
+    void release_functions();
+}
+
+#define FLAC__STREAM_DECODER_INIT_STATUS_OK 0
+#define FLAC__STREAM_DECODER_END_OF_STREAM 4
+#define FLAC__STREAM_DECODER_SEEK_ERROR 6
+#define FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE 0
+#define FLAC__METADATA_TYPE_STREAMINFO 0
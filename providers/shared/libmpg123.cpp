@@ -0,0 +1,58 @@
+#include "./libmpg123.h"
+#include <dlfcn.h>
+#include <cassert>
+
+std::shared_ptr<libmpg123::function_handle> libmpg123::functions{nullptr};
+
+#define _str(x) #x
+
+#define resolve_method(name) \
+functions->name = (decltype(functions->name)) dlsym(functions->dl_handle, _str(name)); \
+if(!functions->name) { error = std::string{"failed to resolve function " _str(name)}; goto error_cleanup; }
+
+bool libmpg123::resolve_functions(std::string& error) {
+    assert(!functions);
+
+    functions = std::shared_ptr<libmpg123::function_handle>{new libmpg123::function_handle{}, [](auto handle) {
+        if(handle->dl_handle)
+            dlclose(handle->dl_handle);
+        delete handle;
+    }};
+    for(const auto& library : {"libmpg123.so.0", "libmpg123.so"})
+        if((functions->dl_handle = dlopen(library, RTLD_NOW | RTLD_LOCAL)))
+            break;
+
+    if(!functions->dl_handle) {
+        error = "failed to load libmpg123";
+        goto error_cleanup;
+    }
+
+    resolve_method(mpg123_init)
+    resolve_method(mpg123_new)
+    resolve_method(mpg123_delete)
+    resolve_method(mpg123_param)
+    resolve_method(mpg123_open)
+    resolve_method(mpg123_close)
+    resolve_method(mpg123_getformat)
+    resolve_method(mpg123_format_none)
+    resolve_method(mpg123_format)
+    resolve_method(mpg123_scan)
+    resolve_method(mpg123_length)
+    resolve_method(mpg123_read)
+    resolve_method(mpg123_seek)
+    resolve_method(mpg123_strerror)
+
+    if(functions->mpg123_init() != MPG123_OK) {
+        error = "failed to initialize libmpg123";
+        goto error_cleanup;
+    }
+    return true;
+
+    error_cleanup:
+    libmpg123::release_functions();
+    return false;
+}
+
+void libmpg123::release_functions() {
+    functions = nullptr;
+}
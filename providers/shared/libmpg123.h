@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cstddef>
+#include <sys/types.h>
+
+/* libmpg123 will be resolved at runtime. Used for in process mp3 decoding. */
+namespace libmpg123 {
+    struct function_handle {
+        void* dl_handle;
+
+        int(*mpg123_init)();
+        void*(*mpg123_new)(const char* decoder, int* error);
+        void(*mpg123_delete)(void* handle);
+        int(*mpg123_param)(void* handle, int type, long value, double fvalue);
+        int(*mpg123_open)(void* handle, const char* path);
+        int(*mpg123_close)(void* handle);
+        int(*mpg123_getformat)(void* handle, long* rate, int* channels, int* encoding);
+        int(*mpg123_format_none)(void* handle);
+        int(*mpg123_format)(void* handle, long rate, int channels, int encodings);
+        int(*mpg123_scan)(void* handle);
+        off_t(*mpg123_length)(void* handle);
+        int(*mpg123_read)(void* handle, void* buffer, size_t size, size_t* done);
+        off_t(*mpg123_seek)(void* handle, off_t offset, int whence);
+        const char*(*mpg123_strerror)(void* handle);
+    };
+    /* users (e.g. decoders) keep a reference, the library will be unloaded once the last reference has been released */
+    extern std::shared_ptr<function_handle> functions;
+
+    bool resolve_functions(std::string& error);
+    void release_functions();
+}
+
+#define MPG123_OK 0
+#define MPG123_ERR (-1)
+#define MPG123_NEED_MORE (-10)
+#define MPG123_NEW_FORMAT (-11)
+#define MPG123_DONE (-12)
+
+#define MPG123_ADD_FLAGS 2
+#define MPG123_QUIET 0x20
+#define MPG123_GAPLESS 0x40
+
+#define MPG123_ENC_SIGNED_16 0xD0
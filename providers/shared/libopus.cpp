@@ -0,0 +1,50 @@
+#include "./libopus.h"
+#include <dlfcn.h>
+#include <cassert>
+
+std::shared_ptr<libopus::function_handle> libopus::functions{nullptr};
+
+#define _str(x) #x
+
+#define resolve_method(name) \
+functions->name = (decltype(functions->name)) dlsym(functions->dl_handle, _str(name)); \
+if(!functions->name) { error = std::string{"failed to resolve function " _str(name)}; goto error_cleanup; }
+
+bool libopus::resolve_functions(std::string& error) {
+    assert(!functions);
+
+    functions = std::shared_ptr<libopus::function_handle>{new libopus::function_handle{}, [](auto handle) {
+        if(handle->dl_handle)
+            dlclose(handle->dl_handle);
+        delete handle;
+    }};
+    functions->dl_handle = dlopen(nullptr, RTLD_NOW);
+    if(!functions->dl_handle || !dlsym(functions->dl_handle, "opus_decoder_create")) {
+        if(functions->dl_handle)
+            dlclose(functions->dl_handle);
+
+        for(const auto& library : {"libopus.so.0", "libopus.so"})
+            if((functions->dl_handle = dlopen(library, RTLD_NOW | RTLD_LOCAL)))
+                break;
+
+        if(!functions->dl_handle) {
+            error = "failed to load libopus";
+            goto error_cleanup;
+        }
+    }
+
+    resolve_method(opus_decoder_create)
+    resolve_method(opus_decoder_destroy)
+    resolve_method(opus_decode)
+    resolve_method(opus_decoder_ctl)
+    resolve_method(opus_strerror)
+    return true;
+
+    error_cleanup:
+    libopus::release_functions();
+    return false;
+}
+
+void libopus::release_functions() {
+    functions = nullptr;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+/* libopus will be resolved at runtime. The host usually already has it loaded for the voice codec. */
+namespace libopus {
+    struct function_handle {
+        void* dl_handle;
+
+        void*(*opus_decoder_create)(int32_t fs, int channels, int* error);
+        void(*opus_decoder_destroy)(void* decoder);
+        int(*opus_decode)(void* decoder, const unsigned char* data, int32_t length, int16_t* pcm, int frame_size, int decode_fec);
+        int(*opus_decoder_ctl)(void* decoder, int request, ...);
+        const char*(*opus_strerror)(int error);
+    };
+    /* users (e.g. decoders) keep a reference, the library will be unloaded once the last reference has been released */
+    extern std::shared_ptr<function_handle> functions;
+
+    bool resolve_functions(std::string& error);
+    void release_functions();
+}
+
+#define OPUS_OK 0
+#define OPUS_RESET_STATE 4028
@@ -26,10 +26,18 @@ class YTProvider : public PlayerProvider {
 			return manager->resolve_url_info(url);
 		}
 
+		threads::Future<shared_ptr<music::UrlInfo>> query_info(const std::string &url, void*, void*, const std::shared_ptr<music::CancellationToken>& token) override {
+			return manager->resolve_url_info(url, token);
+		}
+
 		threads::Future<std::shared_ptr<music::MusicPlayer>> createPlayer(const std::string &string, void*, void*) override {
             return manager->create_stream(string);
         }
 
+		threads::Future<std::shared_ptr<music::MusicPlayer>> createPlayer(const std::string &string, void*, void*, const std::shared_ptr<music::CancellationToken>& token) override {
+            return manager->create_stream(string, token);
+        }
+
         bool acceptString(const std::string &str) override {
         	{
         	    lock_guard lock(this->cache_lock);
@@ -2,6 +2,7 @@
 #include <json/json.h>
 #include <memory>
 #include <utility>
+#include <cstring>
 #include <experimental/filesystem>
 
 #include "providers/shared/INIParser.h"
@@ -9,6 +10,7 @@
 
 #include "./YTVManager.h"
 #include "./YoutubeMusicPlayer.h"
+#include "providers/ffmpeg/FFMpegDiskCache.h"
 
 namespace fs = std::experimental::filesystem;
 
@@ -134,7 +136,12 @@ std::shared_ptr<music::UrlInfo> parse_url_info(const cw::Result& result, std::st
     }
 }
 
-threads::Future<std::shared_ptr<music::UrlInfo>> YTVManager::resolve_url_info(const std::string& video) {
+inline void cancel_on(const std::shared_ptr<music::CancellationToken>& token, const std::shared_ptr<cw::ExecutionHandle>& handle) {
+    if(token)
+        token->onCancel([handle]{ cw::cancel(handle); });
+}
+
+threads::Future<std::shared_ptr<music::UrlInfo>> YTVManager::resolve_url_info(const std::string& video, const std::shared_ptr<music::CancellationToken>& token) {
     threads::Future<std::shared_ptr<UrlInfo>> future;
 
     auto config = this->configuration();
@@ -142,7 +149,7 @@ threads::Future<std::shared_ptr<music::UrlInfo>> YTVManager::resolve_url_info(co
                                      strvar::StringValue{"command", config->youtubedl_command},
                                      strvar::StringValue{"video_url", video}
     );
-    cw::execute(command, [future, video](const cw::Result& result) {
+    auto handle = cw::execute(command, [future, video](const cw::Result& result) {
         std::string error{};
         auto info = parse_url_info(result, error);
         if(!info)
@@ -154,17 +161,99 @@ threads::Future<std::shared_ptr<music::UrlInfo>> YTVManager::resolve_url_info(co
     }, [future](const std::string& error) {
         future.executionFailed(error);
     });
+    cancel_on(token, handle);
 
     return future;
 }
 
-threads::Future<std::shared_ptr<music::MusicPlayer>> YTVManager::create_stream(const std::string &video) {
+/* the video id will be used as disk cache key. Returns an empty string if the url does not contain one. */
+std::string video_id_from_url(const std::string& url) {
+    static const char* id_prefixes[] = {"?v=", "&v=", "youtu.be/", "/embed/", "/shorts/", "/v/"};
+
+    for(const auto& prefix : id_prefixes) {
+        auto index = url.find(prefix);
+        if(index == std::string::npos)
+            continue;
+
+        index += strlen(prefix);
+        auto end = index;
+        while(end < url.length() && (isalnum(url[end]) || url[end] == '-' || url[end] == '_'))
+            end++;
+
+        if(end - index == 11)
+            return url.substr(index, 11);
+    }
+
+    return "";
+}
+
+inline std::string disk_cache_key(const std::string& video_id, const std::string& codec) {
+    return "yt_" + video_id + "." + codec;
+}
+
+threads::Future<std::shared_ptr<music::MusicPlayer>> YTVManager::create_stream(const std::string &video, const std::shared_ptr<music::CancellationToken>& token) {
     threads::Future<std::shared_ptr<music::MusicPlayer>> future;
 
-    auto fut = resolve_stream_info(video);
-    fut.waitAndGetLater([future, fut](const std::shared_ptr<AudioInfo>& audio){
-        if(fut.succeeded() && audio) return future.executionSucceed(make_shared<music::player::YoutubeMusicPlayer>(audio));
-        else return future.executionFailed(fut.errorMegssage());
+    auto config = this->configuration();
+    auto disk_cache = music::player::FFMpegDiskCache::instance;
+    if(auto video_id{video_id_from_url(video)}; disk_cache && !video_id.empty()) {
+        std::vector<std::string> keys{};
+        for(const auto& codec : audio_prefer_codec_queue)
+            if(*codec && strcmp(codec, "none") != 0)
+                keys.push_back(disk_cache_key(video_id, codec));
+
+        if(auto entry{disk_cache->lookup(keys)}; entry.has_value()) {
+            auto& metadata = entry->metadata;
+            auto audio = std::make_shared<AudioInfo>();
+            audio->title = metadata["title"];
+            audio->description = metadata["description"];
+            audio->thumbnail = metadata["thumbnail"];
+            audio->codec = metadata["codec"];
+            audio->stream_url = entry->path;
+            audio->video_id = video_id;
+            audio->cached = true;
+            audio->cache_pin = std::move(entry->pin);
+
+            auto player = make_shared<music::player::YoutubeMusicPlayer>(audio);
+            player->prefix_cache_key("yt_" + video_id);
+            if(config->buffering.video_low_ms > 0 && config->buffering.video_high_ms > 0)
+                player->buffer_watermarks(music::FFMpegBufferWatermarks{config->buffering.video_low_ms, config->buffering.video_high_ms});
+
+            future.executionSucceed(player);
+            return future;
+        }
+    }
+
+    auto fut = resolve_stream_info(video, token);
+    fut.waitAndGetLater([future, fut, config, disk_cache, token](const std::shared_ptr<AudioInfo>& audio){
+        if(!fut.succeeded() || !audio)
+            return future.executionFailed(fut.errorMegssage());
+
+        if(token && token->cancelled())
+            return future.executionFailed("cancelled");
+
+        auto player = make_shared<music::player::YoutubeMusicPlayer>(audio);
+        if(!audio->video_id.empty()) {
+            /* the stream url changes with every resolve */
+            player->prefix_cache_key("yt_" + audio->video_id);
+        }
+
+        if(disk_cache && !audio->live_stream && !audio->video_id.empty() && !audio->codec.empty()) {
+            player->disk_cache_entry(disk_cache_key(audio->video_id, audio->codec), {
+                {"title", audio->title},
+                {"description", audio->description},
+                {"thumbnail", audio->thumbnail},
+                {"codec", audio->codec}
+            });
+        }
+        player->url_refresh_margin(std::chrono::seconds{config->url_refresh_margin_s});
+
+        const auto low_ms = audio->live_stream ? config->buffering.live_low_ms : config->buffering.video_low_ms;
+        const auto high_ms = audio->live_stream ? config->buffering.live_high_ms : config->buffering.video_high_ms;
+        if(low_ms > 0 && high_ms > 0)
+            player->buffer_watermarks(music::FFMpegBufferWatermarks{low_ms, high_ms});
+
+        return future.executionSucceed(player);
     }, nullptr);
 
     return future;
@@ -236,7 +325,7 @@ std::shared_ptr<AudioInfo> parse_stream_info(const cw::Result& result, std::stri
 
     int index = -1;
     int abr = -1; //Audio bitrate
-    string streamUrl;
+    string streamUrl, streamCodec;
     for(const auto& entry : urls) {
         int i = 0;
         while(audio_prefer_codec_queue[i]) {
@@ -257,18 +346,19 @@ std::shared_ptr<AudioInfo> parse_stream_info(const cw::Result& result, std::stri
             index = i;
             abr = entry.bitrate;
             streamUrl = entry.url;
-
+            streamCodec = entry.codec;
         }
     }
     if(streamUrl.empty()) {
         log::log(log::err, "[YT-DL] Failed to get a valid audio stream with valid quality!");
         streamUrl = urls[0].url;
+        streamCodec = urls[0].codec;
     }
     log::log(log::debug, string() + "[YT-DL] Using audio quality " + audio_prefer_codec_queue[index]);
-    return std::make_shared<AudioInfo>(AudioInfo{root["fulltitle"].asString(), "unknown", thumbnail, streamUrl, stream});
+    return std::make_shared<AudioInfo>(AudioInfo{root["fulltitle"].asString(), "unknown", thumbnail, streamUrl, stream, streamCodec, root["id"].asString()});
 }
 
-threads::Future<std::shared_ptr<AudioInfo>> YTVManager::resolve_stream_info(const std::string& video) {
+threads::Future<std::shared_ptr<AudioInfo>> YTVManager::resolve_stream_info(const std::string& video, const std::shared_ptr<music::CancellationToken>& token) {
 	threads::Future<std::shared_ptr<AudioInfo>> future;
 
     auto config = this->configuration();
@@ -276,7 +366,7 @@ threads::Future<std::shared_ptr<AudioInfo>> YTVManager::resolve_stream_info(cons
                                      strvar::StringValue{"command", config->youtubedl_command},
                                      strvar::StringValue{"video_url", video}
     );
-    cw::execute(command, [future](const cw::Result& result) {
+    auto handle = cw::execute(command, [future](const cw::Result& result) {
         std::string error{};
         auto info = parse_stream_info(result, error);
         if(!info)
@@ -286,6 +376,7 @@ threads::Future<std::shared_ptr<AudioInfo>> YTVManager::resolve_stream_info(cons
     }, [future](const std::string& error) {
         future.executionFailed(error);
     });
+    cancel_on(token, handle);
 
 	return future;
 }
@@ -302,9 +393,15 @@ std::shared_ptr<YTProviderConfig> YTVManager::configuration() const {
             music::log::log(music::log::err, "[YT-DL] Could not parse youtube.ini config! Using default values");
         } else {
             config->youtubedl_command = ini_reader.Get("general", "youtubedl_command", config->youtubedl_command);
+            config->url_refresh_margin_s = ini_reader.GetInteger("general", "url_refresh_margin_s", config->url_refresh_margin_s);
             config->commands.version = ini_reader.Get("commands", "version", config->commands.version);
             config->commands.query_video = ini_reader.Get("commands", "query_video", config->commands.query_video);
             config->commands.query_url = ini_reader.Get("commands", "query_url", config->commands.query_url);
+
+            config->buffering.video_low_ms = ini_reader.GetInteger("buffering", "video_low_ms", config->buffering.video_low_ms);
+            config->buffering.video_high_ms = ini_reader.GetInteger("buffering", "video_high_ms", config->buffering.video_high_ms);
+            config->buffering.live_low_ms = ini_reader.GetInteger("buffering", "live_low_ms", config->buffering.live_low_ms);
+            config->buffering.live_high_ms = ini_reader.GetInteger("buffering", "live_high_ms", config->buffering.live_high_ms);
         }
     } else {
         music::log::log(music::log::trace, "[YT-DL] Missing configuration file. Using default values");
@@ -10,11 +10,19 @@ namespace yt {
         std::string stream_url{};
 
         bool live_stream{false};
+        std::string codec{}; /* audio codec of the stream url as reported by youtube-dl */
+
+        std::string video_id{};
+        bool cached{false}; /* stream_url points to a file within the ffmpeg disk cache */
+        std::shared_ptr<void> cache_pin{}; /* keeps the cached file while the player exists */
     };
 
 	struct YTProviderConfig {
 		std::string youtubedl_command = "youtube-dl";
 
+		/* stream urls will be resolved again this many seconds before they expire. Zero to disable. */
+		size_t url_refresh_margin_s = 600;
+
 		struct {
 			std::string version = "${command} --version";
 			std::string query_video = "${command} -v --no-check-certificate -s --print-json --get-thumbnail \"${video_url}\"";
@@ -24,6 +32,15 @@ namespace yt {
 			 */
 			std::string query_url = "${command} -v --no-check-certificate -s --print-json --no-playlist --flat-playlist --get-thumbnail \"${video_url}\"";
 		} commands;
+
+		/* buffer watermarks in milliseconds. Zero to use the ffmpeg provider defaults. */
+		struct {
+			size_t video_low_ms = 0;
+			size_t video_high_ms = 0;
+
+			size_t live_low_ms = 0;
+			size_t live_high_ms = 0;
+		} buffering;
 	};
 
     class YTVManager {
@@ -31,9 +48,10 @@ namespace yt {
             explicit YTVManager() = default;
             ~YTVManager() = default;
 
-            [[nodiscard]] threads::Future<std::shared_ptr<music::UrlInfo>> resolve_url_info(const std::string&);
-            [[nodiscard]] threads::Future<std::shared_ptr<AudioInfo>> resolve_stream_info(const std::string&);
-            [[nodiscard]] threads::Future<std::shared_ptr<music::MusicPlayer>> create_stream(const std::string &);
+            /* cancelling the token kills the youtube-dl process */
+            [[nodiscard]] threads::Future<std::shared_ptr<music::UrlInfo>> resolve_url_info(const std::string&, const std::shared_ptr<music::CancellationToken>& = nullptr);
+            [[nodiscard]] threads::Future<std::shared_ptr<AudioInfo>> resolve_stream_info(const std::string&, const std::shared_ptr<music::CancellationToken>& = nullptr);
+            [[nodiscard]] threads::Future<std::shared_ptr<music::MusicPlayer>> create_stream(const std::string &, const std::shared_ptr<music::CancellationToken>& = nullptr);
 
 		    [[nodiscard]] std::shared_ptr<YTProviderConfig> configuration() const;
     };
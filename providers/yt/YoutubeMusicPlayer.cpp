@@ -1,10 +1,81 @@
+#include <cstring>
 #include "./YoutubeMusicPlayer.h"
 #include "./YTVManager.h"
 
 using namespace music::player;
 
-YoutubeMusicPlayer::YoutubeMusicPlayer(std::shared_ptr<yt::AudioInfo> info) : FFMpegMusicPlayer{info->stream_url, FFMPEGURLType::STREAM, FallbackStreamInfo{}}, video{std::move(info)} {}
-YoutubeMusicPlayer::~YoutubeMusicPlayer() = default;
+extern yt::YTVManager* manager;
+
+/* googlevideo urls contain their expiry as unix timestamp ("expire=" within the query, "/expire/" within the path of hls manifests) */
+std::chrono::system_clock::time_point parse_url_expiry(const std::string& url) {
+    for(const auto& key : {"?expire=", "&expire=", "/expire/"}) {
+        auto index = url.find(key);
+        if(index == std::string::npos)
+            continue;
+
+        index += strlen(key);
+        auto end = index;
+        while(end < url.length() && isdigit(url[end]))
+            end++;
+
+        if(end > index && end - index < 12)
+            return std::chrono::system_clock::time_point{std::chrono::seconds{std::stoll(url.substr(index, end - index))}};
+    }
+
+    return {};
+}
+
+YoutubeMusicPlayer::YoutubeMusicPlayer(std::shared_ptr<yt::AudioInfo> info) : FFMpegMusicPlayer{info->stream_url, info->cached ? FFMPEGURLType::FILE : FFMPEGURLType::STREAM, FallbackStreamInfo{}}, video{std::move(info)} {
+    this->source_codec_ = this->video->codec;
+    if(!this->video->cached)
+        this->url_expiry = parse_url_expiry(this->video->stream_url);
+    this->refresh_state->player = this;
+}
+
+YoutubeMusicPlayer::~YoutubeMusicPlayer() {
+    std::shared_ptr<music::CancellationToken> token{};
+    {
+        /* completed resolves no longer post to the refresh event */
+        std::lock_guard lock{this->refresh_state->lock};
+        this->refresh_state->player = nullptr;
+        token = std::move(this->refresh_state->token);
+    }
+
+    if(auto event{std::exchange(this->refresh_event, nullptr)}; event) {
+        libevent::functions->event_del_block(event);
+        libevent::functions->event_free(event);
+    }
+
+    /* kills a pending youtube-dl */
+    if(token)
+        token->cancel();
+}
+
+bool YoutubeMusicPlayer::initialize(size_t channel) {
+    if(!FFMpegMusicPlayer::initialize(channel))
+        return false;
+
+    if(this->video->cached || this->video->video_id.empty())
+        return true;
+
+    auto event_base = FFMpegMusicPlayer::event_base();
+    if(event_base)
+        this->refresh_event = libevent::functions->event_new(event_base, -1, 0, [](int, short, void* ptr_player) {
+            ((YoutubeMusicPlayer*) ptr_player)->callback_refresh_event();
+        }, this);
+
+    if(!this->refresh_event) {
+        music::log::log(music::log::warn, "[YT-DL] Failed to allocate the url refresh event. The stream url will not be refreshed.");
+        return true;
+    }
+
+    this->schedule_refresh(std::chrono::seconds{0});
+    return true;
+}
+
+void YoutubeMusicPlayer::url_refresh_margin(std::chrono::seconds margin) {
+    this->refresh_margin = margin;
+}
 
 std::string music::player::YoutubeMusicPlayer::songTitle() {
     return this->video->title;
@@ -20,3 +91,123 @@ std::deque<std::shared_ptr<music::Thumbnail>> YoutubeMusicPlayer::thumbnails() {
 		response.push_front(std::make_shared<music::ThumbnailUrl>(this->video->thumbnail));
 	return response;
 }
+
+void YoutubeMusicPlayer::schedule_refresh(std::chrono::seconds min_delay) {
+    if(!this->refresh_event || this->url_expiry.time_since_epoch().count() == 0 || this->refresh_margin.count() == 0)
+        return;
+
+    auto delay = std::chrono::duration_cast<std::chrono::seconds>(this->url_expiry - this->refresh_margin - std::chrono::system_clock::now());
+    delay = std::max(delay, min_delay);
+
+    timeval timeout{std::max(delay.count(), (int64_t) 0), 0};
+    libevent::functions->event_add(this->refresh_event, &timeout);
+}
+
+void YoutubeMusicPlayer::callback_refresh_event() {
+    std::shared_ptr<yt::AudioInfo> info{};
+    std::string error{};
+    bool resume;
+    {
+        std::unique_lock lock{this->refresh_state->lock};
+        if(!this->refresh_state->completed) {
+            lock.unlock();
+            this->refresh_stream_url(false);
+            return;
+        }
+
+        this->refresh_state->completed = false;
+        this->refresh_state->pending = false;
+        info = std::move(this->refresh_state->result);
+        error = std::move(this->refresh_state->error);
+        resume = std::exchange(this->refresh_state->resume, false);
+    }
+
+    if(info)
+        this->refresh_succeeded(info, resume);
+    else
+        this->refresh_failed(error, resume);
+}
+
+void YoutubeMusicPlayer::refresh_stream_url(bool resume) {
+    if(!::manager || !this->refresh_event)
+        return;
+
+    auto state = this->refresh_state;
+    std::shared_ptr<music::CancellationToken> token{};
+    {
+        std::lock_guard lock{state->lock};
+        state->resume |= resume;
+        if(state->pending)
+            return;
+
+        state->pending = true;
+        token = state->token = std::make_shared<music::CancellationToken>();
+    }
+
+    music::log::log(music::log::debug, "[YT-DL] Resolving the stream url of " + this->video->video_id + " again" + (resume ? " (stream aborted)" : ""));
+    auto future = ::manager->resolve_stream_info("https://www.youtube.com/watch?v=" + this->video->video_id, token);
+    future.waitAndGetLater([state, future](const std::shared_ptr<yt::AudioInfo>& info) {
+        std::lock_guard lock{state->lock};
+        state->token = nullptr;
+        if(!state->player)
+            return;
+
+        /* the player state is only touched within the event loop */
+        state->completed = true;
+        if(future.succeeded() && info)
+            state->result = info;
+        else
+            state->error = future.succeeded() ? "empty response" : future.errorMegssage();
+
+        static const timeval kTimeoutZero{0, 0};
+        libevent::functions->event_add(state->player->refresh_event, &kTimeoutZero);
+    }, nullptr);
+}
+
+void YoutubeMusicPlayer::refresh_succeeded(const std::shared_ptr<yt::AudioInfo> &info, bool resume) {
+    this->last_refresh = std::chrono::system_clock::now();
+    this->url_expiry = parse_url_expiry(info->stream_url);
+    this->source_codec_ = info->codec;
+    music::log::log(music::log::debug, "[YT-DL] Refreshed the stream url of " + this->video->video_id);
+
+    if(resume)
+        this->resume_stream(info->stream_url);
+    else
+        this->stream_url(info->stream_url);
+
+    this->schedule_refresh(std::chrono::seconds{60});
+}
+
+void YoutubeMusicPlayer::refresh_failed(const std::string &error, bool resume) {
+    music::log::log(music::log::warn, "[YT-DL] Failed to refresh the stream url of " + this->video->video_id + ": " + error);
+    if(resume) {
+        this->abort_stream("failed to refresh the stream url (" + error + ")");
+        return;
+    }
+
+    /* the current url is still valid. Try again later. */
+    this->schedule_refresh(std::chrono::seconds{60});
+}
+
+bool YoutubeMusicPlayer::handle_stream_abort(FFMpegStream &stream) {
+    if(!this->refresh_event || !::manager)
+        return false;
+
+    if(stream.url != this->url()) {
+        /* the url has been refreshed while the stream was running */
+        this->resume_stream(this->url());
+        return true;
+    }
+
+    const auto now = std::chrono::system_clock::now();
+    const auto expired = stream.http_status() == 403 || (this->url_expiry.time_since_epoch().count() > 0 && now >= this->url_expiry);
+    if(!expired)
+        return false;
+
+    /* the fresh url got rejected as well. Let the player count the failures. */
+    if(now - this->last_refresh < std::chrono::seconds{60})
+        return false;
+
+    this->refresh_stream_url(true);
+    return true;
+}
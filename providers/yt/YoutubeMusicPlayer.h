@@ -7,18 +7,60 @@ namespace yt {
 }
 
 namespace music::player {
+    /*
+     * The stream urls youtube-dl resolves expire after a few hours.
+     * The player resolves the url again ahead of its expiry and restarts expired streams at the current position.
+     */
     class YoutubeMusicPlayer : public FFMpegMusicPlayer {
         public:
             explicit YoutubeMusicPlayer(std::shared_ptr<yt::AudioInfo>);
             ~YoutubeMusicPlayer() override;
 
+            bool initialize(size_t) override;
+
+            /* resolve the stream url again this long before it expires. Zero disables the refresh. Must be set before initialize. */
+            void url_refresh_margin(std::chrono::seconds /* margin */);
+
             std::string songTitle() override;
 
             std::string songDescription() override;
 
             std::deque<std::shared_ptr<Thumbnail>> thumbnails() override;
 
+        protected:
+            bool handle_stream_abort(FFMpegStream& /* stream */) override;
+
         private:
+            /* shared with pending resolves which might outlive the player */
+            struct RefreshState {
+                std::mutex lock{};
+                YoutubeMusicPlayer* player{nullptr};
+
+                bool pending{false};
+                bool resume{false}; /* the stream aborted and awaits the new url */
+                std::shared_ptr<music::CancellationToken> token{};
+
+                /* result of the resolve, applied within the event loop */
+                bool completed{false};
+                std::shared_ptr<yt::AudioInfo> result{};
+                std::string error{};
+            };
+
+            void schedule_refresh(std::chrono::seconds /* min delay */);
+            /* the refresh event fires for due refreshes and completed resolves */
+            void callback_refresh_event();
+            void refresh_stream_url(bool /* resume */);
+            /* called within the event loop */
+            void refresh_succeeded(const std::shared_ptr<yt::AudioInfo>& /* info */, bool /* resume */);
+            void refresh_failed(const std::string& /* error */, bool /* resume */);
+
             std::shared_ptr<yt::AudioInfo> video;
+
+            std::chrono::seconds refresh_margin{600};
+            std::chrono::system_clock::time_point url_expiry{}; /* epoch if unknown */
+            std::chrono::system_clock::time_point last_refresh{};
+
+            void* refresh_event{nullptr};
+            std::shared_ptr<RefreshState> refresh_state{std::make_shared<RefreshState>()};
     };
 }
\ No newline at end of file